@@ -71,22 +71,18 @@ struct header {
 	/* Bitmap of which pages are large. */
 	unsigned long pagesize[MAX_LARGE_PAGES / BITS_PER_LONG];
 
+	/* Bitmaps of small pages in huge allocs, and where each one starts. */
+	unsigned long huge[MAX_SMALL_PAGES / BITS_PER_LONG];
+	unsigned long huge_start[MAX_SMALL_PAGES / BITS_PER_LONG];
+
 	/* List of unused small/large pages. */
 	u16 small_free_list;
 	u16 large_free_list;
 
-	/* List of huge allocs. */
-	unsigned long huge;
-
 	/* This is less defined: we have two buckets for each power of 2 */
 	struct bucket_state bs[1];
 };
 
-struct huge_alloc {
-	unsigned long next, prev;
-	unsigned long off, len;
-};
-
 struct page_header {
 	u16 next, prev;
 	/* FIXME: We can just count all-0 and all-1 used[] elements. */
@@ -217,36 +213,6 @@ static u16 pop_from_list(struct header *head,
 	return h;
 }
 
-static void add_to_huge_list(struct header *head, struct huge_alloc *ha)
-{
-	unsigned long h = head->huge;
-	unsigned long offset = (char *)ha - (char *)head;
-
-	ha->next = h;
-	if (h) {
-		struct huge_alloc *prev = (void *)((char *)head + h);
-		assert(prev->prev == 0);
-		prev->prev = offset;
-	}
-	head->huge = offset;
-	ha->prev = 0;
-}
-
-static void del_from_huge(struct header *head, struct huge_alloc *ha)
-{
-	/* Front of list? */
-	if (ha->prev == 0) {
-		head->huge = ha->next;
-	} else {
-		struct huge_alloc *prev = (void *)((char *)head + ha->prev);
-		prev->next = ha->next;
-	}
-	if (ha->next != 0) {
-		struct huge_alloc *next = (void *)((char *)head + ha->next);
-		next->prev = ha->prev;
-	}
-}
-
 static void add_small_page_to_freelist(struct header *head,
 				       struct page_header *ph,
 				       unsigned int sp_bits)
@@ -437,7 +403,8 @@ static bool all_empty(struct header *head,
 
 	for (i = 0; i < SMALL_PAGES_PER_LARGE_PAGE; i++) {
 		struct page_header *ph = from_pgnum(head, pgnum + i, sp_bits);
-		if (ph->elements_used)
+		/* Huge allocs have user data where elements_used would be. */
+		if (ph->elements_used || test_bit(head->huge, pgnum + i))
 			return false;
 	}
 	return true;
@@ -513,17 +480,35 @@ static u16 get_small_page(struct header *head, unsigned long poolsize,
 	return ret;
 }
 
-static bool huge_allocated(struct header *head, unsigned long offset)
+static bool huge_allocated(struct header *head, unsigned long offset,
+			   unsigned int sp_bits)
 {
-	unsigned long i;
-	struct huge_alloc *ha;
+	return test_bit(head->huge, offset >> sp_bits);
+}
 
-	for (i = head->huge; i; i = ha->next) {
-		ha = (void *)((char *)head + i);
-		if (ha->off <= offset && ha->off + ha->len > offset)
-			return true;
+/* How many small pages in the huge alloc starting at this page? */
+static unsigned long huge_pages(const struct header *head, unsigned long pgnum)
+{
+	unsigned long i, ends;
+
+	/* Look for the first page which isn't a continuation. */
+	i = pgnum + 1;
+	while (i < MAX_SMALL_PAGES) {
+		ends = ~(head->huge[i / BITS_PER_LONG]
+			 & ~head->huge_start[i / BITS_PER_LONG])
+			>> (i % BITS_PER_LONG);
+		if (ends)
+			return i + affsl(ends) - 1 - pgnum;
+		i = align_up(i + 1, BITS_PER_LONG);
 	}
-	return false;
+	return MAX_SMALL_PAGES - pgnum;
+}
+
+static void set_huge(struct header *head, unsigned long pgnum,
+		     unsigned long num)
+{
+	while (num--)
+		set_bit(head->huge, pgnum++);
 }
 
 /* They want something really big.  Aim for contiguous pages (slow). */
@@ -531,17 +516,11 @@ static COLD void *huge_alloc(void *pool, unsigned long poolsize,
 			     unsigned long size, unsigned long align)
 {
 	struct header *head = pool;
-	struct huge_alloc *ha;
 	unsigned long i, sp_bits, lp_bits, num, header_size;
 
 	sp_bits = small_page_bits(poolsize);
 	lp_bits = sp_bits + BITS_FROM_SMALL_TO_LARGE_PAGE;
 
-	/* Allocate tracking structure optimistically. */
-	ha = alloc_get(pool, poolsize, sizeof(*ha), ALIGNOF(*ha));
-	if (!ha)
-		return NULL;
-
 	/* First search for contiguous small pages... */
 	header_size = sizeof(*head) + sizeof(head->bs) * (max_bucket(lp_bits)-1);
 
@@ -552,9 +531,10 @@ static COLD void *huge_alloc(void *pool, unsigned long poolsize,
 		struct page_header *pg;
 		unsigned long off = (i << sp_bits);
 
-		/* Skip over large pages. */
+		/* Skip over large pages: they break up any run. */
 		if (test_bit(head->pagesize, i >> BITS_FROM_SMALL_TO_LARGE_PAGE)) {
 			i += (1UL << BITS_FROM_SMALL_TO_LARGE_PAGE)-1;
+			num = 0;
 			continue;
 		}
 
@@ -562,8 +542,7 @@ static COLD void *huge_alloc(void *pool, unsigned long poolsize,
 		if (!num && off % align != 0)
 			continue;
 
-		/* FIXME: This makes us O(n^2). */
-		if (huge_allocated(head, off)) {
+		if (huge_allocated(head, off, sp_bits)) {
 			num = 0;
 			continue;
 		}
@@ -585,8 +564,7 @@ static COLD void *huge_alloc(void *pool, unsigned long poolsize,
 					      &head->small_free_list,
 					      pg, sp_bits);
 			}
-			ha->off = (i - num + 1) << sp_bits;
-			ha->len = num << sp_bits;
+			i = i - num + 1;
 			goto done;
 		}
 	}
@@ -600,16 +578,17 @@ static COLD void *huge_alloc(void *pool, unsigned long poolsize,
 		struct page_header *pg;
 		unsigned long off = (i << lp_bits);
 
-		/* Ignore small pages. */
-		if (!test_bit(head->pagesize, i))
+		/* Small pages break up any run, too. */
+		if (!test_bit(head->pagesize, i)) {
+			num = 0;
 			continue;
+		}
 
 		/* Does this page meet alignment requirements? */
 		if (!num && off % align != 0)
 			continue;
 
-		/* FIXME: This makes us O(n^2). */
-		if (huge_allocated(head, off)) {
+		if (huge_allocated(head, off, sp_bits)) {
 			num = 0;
 			continue;
 		}
@@ -631,73 +610,97 @@ static COLD void *huge_alloc(void *pool, unsigned long poolsize,
 					      &head->large_free_list,
 					      pg, sp_bits);
 			}
-			ha->off = (i - num + 1) << lp_bits;
-			ha->len = num << lp_bits;
+			i = (i - num + 1) << BITS_FROM_SMALL_TO_LARGE_PAGE;
+			num <<= BITS_FROM_SMALL_TO_LARGE_PAGE;
 			goto done;
 		}
 	}
 
-	/* Unable to satisfy: free huge alloc structure. */
-	alloc_free(pool, poolsize, ha);
+	/* Unable to satisfy. */
 	return NULL;
 
 done:
-	add_to_huge_list(pool, ha);
-	return (char *)pool + ha->off;
+	/* i and num are now in small pages. */
+	set_bit(head->huge_start, i);
+	set_huge(head, i, num);
+	return from_pgnum(head, i, sp_bits);
 }
 
 static COLD void
 huge_free(struct header *head, unsigned long poolsize, void *free)
 {
-	unsigned long i, off, pgnum, free_off = (char *)free - (char *)head;
-	unsigned int sp_bits, lp_bits;
-	struct huge_alloc *ha;
-
-	for (i = head->huge; i; i = ha->next) {
-		ha = (void *)((char *)head + i);
-		if (free_off == ha->off)
-			break;
-	}
-	assert(i);
+	unsigned long i, num, pgnum, free_off = (char *)free - (char *)head;
+	unsigned int sp_bits;
+	struct page_header *ph;
+	bool large;
 
-	/* Free up all the pages, delete and free ha */
+	/* Free up all the pages, and forget the alloc. */
 	sp_bits = small_page_bits(poolsize);
-	lp_bits = sp_bits + BITS_FROM_SMALL_TO_LARGE_PAGE;
 	pgnum = free_off >> sp_bits;
+	num = huge_pages(head, pgnum);
+	large = test_bit(head->pagesize, pgnum >> BITS_FROM_SMALL_TO_LARGE_PAGE);
 
-	if (test_bit(head->pagesize, pgnum >> BITS_FROM_SMALL_TO_LARGE_PAGE)) {
-		for (off = ha->off;
-		     off < ha->off + ha->len;
-		     off += 1UL << lp_bits) {
-			add_large_page_to_freelist(head,
-						   (void *)((char *)head + off),
-						   sp_bits);
-		}
-	} else {
-		for (off = ha->off;
-		     off < ha->off + ha->len;
-		     off += 1UL << sp_bits) {
-			add_small_page_to_freelist(head,
-						   (void *)((char *)head + off),
-						   sp_bits);
-		}
+	clear_bit(head->huge_start, pgnum);
+	for (i = pgnum; i < pgnum + num; i++) {
+		clear_bit(head->huge, i);
+		if (large && i % SMALL_PAGES_PER_LARGE_PAGE)
+			continue;
+		/* Whatever they left here, the page is empty now. */
+		ph = from_pgnum(head, i, sp_bits);
+		ph->elements_used = 0;
+		if (large)
+			add_large_page_to_freelist(head, ph, sp_bits);
+		else
+			add_small_page_to_freelist(head, ph, sp_bits);
 	}
-	del_from_huge(head, ha);
-	alloc_free(head, poolsize, ha);
 }
 
-static COLD unsigned long huge_size(struct header *head, void *p)
+static COLD unsigned long huge_size(struct header *head,
+				    unsigned long poolsize, void *p)
 {
-	unsigned long i, off = (char *)p - (char *)head;
-	struct huge_alloc *ha;
+	unsigned int sp_bits = small_page_bits(poolsize);
 
-	for (i = head->huge; i; i = ha->next) {
-		ha = (void *)((char *)head + i);
-		if (off == ha->off) {
-			return ha->len;
-		}
+	return huge_pages(head, ((char *)p - (char *)head) >> sp_bits)
+		<< sp_bits;
+}
+
+/* Try to grow a huge alloc over the free pages which follow it. */
+static COLD bool huge_extend(struct header *head, unsigned long poolsize,
+			     void *p, unsigned long size)
+{
+	unsigned long off, start, end, pgbits, sp_bits, lp_bits;
+	bool large;
+
+	sp_bits = small_page_bits(poolsize);
+	lp_bits = sp_bits + BITS_FROM_SMALL_TO_LARGE_PAGE;
+	start = (char *)p - (char *)head;
+	end = start + (huge_pages(head, start >> sp_bits) << sp_bits);
+	large = test_bit(head->pagesize, start >> lp_bits);
+	pgbits = large ? lp_bits : sp_bits;
+
+	/* Every page we need must be free, and the same size as ours. */
+	for (off = end; off < start + size; off += 1UL << pgbits) {
+		struct page_header *pg = (void *)((char *)head + off);
+
+		if (off + (1UL << pgbits) > poolsize)
+			return false;
+		if (!!test_bit(head->pagesize, off >> lp_bits) != large)
+			return false;
+		if (huge_allocated(head, off, sp_bits))
+			return false;
+		if (pg->elements_used)
+			return false;
 	}
-	abort();
+
+	/* Remove them from the free list. */
+	for (off = end; off < start + size; off += 1UL << pgbits) {
+		del_from_list(head,
+			      large ? &head->large_free_list
+			      : &head->small_free_list,
+			      (void *)((char *)head + off), sp_bits);
+	}
+	set_huge(head, end >> sp_bits, (off - end) >> sp_bits);
+	return true;
 }
 
 void *alloc_get(void *pool, unsigned long poolsize,
@@ -819,6 +822,38 @@ void alloc_free(void *pool, unsigned long poolsize, void *free)
 	}
 }
 
+void *alloc_realloc(void *pool, unsigned long poolsize, void *p,
+		    unsigned long size, unsigned long align)
+{
+	struct header *head = pool;
+	unsigned long pgnum, oldsize, sp_bits;
+	void *new;
+
+	oldsize = alloc_size(pool, poolsize, p);
+	if (size <= oldsize)
+		return p;
+
+	if (poolsize >= MIN_USEFUL_SIZE) {
+		sp_bits = small_page_bits(poolsize);
+		pgnum = ((char *)p - (char *)pool) >> sp_bits;
+		if (test_bit(head->pagesize,
+			     pgnum >> BITS_FROM_SMALL_TO_LARGE_PAGE))
+			pgnum &= ~(SMALL_PAGES_PER_LARGE_PAGE - 1);
+
+		/* Huge allocs start on a page: maybe we can just grow. */
+		if ((void *)from_pgnum(head, pgnum, sp_bits) == p
+		    && huge_extend(head, poolsize, p, size))
+			return p;
+	}
+
+	new = alloc_get(pool, poolsize, size, align);
+	if (new) {
+		memcpy(new, p, oldsize);
+		alloc_free(pool, poolsize, p);
+	}
+	return new;
+}
+
 unsigned long alloc_size(void *pool, unsigned long poolsize, void *p)
 {
 	struct header *head = pool;
@@ -840,11 +875,152 @@ unsigned long alloc_size(void *pool, unsigned long poolsize, void *p)
 	/* Step back to page header. */
 	ph = from_pgnum(head, pgnum, sp_bits);
 	if ((void *)ph == p)
-		return huge_size(head, p);
+		return huge_size(head, poolsize, p);
 
 	return bucket_to_size(ph->bucket);
 }
 
+static void cache_lock(struct alloc_cache *cache)
+{
+	if (cache->lock)
+		cache->lock(cache->arg);
+}
+
+static void cache_unlock(struct alloc_cache *cache)
+{
+	if (cache->unlock)
+		cache->unlock(cache->arg);
+}
+
+void alloc_cache_init(struct alloc_cache *cache,
+		      void *pool, unsigned long poolsize,
+		      void (*lock)(void *arg), void (*unlock)(void *arg),
+		      void *arg)
+{
+	unsigned int i;
+
+	cache->pool = pool;
+	cache->poolsize = poolsize;
+	cache->lock = lock;
+	cache->unlock = unlock;
+	cache->arg = arg;
+
+	/* Tiny pools have no buckets; huge allocations aren't worth it. */
+	if (poolsize < MIN_USEFUL_SIZE)
+		cache->buckets = 0;
+	else {
+		cache->buckets = max_bucket(small_page_bits(poolsize)
+					    + BITS_FROM_SMALL_TO_LARGE_PAGE);
+		if (cache->buckets > ALLOC_CACHE_BUCKETS)
+			cache->buckets = ALLOC_CACHE_BUCKETS;
+	}
+
+	for (i = 0; i < ALLOC_CACHE_BUCKETS; i++)
+		cache->mag[i].num = 0;
+}
+
+/* Caller holds lock: give back the top num of this magazine. */
+static void spill_magazine(struct alloc_cache *cache,
+			   struct alloc_magazine *mag, unsigned int num)
+{
+	while (num--)
+		alloc_free(cache->pool, cache->poolsize, mag->p[--mag->num]);
+}
+
+void *alloc_cache_get(struct alloc_cache *cache,
+		      unsigned long size, unsigned long align)
+{
+	struct alloc_magazine *mag;
+	unsigned int bucket, i;
+	void *p;
+
+	size = align_up(size, align);
+	if (unlikely(!size))
+		size = 1;
+	bucket = size_to_bucket(size);
+
+	if (unlikely(bucket >= cache->buckets)) {
+		cache_lock(cache);
+		p = alloc_get(cache->pool, cache->poolsize, size, align);
+		cache_unlock(cache);
+		return p;
+	}
+
+	mag = &cache->mag[bucket];
+	if (likely(mag->num))
+		return mag->p[--mag->num];
+
+	/* Empty: refill half the magazine in one go. */
+	cache_lock(cache);
+	for (i = 0; i < ALLOC_CACHE_DEPTH / 2; i++) {
+		p = alloc_get(cache->pool, cache->poolsize,
+			      bucket_to_size(bucket), align);
+		if (!p)
+			break;
+		mag->p[mag->num++] = p;
+	}
+
+	/* Pool is full?  Hand back everything we're hoarding and retry. */
+	if (unlikely(!mag->num)) {
+		for (i = 0; i < cache->buckets; i++)
+			spill_magazine(cache, &cache->mag[i],
+				       cache->mag[i].num);
+		p = alloc_get(cache->pool, cache->poolsize, size, align);
+		cache_unlock(cache);
+		return p;
+	}
+	cache_unlock(cache);
+
+	return mag->p[--mag->num];
+}
+
+void alloc_cache_free(struct alloc_cache *cache, void *p)
+{
+	struct header *head = cache->pool;
+	struct alloc_magazine *mag;
+	unsigned long pgnum, offset = (char *)p - (char *)cache->pool;
+	struct page_header *ph;
+	unsigned int sp_bits;
+
+	if (unlikely(!cache->buckets))
+		goto uncached;
+
+	/* The page header can't change under us: p is allocated. */
+	sp_bits = small_page_bits(cache->poolsize);
+	pgnum = offset >> sp_bits;
+	if (test_bit(head->pagesize, pgnum >> BITS_FROM_SMALL_TO_LARGE_PAGE))
+		pgnum &= ~(SMALL_PAGES_PER_LARGE_PAGE - 1);
+	ph = from_pgnum(head, pgnum, sp_bits);
+
+	/* Huge allocs start at a page boundary, and aren't cached. */
+	if (unlikely((void *)ph == p || ph->bucket >= cache->buckets))
+		goto uncached;
+
+	mag = &cache->mag[ph->bucket];
+	if (unlikely(mag->num == ALLOC_CACHE_DEPTH)) {
+		cache_lock(cache);
+		spill_magazine(cache, mag, ALLOC_CACHE_DEPTH / 2);
+		cache_unlock(cache);
+	}
+	mag->p[mag->num++] = p;
+	return;
+
+uncached:
+	cache_lock(cache);
+	alloc_free(cache->pool, cache->poolsize, p);
+	cache_unlock(cache);
+}
+
+void alloc_cache_flush(struct alloc_cache *cache)
+{
+	unsigned int i;
+
+	cache_lock(cache);
+	for (i = 0; i < cache->buckets; i++)
+		spill_magazine(cache, &cache->mag[i], cache->mag[i].num);
+	cache_unlock(cache);
+}
+
 /* Useful for gdb breakpoints. */
 static bool check_fail(void)
 {
@@ -989,7 +1165,6 @@ bool alloc_check(void *pool, unsigned long poolsize)
 	struct header *head = pool;
 	unsigned long prev, i, lp_bits, sp_bits, header_size, num_buckets;
 	struct page_header *ph;
-	struct huge_alloc *ha;
 	unsigned long pages[MAX_SMALL_PAGES / BITS_PER_LONG] = { 0 };
 
 	if (poolsize < MIN_USEFUL_SIZE)
@@ -1057,46 +1232,42 @@ bool alloc_check(void *pool, unsigned long poolsize)
 			return false;
 	}
 
-	/* Check the huge alloc list. */
-	prev = 0;
-	for (i = head->huge; i; i = ha->next) {
-		unsigned long pgbits, j;
+	/* Check the huge allocs. */
+	for (i = 0; i < MAX_SMALL_PAGES; i++) {
+		unsigned long pgbits, num, j;
 
-		/* Bad pointer? */
-		if (i >= poolsize || i + sizeof(*ha) > poolsize)
+		if (!test_bit(head->huge_start, i)) {
+			/* Not part of any huge alloc? */
+			if (test_bit(head->huge, i))
+				return check_fail();
+			continue;
+		}
+		if (!test_bit(head->huge, i))
 			return check_fail();
-		ha = (void *)((char *)head + i);
+		num = huge_pages(head, i);
 
-		/* Check contents of ha. */
-		if (ha->off > poolsize || ha->off + ha->len > poolsize)
+		/* Off the end? */
+		if (out_of_bounds(i, sp_bits, num << sp_bits, poolsize))
 			return check_fail();
 
 		/* Large or small page? */
-		pgbits = test_bit(head->pagesize, ha->off >> lp_bits)
-			? lp_bits : sp_bits;
+		pgbits = test_bit(head->pagesize,
+				  i >> BITS_FROM_SMALL_TO_LARGE_PAGE)
+			? BITS_FROM_SMALL_TO_LARGE_PAGE : 0;
 
-		/* Not page boundary? */
-		if ((ha->off % (1UL << pgbits)) != 0)
+		/* Not page boundary, or not page length? */
+		if (i % (1UL << pgbits) || num % (1UL << pgbits))
 			return check_fail();
 
-		/* Not page length? */
-		if ((ha->len % (1UL << pgbits)) != 0)
-			return check_fail();
-
-		/* Linked list corrupt? */
-		if (ha->prev != prev)
-			return check_fail();
-
-		for (j = ha->off; j < ha->off + ha->len; j += (1UL<<sp_bits)) {
+		for (j = i; j < i + num; j++) {
 			/* Already seen this page? */
-			if (test_bit(pages, j >> sp_bits))
+			if (test_bit(pages, j))
 				return check_fail();
-			set_bit(pages, j >> sp_bits);
+			set_bit(pages, j);
 		}
-
-		prev = i;
+		i += num - 1;
 	}
-		
+
 	/* Make sure every page accounted for. */
 	for (i = 0; i < poolsize >> sp_bits; i++) {
 		if (!test_bit(pages, i))
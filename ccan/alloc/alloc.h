@@ -68,6 +68,30 @@ void *alloc_get(void *pool, unsigned long poolsize,
  */
 void alloc_free(void *pool, unsigned long poolsize, void *free);
 
+/**
+ * alloc_realloc - resize some allocated memory in the pool
+ * @pool: the contiguous bytes for the allocator to use
+ * @poolsize: the size of the pool
+ * @p: the non-NULL pointer returned from alloc_get.
+ * @size: the new size of the allocation
+ * @align: the alignment, should it need to move (0 or power of 2)
+ *
+ * This is "realloc" within an initialized pool.  If @size still fits
+ * within alloc_size(), @p is returned unchanged.  Huge allocations are
+ * grown in place if the pages after them are free.  Otherwise a new
+ * allocation is made, the contents copied and @p freed.
+ *
+ * Returns NULL (leaving @p untouched) if there is no room.
+ *
+ * Example:
+ *	double *two = alloc_realloc(pool, 32*1024*1024, d,
+ *				    sizeof(*d) * 2, ALIGNOF(*d));
+ *	if (!two)
+ *		err(1, "Failed to allocate two doubles");
+ */
+void *alloc_realloc(void *pool, unsigned long poolsize, void *p,
+		    unsigned long size, unsigned long align);
+
 /**
  * alloc_size - get the actual size allocated by alloc_get
  * @pool: the contiguous bytes for the allocator to use
@@ -127,4 +151,119 @@ bool alloc_check(void *pool, unsigned long poolsize);
  *	}
  */
 void alloc_visualize(FILE *out, void *pool, unsigned long poolsize);
+
+/* Buckets up to 1024 bytes are cached; this many pointers per bucket. */
+#define ALLOC_CACHE_BUCKETS 41
+#define ALLOC_CACHE_DEPTH 32
+
+/**
+ * struct alloc_cache - a per-thread front end to a shared pool
+ * @pool: the pool this caches.
+ * @poolsize: the size of the pool
+ * @lock: called before touching the shared pool (or NULL).
+ * @unlock: called after touching the shared pool (or NULL).
+ * @arg: handed to @lock and @unlock.
+ * @buckets: how many buckets are cached for this pool.
+ * @mag: the magazine of free pointers for each bucket.
+ *
+ * The pool itself has no locking, so threads (or processes) sharing it
+ * must serialize every alloc_get() and alloc_free().  Give each one its
+ * own alloc_cache instead: small allocations are then satisfied from
+ * and freed to its magazines, and the shared pool is only locked to
+ * move half a magazine at a time.
+ *
+ * Only one thread may use a cache at a time.  It can live in the pool
+ * itself, so another can flush it if its owner dies.  Pointers can be
+ * freed through a different cache from the one which allocated them, or
+ * directly with alloc_free() (under the lock).
+ */
+struct alloc_cache {
+	void *pool;
+	unsigned long poolsize;
+	void (*lock)(void *arg);
+	void (*unlock)(void *arg);
+	void *arg;
+	unsigned int buckets;
+	struct alloc_magazine {
+		unsigned int num;
+		void *p[ALLOC_CACHE_DEPTH];
+	} mag[ALLOC_CACHE_BUCKETS];
+};
+
+/**
+ * alloc_cache_init - initialize a per-thread cache for a pool
+ * @cache: the cache to initialize
+ * @pool: the contiguous bytes for the allocator to use
+ * @poolsize: the size of the pool
+ * @lock: function to serialize access to the pool (or NULL)
+ * @unlock: function to release @lock (or NULL)
+ * @arg: argument for @lock and @unlock.
+ *
+ * The pool must already be initialized with alloc_init().
+ *
+ * Example:
+ *	#include <pthread.h>
+ *	...
+ *	static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+ *
+ *	static void lock_pool(void *arg)
+ *	{
+ *		pthread_mutex_lock(arg);
+ *	}
+ *
+ *	static void unlock_pool(void *arg)
+ *	{
+ *		pthread_mutex_unlock(arg);
+ *	}
+ *	...
+ *		static __thread struct alloc_cache cache;
+ *
+ *		alloc_cache_init(&cache, pool, 32*1024*1024,
+ *				 lock_pool, unlock_pool, &pool_lock);
+ */
+void alloc_cache_init(struct alloc_cache *cache,
+		      void *pool, unsigned long poolsize,
+		      void (*lock)(void *arg), void (*unlock)(void *arg),
+		      void *arg);
+
+/**
+ * alloc_cache_get - allocate some memory via a cache
+ * @cache: the per-thread cache from alloc_cache_init()
+ * @size: the size of the desired allocation
+ * @align: the alignment of the desired allocation (0 or power of 2)
+ *
+ * This is alloc_get(), but small allocations usually don't need to
+ * take the pool lock.
+ *
+ * Example:
+ *	d = alloc_cache_get(&cache, sizeof(*d), ALIGNOF(*d));
+ */
+void *alloc_cache_get(struct alloc_cache *cache,
+		      unsigned long size, unsigned long align);
+
+/**
+ * alloc_cache_free - free some memory via a cache
+ * @cache: the per-thread cache from alloc_cache_init()
+ * @p: the non-NULL pointer returned from alloc_get or alloc_cache_get.
+ *
+ * This is alloc_free(), but small allocations usually don't need to
+ * take the pool lock.
+ *
+ * Example:
+ *	alloc_cache_free(&cache, d);
+ */
+void alloc_cache_free(struct alloc_cache *cache, void *p);
+
+/**
+ * alloc_cache_flush - return all cached memory to the pool
+ * @cache: the per-thread cache from alloc_cache_init()
+ *
+ * Memory in a cache's magazines is still allocated as far as the pool
+ * is concerned.  Call this before a thread exits, or to make it
+ * available to others (eg. when an allocation fails).
+ *
+ * Example:
+ *	alloc_cache_flush(&cache);
+ */
+void alloc_cache_flush(struct alloc_cache *cache);
 #endif /* ALLOC_H */
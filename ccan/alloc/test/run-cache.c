@@ -0,0 +1,133 @@
+#include <ccan/alloc/alloc.h>
+#include <ccan/tap/tap.h>
+#include <ccan/alloc/alloc.c>
+#include <ccan/alloc/bitops.c>
+#include <ccan/alloc/tiny.c>
+#include <stdlib.h>
+#include <err.h>
+
+#define POOL_SIZE (32*1024*1024)
+#define NUM 1000
+
+static unsigned int locks;
+static bool locked;
+
+static void lock(void *arg)
+{
+	if (locked)
+		errx(1, "Nested lock");
+	locked = true;
+	locks++;
+}
+
+static void unlock(void *arg)
+{
+	if (!locked)
+		errx(1, "Unlock without lock");
+	locked = false;
+}
+
+static bool unique(void *p[], unsigned int num)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < num; i++)
+		for (j = i + 1; j < num; j++)
+			if (p[i] == p[j])
+				return false;
+	return true;
+}
+
+/* Fill the pool through the cache, empty it, and see how many we got. */
+static unsigned int fill(struct alloc_cache *cache, void *p[],
+			 unsigned long size)
+{
+	unsigned int i;
+
+	for (i = 0; (p[i] = alloc_cache_get(cache, size, 1)) != NULL; i++);
+	return i;
+}
+
+int main(int argc, char *argv[])
+{
+	struct alloc_cache cache;
+	void *mem, **p, *huge;
+	unsigned int i, num;
+	bool ok;
+
+	plan_tests(18);
+
+	mem = malloc(POOL_SIZE);
+	p = calloc(POOL_SIZE / 64, sizeof(*p));
+
+	alloc_init(mem, POOL_SIZE);
+	alloc_cache_init(&cache, mem, POOL_SIZE, lock, unlock, NULL);
+
+	/* Only one lock per half-magazine. */
+	for (i = 0; i < NUM; i++)
+		p[i] = alloc_cache_get(&cache, 16, 8);
+	ok1(locks <= NUM / (ALLOC_CACHE_DEPTH / 2) + 1);
+	ok = true;
+	for (i = 0; i < NUM; i++) {
+		if (!p[i] || alloc_size(mem, POOL_SIZE, p[i]) < 16
+		    || ((char *)p[i] - (char *)mem) % 8 != 0)
+			ok = false;
+		else
+			memset(p[i], i, 16);
+	}
+	ok1(ok);
+	ok1(unique(p, NUM));
+	ok1(alloc_check(mem, POOL_SIZE));
+
+	locks = 0;
+	for (i = 0; i < NUM; i++)
+		alloc_cache_free(&cache, p[i]);
+	ok1(locks <= NUM / (ALLOC_CACHE_DEPTH / 2) + 1);
+	ok1(cache.mag[size_to_bucket(16)].num > 0);
+	ok1(alloc_check(mem, POOL_SIZE));
+	alloc_cache_flush(&cache);
+	ok1(cache.mag[size_to_bucket(16)].num == 0);
+	ok1(alloc_check(mem, POOL_SIZE));
+
+	/* Mixing with the uncached calls is fine. */
+	p[0] = alloc_get(mem, POOL_SIZE, 100, 4);
+	alloc_cache_free(&cache, p[0]);
+	p[1] = alloc_cache_get(&cache, 100, 4);
+	ok1(p[1] == p[0]);
+	alloc_free(mem, POOL_SIZE, p[1]);
+
+	/* Huge allocations go straight to the pool. */
+	locks = 0;
+	huge = alloc_cache_get(&cache, POOL_SIZE / 4, 1);
+	ok1(huge && locks == 1);
+	alloc_cache_free(&cache, huge);
+	ok1(locks == 2);
+	alloc_cache_flush(&cache);
+	ok1(alloc_check(mem, POOL_SIZE));
+
+	/* When the pool is full, what's cached gets used. */
+	alloc_init(mem, MIN_USEFUL_SIZE);
+	alloc_cache_init(&cache, mem, MIN_USEFUL_SIZE, lock, unlock, NULL);
+	num = fill(&cache, p, 64);
+	for (i = 0; i < num; i++)
+		alloc_cache_free(&cache, p[i]);
+	ok1(fill(&cache, p, 64) == num);
+	for (i = 0; i < num; i++)
+		alloc_cache_free(&cache, p[i]);
+	alloc_cache_flush(&cache);
+	ok1(alloc_check(mem, MIN_USEFUL_SIZE));
+	for (i = 0; alloc_get(mem, MIN_USEFUL_SIZE, 64, 1); i++);
+	ok1(i == num);
+
+	/* Tiny pools simply aren't cached. */
+	alloc_init(mem, 1024);
+	alloc_cache_init(&cache, mem, 1024, NULL, NULL, NULL);
+	p[0] = alloc_cache_get(&cache, 10, 1);
+	ok1(p[0] && alloc_size(mem, 1024, p[0]) >= 10);
+	alloc_cache_free(&cache, p[0]);
+	ok1(alloc_check(mem, 1024) && cache.mag[size_to_bucket(10)].num == 0);
+
+	free(p);
+	free(mem);
+	return exit_status();
+}
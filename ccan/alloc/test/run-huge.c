@@ -0,0 +1,120 @@
+#include <ccan/alloc/alloc.h>
+#include <ccan/tap/tap.h>
+#include <ccan/alloc/alloc.c>
+#include <ccan/alloc/bitops.c>
+#include <ccan/alloc/tiny.c>
+#include <stdlib.h>
+#include <err.h>
+
+#define POOL_SIZE (32*1024*1024)
+#define NUM_LIVE 2000
+
+/* Find the biggest huge alloc which fits, checking as we go. */
+static bool probe_largest(void *mem)
+{
+	unsigned long lo = 0, hi = POOL_SIZE, mid;
+	void *p;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo + 1) / 2;
+		p = alloc_get(mem, POOL_SIZE, mid, 1);
+		if (p) {
+			alloc_free(mem, POOL_SIZE, p);
+			lo = mid;
+		} else
+			hi = mid - 1;
+		if (!alloc_check(mem, POOL_SIZE))
+			return false;
+	}
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	void *mem, *p[POOL_SIZE / (16*1024)];
+	unsigned int i, num;
+	unsigned long size, sp_bits, pgnum;
+	bool ok;
+
+	plan_tests(11);
+
+	mem = malloc(POOL_SIZE);
+	alloc_init(mem, POOL_SIZE);
+
+	/* Fill it with different-sized huge allocs. */
+	ok = true;
+	for (num = 0; ; num++) {
+		size = 16*1024 * (1 + num % 5);
+		p[num] = alloc_get(mem, POOL_SIZE, size, 1);
+		if (!p[num])
+			break;
+		if (alloc_size(mem, POOL_SIZE, p[num]) < size)
+			ok = false;
+		/* Scribble over it all, including where page headers were. */
+		memset(p[num], 0xFF, size);
+	}
+	ok1(num > 100);
+	ok1(ok);
+	ok1(alloc_check(mem, POOL_SIZE));
+
+	/* Sizes stay right as neighbours come and go. */
+	for (i = 0; i < num; i += 2)
+		alloc_free(mem, POOL_SIZE, p[i]);
+	ok = true;
+	for (i = 1; i < num; i += 2)
+		if (alloc_size(mem, POOL_SIZE, p[i]) < 16*1024 * (1 + i % 5))
+			ok = false;
+	ok1(ok);
+	ok1(alloc_check(mem, POOL_SIZE));
+	for (i = 1; i < num; i += 2)
+		alloc_free(mem, POOL_SIZE, p[i]);
+	ok1(alloc_check(mem, POOL_SIZE));
+
+	/* Every page is free again, even ones they scribbled on. */
+	p[0] = alloc_get(mem, POOL_SIZE, POOL_SIZE / 2, 1);
+	ok1(p[0]);
+	alloc_free(mem, POOL_SIZE, p[0]);
+
+	/* A run of free pages mustn't span a page of the other size. */
+	memset(p, 0, sizeof(p[0]) * NUM_LIVE);
+	ok = true;
+	for (i = 0; i < 100000 && ok; i++) {
+		unsigned int j = random() % NUM_LIVE, r = random() % 100;
+
+		if (p[j])
+			alloc_free(mem, POOL_SIZE, p[j]);
+		/* Mostly small, some large, a few huge. */
+		if (r < 70)
+			size = 16 + random() % 48;
+		else if (r < 95)
+			size = 64 + random() % 960;
+		else
+			size = 1024 + random() % (63*1024);
+		p[j] = alloc_get(mem, POOL_SIZE, size, 16);
+		if (i % 1000 == 0)
+			ok = probe_largest(mem);
+	}
+	ok1(ok);
+
+	/* A huge alloc in small pages, full of zeroes, isn't free space.
+	 * Use up small pages until one gets broken off a large page. */
+	alloc_init(mem, POOL_SIZE);
+	sp_bits = small_page_bits(POOL_SIZE);
+	do {
+		p[0] = alloc_get(mem, POOL_SIZE, 16, 16);
+		pgnum = ((char *)p[0] - (char *)mem) >> sp_bits;
+	} while (pgnum < SMALL_PAGES_PER_LARGE_PAGE);
+	/* Now take the rest of that large page with a huge alloc. */
+	size = (SMALL_PAGES_PER_LARGE_PAGE - 1) << sp_bits;
+	p[1] = alloc_get(mem, POOL_SIZE, size, 1);
+	ok1(((char *)p[1] - (char *)mem) >> sp_bits == pgnum + 1);
+	memset(p[1], 0, size);
+	/* p[0] was alone on its page, so it's free now. */
+	alloc_free(mem, POOL_SIZE, p[0]);
+	/* This fails, but tries recombining small pages first. */
+	ok1(!alloc_get(mem, POOL_SIZE, POOL_SIZE, 1));
+	ok1(alloc_check(mem, POOL_SIZE));
+
+	free(mem);
+	return exit_status();
+}
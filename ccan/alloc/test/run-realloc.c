@@ -0,0 +1,91 @@
+#include <ccan/alloc/alloc.h>
+#include <ccan/tap/tap.h>
+#include <ccan/alloc/alloc.c>
+#include <ccan/alloc/bitops.c>
+#include <ccan/alloc/tiny.c>
+#include <stdlib.h>
+#include <err.h>
+
+#define POOL_SIZE (32*1024*1024)
+
+static void fill(void *p, unsigned long size)
+{
+	unsigned long i;
+
+	for (i = 0; i < size; i++)
+		((unsigned char *)p)[i] = i;
+}
+
+static bool filled(void *p, unsigned long size)
+{
+	unsigned long i;
+
+	for (i = 0; i < size; i++)
+		if (((unsigned char *)p)[i] != (unsigned char)i)
+			return false;
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	void *mem, *p, *q, *other;
+	unsigned long size;
+
+	plan_tests(21);
+
+	mem = malloc(POOL_SIZE);
+	alloc_init(mem, POOL_SIZE);
+
+	/* Small: stays put while it fits in its bucket. */
+	p = alloc_get(mem, POOL_SIZE, 10, 1);
+	size = alloc_size(mem, POOL_SIZE, p);
+	fill(p, size);
+	ok1(alloc_realloc(mem, POOL_SIZE, p, size, 1) == p);
+	q = alloc_realloc(mem, POOL_SIZE, p, size * 3, 1);
+	ok1(q && q != p && alloc_size(mem, POOL_SIZE, q) >= size * 3);
+	ok1(filled(q, size));
+	ok1(alloc_check(mem, POOL_SIZE));
+
+	/* Small to huge. */
+	p = alloc_realloc(mem, POOL_SIZE, q, 64*1024, 1);
+	ok1(p && alloc_size(mem, POOL_SIZE, p) >= 64*1024);
+	ok1(filled(p, size));
+	ok1(alloc_check(mem, POOL_SIZE));
+
+	/* Huge grows in place into the free pages after it. */
+	fill(p, 64*1024);
+	q = alloc_realloc(mem, POOL_SIZE, p, 100*1024, 1);
+	ok1(q == p && alloc_size(mem, POOL_SIZE, q) >= 100*1024);
+	ok1(filled(q, 64*1024));
+	ok1(alloc_check(mem, POOL_SIZE));
+
+	/* Until the small pages run out... */
+	p = alloc_realloc(mem, POOL_SIZE, q, 1024*1024, 1);
+	ok1(p && p != q && filled(p, 64*1024));
+	ok1(alloc_check(mem, POOL_SIZE));
+
+	/* ... now it's in large pages, and can grow over those. */
+	fill(p, 1024*1024);
+	q = alloc_realloc(mem, POOL_SIZE, p, 4*1024*1024, 1);
+	ok1(q == p && alloc_size(mem, POOL_SIZE, q) >= 4*1024*1024);
+	ok1(filled(q, 1024*1024));
+	ok1(alloc_check(mem, POOL_SIZE));
+
+	/* Something else in the way means a move. */
+	fill(q, 4*1024*1024);
+	other = alloc_get(mem, POOL_SIZE, 1024*1024, 1);
+	ok1(other == (char *)q + alloc_size(mem, POOL_SIZE, q));
+	p = alloc_realloc(mem, POOL_SIZE, q, 8*1024*1024, 1);
+	ok1(p && p != q && filled(p, 4*1024*1024));
+	ok1(alloc_check(mem, POOL_SIZE));
+
+	/* Failure leaves it alone. */
+	ok1(alloc_realloc(mem, POOL_SIZE, p, POOL_SIZE, 1) == NULL);
+	ok1(filled(p, 4*1024*1024));
+	alloc_free(mem, POOL_SIZE, p);
+	alloc_free(mem, POOL_SIZE, other);
+	ok1(alloc_check(mem, POOL_SIZE));
+
+	free(mem);
+	return exit_status();
+}
@@ -0,0 +1,55 @@
+#include <ccan/tap/tap.h>
+#include "config.h"
+#include <ccan/alloc/tiny.c>
+#include <ccan/alloc/bitops.c>
+#include <stdlib.h>
+#include <err.h>
+
+#define POOL_SIZE (128 * 1024)
+#define NUM 500
+
+int main(void)
+{
+	unsigned char *mem = malloc(POOL_SIZE);
+	void *p[NUM] = { NULL };
+	unsigned int i, j, fails = 0;
+	unsigned long size;
+	bool ok = true;
+
+	plan_tests(6);
+
+	tiny_alloc_init(mem, POOL_SIZE);
+	ok1(index_size(POOL_SIZE) != 0);
+	ok1(tiny_alloc_check(mem, POOL_SIZE));
+
+	/* Churn, with sizes both in and beyond the free array. */
+	for (i = 0; i < 20000; i++) {
+		j = random() % NUM;
+		if (p[j])
+			tiny_alloc_free(mem, POOL_SIZE, p[j]);
+		size = random() % 2 ? random() % 64 : random() % 1024;
+		p[j] = tiny_alloc_get(mem, POOL_SIZE, size, 1 << (random() % 4));
+		if (!p[j])
+			fails++;
+		else if (tiny_alloc_size(mem, POOL_SIZE, p[j]) < size)
+			ok = false;
+		else
+			memset(p[j], 0xFF, size);
+		if (i % 100 == 0 && !tiny_alloc_check(mem, POOL_SIZE))
+			ok = false;
+	}
+	ok1(ok);
+	ok1(fails < 20000 / 10);
+
+	/* Once it's all free, the index lets us find it all again. */
+	for (i = 0; i < NUM; i++)
+		if (p[i])
+			tiny_alloc_free(mem, POOL_SIZE, p[i]);
+	ok1(tiny_alloc_check(mem, POOL_SIZE));
+	p[0] = tiny_alloc_get(mem, POOL_SIZE,
+			      POOL_SIZE - blocks_start(POOL_SIZE) - 8, 1);
+	ok1(p[0] && tiny_alloc_check(mem, POOL_SIZE));
+
+	free(mem);
+	return exit_status();
+}
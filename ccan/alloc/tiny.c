@@ -17,6 +17,14 @@
 
 #define MAX_FREE_CACHED_SIZE 256
 
+/* Pools this big get an index with an entry for each segment. */
+#define INDEX_MIN_POOLSIZE (64 * 1024)
+#define SEGMENT_BITS 8
+#define SEGMENT_SIZE (1UL << SEGMENT_BITS)
+/* Second byte of entry: some block starts here; bound on free blocks. */
+#define INDEX_HAS_START 0x80
+#define INDEX_BOUND_MASK 0x7F
+
 /* Val is usually offset by MIN_BLOCK_SIZE here. */
 static unsigned encode_length(unsigned long val)
 {
@@ -104,6 +112,66 @@ static unsigned long free_array_size(unsigned long poolsize)
 	return poolsize / 1024;
 }
 
+/* The index follows the free array, two bytes per segment.  The first
+ * is the offset of the first block starting in the segment, the second
+ * INDEX_HAS_START (if there is one) and an upper bound on afls() of the
+ * length of any free block starting in the segment. */
+static unsigned long index_size(unsigned long poolsize)
+{
+	if (poolsize < INDEX_MIN_POOLSIZE)
+		return 0;
+	return (poolsize + SEGMENT_SIZE - 1) / SEGMENT_SIZE * 2;
+}
+
+/* Blocks start after the free array and index. */
+static unsigned long blocks_start(unsigned long poolsize)
+{
+	return free_array_size(poolsize) + index_size(poolsize);
+}
+
+static unsigned char *index_entry(unsigned char *pool, unsigned long poolsize,
+				  unsigned long off)
+{
+	return pool + free_array_size(poolsize) + (off >> SEGMENT_BITS) * 2;
+}
+
+/* A block now starts at off: is it the segment's first? */
+static void index_add_start(unsigned char *pool, unsigned long poolsize,
+			    unsigned long off)
+{
+	unsigned char *e;
+
+	if (!index_size(poolsize))
+		return;
+	e = index_entry(pool, poolsize, off);
+	if (!(e[1] & INDEX_HAS_START) || (off % SEGMENT_SIZE) < e[0]) {
+		e[0] = off % SEGMENT_SIZE;
+		e[1] |= INDEX_HAS_START;
+	}
+}
+
+/* The block at off is now free: raise the segment's bound to cover it. */
+static void index_add_free(unsigned char *pool, unsigned long poolsize,
+			   unsigned long off, unsigned long len)
+{
+	unsigned char *e;
+
+	if (!index_size(poolsize))
+		return;
+	e = index_entry(pool, poolsize, off);
+	if ((e[1] & INDEX_BOUND_MASK) < afls(len))
+		e[1] = (e[1] & INDEX_HAS_START) | afls(len);
+}
+
+/* Could a free block starting in this segment hold size bytes? */
+static bool index_may_fit(const unsigned char *e, unsigned long size)
+{
+	if (!(e[1] & INDEX_HAS_START))
+		return false;
+	/* Block lengths are < 1 << bound, and include a header byte. */
+	return (1UL << (e[1] & INDEX_BOUND_MASK)) > size + 1;
+}
+
 /* We have series of 69 free sizes like so:
  * 1, 2, 3, 4.  6, 8, 10, 12, 14, 16. 20, 24, 28, 32... 252.
  */
@@ -124,15 +192,56 @@ static unsigned long free_array_off(unsigned long size)
 
 void tiny_alloc_init(void *pool, unsigned long poolsize)
 {
-	/* We start with free array, and then the rest is free. */
-	unsigned long arrsize = free_array_size(poolsize);
+	/* We start with free array and index, and then the rest is free. */
+	unsigned long start = blocks_start(poolsize);
 
 	/* Do nothing with 1 byte or less! */
 	if (poolsize < MIN_BLOCK_SIZE)
 		return;
 
-	memset(pool, 0, arrsize);
-	encode(poolsize - arrsize, true, (unsigned char *)pool + arrsize);
+	memset(pool, 0, start);
+	encode(poolsize - start, true, (unsigned char *)pool + start);
+	index_add_start(pool, poolsize, start);
+	index_add_free(pool, poolsize, start, poolsize - start);
+}
+
+static void add_to_free_array(unsigned char *arr,
+			      unsigned long poolsize,
+			      unsigned long size,
+			      unsigned long off)
+{
+	unsigned long fa_off;
+
+	if (size >= MAX_FREE_CACHED_SIZE)
+		return;
+
+	for (fa_off = free_array_off(size);
+	     fa_off + 3 < free_array_size(poolsize);
+	     fa_off += free_array_off(MAX_FREE_CACHED_SIZE)) {
+		if (!arr[fa_off] && !arr[fa_off+1] && !arr[fa_off+2]) {
+			arr[fa_off] = (off >> 16);
+			arr[fa_off+1] = (off >> 8);
+			arr[fa_off+2] = off;
+			break;
+		}
+	}
+}
+
+/* Refill the free array and rebuild the index from scratch. */
+static void rebuild(unsigned char *pool, unsigned long poolsize)
+{
+	unsigned long len, off;
+	bool free;
+
+	memset(pool, 0, blocks_start(poolsize));
+	for (off = blocks_start(poolsize); off < poolsize; off += len) {
+		decode(&len, &free, pool + off);
+		index_add_start(pool, poolsize, off);
+		if (free) {
+			add_to_free_array(pool, poolsize, len, off);
+			index_add_free(pool, poolsize, off, len);
+		}
+	}
 }
 
 /* Walk through and try to coalesce */
@@ -141,7 +250,7 @@ static bool try_coalesce(unsigned char *pool, unsigned long poolsize)
 	unsigned long len, prev_off = 0, prev_len = 0, off;
 	bool free, prev_free = false, coalesced = false;
 
-	off = free_array_size(poolsize);
+	off = blocks_start(poolsize);
 	do {
 		decode(&len, &free, pool + off);
 		if (free && prev_free) {
@@ -156,9 +265,9 @@ static bool try_coalesce(unsigned char *pool, unsigned long poolsize)
 		off += len;
 	} while (off < poolsize);
 
-	/* Clear the free array. */
+	/* Free array and index point at blocks which are gone. */
 	if (coalesced)
-		memset(pool, 0, free_array_size(poolsize));
+		rebuild(pool, poolsize);
 
 	return coalesced;
 }
@@ -173,32 +282,60 @@ static bool long_enough(unsigned long offset, unsigned long len,
 	return offset + size <= end;
 }
 
-static void add_to_free_array(unsigned char *arr,
-			      unsigned long poolsize,
-			      unsigned long size,
-			      unsigned long off)
+/* Walk every block looking for room: returns poolsize if none. */
+static unsigned long search(unsigned char *arr, unsigned long poolsize,
+			    unsigned long size, unsigned long align)
 {
-	unsigned long fa_off;
-
-	if (size >= MAX_FREE_CACHED_SIZE)
-		return;
+	unsigned long len, off = blocks_start(poolsize);
+	bool free;
 
-	for (fa_off = free_array_off(size);
-	     fa_off + 3 < free_array_size(poolsize);
-	     fa_off += free_array_off(MAX_FREE_CACHED_SIZE)) {
-		if (!arr[fa_off] && !arr[fa_off+1] && !arr[fa_off+2]) {
-			arr[fa_off] = (off >> 16);
-			arr[fa_off+1] = (off >> 8);
-			arr[fa_off+2] = off;
+	do {
+		decode(&len, &free, arr + off);
+		if (free && long_enough(off, len, size, align))
 			break;
-		}
+		off += len;
+	} while (off < poolsize);
+	return off;
+}
+
+/* Only walk segments which might have room, tightening their bounds. */
+static unsigned long search_index(unsigned char *arr, unsigned long poolsize,
+				  unsigned long size, unsigned long align)
+{
+	unsigned long len, off, seg, largest;
+	unsigned char *e;
+	bool free;
+
+	for (seg = blocks_start(poolsize) / SEGMENT_SIZE;
+	     seg * SEGMENT_SIZE < poolsize;
+	     seg++) {
+		e = index_entry(arr, poolsize, seg * SEGMENT_SIZE);
+		if (!index_may_fit(e, size))
+			continue;
+
+		/* Walk the blocks which start in this segment. */
+		largest = 0;
+		off = seg * SEGMENT_SIZE + e[0];
+		do {
+			decode(&len, &free, arr + off);
+			if (free) {
+				if (long_enough(off, len, size, align))
+					return off;
+				if (len > largest)
+					largest = len;
+			}
+			off += len;
+		} while (off < (seg + 1) * SEGMENT_SIZE && off < poolsize);
+
+		/* Now we know exactly. */
+		e[1] = INDEX_HAS_START | afls(largest);
 	}
+	return poolsize;
 }
 
 void *tiny_alloc_get(void *pool, unsigned long poolsize,
 		     unsigned long size, unsigned long align)
 {
-	unsigned long arrsize = free_array_size(poolsize);
 	unsigned long len, off, actual, hdr, free_bucket;
 	long fa_off;
 	unsigned char *arr = pool;
@@ -235,25 +372,20 @@ void *tiny_alloc_get(void *pool, unsigned long poolsize,
 	}
 
 again:
-	off = arrsize;
-
-	decode(&len, &free, arr + off);
-	while (!free || !long_enough(off, len, size, align)) {
-		/* Refill free array as we go. */
-		if (free && coalesced)
-			add_to_free_array(arr, poolsize, len, off);
+	if (index_size(poolsize))
+		off = search_index(arr, poolsize, size, align);
+	else
+		off = search(arr, poolsize, size, align);
 
-		off += len;
-		/* Hit end? */
-		if (off == poolsize) {
-			if (!coalesced && try_coalesce(pool, poolsize)) {
-				coalesced = true;
-				goto again;
-			}
-			return NULL;
+	/* Hit end? */
+	if (off == poolsize) {
+		if (!coalesced && try_coalesce(pool, poolsize)) {
+			coalesced = true;
+			goto again;
 		}
-		decode(&len, &free, arr + off);
+		return NULL;
 	}
+	decode(&len, &free, arr + off);
 
 found:
 	/* We have a free block.  Since we walk from front, take far end. */
@@ -265,6 +397,7 @@ found:
 	if (hdr - off >= MIN_BLOCK_SIZE) {
 		encode(hdr - off, true, arr + off);
 		add_to_free_array(arr, poolsize, hdr - off, off);
+		index_add_start(arr, poolsize, hdr);
 	} else {
 		hdr = off;
 	}
@@ -313,6 +446,7 @@ void tiny_alloc_free(void *pool, unsigned long poolsize, void *freep)
 
 	/* If an empty slot, put this in free array. */
 	add_to_free_array(pool, poolsize, len, hdr - arr);
+	index_add_free(pool, poolsize, hdr - arr, len);
 }
 
 unsigned long tiny_alloc_size(void *pool, unsigned long poolsize, void *p)
@@ -352,8 +486,9 @@ bool tiny_alloc_check(void *pool, unsigned long poolsize)
 {
 	unsigned long arrsize = free_array_size(poolsize);
 	unsigned char *arr = pool;
-	unsigned long len, off, hdrlen;
+	unsigned long len, off, hdrlen, seg, num_starts = 0;
 	unsigned long i, freearr[arrsize], num_freearr = 0;
+	unsigned char *e;
 	bool free;
 
 	if (poolsize < MIN_BLOCK_SIZE)
@@ -371,7 +506,8 @@ bool tiny_alloc_check(void *pool, unsigned long poolsize)
 		freearr[num_freearr++] = off;
 	}
 
-	for (off = arrsize; off < poolsize; off += len) {
+	seg = 0;
+	for (off = blocks_start(poolsize); off < poolsize; off += len) {
 		/* We should have a valid header. */
 		if (!check_decode(arr + off, poolsize - off))
 			return false;
@@ -380,6 +516,21 @@ bool tiny_alloc_check(void *pool, unsigned long poolsize)
 			return tiny_check_fail();
 		if (hdrlen != encode_length(len - MIN_BLOCK_SIZE))
 			return tiny_check_fail();
+		if (index_size(poolsize)) {
+			e = index_entry(arr, poolsize, off);
+			/* First block in this segment must be in index. */
+			if (!num_starts || off / SEGMENT_SIZE != seg) {
+				seg = off / SEGMENT_SIZE;
+				num_starts++;
+				if (!(e[1] & INDEX_HAS_START))
+					return tiny_check_fail();
+				if (e[0] != off % SEGMENT_SIZE)
+					return tiny_check_fail();
+			}
+			/* Bound must cover every free block. */
+			if (free && (e[1] & INDEX_BOUND_MASK) < afls(len))
+				return tiny_check_fail();
+		}
 		for (i = 0; i < num_freearr; i++) {
 			if (freearr[i] == off) {
 				if (!free)
@@ -396,6 +547,14 @@ bool tiny_alloc_check(void *pool, unsigned long poolsize)
 	if (num_freearr)
 		return tiny_check_fail();
 
+	/* No other segments should claim to have blocks. */
+	for (i = 0; i < index_size(poolsize); i += 2) {
+		if (arr[arrsize + i + 1] & INDEX_HAS_START)
+			num_starts--;
+	}
+	if (index_size(poolsize) && num_starts)
+		return tiny_check_fail();
+
 	/* Now check that sizes are correct. */
 	for (i = 0; i + 3 < free_array_size(poolsize); i += 3) {
 		unsigned long fa_off;
@@ -0,0 +1,461 @@
+/* Replay allocation traces against alloc, tiny and malloc, reporting
+ * speed, worst-case latency and fragmentation over time.
+ *
+ * A trace is a text file, one operation per line:
+ *	a <id> <size>	allocate <size> bytes, known as <id> from now on
+ *	r <id> <size>	resize <id> to <size> bytes
+ *	f <id>		free <id>
+ * Blank lines and lines starting with # are ignored.  Ids are small
+ * integers and can be reused once freed: a malloc trace (eg. from
+ * ltrace) can be turned into this by numbering the pointers.
+ *
+ * Alternatively, --synthetic generates a trace which keeps about
+ * --live objects allocated, with sizes drawn from a distribution.
+ */
+#include <ccan/alloc/alloc.h>
+#include <ccan/alloc/alloc.c>
+#include <ccan/alloc/bitops.c>
+#include <ccan/alloc/tiny.c>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <err.h>
+#include <malloc.h>
+
+struct op {
+	char type;
+	unsigned long id;
+	unsigned long size;
+};
+
+struct allocator {
+	const char *name;
+	void (*init)(void *pool, unsigned long poolsize);
+	void *(*get)(void *pool, unsigned long poolsize,
+		     unsigned long size, unsigned long align);
+	void *(*resize)(void *pool, unsigned long poolsize, void *p,
+			unsigned long size, unsigned long align);
+	void (*free)(void *pool, unsigned long poolsize, void *p);
+	unsigned long (*size)(void *pool, unsigned long poolsize, void *p);
+	/* Does the pool mean anything (for fragmentation)? */
+	bool pooled;
+	/* Largest pool it can handle (0 for any). */
+	unsigned long max_pool;
+};
+
+static void *tiny_resize(void *pool, unsigned long poolsize, void *p,
+			 unsigned long size, unsigned long align)
+{
+	unsigned long oldsize = tiny_alloc_size(pool, poolsize, p);
+	void *new;
+
+	if (size <= oldsize)
+		return p;
+	new = tiny_alloc_get(pool, poolsize, size, align);
+	if (new) {
+		memcpy(new, p, oldsize);
+		tiny_alloc_free(pool, poolsize, p);
+	}
+	return new;
+}
+
+static void malloc_init(void *pool, unsigned long poolsize)
+{
+}
+
+static void *malloc_get(void *pool, unsigned long poolsize,
+			unsigned long size, unsigned long align)
+{
+	return malloc(size);
+}
+
+static void *malloc_resize(void *pool, unsigned long poolsize, void *p,
+			   unsigned long size, unsigned long align)
+{
+	return realloc(p, size);
+}
+
+static void malloc_free(void *pool, unsigned long poolsize, void *p)
+{
+	free(p);
+}
+
+static unsigned long malloc_size(void *pool, unsigned long poolsize, void *p)
+{
+	return malloc_usable_size(p);
+}
+
+static const struct allocator allocators[] = {
+	{ "alloc", alloc_init, alloc_get, alloc_realloc, alloc_free,
+	  alloc_size, true, 0 },
+	/* tiny's free array holds 24-bit offsets. */
+	{ "tiny", tiny_alloc_init, tiny_alloc_get, tiny_resize,
+	  tiny_alloc_free, tiny_alloc_size, true, 1 << 24 },
+	{ "malloc", malloc_init, malloc_get, malloc_resize, malloc_free,
+	  malloc_size, false, 0 },
+};
+
+/* What we know about each id while replaying. */
+struct object {
+	void *p;
+	unsigned long size;
+};
+
+struct stats {
+	unsigned long ops, failures;
+	uint64_t total_ns, worst_ns;
+	char worst_type;
+	/* Bytes asked for, and bytes the allocator actually gave. */
+	unsigned long requested, allocated;
+	unsigned long peak_requested, peak_allocated;
+};
+
+static uint64_t now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned long parse_size(const char *str)
+{
+	char *end;
+	unsigned long val = strtoul(str, &end, 0);
+
+	switch (*end) {
+	case 'k': case 'K':
+		return val << 10;
+	case 'm': case 'M':
+		return val << 20;
+	case 'g': case 'G':
+		return val << 30;
+	case '\0':
+		return val;
+	}
+	errx(1, "Bad size '%s'", str);
+}
+
+static struct op *load_trace(const char *filename, unsigned long *num_ops,
+			     unsigned long *num_ids)
+{
+	FILE *f = fopen(filename, "r");
+	struct op *ops = NULL;
+	unsigned long num = 0, max = 0, line = 0;
+	char buf[256];
+
+	if (!f)
+		err(1, "Opening %s", filename);
+
+	*num_ids = 0;
+	while (fgets(buf, sizeof(buf), f)) {
+		struct op op;
+		int n;
+
+		line++;
+		if (buf[0] == '#' || buf[0] == '\n')
+			continue;
+		n = sscanf(buf, "%c %lu %lu", &op.type, &op.id, &op.size);
+		if (n < 2 || (op.type != 'f' && n != 3)
+		    || !strchr("arf", op.type))
+			errx(1, "%s:%lu: bad line '%s'", filename, line, buf);
+		if (num == max) {
+			max = max * 2 + 1024;
+			ops = realloc(ops, max * sizeof(*ops));
+			if (!ops)
+				err(1, "Allocating %lu ops", max);
+		}
+		ops[num++] = op;
+		if (op.id >= *num_ids)
+			*num_ids = op.id + 1;
+	}
+	fclose(f);
+	*num_ops = num;
+	return ops;
+}
+
+/* Sizes for a synthetic trace. */
+static unsigned long synthetic_size(const char *dist)
+{
+	unsigned long min, max, mean;
+	unsigned int r = random() % 100;
+
+	if (sscanf(dist, "uniform:%lu-%lu", &min, &max) == 2)
+		return min + random() % (max - min + 1);
+	if (sscanf(dist, "exp:%lu", &mean) == 1)
+		return 1 + -log((random() + 1.0) / (RAND_MAX + 2.0)) * mean;
+	/* Lots of small headers and strings, a few buffers. */
+	if (strcmp(dist, "talloc") == 0) {
+		if (r < 70)
+			return 16 + random() % 48;
+		if (r < 95)
+			return 64 + random() % 960;
+		return 1024 + random() % (63 * 1024);
+	}
+	errx(1, "Unknown distribution '%s'", dist);
+}
+
+static struct op *synthetic_trace(const char *dist, unsigned long num_ops,
+				  unsigned long live)
+{
+	struct op *ops = malloc(num_ops * sizeof(*ops));
+	unsigned long *ids = malloc(live * 2 * sizeof(*ids));
+	unsigned long i, j, num_live = 0, next_id = 0;
+	unsigned long *free_ids = malloc(live * 2 * sizeof(*free_ids));
+	unsigned long num_free = 0;
+
+	if (!ops || !ids || !free_ids)
+		err(1, "Allocating synthetic trace");
+
+	for (i = 0; i < num_ops; i++) {
+		unsigned int r = random() % 100;
+
+		/* Grow towards live, then hover around it. */
+		if (num_live < live / 2 || (num_live < live * 2 - 1 && r < 45)) {
+			ops[i].type = 'a';
+			ops[i].id = num_free ? free_ids[--num_free] : next_id++;
+			ops[i].size = synthetic_size(dist);
+			ids[num_live++] = ops[i].id;
+		} else if (r < 55) {
+			ops[i].type = 'r';
+			ops[i].id = ids[random() % num_live];
+			ops[i].size = synthetic_size(dist);
+		} else {
+			j = random() % num_live;
+			ops[i].type = 'f';
+			ops[i].id = ids[j];
+			ids[j] = ids[--num_live];
+			free_ids[num_free++] = ops[i].id;
+		}
+	}
+	free(ids);
+	free(free_ids);
+	return ops;
+}
+
+/* How big is the largest thing we could allocate now? */
+static unsigned long largest_free(const struct allocator *a,
+				  void *pool, unsigned long poolsize)
+{
+	unsigned long lo = 0, hi = poolsize, mid;
+	void *p;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo + 1) / 2;
+		p = a->get(pool, poolsize, mid, 1);
+		if (p) {
+			a->free(pool, poolsize, p);
+			lo = mid;
+		} else
+			hi = mid - 1;
+	}
+	return lo;
+}
+
+static void report(const struct allocator *a, void *pool,
+		   unsigned long poolsize, const struct stats *s)
+{
+	printf("%10lu %10lu %10lu %9.1f%%", s->ops, s->requested,
+	       s->allocated, s->allocated
+	       ? 100.0 * (s->allocated - s->requested) / s->allocated : 0.0);
+	if (a->pooled) {
+		unsigned long spare = poolsize - s->allocated;
+
+		printf(" %9.1f%%", spare
+		       ? 100.0 * (spare - largest_free(a, pool, poolsize))
+		       / spare : 0.0);
+	}
+	printf("\n");
+}
+
+static void account(const struct allocator *a, void *pool,
+		    unsigned long poolsize, struct stats *s,
+		    struct object *obj, int sign)
+{
+	unsigned long size = a->size(pool, poolsize, obj->p);
+
+	if (sign > 0) {
+		s->requested += obj->size;
+		s->allocated += size;
+	} else {
+		s->requested -= obj->size;
+		s->allocated -= size;
+	}
+	if (s->requested > s->peak_requested)
+		s->peak_requested = s->requested;
+	if (s->allocated > s->peak_allocated)
+		s->peak_allocated = s->allocated;
+}
+
+static void replay(const struct allocator *a, void *pool,
+		   unsigned long poolsize, const struct op ops[],
+		   unsigned long num_ops, unsigned long num_ids,
+		   unsigned long interval)
+{
+	struct object *objs = calloc(num_ids, sizeof(*objs));
+	struct stats s;
+	unsigned long i;
+	uint64_t start, ns;
+	void *p;
+
+	if (!objs)
+		err(1, "Allocating %lu objects", num_ids);
+	memset(&s, 0, sizeof(s));
+	if (a->max_pool && poolsize > a->max_pool)
+		poolsize = a->max_pool;
+	a->init(pool, poolsize);
+
+	if (a->pooled)
+		printf("%s (%lu byte pool):\n", a->name, poolsize);
+	else
+		printf("%s:\n", a->name);
+	printf("%10s %10s %10s %10s",
+	       "ops", "requested", "allocated", "internal");
+	printf(a->pooled ? " %10s\n" : "\n", "external");
+
+	for (i = 0; i < num_ops; i++) {
+		struct object *obj = &objs[ops[i].id];
+
+		/* Failed allocations have nothing to free or resize. */
+		if (ops[i].type != 'a' && !obj->p)
+			continue;
+		if (obj->p)
+			account(a, pool, poolsize, &s, obj, -1);
+
+		p = NULL;
+		start = now_nsec();
+		switch (ops[i].type) {
+		case 'a':
+			if (obj->p)
+				errx(1, "Op %lu: id %lu already allocated",
+				     i, ops[i].id);
+			obj->p = a->get(pool, poolsize, ops[i].size, 16);
+			break;
+		case 'r':
+			p = a->resize(pool, poolsize, obj->p, ops[i].size, 16);
+			if (p)
+				obj->p = p;
+			break;
+		case 'f':
+			a->free(pool, poolsize, obj->p);
+			obj->p = NULL;
+			break;
+		}
+		ns = now_nsec() - start;
+
+		s.ops++;
+		s.total_ns += ns;
+		if (ns > s.worst_ns) {
+			s.worst_ns = ns;
+			s.worst_type = ops[i].type;
+		}
+
+		if (ops[i].type != 'f') {
+			if ((ops[i].type == 'a' && !obj->p)
+			    || (ops[i].type == 'r' && !p))
+				s.failures++;
+			else
+				obj->size = ops[i].size;
+		}
+		if (obj->p)
+			account(a, pool, poolsize, &s, obj, 1);
+
+		if (s.ops % interval == 0)
+			report(a, pool, poolsize, &s);
+	}
+	if (s.ops % interval)
+		report(a, pool, poolsize, &s);
+
+	printf("%lu ops in %.3f sec = %.0f ops/sec, %lu failed\n",
+	       s.ops, s.total_ns / 1e9,
+	       s.total_ns ? s.ops / (s.total_ns / 1e9) : 0.0, s.failures);
+	printf("Worst latency %.1f usec (%s)\n", s.worst_ns / 1000.0,
+	       s.worst_type == 'a' ? "alloc"
+	       : s.worst_type == 'r' ? "resize" : "free");
+	printf("Peak requested %lu, allocated %lu", s.peak_requested,
+	       s.peak_allocated);
+	if (a->pooled)
+		printf(" (%.1f%% of pool)", 100.0 * s.peak_allocated / poolsize);
+	printf("\n\n");
+
+	/* Clean up, so malloc doesn't leak between runs. */
+	for (i = 0; i < num_ids; i++)
+		if (objs[i].p)
+			a->free(pool, poolsize, objs[i].p);
+	free(objs);
+}
+
+static void usage(void)
+{
+	errx(1, "Usage: allocbench [options] <tracefile>\n"
+	     "   or: allocbench [options] --synthetic=<dist>\n"
+	     "Options:\n"
+	     "  --allocator=alloc|tiny|malloc (default all)\n"
+	     "  --pool=<size> (default 64M)\n"
+	     "  --interval=<ops> between fragmentation reports\n"
+	     "Synthetic traces:\n"
+	     "  <dist> is uniform:<min>-<max>, exp:<mean> or talloc\n"
+	     "  --ops=<num> (default 1000000)\n"
+	     "  --live=<num> objects to keep around (default 10000)\n"
+	     "  --seed=<num>");
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long poolsize = 64 << 20, num_ops = 1000000, live = 10000;
+	unsigned long interval = 0, num_ids, i;
+	const char *synthetic = NULL, *which = NULL;
+	struct op *ops;
+	void *pool;
+
+	while (argv[1] && strncmp(argv[1], "--", 2) == 0) {
+		if (strncmp(argv[1], "--allocator=", 12) == 0)
+			which = argv[1] + 12;
+		else if (strncmp(argv[1], "--pool=", 7) == 0)
+			poolsize = parse_size(argv[1] + 7);
+		else if (strncmp(argv[1], "--interval=", 11) == 0)
+			interval = parse_size(argv[1] + 11);
+		else if (strncmp(argv[1], "--synthetic=", 12) == 0)
+			synthetic = argv[1] + 12;
+		else if (strncmp(argv[1], "--ops=", 6) == 0)
+			num_ops = parse_size(argv[1] + 6);
+		else if (strncmp(argv[1], "--live=", 7) == 0)
+			live = parse_size(argv[1] + 7);
+		else if (strncmp(argv[1], "--seed=", 7) == 0)
+			srandom(atol(argv[1] + 7));
+		else
+			usage();
+		argv++;
+		argc--;
+	}
+
+	if (synthetic) {
+		if (argc != 1 || !live)
+			usage();
+		ops = synthetic_trace(synthetic, num_ops, live);
+		num_ids = live * 2;
+	} else {
+		if (argc != 2)
+			usage();
+		ops = load_trace(argv[1], &num_ops, &num_ids);
+	}
+	if (!interval)
+		interval = num_ops / 20 + 1;
+
+	pool = malloc(poolsize);
+	if (!pool)
+		err(1, "Allocating %lu byte pool", poolsize);
+
+	for (i = 0; i < sizeof(allocators) / sizeof(allocators[0]); i++) {
+		if (which && strcmp(which, allocators[i].name) != 0)
+			continue;
+		replay(&allocators[i], pool, poolsize, ops, num_ops, num_ids,
+		       interval);
+	}
+	free(pool);
+	free(ops);
+	return 0;
+}
@@ -0,0 +1,149 @@
+/* Multi-threaded alloc/free throughput: one locked pool vs. per-thread caches. */
+#include <ccan/alloc/alloc.h>
+#include <ccan/alloc/alloc.c>
+#include <ccan/alloc/bitops.c>
+#include <ccan/alloc/tiny.c>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <sys/time.h>
+
+#define POOL_SIZE (256*1024*1024)
+/* Objects each thread keeps live. */
+#define WORKING_SET 1024
+
+static void *pool;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long num_ops;
+static bool use_cache;
+
+static void lock_pool(void *arg)
+{
+	pthread_mutex_lock(arg);
+}
+
+static void unlock_pool(void *arg)
+{
+	pthread_mutex_unlock(arg);
+}
+
+static void *get(struct alloc_cache *cache, unsigned long size)
+{
+	void *p;
+
+	if (cache)
+		return alloc_cache_get(cache, size, 8);
+	pthread_mutex_lock(&pool_lock);
+	p = alloc_get(pool, POOL_SIZE, size, 8);
+	pthread_mutex_unlock(&pool_lock);
+	return p;
+}
+
+static void put(struct alloc_cache *cache, void *p)
+{
+	if (cache)
+		alloc_cache_free(cache, p);
+	else {
+		pthread_mutex_lock(&pool_lock);
+		alloc_free(pool, POOL_SIZE, p);
+		pthread_mutex_unlock(&pool_lock);
+	}
+}
+
+static void *thread(void *arg)
+{
+	struct alloc_cache *cache = NULL;
+	void *p[WORKING_SET] = { NULL };
+	unsigned int seed = (unsigned long)arg;
+	unsigned long i, j, size;
+
+	if (use_cache) {
+		cache = malloc(sizeof(*cache));
+		alloc_cache_init(cache, pool, POOL_SIZE,
+				 lock_pool, unlock_pool, &pool_lock);
+	}
+
+	for (i = 0; i < num_ops; i++) {
+		j = rand_r(&seed) % WORKING_SET;
+		if (p[j]) {
+			put(cache, p[j]);
+			p[j] = NULL;
+			continue;
+		}
+		/* Mostly small things, like talloc headers and strings. */
+		size = 8 + rand_r(&seed) % 248;
+		p[j] = get(cache, size);
+		if (!p[j])
+			errx(1, "Allocation of %lu failed", size);
+		/* Touch it, as a real user would. */
+		*(char *)p[j] = 0;
+	}
+
+	for (j = 0; j < WORKING_SET; j++)
+		if (p[j])
+			put(cache, p[j]);
+	if (cache) {
+		alloc_cache_flush(cache);
+		free(cache);
+	}
+	return NULL;
+}
+
+/* Returns total ops per second. */
+static double run(unsigned int num_threads)
+{
+	pthread_t tids[num_threads];
+	struct timeval start, stop, diff;
+	unsigned long i;
+
+	alloc_init(pool, POOL_SIZE);
+	gettimeofday(&start, NULL);
+	for (i = 0; i < num_threads; i++)
+		if (pthread_create(&tids[i], NULL, thread, (void *)(i+1)) != 0)
+			err(1, "Creating thread");
+	for (i = 0; i < num_threads; i++)
+		pthread_join(tids[i], NULL);
+	gettimeofday(&stop, NULL);
+
+	if (!alloc_check(pool, POOL_SIZE))
+		errx(1, "Pool corrupt after %u threads", num_threads);
+
+	timersub(&stop, &start, &diff);
+	return (double)num_ops * num_threads
+		/ (diff.tv_sec + diff.tv_usec / 1000000.0);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int i, max_threads = 8;
+	double base = 0, ops;
+
+	num_ops = 1000000;
+	if (argc > 1 && strcmp(argv[1], "--cache") == 0) {
+		use_cache = true;
+		argc--;
+		argv++;
+	}
+	if (argc > 1)
+		max_threads = atoi(argv[1]);
+	if (argc > 2)
+		num_ops = atol(argv[2]);
+	if (argc > 3 || !max_threads)
+		errx(1, "Usage: threadspeed [--cache] [<maxthreads> [<ops>]]");
+
+	pool = malloc(POOL_SIZE);
+	if (!pool)
+		err(1, "Allocating pool");
+
+	for (i = 1; i <= max_threads; i *= 2) {
+		ops = run(i);
+		if (i == 1)
+			base = ops;
+		printf("%s %u threads: %.0f ops/sec (%.2fx)\n",
+		       use_cache ? "cached" : "locked", i, ops, ops / base);
+	}
+	free(pool);
+	return 0;
+}
@@ -1,4 +1,8 @@
 /* Licensed under GPLv3+ - see LICENSE file for details */
+#include "config.h"
+#ifndef __linux__
+#error "antithread needs Linux futexes, eventfd and epoll"
+#endif
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -11,6 +15,17 @@
 #include <errno.h>
 #include <assert.h>
 #include <err.h>
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
+#include <sched.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
 #include "antithread.h"
 #include <ccan/noerr/noerr.h>
 #include <ccan/talloc/talloc.h>
@@ -25,14 +40,76 @@
 
 static LIST_HEAD(pools);
 
+/* The owner word is 0 or the owner's pid (with LOCK_WAITERS if someone
+ * may be asleep on it); only the owner touches depth.  The whole-pool and
+ * allocator locks live in a table after the pool; every object allocated
+ * in the pool has its own in front of it (see at_realloc). */
+struct at_lock {
+	uint32_t owner;
+	uint32_t depth;
+};
+
+#define LOCK_ALL 0
+#define LOCK_ALLOC 1
+/* Only two locks, but keep the mapping a whole number of pages. */
+#define LOCK_TABLE_SIZE 4096
+
+/* In front of each allocation; keeps talloc's 16-byte alignment. */
+#define OBJ_HDR_SIZE 16
+#define LOCK_WAITERS 0x80000000U
+
+/* If we've waited this long, check the other side is still alive. */
+#define LOCK_CHECK_NSEC (100 * 1000 * 1000)
+
+/* Messages go through a single-producer, single-consumer ring in the
+ * pool.  The consumer sets waiting before it sleeps on the head futex, and
+ * the producer only wakes it if it clears waiting; similarly the producer
+ * sets full before it sleeps on the tail futex.  If someone is polling the
+ * fd, the eventfd is readable exactly when the ring isn't empty: the
+ * producer pokes it when the ring stops being empty, and the consumer
+ * clears it when it empties the ring.  So the consumer doesn't clear it
+ * before that poke lands, the producer sets poking around it.
+ * The pipes are only used at startup, and to notice the other side dying. */
+#define AT_RING_SIZE 256
+
+struct at_ring {
+	/* Producer writes these... */
+	volatile uint32_t head;
+	volatile uint32_t full;
+	volatile uint32_t poking;
+	char pad[52];
+	/* ...consumer writes these. */
+	volatile uint32_t tail;
+	volatile uint32_t waiting;
+	volatile uint32_t polled;
+	int efd;
+	char pad2[48];
+	const void *msg[AT_RING_SIZE];
+};
+
+struct at_chan {
+	struct at_ring to_child, to_parent;
+	/* The child's allocation cache: here, we can empty it however the
+	 * child goes. */
+	struct alloc_cache cache;
+};
+
 /* Talloc destroys parents before children (damn Tridge's failing destructors!)
  * so we need the first child (ie. last-destroyed) to actually clean up. */
 struct at_pool_contents {
 	struct list_node list;
 	void *pool;
 	unsigned long poolsize;
+	struct at_lock *locks;
+	/* Our own cache of allocations, only locking the pool to refill: in
+	 * a child it's in our at_chan, in the parent it's local_cache. */
+	struct alloc_cache *cache;
+	struct alloc_cache local_cache;
 	int fd;
-	int parent_rfd, parent_wfd;
+	int parent_rfd, parent_wfd, parent_pollfd;
+	struct at_chan *parent_chan;
+	/* NUMA node new antithreads are pinned to, or -1. */
+	int node;
 	struct at_pool *atp;
 };
 
@@ -43,39 +120,307 @@ struct at_pool {
 
 struct athread {
 	pid_t pid;
-	int rfd, wfd;
+	int rfd, wfd, pollfd;
+	struct at_chan *chan;
 };
 
-/* FIXME: Better locking through futexes. */
-static void lock(int fd, unsigned long off)
+/* getpid() is a syscall: cache it, and reset it in any child forked. */
+static pid_t my_pid;
+
+static void forget_pid(void)
 {
-	struct flock fl;
+	my_pid = 0;
+}
 
-	fl.l_type = F_WRLCK;
-	fl.l_whence = SEEK_SET;
-	fl.l_start = off;
-	fl.l_len = 1;
+static uint32_t lock_id(void)
+{
+	static bool registered;
 
-	while (fcntl(fd, F_SETLKW, &fl) < 0) {
-		if (errno != EINTR)
-			err(1, "Failure locking antithread file");
+	if (!my_pid) {
+		if (!registered) {
+			pthread_atfork(NULL, NULL, forget_pid);
+			registered = true;
+		}
+		my_pid = getpid();
+	}
+	return my_pid;
+}
+
+static int futex(uint32_t *uaddr, int op, uint32_t val,
+		 const struct timespec *timeout)
+{
+	return syscall(SYS_futex, uaddr, op, val, timeout, NULL, 0);
+}
+
+static bool owner_dead(pid_t pid)
+{
+	siginfo_t info;
+
+	/* Our own (zombie) children still exist as far as kill() knows. */
+	info.si_pid = 0;
+	if (waitid(P_PID, pid, &info, WEXITED|WNOHANG|WNOWAIT) == 0)
+		return info.si_pid == pid;
+	return kill(pid, 0) != 0 && errno == ESRCH;
+}
+
+static void lock(struct at_lock *l)
+{
+	uint32_t me = lock_id(), want = me, old;
+	struct timespec ts = { 0, LOCK_CHECK_NSEC };
+	int serrno = errno;
+
+	if ((l->owner & ~LOCK_WAITERS) == me) {
+		l->depth++;
+		return;
 	}
+
+	while ((old = __sync_val_compare_and_swap(&l->owner, 0, want)) != 0) {
+		/* Make sure the owner wakes us when it's done. */
+		if (!(old & LOCK_WAITERS)) {
+			if (!__sync_bool_compare_and_swap(&l->owner, old,
+							  old|LOCK_WAITERS))
+				continue;
+			old |= LOCK_WAITERS;
+		}
+		/* Once we've slept, others may be asleep too. */
+		want = me | LOCK_WAITERS;
+		if (futex(&l->owner, FUTEX_WAIT, old, &ts) == 0
+		    || errno != ETIMEDOUT)
+			continue;
+
+		/* Owner died holding it?  It's ours now. */
+		if (owner_dead(old & ~LOCK_WAITERS)
+		    && __sync_bool_compare_and_swap(&l->owner, old, want))
+			break;
+	}
+	l->depth = 1;
+	errno = serrno;
 }
 
-static void unlock(int fd, unsigned long off)
+static void unlock(struct at_lock *l)
 {
-	struct flock fl;
 	int serrno = errno;
 
-	fl.l_type = F_UNLCK;
-	fl.l_whence = SEEK_SET;
-	fl.l_start = off;
-	fl.l_len = 1;
+	if ((l->owner & ~LOCK_WAITERS) != lock_id())
+		errx(1, "Unlocking antithread lock we don't hold");
 
-	fcntl(fd, F_SETLK, &fl);
+	if (--l->depth)
+		return;
+
+	if (__sync_fetch_and_and(&l->owner, 0) & LOCK_WAITERS)
+		futex(&l->owner, FUTEX_WAKE, 1, NULL);
 	errno = serrno;
 }
 
+/* talloc's header sits between our allocation and the pointer it gives
+ * out: the pool context is the first thing allocated, so we measure it. */
+static unsigned long talloc_hdr;
+static void *last_alloc;
+
+static struct at_lock *obj_lock(const void *obj)
+{
+	return (struct at_lock *)((char *)obj - talloc_hdr - OBJ_HDR_SIZE);
+}
+
+/* The pipes are never written after startup: readable means EOF. */
+static bool peer_gone(int fd)
+{
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	return poll(&pfd, 1, 0) == 1;
+}
+
+static void poke(int efd)
+{
+	uint64_t one = 1;
+
+	if (write(efd, &one, sizeof(one)) != sizeof(one))
+		err(1, "Waking antithread");
+}
+
+static void unpoke(int efd)
+{
+	uint64_t val;
+
+	/* Non-blocking: EAGAIN if it's already clear. */
+	if (read(efd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		err(1, "Reading antithread eventfd");
+}
+
+static bool ring_empty(const struct at_ring *r)
+{
+	return r->tail == r->head;
+}
+
+/* Returns false if the consumer died while we waited for room. */
+static bool ring_send(struct at_ring *r, const void *msg, int peerfd)
+{
+	uint32_t head = r->head, tail;
+	struct timespec ts = { 0, LOCK_CHECK_NSEC };
+	bool was_empty;
+
+	while (head - (tail = r->tail) == AT_RING_SIZE) {
+		r->full = 1;
+		__sync_synchronize();
+		if (r->tail != tail)
+			continue;
+		if (futex((uint32_t *)&r->tail, FUTEX_WAIT, tail, &ts) != 0
+		    && errno == ETIMEDOUT && peer_gone(peerfd))
+			return false;
+	}
+
+	/* Only we add, so if it's empty now it stays so until we do. */
+	was_empty = (r->tail == head);
+	if (was_empty) {
+		r->poking = 1;
+		__sync_synchronize();
+	}
+
+	r->msg[head % AT_RING_SIZE] = msg;
+	__sync_synchronize();
+	r->head = head + 1;
+
+	/* Consumer sets waiting (or polled) then checks head: we do the
+	 * reverse. */
+	__sync_synchronize();
+	if (r->polled) {
+		if (was_empty)
+			poke(r->efd);
+	} else if (r->waiting) {
+		/* Only one wake needed until it sleeps again. */
+		if (__sync_bool_compare_and_swap(&r->waiting, 1, 0))
+			futex((uint32_t *)&r->head, FUTEX_WAKE, 1, NULL);
+	}
+
+	if (was_empty) {
+		__sync_synchronize();
+		r->poking = 0;
+	}
+	return true;
+}
+
+static unsigned int ring_recv(struct at_ring *r, void **msgs, unsigned int max,
+			      int peerfd)
+{
+	uint32_t tail = r->tail, head = r->head;
+	unsigned int i;
+
+	if (head - tail < max)
+		max = head - tail;
+	if (!max)
+		return 0;
+
+	__sync_synchronize();
+	/* If we emptied the ring before its poke landed, the fd would be
+	 * left readable: a poller would then block reading it. */
+	if (r->polled) {
+		while (r->poking && !peer_gone(peerfd))
+			sched_yield();
+	}
+	for (i = 0; i < max; i++)
+		msgs[i] = (void *)r->msg[(tail + i) % AT_RING_SIZE];
+	__sync_synchronize();
+	r->tail = tail + max;
+
+	/* Producer sets full then checks tail: we do the reverse. */
+	__sync_synchronize();
+	if (r->full) {
+		r->full = 0;
+		futex((uint32_t *)&r->tail, FUTEX_WAKE, 1, NULL);
+	}
+	return max;
+}
+
+/* Keep the eventfd readable iff there's something in the ring. */
+static void ring_repoll(struct at_ring *r)
+{
+	unpoke(r->efd);
+	__sync_synchronize();
+	if (!ring_empty(r))
+		poke(r->efd);
+}
+
+static bool ring_wait_polled(struct at_ring *r, int peerfd)
+{
+	struct pollfd pfd[2];
+
+	pfd[0].fd = r->efd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = peerfd;
+	pfd[1].events = POLLIN;
+	if (poll(pfd, 2, -1) < 0) {
+		if (errno != EINTR)
+			err(1, "Waiting for antithread message");
+		return true;
+	}
+	unpoke(r->efd);
+	return !pfd[1].revents;
+}
+
+/* Blocks for at least one message; 0 means the producer died. */
+static unsigned int ring_read(struct at_ring *r, void **msgs, unsigned int max,
+			      int peerfd)
+{
+	struct timespec ts = { 0, LOCK_CHECK_NSEC };
+	unsigned int n;
+	uint32_t head;
+
+	while ((n = ring_recv(r, msgs, max, peerfd)) == 0) {
+		head = r->head;
+		r->waiting = 1;
+		__sync_synchronize();
+		if (!ring_empty(r))
+			continue;
+
+		if (r->polled) {
+			if (!ring_wait_polled(r, peerfd) && ring_empty(r))
+				break;
+		} else if (futex((uint32_t *)&r->head, FUTEX_WAIT, head, &ts)
+			   != 0 && errno == ETIMEDOUT && peer_gone(peerfd)) {
+			__sync_synchronize();
+			if (ring_empty(r))
+				break;
+		}
+	}
+
+	r->waiting = 0;
+	if (r->polled)
+		ring_repoll(r);
+	return n;
+}
+
+/* Someone wants to poll: the fd needs to wake for messages and death. */
+static int ring_pollfd(struct at_ring *r, int peerfd, int *pollfd)
+{
+	struct epoll_event ev;
+
+	if (*pollfd != -1)
+		return *pollfd;
+
+	*pollfd = epoll_create(2);
+	if (*pollfd < 0)
+		err(1, "Creating antithread poll fd");
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	if (epoll_ctl(*pollfd, EPOLL_CTL_ADD, r->efd, &ev) != 0
+	    || epoll_ctl(*pollfd, EPOLL_CTL_ADD, peerfd, &ev) != 0)
+		err(1, "Setting up antithread poll fd");
+
+	r->polled = 1;
+	__sync_synchronize();
+	ring_repoll(r);
+	return *pollfd;
+}
+
+static void ring_init(struct at_ring *r, int efd)
+{
+	memset(r, 0, sizeof(*r));
+	r->efd = efd;
+}
+
 /* This pointer is in a pool.  Find which one. */
 static struct at_pool_contents *find_pool(const void *ptr)
 {
@@ -95,40 +440,71 @@ static struct at_pool_contents *find_pool(const void *ptr)
 
 static int destroy_pool(struct at_pool_contents *p)
 {
+	alloc_cache_flush(p->cache);
 	list_del(&p->list);
-	munmap(p->pool, p->poolsize);
+	munmap(p->pool, p->poolsize + LOCK_TABLE_SIZE);
 	close(p->fd);
 	close(p->parent_rfd);
 	close(p->parent_wfd);
+	if (p->parent_pollfd != -1)
+		close(p->parent_pollfd);
 	return 0;
 }
 
+/* talloc hands us the parent when allocating, otherwise ptr itself. */
 static void *at_realloc(const void *parent, void *ptr, size_t size)
 {
 	struct at_pool_contents *p = find_pool(parent);
-	/* FIXME: realloc in ccan/alloc? */
-	void *new;
+	char *new;
 
 	if (size == 0) {
-		alloc_free(p->pool, p->poolsize, ptr);
-		new = NULL;
+		alloc_cache_free(p->cache, (char *)ptr - OBJ_HDR_SIZE);
+		return NULL;
 	} else if (ptr == NULL) {
 		/* FIXME: Alignment */
-		new = alloc_get(p->pool, p->poolsize, size, 16);
+		new = alloc_cache_get(p->cache, OBJ_HDR_SIZE + size, 16);
+		if (!new)
+			return NULL;
+		memset(new, 0, sizeof(struct at_lock));
+		last_alloc = new + OBJ_HDR_SIZE;
 	} else {
-		if (size <= alloc_size(p->pool, p->poolsize, ptr))
-			new = ptr;
-		else {
-			new = alloc_get(p->pool, p->poolsize, size, 16);
-			if (new) {
-				memcpy(new, ptr,
-				       alloc_size(p->pool, p->poolsize, ptr));
-				alloc_free(p->pool, p->poolsize, ptr);
-			}
-		}
+		lock(&p->locks[LOCK_ALLOC]);
+		new = alloc_realloc(p->pool, p->poolsize,
+				    (char *)ptr - OBJ_HDR_SIZE,
+				    OBJ_HDR_SIZE + size, 16);
+		unlock(&p->locks[LOCK_ALLOC]);
+		if (!new)
+			return NULL;
 	}
 
-	return new;
+	return new + OBJ_HDR_SIZE;
+}
+
+static void cache_lock(void *l)
+{
+	lock(l);
+}
+
+static void cache_unlock(void *l)
+{
+	unlock(l);
+}
+
+/* Each process starts with an empty cache: never share a parent's! */
+static void init_cache(struct at_pool_contents *p, struct alloc_cache *cache)
+{
+	alloc_cache_init(cache, p->pool, p->poolsize,
+			 cache_lock, cache_unlock, &p->locks[LOCK_ALLOC]);
+}
+
+/* A dead child can't flush its own cache, so we do. */
+static void reclaim_cache(struct alloc_cache *cache)
+{
+	/* It may have been another program: use our lock functions (the
+	 * pool and lock table are at the same address in all of us). */
+	cache->lock = cache_lock;
+	cache->unlock = cache_unlock;
+	alloc_cache_flush(cache);
 }
 
 static struct at_pool_contents *locked;
@@ -136,7 +512,7 @@ static void talloc_lock(const void *ptr)
 {
 	struct at_pool_contents *p = find_pool(ptr);
 
-	lock(p->fd, 0);
+	lock(&p->locks[LOCK_ALL]);
 	assert(!locked);
 	locked = p;
 }
@@ -146,7 +522,161 @@ static void talloc_unlock(void)
 	struct at_pool_contents *p = locked;
 
 	locked = NULL;
-	unlock(p->fd, 0);
+	unlock(&p->locks[LOCK_ALL]);
+}
+
+/* Node and CPU lists in sysfs look like "0-3,8-11". */
+#define MAX_NODES 1024
+#define NODE_WORDS (MAX_NODES / (sizeof(unsigned long) * CHAR_BIT))
+#define NODE_BIT(n) (1UL << ((n) % (sizeof(unsigned long) * CHAR_BIT)))
+#define NODE_WORD(n) ((n) / (sizeof(unsigned long) * CHAR_BIT))
+
+static bool read_list(const char *fmt, int num,
+		      unsigned long *bits, unsigned int nbits)
+{
+	char path[100], buf[4096], *p;
+	int fd, len;
+	unsigned long lo, hi;
+
+	sprintf(path, fmt, num);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close_noerr(fd);
+	if (len <= 0)
+		return false;
+	buf[len] = '\0';
+
+	memset(bits, 0, nbits / CHAR_BIT);
+	for (p = buf; *p >= '0' && *p <= '9'; p++) {
+		lo = hi = strtoul(p, &p, 10);
+		if (*p == '-')
+			hi = strtoul(p + 1, &p, 10);
+		for (; lo <= hi && lo < nbits; lo++)
+			bits[NODE_WORD(lo)] |= NODE_BIT(lo);
+		if (*p != ',')
+			break;
+	}
+	return true;
+}
+
+static bool node_cpus(int node, cpu_set_t *cpus)
+{
+	unsigned long bits[CPU_SETSIZE / (sizeof(unsigned long) * CHAR_BIT)];
+	unsigned int i;
+
+	if (node < 0 || node >= MAX_NODES
+	    || !read_list("/sys/devices/system/node/node%i/cpulist", node,
+			  bits, CPU_SETSIZE))
+		return false;
+
+	CPU_ZERO(cpus);
+	for (i = 0; i < CPU_SETSIZE; i++)
+		if (bits[NODE_WORD(i)] & NODE_BIT(i))
+			CPU_SET(i, cpus);
+	return CPU_COUNT(cpus) != 0;
+}
+
+/* Older headers may lack these: then those pool options aren't there. */
+#ifndef MFD_HUGETLB
+#define MFD_HUGETLB 4U
+#endif
+
+static int memfd(unsigned int flags)
+{
+#ifdef SYS_memfd_create
+	return syscall(SYS_memfd_create, "antithread", flags);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static int set_mempolicy(int mode, const unsigned long *nodes)
+{
+#ifdef SYS_set_mempolicy
+	return syscall(SYS_set_mempolicy, mode, nodes, MAX_NODES + 1);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static int mbind(void *addr, unsigned long len, int mode,
+		 const unsigned long *nodes)
+{
+#ifdef SYS_mbind
+	return syscall(SYS_mbind, addr, len, mode, nodes, MAX_NODES + 1, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/* Run on that node's CPUs: memory we touch first then comes from it too. */
+static void bind_node(int node)
+{
+	unsigned long nodes[NODE_WORDS] = { 0 };
+	cpu_set_t cpus;
+
+	if (!node_cpus(node, &cpus))
+		return;
+	/* Both are hints: if we can't, we just run slower. */
+	sched_setaffinity(0, sizeof(cpus), &cpus);
+	nodes[NODE_WORD(node)] = NODE_BIT(node);
+	set_mempolicy(MPOL_PREFERRED, nodes);
+}
+
+/* Where a new pool's pages go, if we're asked. */
+static bool place_pool(void *pool, unsigned long len, unsigned int flags,
+		       int node)
+{
+	unsigned long nodes[NODE_WORDS] = { 0 };
+	int mode;
+
+	if (flags & AT_POOL_INTERLEAVE) {
+		if (!read_list("/sys/devices/system/node/online", 0,
+			       nodes, MAX_NODES)) {
+			errno = ENOSYS;
+			return false;
+		}
+		mode = MPOL_INTERLEAVE;
+	} else if (flags & AT_POOL_BIND) {
+		cpu_set_t cpus;
+
+		if (!node_cpus(node, &cpus)) {
+			errno = EINVAL;
+			return false;
+		}
+		nodes[NODE_WORD(node)] = NODE_BIT(node);
+		mode = MPOL_BIND;
+	} else
+		return true;
+
+	/* On a memfd, this is the file's policy: children share it. */
+	return mbind(pool, len, mode, nodes) == 0;
+}
+
+static unsigned long huge_page_size(void)
+{
+	char buf[4096], *p;
+	int fd, len;
+	unsigned long size = 2 * 1024 * 1024;
+
+	fd = open("/proc/meminfo", O_RDONLY);
+	if (fd < 0)
+		return size;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close_noerr(fd);
+	if (len > 0) {
+		buf[len] = '\0';
+		p = strstr(buf, "Hugepagesize:");
+		if (p)
+			size = strtoul(p + strlen("Hugepagesize:"), NULL, 10)
+				* 1024;
+	}
+	return size;
 }
 
 /* We add 16MB to size.  This compensates for address randomization. */
@@ -154,29 +684,50 @@ static void talloc_unlock(void)
 
 /* Create a new sharable pool. */
 struct at_pool *at_pool(unsigned long size)
+{
+	return at_pool_ex(size, 0, -1);
+}
+
+struct at_pool *at_pool_ex(unsigned long size, unsigned int flags, int node)
 {
 	int fd;
 	struct at_pool *atp;
 	struct at_pool_contents *p;
-	FILE *f;
+	unsigned long align = getpagesize();
+	void *area;
+
+	if ((flags & AT_POOL_BIND) && (flags & AT_POOL_INTERLEAVE)) {
+		errno = EINVAL;
+		return NULL;
+	}
 
 	/* FIXME: How much should we actually add for overhead?. */
 	size += 32 * getpagesize();
 
-	/* Round up to whole pages. */
-	size = (size + getpagesize()-1) & ~(getpagesize()-1);
+	if (flags & AT_POOL_HUGEPAGES)
+		align = huge_page_size();
 
-	f = tmpfile();
-	if (!f)
-		return NULL;
+	/* Round up to whole pages, including the lock table (hugetlb
+	 * mappings can only be unmapped in whole pages). */
+	size = ((size + LOCK_TABLE_SIZE + align-1) & ~(align-1))
+		- LOCK_TABLE_SIZE;
 
-	fd = dup(fileno(f));
-	fclose_noerr(f);
+	if (flags) {
+		/* Placement policy sticks to shmem, not to plain files. */
+		fd = memfd((flags & AT_POOL_HUGEPAGES) ? MFD_HUGETLB : 0);
+	} else {
+		FILE *f = tmpfile();
+		if (!f)
+			return NULL;
+
+		fd = dup(fileno(f));
+		fclose_noerr(f);
+	}
 
 	if (fd < 0)
 		return NULL;
 
-	if (ftruncate(fd, size + PADDING) != 0)
+	if (ftruncate(fd, size + LOCK_TABLE_SIZE) != 0)
 		goto fail_close;
 
 	atp = talloc(NULL, struct at_pool);
@@ -187,24 +738,36 @@ struct at_pool *at_pool(unsigned long size)
 	if (!p)
 		goto fail_free;
 
-	/* First map gets a nice big area. */
-	p->pool = mmap(NULL, size+PADDING, PROT_READ|PROT_WRITE, MAP_SHARED, fd,
-		       0);
-	if (p->pool == MAP_FAILED)
+	/* First map gets a nice big area (without reserving hugepages). */
+	area = mmap(NULL, size + PADDING + align, PROT_NONE,
+		    MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (area == MAP_FAILED)
 		goto fail_free;
 
-	/* Then we remap into the middle of it. */
-	munmap(p->pool, size+PADDING);
-	p->pool = mmap((char *)p->pool + PADDING/2, size, PROT_READ|PROT_WRITE,
-		       MAP_SHARED, fd, 0);
+	/* Then we map into the middle of it (lock table after pool). */
+	munmap(area, size + PADDING + align);
+	area = (void *)(((unsigned long)area + PADDING/2 + align-1)
+			& ~(align-1));
+	p->pool = mmap(area, size + LOCK_TABLE_SIZE,
+		       PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
 	if (p->pool == MAP_FAILED)
 		goto fail_free;
 
+	if (!place_pool(p->pool, size + LOCK_TABLE_SIZE, flags, node)) {
+		munmap(p->pool, size + LOCK_TABLE_SIZE);
+		goto fail_free;
+	}
+
 	p->fd = fd;
 	p->poolsize = size;
-	p->parent_rfd = p->parent_wfd = -1;
+	p->locks = (struct at_lock *)((char *)p->pool + size);
+	p->parent_rfd = p->parent_wfd = p->parent_pollfd = -1;
+	p->parent_chan = NULL;
+	p->node = -1;
 	p->atp = atp;
 	alloc_init(p->pool, p->poolsize);
+	init_cache(p, &p->local_cache);
+	p->cache = &p->local_cache;
 	list_add(&pools, &p->list);
 	talloc_set_destructor(p, destroy_pool);
 
@@ -212,6 +775,7 @@ struct at_pool *at_pool(unsigned long size)
 				       at_realloc, talloc_lock, talloc_unlock);
 	if (!atp->ctx)
 		goto fail_free;
+	talloc_hdr = (char *)atp->ctx - (char *)last_alloc;
 	return atp;
 
 fail_free:
@@ -221,6 +785,16 @@ fail_close:
 	return NULL;
 }
 
+bool at_pool_set_node(struct at_pool *atp, int node)
+{
+	cpu_set_t cpus;
+
+	if (node != -1 && !node_cpus(node, &cpus))
+		return false;
+	atp->p->node = node;
+	return true;
+}
+
 /* Talloc off this to allocate from within the pool. */
 const void *at_pool_ctx(struct at_pool *atp)
 {
@@ -242,18 +816,27 @@ static int destroy_at(struct athread *at)
 
 	close(at->rfd);
 	close(at->wfd);
+	if (at->pollfd != -1)
+		close(at->pollfd);
 
 	/* FIXME: Should we do SIGKILL if process doesn't exit soon? */
 	if (waitpid(at->pid, NULL, 0) != at->pid)
 		err(1, "Waiting for athread %p (pid %u)", at, at->pid);
 
+	/* It may not have flushed it: killed, or exit() without returning. */
+	reclaim_cache(&at->chan->cache);
+
+	close(at->chan->to_child.efd);
+	close(at->chan->to_parent.efd);
+	talloc_free(at->chan);
+
 	return 0;
 }
 
 /* Sets up thread and forks it.  NULL on error. */
 static struct athread *fork_thread(struct at_pool *atp)
 {
-	int p2c[2], c2p[2];
+	int p2c[2], c2p[2], efd[2];
 	struct athread *at;
 	struct at_pool_contents *pool = atp->p;
 
@@ -263,10 +846,27 @@ static struct athread *fork_thread(struct at_pool *atp)
 
 	/* We don't want this allocated *in* the pool. */
 	at = talloc_steal(atp, talloc(NULL, struct athread));
+	at->pollfd = -1;
 
-	if (pipe(p2c) != 0)
+	/* But the message rings do go in the pool. */
+	at->chan = talloc(atp->ctx, struct at_chan);
+	if (!at->chan)
 		goto free;
 
+	efd[0] = eventfd(0, EFD_NONBLOCK);
+	if (efd[0] < 0)
+		goto free;
+	efd[1] = eventfd(0, EFD_NONBLOCK);
+	if (efd[1] < 0)
+		goto close_efd0;
+	ring_init(&at->chan->to_child, efd[0]);
+	ring_init(&at->chan->to_parent, efd[1]);
+	/* Empty, in case the child never gets to use it. */
+	init_cache(pool, &at->chan->cache);
+
+	if (pipe(p2c) != 0)
+		goto close_efd1;
+
 	if (pipe(c2p) != 0)
 		goto close_p2c;
 
@@ -280,6 +880,10 @@ static struct athread *fork_thread(struct at_pool *atp)
 		close(p2c[1]);
 		pool->parent_rfd = p2c[0];
 		pool->parent_wfd = c2p[1];
+		pool->parent_chan = at->chan;
+		if (pool->node != -1)
+			bind_node(pool->node);
+		pool->cache = &at->chan->cache;
 		talloc_set_destructor(at, cant_destroy_self);
 	} else {
 		/* Parent */
@@ -297,7 +901,12 @@ close_c2p:
 close_p2c:
 	close_noerr(p2c[0]);
 	close_noerr(p2c[1]);
+close_efd1:
+	close_noerr(efd[1]);
+close_efd0:
+	close_noerr(efd[0]);
 free:
+	talloc_free(at->chan);
 	talloc_free(at);
 	return NULL;
 }
@@ -315,7 +924,12 @@ struct athread *_at_run(struct at_pool *atp,
 
 	if (at->pid == 0) {
 		/* Child */
-		at_tell_parent(atp, fn(atp, obj));
+		void *ret = fn(atp, obj);
+
+		/* Hand back what we've cached before we go (if we don't get
+		 * this far, the parent does it when it frees us). */
+		alloc_cache_flush(atp->p->cache);
+		at_tell_parent(atp, ret);
 		exit(0);
 	}
 	/* Parent */
@@ -344,10 +958,11 @@ struct athread *at_spawn(struct at_pool *atp, void *arg, char *cmdline[])
 		/* child */
 		char *argv[num_args(cmdline) + 2];
 		argv[0] = cmdline[0];
-		argv[1] = talloc_asprintf(NULL, "AT:%p/%lu/%i/%i/%i/%p",
+		argv[1] = talloc_asprintf(NULL, "AT:%p/%lu/%i/%i/%i/%p/%p",
 					  atp->p->pool, atp->p->poolsize,
 					  atp->p->fd, atp->p->parent_rfd,
-					  atp->p->parent_wfd, arg);
+					  atp->p->parent_wfd,
+					  atp->p->parent_chan, arg);
 		/* Copy including NULL terminator. */
 		memcpy(&argv[2], &cmdline[1], num_args(cmdline)*sizeof(char *));
 		execvp(argv[0], argv);
@@ -374,33 +989,30 @@ struct athread *at_spawn(struct at_pool *atp, void *arg, char *cmdline[])
 /* The fd to poll on */
 int at_fd(struct athread *at)
 {
-	return at->rfd;
+	return ring_pollfd(&at->chan->to_parent, at->rfd, &at->pollfd);
 }
 
-/* What's the antithread saying?  Blocks if fd not ready. */
+/* What's the antithread saying?  Blocks if nothing there yet. */
 void *at_read(struct athread *at)
 {
 	void *ret;
 
-	switch (read(at->rfd, &ret, sizeof(ret))) {
-	case -1:
-		err(1, "Reading from athread %p (pid %u)", at, at->pid);
-	case 0:
-		/* Thread died. */
+	if (!ring_read(&at->chan->to_parent, &ret, 1, at->rfd))
 		return NULL;
-	case sizeof(ret):
-		return ret;
-	default:
-		/* Should never happen. */
-		err(1, "Short read from athread %p (pid %u)", at, at->pid);
-	}
+	return ret;
+}
+
+/* Grab as many messages as are waiting (up to max), blocking for one. */
+unsigned int at_read_batch(struct athread *at, void **msgs, unsigned int max)
+{
+	return ring_read(&at->chan->to_parent, msgs, max, at->rfd);
 }
 
 /* Say something to a child. */
 void at_tell(struct athread *at, const void *status)
 {
-	if (write(at->wfd, &status, sizeof(status)) != sizeof(status))
-		err(1, "Failure writing to athread %p (pid %u)", at, at->pid);
+	if (!ring_send(&at->chan->to_child, status, at->rfd))
+		errx(1, "Failure writing to athread %p (pid %u)", at, at->pid);
 }
 
 /* For child to grab arguments from command line (removes them) */
@@ -422,17 +1034,20 @@ struct at_pool *at_get_pool(int *argc, char *argv[], void **arg)
 
 	p = atp->p = talloc(atp, struct at_pool_contents);
 
-	if (sscanf(argv[1], "AT:%p/%lu/%i/%i/%i/%p",
+	p->parent_pollfd = -1;
+	p->node = -1;
+	if (sscanf(argv[1], "AT:%p/%lu/%i/%i/%i/%p/%p",
 		   &p->pool, &p->poolsize, &p->fd,
-		   &p->parent_rfd, &p->parent_wfd, arg) != 6) {
+		   &p->parent_rfd, &p->parent_wfd,
+		   (void **)&p->parent_chan, arg) != 7) {
 		errno = EINVAL;
 		goto fail;
 	}
 
 	/* FIXME: To try to adjust for address space randomization, we
 	 * could re-exec a few times. */
-	map = mmap(p->pool, p->poolsize, PROT_READ|PROT_WRITE, MAP_SHARED,
-		   p->fd, 0);
+	map = mmap(p->pool, p->poolsize + LOCK_TABLE_SIZE,
+		   PROT_READ|PROT_WRITE, MAP_SHARED, p->fd, 0);
 	if (map != p->pool) {
 		fprintf(stderr, "Mapping %lu bytes @%p gave %p\n",
 			p->poolsize, p->pool, map);
@@ -440,6 +1055,9 @@ struct at_pool *at_get_pool(int *argc, char *argv[], void **arg)
 		goto fail;
 	}
 
+	p->locks = (struct at_lock *)((char *)p->pool + p->poolsize);
+	init_cache(p, &p->parent_chan->cache);
+	p->cache = &p->parent_chan->cache;
 	list_add(&pools, &p->list);
 	talloc_set_destructor(p, destroy_pool);
 	p->atp = atp;
@@ -448,6 +1066,7 @@ struct at_pool *at_get_pool(int *argc, char *argv[], void **arg)
 				       at_realloc, talloc_lock, talloc_unlock);
 	if (!atp->ctx)
 		goto fail;
+	talloc_hdr = (char *)atp->ctx - (char *)last_alloc;
 
 	/* Tell parent we're good. */
 	err = 0;
@@ -472,30 +1091,30 @@ void at_tell_parent(struct at_pool *atp, const void *status)
 	if (atp->p->parent_wfd == -1)
 		errx(1, "This process is not an antithread of this pool");
 
-	if (write(atp->p->parent_wfd, &status, sizeof(status))!=sizeof(status))
-		err(1, "Failure writing to parent");
+	if (!ring_send(&atp->p->parent_chan->to_parent, status,
+		       atp->p->parent_rfd))
+		errx(1, "Failure writing to parent");
 }
 
-/* What's the parent saying?  Blocks if fd not ready. */
+/* What's the parent saying?  Blocks if nothing there yet. */
 void *at_read_parent(struct at_pool *atp)
 {
 	void *ret;
 
+	if (!at_read_parent_batch(atp, &ret, 1))
+		return NULL;
+	return ret;
+}
+
+/* Grab as many messages as are waiting (up to max), blocking for one. */
+unsigned int at_read_parent_batch(struct at_pool *atp,
+				  void **msgs, unsigned int max)
+{
 	if (atp->p->parent_rfd == -1)
 		errx(1, "This process is not an antithread of this pool");
 
-	switch (read(atp->p->parent_rfd, &ret, sizeof(ret))) {
-	case -1:
-		err(1, "Reading from parent");
-	case 0:
-		/* Parent died. */
-		return NULL;
-	case sizeof(ret):
-		return ret;
-	default:
-		/* Should never happen. */
-		err(1, "Short read from parent");
-	}
+	return ring_read(&atp->p->parent_chan->to_child, msgs, max,
+			 atp->p->parent_rfd);
 }
 
 /* The fd to poll on */
@@ -504,49 +1123,371 @@ int at_parent_fd(struct at_pool *atp)
 	if (atp->p->parent_rfd == -1)
 		errx(1, "This process is not an antithread of this pool");
 
-	return atp->p->parent_rfd;
+	return ring_pollfd(&atp->p->parent_chan->to_child, atp->p->parent_rfd,
+			   &atp->p->parent_pollfd);
 }
 
-/* FIXME: Futexme. */
-void at_lock(void *obj)
+void *at_alloc(struct at_pool *atp, unsigned long size)
 {
-	struct at_pool *atp = talloc_find_parent_bytype(obj, struct at_pool);
-#if 0
-	unsigned int *l;
-
-	/* This isn't required yet, but ensures it's a talloc ptr */
-	l = talloc_lock_ptr(obj);
-#endif
+	return alloc_cache_get(atp->p->cache, size, 16);
+}
 
-	lock(atp->p->fd, (char *)obj - (char *)atp->p->pool);
+void at_free(struct at_pool *atp, void *p)
+{
+	alloc_cache_free(atp->p->cache, p);
+}
 
-#if 0
-	if (*l)
-		errx(1, "Object %p was already locked (something died?)", obj);
-	*l = 1;
-#endif
+void at_lock(void *obj)
+{
+	lock(obj_lock(obj));
 }
 
 void at_unlock(void *obj)
 {
-	struct at_pool *atp = talloc_find_parent_bytype(obj, struct at_pool);
-#if 0
-	unsigned int *l;
-
-	l = talloc_lock_ptr(obj);
-	if (!*l)
-		errx(1, "Object %p was already unlocked", obj);
-	*l = 0;
-#endif
-	unlock(atp->p->fd, (char *)obj - (char *)atp->p->pool);
+	unlock(obj_lock(obj));
 }
 
 void at_lock_all(struct at_pool *atp)
 {
-	lock(atp->p->fd, 0);
+	lock(&atp->p->locks[LOCK_ALL]);
 }
 	
 void at_unlock_all(struct at_pool *atp)
 {
-	unlock(atp->p->fd, 0);
+	unlock(&atp->p->locks[LOCK_ALL]);
+}
+
+/* Task pools.  Each worker has a Chase-Lev deque in the pool: only it
+ * pushes and pops at the bottom, others steal from the top.  Tasks from
+ * the parent (or which don't fit) go on a shared list under a lock.  Idle
+ * workers sleep on the seq futex, which submitters bump if any sleep. */
+#define AT_DEQUE_SIZE 256
+
+enum future_state { FUTURE_PENDING, FUTURE_WAITING, FUTURE_DONE };
+
+struct at_future {
+	void *(*fn)(struct at_taskpool *, void *);
+	void *arg;
+	void *result;
+	volatile uint32_t state;
+	struct at_future *next;
+};
+
+struct at_deque {
+	volatile long top;
+	char pad[56];
+	volatile long bottom;
+	char pad2[56];
+	struct at_future *volatile task[AT_DEQUE_SIZE];
+};
+
+struct at_tasks {
+	struct at_lock lock;
+	struct at_future *volatile inject, **inject_tail;
+	volatile uint32_t seq, sleepers, stop;
+	unsigned int num;
+	struct at_deque deque[];
+};
+
+struct at_taskpool {
+	struct at_pool *atp;
+	struct at_tasks *tasks;
+	struct athread **workers;
+	unsigned int num, seed;
+	/* Which worker we are, or -1 in the parent. */
+	int self;
+};
+
+static bool deque_push(struct at_deque *d, struct at_future *f)
+{
+	long b = d->bottom;
+
+	if (b - d->top >= AT_DEQUE_SIZE)
+		return false;
+	d->task[b % AT_DEQUE_SIZE] = f;
+	__sync_synchronize();
+	d->bottom = b + 1;
+	return true;
+}
+
+static struct at_future *deque_pop(struct at_deque *d)
+{
+	long t, b = d->bottom - 1;
+	struct at_future *f;
+
+	d->bottom = b;
+	__sync_synchronize();
+	t = d->top;
+	if (t > b) {
+		d->bottom = b + 1;
+		return NULL;
+	}
+
+	f = d->task[b % AT_DEQUE_SIZE];
+	/* Last one: race thieves for it. */
+	if (t == b) {
+		if (!__sync_bool_compare_and_swap(&d->top, t, t + 1))
+			f = NULL;
+		d->bottom = b + 1;
+	}
+	return f;
+}
+
+static struct at_future *deque_steal(struct at_deque *d)
+{
+	struct at_future *f;
+	long t;
+
+	for (;;) {
+		t = d->top;
+		__sync_synchronize();
+		if (t >= d->bottom)
+			return NULL;
+		f = d->task[t % AT_DEQUE_SIZE];
+		if (__sync_bool_compare_and_swap(&d->top, t, t + 1))
+			return f;
+	}
+}
+
+static void inject_push(struct at_tasks *t, struct at_future *f)
+{
+	lock(&t->lock);
+	*t->inject_tail = f;
+	t->inject_tail = &f->next;
+	unlock(&t->lock);
+}
+
+static struct at_future *inject_pop(struct at_tasks *t)
+{
+	struct at_future *f;
+
+	lock(&t->lock);
+	f = t->inject;
+	if (f) {
+		t->inject = f->next;
+		if (!t->inject)
+			t->inject_tail = (struct at_future **)&t->inject;
+	}
+	unlock(&t->lock);
+	return f;
+}
+
+static struct at_future *find_task(struct at_taskpool *tp)
+{
+	struct at_tasks *t = tp->tasks;
+	struct at_future *f;
+	unsigned int i, start;
+
+	if (tp->self >= 0) {
+		f = deque_pop(&t->deque[tp->self]);
+		if (f)
+			return f;
+	}
+
+	if (t->inject) {
+		f = inject_pop(t);
+		if (f)
+			return f;
+	}
+
+	/* Our tp->num only counts workers started before us. */
+	start = rand_r(&tp->seed);
+	for (i = 0; i < t->num; i++) {
+		unsigned int victim = (start + i) % t->num;
+
+		if (victim == tp->self)
+			continue;
+		f = deque_steal(&t->deque[victim]);
+		if (f)
+			return f;
+	}
+	return NULL;
+}
+
+static void wake_worker(struct at_tasks *t, int num)
+{
+	__sync_synchronize();
+	if (t->sleepers) {
+		__sync_fetch_and_add(&t->seq, 1);
+		futex((uint32_t *)&t->seq, FUTEX_WAKE, num, NULL);
+	}
+}
+
+static void run_task(struct at_taskpool *tp, struct at_future *f)
+{
+	f->result = f->fn(tp, f->arg);
+	__sync_synchronize();
+
+	/* Once it's done, the owner may free it: the wakes are harmless.  A
+	 * waiting worker sleeps with the idle ones, so wake them all. */
+	if (__sync_lock_test_and_set(&f->state, FUTURE_DONE) == FUTURE_WAITING) {
+		futex((uint32_t *)&f->state, FUTEX_WAKE, INT_MAX, NULL);
+		wake_worker(tp->tasks, INT_MAX);
+	}
+}
+
+/* Sleep until there may be work, or until fut (if any) is done.  Returns
+ * a task if one turned up as we were going to sleep. */
+static struct at_future *worker_idle(struct at_taskpool *tp,
+				     struct at_future *fut)
+{
+	struct at_tasks *t = tp->tasks;
+	struct timespec ts = { 0, LOCK_CHECK_NSEC };
+	struct at_future *f;
+	uint32_t seq;
+
+	/* Submitters (and whoever finishes fut) bump seq if they see us. */
+	seq = t->seq;
+	__sync_fetch_and_add(&t->sleepers, 1);
+	if (fut)
+		__sync_bool_compare_and_swap(&fut->state, FUTURE_PENDING,
+					     FUTURE_WAITING);
+	f = find_task(tp);
+	if (!f && !(fut ? fut->state == FUTURE_DONE : t->stop)
+	    && futex((uint32_t *)&t->seq, FUTEX_WAIT, seq, &ts) != 0
+	    && errno == ETIMEDOUT && peer_gone(tp->atp->p->parent_rfd))
+		exit(0);
+	__sync_fetch_and_sub(&t->sleepers, 1);
+	return f;
+}
+
+static void *worker(struct at_pool *atp, struct at_taskpool *tp)
+{
+	struct at_future *f;
+
+	for (;;) {
+		f = find_task(tp);
+		if (!f) {
+			if (tp->tasks->stop)
+				return NULL;
+			f = worker_idle(tp, NULL);
+		}
+		if (f)
+			run_task(tp, f);
+	}
+}
+
+static int destroy_taskpool(struct at_taskpool *tp)
+{
+	unsigned int i;
+
+	/* Workers finish everything queued, then return. */
+	tp->tasks->stop = 1;
+	wake_worker(tp->tasks, INT_MAX);
+	for (i = 0; i < tp->num; i++) {
+		at_read(tp->workers[i]);
+		talloc_free(tp->workers[i]);
+	}
+	talloc_free(tp->tasks);
+	return 0;
+}
+
+struct at_taskpool *at_taskpool(struct at_pool *atp, unsigned int workers)
+{
+	struct at_taskpool *tp;
+
+	if (!workers)
+		workers = sysconf(_SC_NPROCESSORS_ONLN);
+
+	/* Like athreads, the handle isn't *in* the pool. */
+	tp = talloc(atp, struct at_taskpool);
+	if (!tp)
+		return NULL;
+	tp->atp = atp;
+	tp->num = 0;
+	tp->workers = talloc_array(tp, struct athread *, workers);
+	tp->tasks = talloc_zero_size(atp->ctx, sizeof(*tp->tasks)
+				     + workers * sizeof(tp->tasks->deque[0]));
+	if (!tp->workers || !tp->tasks) {
+		talloc_free(tp->tasks);
+		talloc_free(tp);
+		return NULL;
+	}
+	tp->tasks->inject_tail = (struct at_future **)&tp->tasks->inject;
+	tp->tasks->num = workers;
+	talloc_set_destructor(tp, destroy_taskpool);
+
+	/* Each one gets a copy of tp with their own number in it. */
+	while (tp->num < workers) {
+		tp->self = tp->seed = tp->num;
+		tp->workers[tp->num] = at_run(atp, worker, tp);
+		if (!tp->workers[tp->num]) {
+			tp->self = -1;
+			talloc_free(tp);
+			return NULL;
+		}
+		talloc_steal(tp, tp->workers[tp->num++]);
+	}
+	tp->self = -1;
+	tp->seed = getpid();
+	return tp;
+}
+
+struct at_pool *at_taskpool_pool(struct at_taskpool *tp)
+{
+	return tp->atp;
+}
+
+struct at_future *_at_task(struct at_taskpool *tp,
+			   void *(*fn)(struct at_taskpool *, void *),
+			   void *arg)
+{
+	struct at_future *f = talloc(tp->atp->ctx, struct at_future);
+
+	if (!f)
+		return NULL;
+	f->fn = fn;
+	f->arg = arg;
+	f->state = FUTURE_PENDING;
+	f->next = NULL;
+
+	if (tp->self < 0 || !deque_push(&tp->tasks->deque[tp->self], f))
+		inject_push(tp->tasks, f);
+	wake_worker(tp->tasks, 1);
+	return f;
+}
+
+/* The parent can't steal, but it can notice a worker dying. */
+static void future_wait(struct at_taskpool *tp, struct at_future *f)
+{
+	struct timespec ts = { 0, LOCK_CHECK_NSEC };
+	unsigned int i;
+
+	while (f->state != FUTURE_DONE) {
+		if (!__sync_bool_compare_and_swap(&f->state, FUTURE_PENDING,
+						  FUTURE_WAITING)
+		    && f->state != FUTURE_WAITING)
+			continue;
+		if (futex((uint32_t *)&f->state, FUTEX_WAIT, FUTURE_WAITING,
+			  &ts) == 0 || errno != ETIMEDOUT)
+			continue;
+		for (i = 0; i < tp->num; i++)
+			if (peer_gone(tp->workers[i]->rfd))
+				errx(1, "Task pool worker %u died", i);
+	}
+}
+
+void *at_future_get(struct at_taskpool *tp, struct at_future *f)
+{
+	struct at_future *other;
+	void *ret;
+
+	if (tp->self < 0)
+		future_wait(tp, f);
+	else {
+		/* A worker must keep working, or nested tasks could deadlock;
+		 * with nothing else to do, it sleeps until f is done. */
+		while (f->state != FUTURE_DONE) {
+			other = find_task(tp);
+			if (!other)
+				other = worker_idle(tp, f);
+			if (other)
+				run_task(tp, other);
+		}
+	}
+
+	__sync_synchronize();
+	ret = f->result;
+	talloc_free(f);
+	return ret;
 }
@@ -2,6 +2,7 @@
 #ifndef ANTITHREAD_H
 #define ANTITHREAD_H
 #include <ccan/typesafe_cb/typesafe_cb.h>
+#include <stdbool.h>
 
 struct at_pool;
 struct athread;
@@ -11,6 +12,19 @@ struct athread;
 /* Create a new sharable pool. */
 struct at_pool *at_pool(unsigned long size);
 
+/* Pool options: back it with hugepages (which must be reserved, see
+ * /proc/sys/vm/nr_hugepages), and spread it over all NUMA nodes or keep
+ * it on one.  NULL (with errno set) if the system can't do it. */
+#define AT_POOL_HUGEPAGES	1
+#define AT_POOL_INTERLEAVE	2
+#define AT_POOL_BIND		4 /* To node */
+struct at_pool *at_pool_ex(unsigned long size, unsigned int flags, int node);
+
+/* Pin antithreads created after this to the CPUs of a NUMA node (-1 for
+ * anywhere): pool memory they touch first comes from that node too.
+ * false if there is no such node. */
+bool at_pool_set_node(struct at_pool *pool, int node);
+
 /* Talloc off this to allocate from within the pool. */
 const void *at_pool_ctx(struct at_pool *atp);
 
@@ -27,9 +41,12 @@ struct athread *at_spawn(struct at_pool *pool, void *arg, char *cmdline[]);
 /* The fd to poll on */
 int at_fd(struct athread *at);
 
-/* What's the antithread saying?  Blocks if fd not ready. */
+/* What's the antithread saying?  Blocks if nothing there yet. */
 void *at_read(struct athread *at);
 
+/* Grab up to max messages at once; blocks for the first.  0 if it died. */
+unsigned int at_read_batch(struct athread *at, void **msgs, unsigned int max);
+
 /* Say something to a child (async). */
 void at_tell(struct athread *at, const void *status);
 
@@ -40,22 +57,61 @@ struct at_pool *at_get_pool(int *argc, char *argv[], void **arg);
 /* Say something to our parent (async). */
 void at_tell_parent(struct at_pool *pool, const void *status);
 
-/* What's the parent saying?  Blocks if fd not ready. */
+/* What's the parent saying?  Blocks if nothing there yet. */
 void *at_read_parent(struct at_pool *pool);
 
+/* Grab up to max messages at once; blocks for the first.  0 if it died. */
+unsigned int at_read_parent_batch(struct at_pool *pool,
+				  void **msgs, unsigned int max);
+
 /* The fd to poll on */
 int at_parent_fd(struct at_pool *pool);
 
-/* Locking: any talloc pointer. */
+/* Raw allocation from the pool, bypassing talloc.  Each antithread keeps
+ * its own cache, so this only locks to refill it; at_free() can be called
+ * from any antithread. */
+void *at_alloc(struct at_pool *pool, unsigned long size);
+void at_free(struct at_pool *pool, void *p);
+
+/* Locking: any talloc pointer in the pool, each with its own lock.  Locks
+ * nest; if the holder dies, the lock is taken from it (but what it was
+ * protecting may be half-updated).  The lock moves with the object, so
+ * don't free or talloc_realloc() it while someone else might lock it. */
 void at_lock(void *obj);
 void at_unlock(void *obj);
 
 void at_lock_all(struct at_pool *pool);
 void at_unlock_all(struct at_pool *pool);
 
-/* Internal function */
+/* Task pools: worker antithreads which run tasks, stealing from each other
+ * when they run dry.  Tasks can start more tasks and wait on them. */
+struct at_taskpool;
+struct at_future;
+
+/* Start this many workers (0 means one per CPU).  Child of pool; free it
+ * to finish the outstanding tasks and stop the workers. */
+struct at_taskpool *at_taskpool(struct at_pool *pool, unsigned int workers);
+
+/* The pool the tasks run in (for allocating results). */
+struct at_pool *at_taskpool_pool(struct at_taskpool *tp);
+
+/* Queue fn(tp, arg) to run on some worker.  NULL on allocation failure. */
+#define at_task(tp, fn, arg)						\
+	_at_task(tp,							\
+		 typesafe_cb_preargs(void *, void *, (fn), (arg),	\
+				     struct at_taskpool *),		\
+		 (arg))
+
+/* Wait for the task to finish (running others meanwhile if we're a
+ * worker), free the future and return what the task returned. */
+void *at_future_get(struct at_taskpool *tp, struct at_future *f);
+
+/* Internal functions */
 struct athread *_at_run(struct at_pool *pool,
 			void *(*fn)(struct at_pool *, void *arg),
 			void *arg);
+struct at_future *_at_task(struct at_taskpool *tp,
+			   void *(*fn)(struct at_taskpool *, void *arg),
+			   void *arg);
 
 #endif /* ANTITHREAD_H */
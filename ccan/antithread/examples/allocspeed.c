@@ -0,0 +1,105 @@
+/* Time allocation-heavy antithreads: each keeps a window of live objects,
+ * replacing a random one each time, through talloc or at_alloc. */
+#include <ccan/antithread/antithread.h>
+#include <ccan/talloc/talloc.h>
+#include <err.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#define NUM_LIVE 256
+
+static bool raw;
+static unsigned int ops = 1000000;
+
+static void *churn(struct at_pool *atp, void *unused)
+{
+	void *live[NUM_LIVE] = { NULL };
+	unsigned int i, seed = getpid();
+
+	/* Wait for the starting gun. */
+	at_read_parent(atp);
+
+	for (i = 0; i < ops; i++) {
+		unsigned int n = rand_r(&seed) % NUM_LIVE;
+		unsigned long size = 16 + rand_r(&seed) % 496;
+
+		if (raw) {
+			if (live[n])
+				at_free(atp, live[n]);
+			live[n] = at_alloc(atp, size);
+		} else {
+			talloc_free(live[n]);
+			live[n] = talloc_size(at_pool_ctx(atp), size);
+		}
+		if (!live[n])
+			return NULL;
+	}
+
+	for (i = 0; i < NUM_LIVE; i++) {
+		if (raw)
+			at_free(atp, live[i]);
+		else
+			talloc_free(live[i]);
+	}
+	return atp;
+}
+
+static unsigned long usec_since(const struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) * 1000000UL
+		+ now.tv_usec - start->tv_usec;
+}
+
+int main(int argc, char *argv[])
+{
+	struct at_pool *atp;
+	struct athread **at;
+	struct timeval start;
+	unsigned int i, num = 4;
+	unsigned long usec;
+
+	if (argc > 1 && strcmp(argv[1], "--raw") == 0) {
+		raw = true;
+		argv++;
+		argc--;
+	}
+	if (argc > 1)
+		num = atoi(argv[1]);
+	if (argc > 2)
+		ops = atoi(argv[2]);
+	if (argc > 3 || !num || !ops)
+		errx(1, "Usage: allocspeed [--raw] [antithreads [ops]]");
+
+	atp = at_pool(16*1024*1024);
+	if (!atp)
+		err(1, "Creating pool");
+
+	at = talloc_array(NULL, struct athread *, num);
+	for (i = 0; i < num; i++) {
+		at[i] = at_run(atp, churn, NULL);
+		if (!at[i])
+			err(1, "Creating antithread %u", i);
+	}
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < num; i++)
+		at_tell(at[i], atp);
+	for (i = 0; i < num; i++)
+		if (at_read(at[i]) != atp)
+			errx(1, "Antithread %u failed", i);
+	usec = usec_since(&start);
+
+	printf("%s: %u antithreads, %u ops each: %lu usec (%lu ns/op)\n",
+	       raw ? "at_alloc" : "talloc", num, ops, usec,
+	       usec * 1000 / ((unsigned long)num * ops));
+	talloc_free(at);
+	talloc_free(atp);
+	return 0;
+}
@@ -11,7 +11,6 @@
 #include <string.h>
 #include <stdint.h>
 #include <math.h>
-#include <sys/select.h>
 #include <ccan/str/str.h>
 #include <ccan/antithread/antithread.h>
 #include <sys/types.h>
@@ -375,95 +374,21 @@ static struct drawing *breed_drawing(const void *ctx,
 	return drawing;
 }
 
-/* This is our anti-thread.  It does the time-consuming operation of
- * breeding two drawings together and scoring the result. */
-static void *breeder(struct at_pool *atp, struct image *master)
-{
+struct breeding {
 	const struct drawing *a, *b;
-
-	/* For simplicity, controller just hands us two pointers in
-	 * separate writes.  It could put them in the pool for us to
-	 * read. */
-	while ((a = at_read_parent(atp)) != NULL) {
-		struct drawing *child;
-		b = at_read_parent(atp);
-
-		child = breed_drawing(at_pool_ctx(atp), a, b, master);
-		at_tell_parent(atp, child);
-	}
-	/* Unused: we never exit. */
-	return NULL;
-}
-
-/* We keep a very rough count of how much work each athread has.  This
- * works fine since fairly all rendering takes about the same time.
- *
- * Better alternative would be to put all the pending work somewhere
- * in the shared area and notify any idle thread.  The threads would
- * keep looking in that shared area until they can't see any more
- * work, then they'd at_tell_parent() back. */
-struct athread_work {
-	struct athread *at;
-	unsigned int pending;
+	const struct image *master;
 };
 
-/* It's assumed that there isn't more than num results pending. */
-static unsigned gather_results(struct athread_work *athreads,
-			       unsigned int num_threads,
-			       struct drawing **drawing,
-			       unsigned int num,
-			       bool block)
-{
-	unsigned int i, maxfd = 0, done = 0;
-	struct timeval zero = { .tv_sec = 0, .tv_usec = 0 };
-
-	/* If it mattered, we could cache this fd mask and maxfd. */
-	for (i = 0; i < num_threads; i++) {
-		if (at_fd(athreads[i].at) > maxfd)
-			maxfd = at_fd(athreads[i].at);
-	}
-
-	do {
-		fd_set set;
-		FD_ZERO(&set);
-		for (i = 0; i < num_threads; i++)
-			FD_SET(at_fd(athreads[i].at), &set);
-
-		if (select(maxfd+1, &set, NULL, NULL, block ? NULL : &zero) < 0)
-			err(1, "Selecting on antithread results");
-
-		for (i = 0; i < num_threads; i++) {
-			if (!FD_ISSET(at_fd(athreads[i].at), &set))
-				continue;
-			*drawing = at_read(athreads[i].at);
-			if (!*drawing)
-				err(1, "Error with thread %u", i);
-			drawing++;
-			num--;
-			athreads[i].pending--;
-			done++;
-		}
-	} while (block && num);
-
-	return done;
-}
-
-/* Hand work to an antithread to breed these two together. */
-static void tell_some_breeder(struct athread_work *athreads,
-			      unsigned int num_threads,
-			      const struct drawing *a, const struct drawing *b)
+/* This is our task.  It does the time-consuming operation of breeding
+ * two drawings together and scoring the result. */
+static void *breed(struct at_taskpool *tp, struct breeding *br)
 {
-	unsigned int i, best = 0;
-
-	/* Find least loaded thread. */
-	for (i = 1; i < num_threads; i++) {
-		if (athreads[i].pending < athreads[best].pending)
-			best = i;
-	}
+	struct drawing *child;
 
-	at_tell(athreads[best].at, a);
-	at_tell(athreads[best].at, b);
-	athreads[best].pending++;
+	child = breed_drawing(at_pool_ctx(at_taskpool_pool(tp)),
+			      br->a, br->b, br->master);
+	talloc_free(br);
+	return child;
 }
 
 /* We seed initial triangles colours from the master image. */
@@ -613,7 +538,7 @@ int main(int argc, char *argv[])
 	struct drawing *drawing[POPULATION_SIZE];
 	unsigned long prev_best, poolsize;
 	struct at_pool *atp;
-	struct athread_work *athreads;
+	struct at_taskpool *tp;
 
 	if (argc != 6 && argc != 7)
 		usage();
@@ -667,22 +592,18 @@ int main(int argc, char *argv[])
 	if (!num_threads)
 		usage();
 
-	/* Hang the threads off the pool (not *in* the pool). */
-	athreads = talloc_array(atp, struct athread_work, num_threads);
-	for (i = 0; i < num_threads; i++) {
-		athreads[i].pending = 0;
-		athreads[i].at = at_run(atp, breeder, master);
-		if (!athreads[i].at)
-			err(1, "Creating antithread %u", i);
-	}
+	tp = at_taskpool(atp, num_threads);
+	if (!tp)
+		err(1, "Creating %u antithreads", num_threads);
 
 	since_prev_best = 0;
 	/* Worse than theoretically worst case. */
 	prev_best = master->height * master->stride * 256;
 
 	while (since_prev_best < PLATEAU_GENS) {
-		unsigned int j, done = 0;
-		struct drawing *new[POPULATION_SIZE/4];
+		unsigned int j;
+		struct at_future *new[POPULATION_SIZE/4];
+		struct drawing *children[POPULATION_SIZE/4];
 
 		qsort(drawing, POPULATION_SIZE, sizeof(drawing[0]),
 		      compare_drawing_scores);
@@ -693,26 +614,25 @@ int main(int argc, char *argv[])
 		/* Probability of being chosen to breed depends on
 		 * rank.  We breed over lowest 1/4 population. */
 		for (j = 0; j < POPULATION_SIZE / 4; j++) {
-			struct drawing *best1, *best2;
-
-			best1 = select_good_drawing(drawing, POPULATION_SIZE);
-			best2 = select_good_drawing(drawing, POPULATION_SIZE);
-
-			tell_some_breeder(athreads, num_threads, best1, best2);
-
-			/* We reap during loop, so return pipes don't fill.
-			 * See "Better alternative" above. */
-			done += gather_results(athreads, num_threads,
-					       new + done, j - done, false);
+			struct breeding *br;
+
+			br = talloc(at_pool_ctx(atp), struct breeding);
+			br->a = select_good_drawing(drawing, POPULATION_SIZE);
+			br->b = select_good_drawing(drawing, POPULATION_SIZE);
+			br->master = master;
+			new[j] = at_task(tp, breed, br);
+			if (!new[j])
+				err(1, "Creating task");
 		}
 
-		/* Collate final results. */
-		gather_results(athreads, num_threads, new+done, j-done, true);
+		/* Collate results. */
+		for (j = 0; j < POPULATION_SIZE / 4; j++)
+			children[j] = at_future_get(tp, new[j]);
 
 		/* Overwrite bottom 1/4 */
 		for (j = POPULATION_SIZE * 3 / 4; j < POPULATION_SIZE; j++) {
 			talloc_free(drawing[j]);
-			drawing[j] = new[j - POPULATION_SIZE * 3 / 4];
+			drawing[j] = children[j - POPULATION_SIZE * 3 / 4];
 		}
 
 		/* We dump on every 1% improvement in score. */
@@ -0,0 +1,131 @@
+/* Time at_lock/at_unlock with several antithreads hammering a set of
+ * objects, against the fcntl byte-range locks antithread used to use. */
+#include <ccan/antithread/antithread.h>
+#include <ccan/talloc/talloc.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#define NUM_OBJS 64
+
+struct bench {
+	bool use_fcntl;
+	int fd;
+	unsigned int ops;
+	unsigned int *objs[NUM_OBJS];
+};
+
+static void fcntl_lock(int fd, int type, unsigned long off)
+{
+	struct flock fl;
+
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = off;
+	fl.l_len = 1;
+
+	while (fcntl(fd, type == F_UNLCK ? F_SETLK : F_SETLKW, &fl) < 0)
+		if (errno != EINTR)
+			err(1, "fcntl lock");
+}
+
+static void *hammer(struct at_pool *atp, struct bench *b)
+{
+	unsigned int i, seed = getpid();
+
+	/* Wait for the starting gun. */
+	at_read_parent(atp);
+
+	for (i = 0; i < b->ops; i++) {
+		unsigned int n = rand_r(&seed) % NUM_OBJS;
+
+		if (b->use_fcntl) {
+			fcntl_lock(b->fd, F_WRLCK, n);
+			(*(volatile unsigned int *)b->objs[n])++;
+			fcntl_lock(b->fd, F_UNLCK, n);
+		} else {
+			at_lock(b->objs[n]);
+			(*(volatile unsigned int *)b->objs[n])++;
+			at_unlock(b->objs[n]);
+		}
+	}
+	return b;
+}
+
+static unsigned long usec_since(const struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) * 1000000UL
+		+ now.tv_usec - start->tv_usec;
+}
+
+int main(int argc, char *argv[])
+{
+	struct at_pool *atp;
+	struct athread **at;
+	struct bench *b;
+	struct timeval start;
+	unsigned int i, total, num = 4, ops = 1000000;
+	unsigned long usec;
+	FILE *f;
+
+	atp = at_pool(1024*1024);
+	if (!atp)
+		err(1, "Creating pool");
+
+	b = talloc_zero(at_pool_ctx(atp), struct bench);
+	if (argc > 1 && strcmp(argv[1], "--fcntl") == 0) {
+		b->use_fcntl = true;
+		argv++;
+		argc--;
+	}
+	if (argc > 1)
+		num = atoi(argv[1]);
+	if (argc > 2)
+		ops = atoi(argv[2]);
+	if (argc > 3 || !num || !ops)
+		errx(1, "Usage: lockspeed [--fcntl] [antithreads [ops]]");
+
+	f = tmpfile();
+	if (!f)
+		err(1, "Creating lock file");
+	b->fd = fileno(f);
+	b->ops = ops;
+	for (i = 0; i < NUM_OBJS; i++)
+		b->objs[i] = talloc_zero(b, unsigned int);
+
+	at = talloc_array(NULL, struct athread *, num);
+	for (i = 0; i < num; i++) {
+		at[i] = at_run(atp, hammer, b);
+		if (!at[i])
+			err(1, "Creating antithread %u", i);
+	}
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < num; i++)
+		at_tell(at[i], b);
+	for (i = 0; i < num; i++)
+		if (at_read(at[i]) != b)
+			errx(1, "Antithread %u failed", i);
+	usec = usec_since(&start);
+
+	for (total = i = 0; i < NUM_OBJS; i++)
+		total += *b->objs[i];
+	if (total != num * ops)
+		errx(1, "Lost updates: %u not %u", total, num * ops);
+
+	printf("%s: %u antithreads, %u ops each: %lu usec (%lu ns/op)\n",
+	       b->use_fcntl ? "fcntl" : "at_lock", num, ops, usec,
+	       usec * 1000 / ((unsigned long)num * ops));
+	talloc_free(at);
+	talloc_free(atp);
+	return 0;
+}
@@ -0,0 +1,88 @@
+/* Time messages through at_tell/at_read: a one-way stream from the
+ * antithread, then a ping-pong between it and us. */
+#include <ccan/antithread/antithread.h>
+#include <ccan/talloc/talloc.h>
+#include <err.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+static unsigned long num = 1000000;
+
+static void *talker(struct at_pool *atp, void *unused)
+{
+	unsigned long i;
+	void *p;
+
+	for (i = 1; i <= num; i++)
+		at_tell_parent(atp, (void *)i);
+
+	/* Bounce them back until told to stop. */
+	while ((p = at_read_parent(atp)) != NULL)
+		at_tell_parent(atp, p);
+	return NULL;
+}
+
+static unsigned long usec_since(const struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) * 1000000UL
+		+ now.tv_usec - start->tv_usec;
+}
+
+int main(int argc, char *argv[])
+{
+	struct at_pool *atp;
+	struct athread *at;
+	struct timeval start;
+	unsigned long i, n, usec;
+	bool batch = false;
+	void *msgs[64];
+
+	if (argc > 1 && strcmp(argv[1], "--batch") == 0) {
+		batch = true;
+		argv++;
+		argc--;
+	}
+	if (argc > 1)
+		num = atol(argv[1]);
+	if (argc > 2 || !num)
+		errx(1, "Usage: tellspeed [--batch] [messages]");
+
+	atp = at_pool(1024*1024);
+	if (!atp)
+		err(1, "Creating pool");
+
+	gettimeofday(&start, NULL);
+	at = at_run(atp, talker, NULL);
+	if (!at)
+		err(1, "Creating antithread");
+	for (i = 0; i < num; i += n) {
+		if (batch)
+			n = at_read_batch(at, msgs, 64);
+		else
+			n = (at_read(at) != NULL);
+		if (!n)
+			errx(1, "Antithread died");
+	}
+	usec = usec_since(&start);
+	printf("stream: %lu messages in %lu usec (%lu/sec)\n",
+	       num, usec, (unsigned long)(num * 1000000.0 / usec));
+
+	gettimeofday(&start, NULL);
+	for (i = 1; i <= num / 10; i++) {
+		at_tell(at, (void *)i);
+		if (at_read(at) != (void *)i)
+			errx(1, "Bad ping-pong reply");
+	}
+	usec = usec_since(&start);
+	printf("ping-pong: %lu round trips in %lu usec (%lu ns each)\n",
+	       num / 10, usec, usec * 1000 / (num / 10));
+
+	talloc_free(atp);
+	return 0;
+}
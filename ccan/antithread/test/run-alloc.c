@@ -0,0 +1,122 @@
+#include <ccan/antithread/antithread.c>
+#include <assert.h>
+#include <ccan/tap/tap.h>
+
+#define NUM_ALLOCS 200
+
+/* What's the biggest allocation the pool itself will give us? */
+static unsigned long largest(struct at_pool *atp)
+{
+	struct at_pool_contents *p = atp->p;
+	unsigned long lo = 0, hi = p->poolsize, mid;
+	void *mem;
+
+	alloc_cache_flush(p->cache);
+	lock(&p->locks[LOCK_ALLOC]);
+	while (lo < hi) {
+		mid = lo + (hi - lo + 1) / 2;
+		mem = alloc_get(p->pool, p->poolsize, mid, 1);
+		if (mem) {
+			alloc_free(p->pool, p->poolsize, mem);
+			lo = mid;
+		} else
+			hi = mid - 1;
+	}
+	unlock(&p->locks[LOCK_ALLOC]);
+	return lo;
+}
+
+/* Keep half of what we allocate, for the parent to free. */
+static void *test(struct at_pool *atp, void *unused)
+{
+	void **keep, *p;
+	unsigned int i;
+
+	keep = at_alloc(atp, sizeof(void *) * NUM_ALLOCS / 2);
+	for (i = 0; i < NUM_ALLOCS; i++) {
+		p = at_alloc(atp, 8 + (i * 37) % 500);
+		if (!p)
+			return NULL;
+		if (i % 2)
+			at_free(atp, p);
+		else
+			keep[i / 2] = p;
+		talloc_free(talloc_size(at_pool_ctx(atp), i));
+	}
+	return keep;
+}
+
+/* Fill our cache, then go without returning. */
+static void *hoard(struct at_pool *atp, void *unused)
+{
+	void *p[NUM_ALLOCS];
+	unsigned int i;
+
+	for (i = 0; i < NUM_ALLOCS; i++)
+		p[i] = at_alloc(atp, 8 + (i * 37) % 500);
+	for (i = 0; i < NUM_ALLOCS; i++)
+		at_free(atp, p[i]);
+	for (i = 0; i < NUM_ALLOCS; i++)
+		talloc_free(talloc_size(at_pool_ctx(atp), i));
+
+	at_tell_parent(atp, atp);
+	if (at_read_parent(atp) == unused)
+		_exit(0);
+	/* Otherwise wait to be killed. */
+	at_read_parent(atp);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	struct at_pool *atp;
+	struct athread *at[2];
+	void **keep[2], *p;
+	unsigned int i, j;
+	unsigned long before;
+
+	plan_tests(10);
+
+	atp = at_pool(1*1024*1024);
+	assert(atp);
+	before = largest(atp);
+	ok1(before > 0);
+
+	p = at_alloc(atp, 100);
+	ok1((char *)p >= (char *)atp->p->pool
+	    && (char *)p < (char *)atp->p->pool + atp->p->poolsize);
+	at_free(atp, p);
+
+	for (i = 0; i < 2; i++)
+		at[i] = at_run(atp, test, NULL);
+	for (i = 0; i < 2; i++)
+		keep[i] = at_read(at[i]);
+	ok1(keep[0] && keep[1]);
+
+	/* Free what they allocated. */
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < NUM_ALLOCS / 2; j++)
+			at_free(atp, keep[i][j]);
+		at_free(atp, keep[i]);
+	}
+
+	/* They flushed their caches as they exited. */
+	for (i = 0; i < 2; i++) {
+		ok1(at_read(at[i]) == NULL);
+		talloc_free(at[i]);
+	}
+	ok1(largest(atp) == before);
+	ok1(alloc_check(atp->p->pool, atp->p->poolsize));
+
+	/* If they exit() or are killed, we empty their caches. */
+	for (i = 0; i < 2; i++)
+		at[i] = at_run(atp, hoard, atp);
+	for (i = 0; i < 2; i++)
+		ok1(at_read(at[i]) == atp);
+	at_tell(at[0], atp);
+	for (i = 0; i < 2; i++)
+		talloc_free(at[i]);
+	ok1(largest(atp) == before);
+
+	return exit_status();
+}
@@ -0,0 +1,86 @@
+#include <ccan/antithread/antithread.c>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <ccan/tap/tap.h>
+
+#define NUM_OBJS 1000
+
+/* Grab the lock, tell the parent, and die holding it. */
+static void *test(struct at_pool *atp, int *val)
+{
+	at_lock(val);
+	*val = 1;
+	at_tell_parent(atp, val);
+	exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+	struct at_pool *atp;
+	struct athread *at;
+	int *val, *other, *objs[NUM_OBJS];
+	unsigned int i;
+	pid_t pid;
+
+	plan_tests(8);
+
+	atp = at_pool(1*1024*1024);
+	assert(atp);
+	val = talloc_zero(at_pool_ctx(atp), int);
+	at = at_run(atp, test, val);
+	assert(at);
+
+	ok1(at_read(at) == val);
+	ok1(*val == 1);
+
+	/* It's dead, so we get the lock. */
+	at_lock(val);
+	(*val)++;
+	at_unlock(val);
+	ok1(*val == 2);
+
+	/* Locks nest, and talloc inside at_lock_all uses the same lock. */
+	at_lock(val);
+	at_lock(val);
+	at_unlock(val);
+	at_unlock(val);
+	at_lock_all(atp);
+	at_lock_all(atp);
+	other = talloc(val, int);
+	ok1(other);
+	at_unlock_all(atp);
+	at_unlock_all(atp);
+	talloc_free(other);
+	ok1(atp->p->locks[0].owner == 0);
+
+	/* Every object has its own lock, so holding many never re-enters. */
+	for (i = 0; i < NUM_OBJS; i++) {
+		objs[i] = talloc(val, int);
+		at_lock(objs[i]);
+	}
+	for (i = 0; i < NUM_OBJS; i++)
+		if (obj_lock(objs[i])->depth != 1)
+			break;
+	ok1(i == NUM_OBJS);
+	for (i = 0; i < NUM_OBJS; i++)
+		at_unlock(objs[i]);
+
+	/* A plain fork() child is its own lock owner, too. */
+	switch (pid = fork()) {
+	case -1:
+		err(1, "fork");
+	case 0:
+		at_lock(val);
+		*val = 3;
+		_exit(0);
+	}
+	waitpid(pid, NULL, 0);
+	ok1(*val == 3);
+	at_lock(val);
+	ok1(obj_lock(val)->depth == 1);
+	at_unlock(val);
+
+	talloc_free(at);
+	return exit_status();
+}
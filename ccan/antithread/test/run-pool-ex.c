@@ -0,0 +1,80 @@
+#include <ccan/antithread/antithread.c>
+#include <assert.h>
+#include <ccan/tap/tap.h>
+
+/* Fill what we're given, and say where we ran. */
+static void *test(struct at_pool *atp, char *buf)
+{
+	cpu_set_t *cpus = talloc(at_pool_ctx(atp), cpu_set_t);
+
+	memset(buf, 'x', 1000);
+	if (sched_getaffinity(0, sizeof(*cpus), cpus) != 0)
+		return NULL;
+	return cpus;
+}
+
+static bool pool_works(struct at_pool *atp)
+{
+	struct athread *at;
+	char *buf;
+	cpu_set_t *cpus;
+	bool ret;
+
+	buf = talloc_zero_array(at_pool_ctx(atp), char, 1000);
+	at = at_run(atp, test, buf);
+	if (!at)
+		return false;
+	cpus = at_read(at);
+	ret = cpus && buf[0] == 'x' && buf[999] == 'x';
+	talloc_free(cpus);
+	talloc_free(at);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	struct at_pool *atp;
+	struct athread *at;
+	cpu_set_t *cpus, node0;
+
+	plan_tests(12);
+
+	/* Both at once makes no sense. */
+	ok1(!at_pool_ex(1024*1024, AT_POOL_INTERLEAVE|AT_POOL_BIND, 0)
+	    && errno == EINVAL);
+	ok1(!at_pool_ex(1024*1024, AT_POOL_BIND, MAX_NODES) && errno == EINVAL);
+
+	/* Every Linux box has a node 0, even if NUMA is compiled out. */
+	assert(node_cpus(0, &node0));
+	atp = at_pool_ex(1024*1024, AT_POOL_INTERLEAVE, -1);
+	ok1(atp);
+	ok1(pool_works(atp));
+	talloc_free(atp);
+
+	atp = at_pool_ex(1024*1024, AT_POOL_BIND, 0);
+	ok1(atp);
+	ok1(pool_works(atp));
+
+	/* Pin children to node 0. */
+	ok1(!at_pool_set_node(atp, MAX_NODES));
+	ok1(at_pool_set_node(atp, 0));
+	at = at_run(atp, test, talloc_array(at_pool_ctx(atp), char, 1000));
+	cpus = at_read(at);
+	ok1(cpus && CPU_EQUAL(cpus, &node0));
+	talloc_free(at);
+	talloc_free(atp);
+
+	/* Hugepages need the admin to reserve some. */
+	atp = at_pool_ex(1024*1024, AT_POOL_HUGEPAGES, -1);
+	if (!atp) {
+		diag("No hugepages: %s", strerror(errno));
+		skip(3, "no hugepages available");
+	} else {
+		ok1(((unsigned long)atp->p->pool & (huge_page_size()-1)) == 0);
+		ok1(((atp->p->poolsize + LOCK_TABLE_SIZE)
+		     & (huge_page_size()-1)) == 0);
+		ok1(pool_works(atp));
+		talloc_free(atp);
+	}
+	return exit_status();
+}
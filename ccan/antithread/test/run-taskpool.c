@@ -0,0 +1,134 @@
+#include <ccan/antithread/antithread.c>
+#include <assert.h>
+#include <ccan/tap/tap.h>
+
+struct range {
+	unsigned long start, end;
+};
+
+static struct range *new_range(struct at_taskpool *tp,
+			       unsigned long start, unsigned long end)
+{
+	struct range *r;
+
+	r = talloc(at_pool_ctx(at_taskpool_pool(tp)), struct range);
+	r->start = start;
+	r->end = end;
+	return r;
+}
+
+/* Splits itself in two until small, so workers get to steal. */
+static void *sum(struct at_taskpool *tp, struct range *r)
+{
+	unsigned long i, total = 0;
+
+	if (r->end - r->start > 64) {
+		unsigned long mid = (r->start + r->end) / 2;
+		struct at_future *a, *b;
+
+		a = at_task(tp, sum, new_range(tp, r->start, mid));
+		b = at_task(tp, sum, new_range(tp, mid, r->end));
+		total = (unsigned long)at_future_get(tp, a)
+			+ (unsigned long)at_future_get(tp, b);
+	} else {
+		for (i = r->start; i < r->end; i++)
+			total += i;
+	}
+	talloc_free(r);
+	return (void *)total;
+}
+
+static void *whoami(struct at_taskpool *tp, void *unused)
+{
+	usleep(2000);
+	return (void *)(long)getpid();
+}
+
+static void *count(struct at_taskpool *tp, unsigned int *counter)
+{
+	usleep(1000);
+	__sync_fetch_and_add(counter, 1);
+	return NULL;
+}
+
+static void *nap(struct at_taskpool *tp, void *unused)
+{
+	usleep(200000);
+	return (void *)(long)getpid();
+}
+
+/* Wait for a task someone steals: how much CPU did waiting take? */
+static void *await_stolen(struct at_taskpool *tp, void *unused)
+{
+	struct at_future *f = at_task(tp, nap, NULL);
+	struct timespec start, end;
+
+	usleep(50000);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start);
+	if ((long)at_future_get(tp, f) == getpid())
+		return (void *)-1L;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end);
+	return (void *)((end.tv_sec - start.tv_sec) * 1000000L
+			+ (end.tv_nsec - start.tv_nsec) / 1000);
+}
+
+#define NUM_WHO 100
+
+int main(int argc, char *argv[])
+{
+	struct at_pool *atp;
+	struct at_taskpool *tp;
+	struct at_future *f[NUM_WHO];
+	long pid[NUM_WHO];
+	unsigned int i, j, distinct, *counter;
+	bool all_workers = true;
+	long usec;
+
+	plan_tests(8);
+
+	atp = at_pool(1*1024*1024);
+	assert(atp);
+	tp = at_taskpool(atp, 4);
+	ok1(tp);
+	ok1(at_taskpool_pool(tp) == atp);
+
+	f[0] = at_task(tp, sum, new_range(tp, 0, 10000));
+	ok1((unsigned long)at_future_get(tp, f[0]) == 10000UL * 9999 / 2);
+
+	/* Blocking tasks from the parent get spread around. */
+	for (i = 0; i < NUM_WHO; i++)
+		f[i] = at_task(tp, whoami, NULL);
+	for (i = 0; i < NUM_WHO; i++)
+		pid[i] = (long)at_future_get(tp, f[i]);
+	for (i = distinct = 0; i < NUM_WHO; i++) {
+		if (pid[i] == getpid())
+			all_workers = false;
+		for (j = 0; j < i; j++)
+			if (pid[j] == pid[i])
+				break;
+		distinct += (j == i);
+	}
+	ok1(all_workers);
+	ok1(distinct > 1 && distinct <= 4);
+
+	/* A worker waiting on a stolen task sleeps, rather than spinning. */
+	f[0] = at_task(tp, await_stolen, NULL);
+	usec = (long)at_future_get(tp, f[0]);
+	diag("Waiting on stolen task took %li usec of CPU", usec);
+	ok1(usec >= 0 && usec < 50000);
+
+	/* Freeing it finishes what's queued. */
+	counter = talloc_zero(at_pool_ctx(atp), unsigned int);
+	for (i = 0; i < 10; i++)
+		at_task(tp, count, counter);
+	talloc_free(tp);
+	ok1(*counter == 10);
+
+	/* One per CPU. */
+	tp = at_taskpool(atp, 0);
+	ok1(tp && tp->num == sysconf(_SC_NPROCESSORS_ONLN));
+	talloc_free(tp);
+
+	talloc_free(atp);
+	return exit_status();
+}
@@ -0,0 +1,136 @@
+#include <ccan/antithread/antithread.c>
+#include <assert.h>
+#include <sys/select.h>
+#include <ccan/tap/tap.h>
+
+/* More than fits in the ring, so both sides have to wait for room. */
+#define NUM_MSGS (AT_RING_SIZE * 4)
+
+static void *test(struct at_pool *atp, void *unused)
+{
+	void *msgs[32];
+	unsigned long i, n, sum = 0;
+
+	for (i = 1; i <= NUM_MSGS; i++)
+		at_tell_parent(atp, (void *)i);
+
+	for (i = 0; i < NUM_MSGS; i += n) {
+		unsigned int j;
+
+		n = at_read_parent_batch(atp, msgs, 32);
+		if (!n)
+			return NULL;
+		for (j = 0; j < n; j++)
+			sum += (unsigned long)msgs[j];
+	}
+	at_tell_parent(atp, (void *)sum);
+
+	/* Now one to poll for. */
+	at_read_parent(atp);
+	at_tell_parent(atp, test);
+	at_read_parent(atp);
+
+	/* Then a stream, for the parent to poll for as it goes. */
+	for (i = 1; i <= NUM_MSGS; i++) {
+		at_tell_parent(atp, (void *)i);
+		if (i % 7 == 0)
+			sched_yield();
+	}
+	at_read_parent(atp);
+	return atp;
+}
+
+static bool readable(int fd)
+{
+	fd_set fds;
+	struct timeval tv = { 0, 0 };
+
+	FD_ZERO(&fds);
+	FD_SET(fd, &fds);
+	return select(fd + 1, &fds, NULL, NULL, &tv) == 1;
+}
+
+static bool wait_readable(int fd)
+{
+	fd_set fds;
+	struct timeval tv = { 10, 0 };
+
+	FD_ZERO(&fds);
+	FD_SET(fd, &fds);
+	return select(fd + 1, &fds, NULL, NULL, &tv) == 1;
+}
+
+int main(int argc, char *argv[])
+{
+	struct at_pool *atp;
+	struct athread *at;
+	void *msgs[NUM_MSGS];
+	unsigned long i, n, max_batch = 0, empty_wakes = 0;
+	bool in_order = true;
+
+	plan_tests(14);
+
+	atp = at_pool(1*1024*1024);
+	assert(atp);
+	at = at_run(atp, test, NULL);
+	assert(at);
+
+	/* Let it fill the ring. */
+	usleep(100000);
+	for (i = 0; i < NUM_MSGS; i += n) {
+		unsigned long j;
+
+		n = at_read_batch(at, msgs + i, NUM_MSGS - i);
+		if (!n)
+			break;
+		for (j = i; j < i + n; j++)
+			if (msgs[j] != (void *)(j + 1))
+				in_order = false;
+		if (n > max_batch)
+			max_batch = n;
+	}
+	ok1(i == NUM_MSGS);
+	ok1(in_order);
+	ok1(max_batch > 1);
+
+	for (i = 1; i <= NUM_MSGS; i++)
+		at_tell(at, (void *)i);
+	ok1(at_read(at) == (void *)(NUM_MSGS * (NUM_MSGS + 1) / 2));
+
+	/* Nothing there, so not readable. */
+	ok1(!readable(at_fd(at)));
+	at_tell(at, at);
+	ok1(wait_readable(at_fd(at)));
+	ok1(at_read(at) == test);
+	ok1(!readable(at_fd(at)));
+
+	/* Readable must mean there's a message: then reading never blocks. */
+	at_tell(at, at);
+	in_order = true;
+	for (i = 0; i < NUM_MSGS; i += n) {
+		unsigned long j;
+
+		if (!wait_readable(at_fd(at)))
+			break;
+		if (ring_empty(&at->chan->to_parent))
+			empty_wakes++;
+		n = at_read_batch(at, msgs + i, NUM_MSGS - i);
+		if (!n)
+			break;
+		for (j = i; j < i + n; j++)
+			if (msgs[j] != (void *)(j + 1))
+				in_order = false;
+	}
+	ok1(i == NUM_MSGS);
+	ok1(in_order);
+	ok1(empty_wakes == 0);
+	ok1(!readable(at_fd(at)));
+
+	/* It returns, then exits: readable for both. */
+	at_tell(at, at);
+	ok1(at_read(at) == atp);
+	ok1(wait_readable(at_fd(at)) && at_read(at) == NULL);
+
+	talloc_free(at);
+	return exit_status();
+}
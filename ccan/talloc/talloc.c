@@ -476,7 +476,6 @@ static void *__talloc_steal(const void *new_ctx, const void *ptr)
 static inline int _talloc_free(const void *ptr)
 {
 	struct talloc_chunk *tc;
-	void *oldparent = NULL;
 
 	if (unlikely(ptr == NULL)) {
 		return -1;
@@ -519,9 +518,6 @@ static inline int _talloc_free(const void *ptr)
 		tc->destructor = NULL;
 	}
 
-	if (unlikely(tc->flags & TALLOC_FLAG_EXT_ALLOC))
-		oldparent = talloc_parent_nolock(ptr);
-
 	if (tc->parent) {
 		_TLIST_REMOVE(tc->parent->child, tc);
 		if (tc->parent->child) {
@@ -573,7 +569,7 @@ static inline int _talloc_free(const void *ptr)
 	tc->flags |= TALLOC_FLAG_FREE;
 
 	if (unlikely(tc->flags & TALLOC_FLAG_EXT_ALLOC))
-		tc_external_realloc(oldparent, tc, 0);
+		tc_external_realloc(ptr, tc, 0);
 	else
 		tc_free(tc);
 
@@ -918,10 +914,8 @@ void *_talloc_realloc(const void *context, void *ptr, size_t size, const char *n
 
 	lock(ptr);
 	if (unlikely(tc->flags & TALLOC_FLAG_EXT_ALLOC)) {
-		/* need to get parent before setting free flag. */
-		void *parent = talloc_parent_nolock(ptr);
 		tc->flags |= TALLOC_FLAG_FREE;
-		new_ptr = tc_external_realloc(parent, tc, size + TC_HDR_SIZE);
+		new_ptr = tc_external_realloc(ptr, tc, size + TC_HDR_SIZE);
 	} else {
 		/* by resetting magic we catch users of the old memory */
 		tc->flags |= TALLOC_FLAG_FREE;
@@ -1000,7 +1000,9 @@ void talloc_set_allocator(void *(*malloc)(size_t size),
  * function; you should use that to figure out which lock to get if you have
  * multiple external pools.
  *
- * The parent pointers in realloc is the talloc pointer of the parent, if any.
+ * The first argument to @realloc is the talloc pointer of the parent (if
+ * any) when allocating, but the pointer itself when resizing or freeing:
+ * finding the parent can mean walking all its siblings.
  */
 void *talloc_add_external(const void *ctx,
 			  void *(*realloc)(const void *parent,
@@ -49,20 +49,21 @@ int main(void)
 	p2 = talloc(p, char);
 	ok1(ext_alloc_count == 3);
 
-	expected_parent = head;
+	/* Resizing and freeing hand it the pointer itself. */
+	expected_parent = p;
 	p = talloc_realloc(NULL, p, char, 1000);
 	ok1(ext_realloc_count == 1);
 	assert(p);
 
-	expected_parent = p;
+	expected_parent = p2;
 	talloc_free(p2);
 	ok1(ext_free_count == 1);
 
-	expected_parent = head;
+	expected_parent = p;
 	talloc_free(p);
 	ok1(ext_free_count == 2);
 
-	expected_parent = NULL;
+	expected_parent = head;
 	talloc_free(head);
 	ok1(ext_free_count == 3);
 
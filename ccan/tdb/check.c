@@ -40,7 +40,12 @@ static bool tdb_check_header(struct tdb_context *tdb, tdb_off_t *recovery)
 	if (hdr.version != TDB_VERSION)
 		goto corrupt;
 
-	if (hdr.rwlocks != 0 && hdr.rwlocks != TDB_HASH_RWLOCK_MAGIC)
+	if (hdr.rwlocks != 0 && hdr.rwlocks != TDB_HASH_RWLOCK_MAGIC
+	    && hdr.rwlocks != TDB_FEATURE_FLAG_MAGIC)
+		goto corrupt;
+	if (hdr.feature_flags & ~TDB_FEATURE_ALL)
+		goto corrupt;
+	if (hdr.rwlocks != TDB_FEATURE_FLAG_MAGIC && hdr.feature_flags)
 		goto corrupt;
 
 	tdb_header_hash(tdb, &h1, &h2);
@@ -54,6 +59,12 @@ static bool tdb_check_header(struct tdb_context *tdb, tdb_off_t *recovery)
 	if (hdr.hash_size != tdb->header.hash_size)
 		goto corrupt;
 
+	if (hdr.hash_locks != tdb->header.hash_locks)
+		goto corrupt;
+
+	if (hdr.feature_flags != tdb->header.feature_flags)
+		goto corrupt;
+
 	if (hdr.recovery_start != 0 &&
 	    hdr.recovery_start < TDB_DATA_START(tdb->header.hash_size))
 		goto corrupt;
@@ -262,6 +273,23 @@ static bool tdb_check_used_record(struct tdb_context *tdb,
 		goto fail_put_key;
 	}
 
+	/* A filter which would hide this record is corrupt. */
+	if ((tdb->header.feature_flags & TDB_FEATURE_CHAIN_FILTER)
+	    && rec->magic != TDB_DEAD_MAGIC) {
+		uint32_t filter;
+
+		if (tdb_ofs_read(tdb, TDB_FILTER_TOP(rec->full_hash),
+				 &filter) == -1)
+			goto fail_put_key;
+		if ((filter & TDB_FILTER_BITS(rec->full_hash))
+		    != TDB_FILTER_BITS(rec->full_hash)) {
+			TDB_LOG((tdb, TDB_DEBUG_ERROR,
+				 "Record offset %d missing from chain filter\n",
+				 off));
+			goto fail_put_key;
+		}
+	}
+
 	/* Mark this offset as a known value for this hash bucket. */
 	record_offset(hashes[BUCKET(rec->full_hash)+1], off);
 	/* And similarly if the next pointer is valid. */
@@ -382,6 +410,16 @@ int tdb_check(struct tdb_context *tdb,
 			record_offset(hashes[h], off);
 	}
 
+	/* Size-class free lists share the free list's bitmap. */
+	if (tdb->flags & TDB_FREELIST_CLASSES) {
+		for (h = 0; h < TDB_FREE_CLASSES; h++) {
+			if (tdb_ofs_read(tdb, FREE_CLASS_TOP(h), &off) == -1)
+				goto free;
+			if (off)
+				record_offset(hashes[0], off);
+		}
+	}
+
 	/* For each record, read it in and check it's ok. */
 	for (off = TDB_DATA_START(tdb->header.hash_size);
 	     off < tdb->map_size;
@@ -61,14 +61,15 @@ static tdb_off_t tdb_dump_record(struct tdb_context *tdb, int hash,
 static int tdb_dump_chain(struct tdb_context *tdb, int i)
 {
 	tdb_off_t rec_ptr, top;
+	int list = (i == -1) ? -1 : (int)BUCKET_LOCK(i);
 
 	top = TDB_HASH_TOP(i);
 
-	if (tdb_lock(tdb, i, F_WRLCK) != 0)
+	if (tdb_lock(tdb, list, F_WRLCK) != 0)
 		return -1;
 
 	if (tdb_ofs_read(tdb, top, &rec_ptr) == -1)
-		return tdb_unlock(tdb, i, F_WRLCK);
+		return tdb_unlock(tdb, list, F_WRLCK);
 
 	if (rec_ptr)
 		printf("hash=%d\n", i);
@@ -77,7 +78,7 @@ static int tdb_dump_chain(struct tdb_context *tdb, int i)
 		rec_ptr = tdb_dump_record(tdb, i, rec_ptr);
 	}
 
-	return tdb_unlock(tdb, i, F_WRLCK);
+	return tdb_unlock(tdb, list, F_WRLCK);
 }
 
 void tdb_dump_all(struct tdb_context *tdb)
@@ -90,21 +91,19 @@ void tdb_dump_all(struct tdb_context *tdb)
 	tdb_dump_chain(tdb, -1);
 }
 
-int tdb_printfreelist(struct tdb_context *tdb)
+static int print_freelist(struct tdb_context *tdb, int list, tdb_off_t top,
+			  long *total_free)
 {
 	int ret;
-	long total_free = 0;
-	tdb_off_t offset, rec_ptr;
+	tdb_off_t rec_ptr;
 	struct tdb_record rec;
 
-	if ((ret = tdb_lock(tdb, -1, F_WRLCK)) != 0)
+	if ((ret = tdb_lock(tdb, list, F_WRLCK)) != 0)
 		return ret;
 
-	offset = FREELIST_TOP;
-
 	/* read in the freelist top */
-	if (tdb_ofs_read(tdb, offset, &rec_ptr) == -1) {
-		tdb_unlock(tdb, -1, F_WRLCK);
+	if (tdb_ofs_read(tdb, top, &rec_ptr) == -1) {
+		tdb_unlock(tdb, list, F_WRLCK);
 		return 0;
 	}
 
@@ -112,26 +111,47 @@ int tdb_printfreelist(struct tdb_context *tdb)
 	while (rec_ptr) {
 		if (tdb->methods->tdb_read(tdb, rec_ptr, (char *)&rec, 
 					   sizeof(rec), DOCONV()) == -1) {
-			tdb_unlock(tdb, -1, F_WRLCK);
+			tdb_unlock(tdb, list, F_WRLCK);
 			return -1;
 		}
 
 		if (rec.magic != TDB_FREE_MAGIC) {
 			printf("bad magic 0x%08x in free list\n", rec.magic);
-			tdb_unlock(tdb, -1, F_WRLCK);
+			tdb_unlock(tdb, list, F_WRLCK);
 			return -1;
 		}
 
 		printf("entry offset=[0x%08x], rec.rec_len = [0x%08x (%d)] (end = 0x%08x)\n", 
 		       rec_ptr, rec.rec_len, rec.rec_len, rec_ptr + rec.rec_len);
-		total_free += rec.rec_len;
+		*total_free += rec.rec_len;
 
 		/* move to the next record */
 		rec_ptr = rec.next;
 	}
-	printf("total rec_len = [0x%08x (%d)]\n", (int)total_free, 
-               (int)total_free);
 
-	return tdb_unlock(tdb, -1, F_WRLCK);
+	return tdb_unlock(tdb, list, F_WRLCK);
 }
 
+int tdb_printfreelist(struct tdb_context *tdb)
+{
+	int ret;
+	long total_free = 0;
+	unsigned int c;
+
+	if (!(tdb->flags & TDB_FREELIST_CLASSES)) {
+		ret = print_freelist(tdb, -1, FREELIST_TOP, &total_free);
+	} else {
+		for (c = 0, ret = 0; c < TDB_FREE_CLASSES && ret == 0; c++) {
+			printf("size class %u (%u bytes and up):\n",
+			       c, c ? 32U << c : 0);
+			ret = print_freelist(tdb, FREE_CLASS_LIST(c),
+					     FREE_CLASS_TOP(c), &total_free);
+		}
+	}
+	if (ret != 0)
+		return ret;
+
+	printf("total rec_len = [0x%08x (%d)]\n", (int)total_free, 
+               (int)total_free);
+	return 0;
+}
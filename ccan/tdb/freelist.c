@@ -62,7 +62,6 @@ int tdb_rec_free_read(struct tdb_context *tdb, tdb_off_t off, struct tdb_record
 }
 
 
-#if USE_RIGHT_MERGES
 /* Remove an element from the freelist.  Must have alloc lock. */
 static int remove_from_freelist(struct tdb_context *tdb, tdb_off_t off, tdb_off_t next)
 {
@@ -82,7 +81,6 @@ static int remove_from_freelist(struct tdb_context *tdb, tdb_off_t off, tdb_off_
 	TDB_LOG((tdb, TDB_DEBUG_FATAL,"remove_from_freelist: not on list at off=%d\n", off));
 	return -1;
 }
-#endif
 
 
 /* update a record tailer (must hold allocation lock) */
@@ -97,10 +95,171 @@ static int update_tailer(struct tdb_context *tdb, tdb_off_t offset,
 			 &totalsize);
 }
 
+/* Free records in size class c are at least 32 << c bytes long, and
+   shorter than 64 << c except in the last class.  A record on a class
+   list remembers which in its (otherwise unused) full_hash; one on no
+   list at all, because it's moving, has TDB_FREE_CLASSES there. */
+static unsigned int size_class(tdb_len_t len)
+{
+	unsigned int c;
+
+	for (c = 0; c < TDB_FREE_CLASSES - 1 && len >= (64U << c); c++);
+	return c;
+}
+
+/* Prepend a free record to class c's list: must hold that class lock. */
+static int class_insert(struct tdb_context *tdb, unsigned int c,
+			tdb_off_t offset, struct tdb_record *rec)
+{
+	tdb_off_t top = FREE_CLASS_TOP(c);
+
+	rec->magic = TDB_FREE_MAGIC;
+	rec->full_hash = c;
+	if (tdb_ofs_read(tdb, top, &rec->next) == -1 ||
+	    tdb_rec_write(tdb, offset, rec) == -1 ||
+	    tdb_ofs_write(tdb, top, &offset) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free record write failed at offset=%d\n", offset));
+		return -1;
+	}
+	return 0;
+}
+
+/* A free record is leaving class c (whose lock we hold) for another:
+   unlink it.  If we don't know what points to it, we walk the list. */
+static int class_unlink(struct tdb_context *tdb, unsigned int c,
+			tdb_off_t offset, struct tdb_record *rec,
+			tdb_off_t last_ptr)
+{
+	struct tdb_record r;
+	tdb_off_t i;
+
+	if (last_ptr == 0) {
+		last_ptr = FREE_CLASS_TOP(c);
+		if (tdb_ofs_read(tdb, last_ptr, &i) == -1)
+			return -1;
+		while (i != offset) {
+			if (i == 0) {
+				tdb->ecode = TDB_ERR_CORRUPT;
+				TDB_LOG((tdb, TDB_DEBUG_FATAL, "class_unlink: %u not in class %u\n", offset, c));
+				return -1;
+			}
+			if (tdb_rec_free_read(tdb, i, &r) == -1)
+				return -1;
+			last_ptr = i;
+			i = r.next;
+		}
+	}
+	return tdb_ofs_write(tdb, last_ptr, &rec->next);
+}
+
+/* A shortened free record may belong in a lower class: move it there.
+   We hold its current class lock, and classes are only ever locked in
+   descending order. */
+static int tdb_reclass(struct tdb_context *tdb, tdb_off_t rec_ptr,
+		       struct tdb_record *rec, tdb_off_t last_ptr)
+{
+	unsigned int c = size_class(rec->rec_len);
+	int ret;
+
+	if (tdb_lock(tdb, FREE_CLASS_LIST(c), F_WRLCK) == -1)
+		return -1;
+
+	ret = class_unlink(tdb, rec->full_hash, rec_ptr, rec, last_ptr);
+	if (ret == 0)
+		ret = class_insert(tdb, c, rec_ptr, rec);
+	tdb_unlock(tdb, FREE_CLASS_LIST(c), F_WRLCK);
+	return ret;
+}
+
+/* Add an element into its size-class list, merging it into the record on
+   its left if that's free.  We hold one class lock at a time. */
+static int tdb_free_class(struct tdb_context *tdb, tdb_off_t offset,
+			  struct tdb_record *rec)
+{
+	tdb_off_t left = offset - sizeof(tdb_off_t), leftsize;
+	struct tdb_record l;
+	unsigned int c;
+
+	/* set an initial tailer, so if we fail we don't leave a bogus record */
+	if (update_tailer(tdb, offset, rec) != 0) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free: update_tailer failed!\n"));
+		return -1;
+	}
+
+	/* Look left: we find out which class to lock without the lock, so
+	 * check again once we have it. */
+	if (left > TDB_DATA_START(tdb->header.hash_size)
+	    && tdb_ofs_read(tdb, left, &leftsize) == 0
+	    && leftsize != 0 && leftsize != TDB_PAD_U32
+	    && leftsize <= offset
+	    && offset - leftsize >= TDB_DATA_START(tdb->header.hash_size)) {
+		left = offset - leftsize;
+		if (tdb->methods->tdb_read(tdb, left, &l, sizeof(l), DOCONV()) == 0
+		    && l.magic == TDB_FREE_MAGIC
+		    && l.full_hash < TDB_FREE_CLASSES) {
+			c = l.full_hash;
+			if (tdb_lock(tdb, FREE_CLASS_LIST(c), F_WRLCK) != 0)
+				return -1;
+
+			/* It may have been allocated or split meanwhile. */
+			if (tdb->methods->tdb_read(tdb, left, &l, sizeof(l),
+						   DOCONV()) == -1)
+				goto fail;
+			if (l.magic == TDB_FREE_MAGIC && l.full_hash == c
+			    && left + sizeof(l) + l.rec_len == offset) {
+				l.rec_len += sizeof(*rec) + rec->rec_len;
+				if (size_class(l.rec_len) == c) {
+					if (tdb_rec_write(tdb, left, &l) == -1) {
+						TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free: update_left failed at %u\n", left));
+						goto fail;
+					}
+					if (update_tailer(tdb, left, &l) == -1) {
+						TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free: update_tailer failed at %u\n", offset));
+						goto fail;
+					}
+					tdb_unlock(tdb, FREE_CLASS_LIST(c), F_WRLCK);
+					return 0;
+				}
+
+				/* It's outgrown its class.  Nobody can merge
+				 * into it while it's on no list. */
+				l.full_hash = TDB_FREE_CLASSES;
+				if (class_unlink(tdb, c, left, &l, 0) == -1
+				    || tdb_rec_write(tdb, left, &l) == -1
+				    || update_tailer(tdb, left, &l) == -1)
+					goto fail;
+				tdb_unlock(tdb, FREE_CLASS_LIST(c), F_WRLCK);
+				offset = left;
+				rec = &l;
+			} else {
+				tdb_unlock(tdb, FREE_CLASS_LIST(c), F_WRLCK);
+			}
+		}
+	}
+
+	/* Now, prepend to its class list.  Our callers still want
+	 * rec->full_hash for unlocking the hash chain, so use a copy. */
+	l = *rec;
+	c = size_class(l.rec_len);
+	if (tdb_lock(tdb, FREE_CLASS_LIST(c), F_WRLCK) != 0)
+		return -1;
+	if (class_insert(tdb, c, offset, &l) == -1)
+		goto fail;
+	tdb_unlock(tdb, FREE_CLASS_LIST(c), F_WRLCK);
+	return 0;
+
+ fail:
+	tdb_unlock(tdb, FREE_CLASS_LIST(c), F_WRLCK);
+	return -1;
+}
+
 /* Add an element into the freelist. Merge adjacent records if
    necessary. */
 int tdb_free(struct tdb_context *tdb, tdb_off_t offset, struct tdb_record *rec)
 {
+	if (tdb->flags & TDB_FREELIST_CLASSES)
+		return tdb_free_class(tdb, offset, rec);
+
 	/* Allocation and tailer lock */
 	if (tdb_lock(tdb, -1, F_WRLCK) != 0)
 		return -1;
@@ -210,6 +369,75 @@ update:
 
 
 
+/* If the record to the right of this (not yet free) one is free, take it
+   off its list and extend rec over it.  Returns 1 if it did, 0 if not.
+   Finding it on its list is O(n), so only tdb_vacuum() does this. */
+static int absorb_right(struct tdb_context *tdb, tdb_off_t offset,
+			struct tdb_record *rec)
+{
+	tdb_off_t right = offset + sizeof(*rec) + rec->rec_len;
+	struct tdb_record r;
+	unsigned int c;
+	int ret;
+
+	if (right + sizeof(r) > tdb->map_size)
+		return 0;
+	if (tdb->methods->tdb_read(tdb, right, &r, sizeof(r), DOCONV()) == -1)
+		return -1;
+	if (r.magic != TDB_FREE_MAGIC)
+		return 0;
+
+	if (!(tdb->flags & TDB_FREELIST_CLASSES)) {
+		/* We hold the allocation lock. */
+		if (remove_from_freelist(tdb, right, r.next) == -1)
+			return -1;
+		rec->rec_len += sizeof(r) + r.rec_len;
+		return 1;
+	}
+
+	/* One on no list is moving: leave it be. */
+	c = r.full_hash;
+	if (c >= TDB_FREE_CLASSES)
+		return 0;
+	if (tdb_lock(tdb, FREE_CLASS_LIST(c), F_WRLCK) != 0)
+		return -1;
+	/* It may have been allocated or split meanwhile. */
+	ret = -1;
+	if (tdb->methods->tdb_read(tdb, right, &r, sizeof(r), DOCONV()) == -1)
+		goto out;
+	if (r.magic != TDB_FREE_MAGIC || r.full_hash != c) {
+		ret = 0;
+		goto out;
+	}
+	if (class_unlink(tdb, c, right, &r, 0) == -1)
+		goto out;
+	/* Its stale header mustn't look mergeable from its right. */
+	r.full_hash = TDB_FREE_CLASSES;
+	if (tdb_rec_write(tdb, right, &r) == -1)
+		goto out;
+	rec->rec_len += sizeof(r) + r.rec_len;
+	ret = 1;
+ out:
+	tdb_unlock(tdb, FREE_CLASS_LIST(c), F_WRLCK);
+	return ret;
+}
+
+/* tdb_free(), but merging with free records on the right as well as the
+   left.  Caller holds the allocation lock. */
+int tdb_free_merge(struct tdb_context *tdb, tdb_off_t offset,
+		   struct tdb_record *rec)
+{
+	int ret;
+
+	while ((ret = absorb_right(tdb, offset, rec)) == 1)
+		;
+	if (ret == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free_merge: right merge failed at %u\n", offset));
+		return -1;
+	}
+	return tdb_free(tdb, offset, rec);
+}
+
 /* 
    the core of tdb_allocate - called when we have decided which
    free list entry to use
@@ -242,7 +470,12 @@ static tdb_off_t tdb_allocate_ofs(struct tdb_context *tdb,
 
 	/* we're going to just shorten the existing record */
 	rec->rec_len -= (length + sizeof(*rec));
-	if (tdb_rec_write(tdb, rec_ptr, rec) == -1) {
+	if ((tdb->flags & TDB_FREELIST_CLASSES)
+	    && size_class(rec->rec_len) != rec->full_hash) {
+		if (tdb_reclass(tdb, rec_ptr, rec, last_ptr) == -1) {
+			return 0;
+		}
+	} else if (tdb_rec_write(tdb, rec_ptr, rec) == -1) {
 		return 0;
 	}
 	if (update_tailer(tdb, rec_ptr, rec) == -1) {
@@ -267,37 +500,25 @@ static tdb_off_t tdb_allocate_ofs(struct tdb_context *tdb,
 	return rec_ptr;
 }
 
-/* allocate some space from the free list. The offset returned points
-   to a unconnected tdb_record within the database with room for at
-   least length bytes of total data
-
-   0 is returned if the space could not be allocated
- */
-tdb_off_t tdb_allocate(struct tdb_context *tdb, tdb_len_t length, struct tdb_record *rec)
+/* find the best fitting record on the list at top.  With first_fit, any
+   record big enough will do: the size-class lists above the one a request
+   falls in only hold records bigger than it. */
+static int tdb_find_fit(struct tdb_context *tdb, tdb_off_t top,
+			tdb_len_t length, bool first_fit, struct tdb_record *rec,
+			tdb_off_t *fit_ptr, tdb_off_t *fit_last_ptr)
 {
-	tdb_off_t rec_ptr, last_ptr, newrec_ptr;
+	tdb_off_t rec_ptr, last_ptr;
 	struct {
 		tdb_off_t rec_ptr, last_ptr;
 		tdb_len_t rec_len;
 	} bestfit;
 	float multiplier = 1.0;
 
-	if (tdb_lock(tdb, -1, F_WRLCK) == -1)
-		return 0;
-
-	/* over-allocate to reduce fragmentation */
-	length *= 1.25;
-
-	/* Extra bytes required for tailer */
-	length += sizeof(tdb_off_t);
-	length = TDB_ALIGN(length, TDB_ALIGNMENT);
-
- again:
-	last_ptr = FREELIST_TOP;
+	last_ptr = top;
 
 	/* read in the freelist top */
-	if (tdb_ofs_read(tdb, FREELIST_TOP, &rec_ptr) == -1)
-		goto fail;
+	if (tdb_ofs_read(tdb, top, &rec_ptr) == -1)
+		return -1;
 
 	bestfit.rec_ptr = 0;
 	bestfit.last_ptr = 0;
@@ -310,8 +531,9 @@ tdb_off_t tdb_allocate(struct tdb_context *tdb, tdb_len_t length, struct tdb_rec
 	 */
 	while (rec_ptr) {
 		if (tdb_rec_free_read(tdb, rec_ptr, rec) == -1) {
-			goto fail;
+			return -1;
 		}
+		tdb_stat_inc(tdb, alloc_walk);
 
 		if (rec->rec_len >= length) {
 			if (bestfit.rec_ptr == 0 ||
@@ -331,7 +553,7 @@ tdb_off_t tdb_allocate(struct tdb_context *tdb, tdb_len_t length, struct tdb_rec
 		   definition of 'too big' changes as we scan
 		   through */
 		if (bestfit.rec_len > 0 &&
-		    bestfit.rec_len < length * multiplier) {
+		    (first_fit || bestfit.rec_len < length * multiplier)) {
 			break;
 		}
 		
@@ -342,13 +564,98 @@ tdb_off_t tdb_allocate(struct tdb_context *tdb, tdb_len_t length, struct tdb_rec
 		multiplier *= 1.05;
 	}
 
-	if (bestfit.rec_ptr != 0) {
-		if (tdb_rec_free_read(tdb, bestfit.rec_ptr, rec) == -1) {
+	*fit_ptr = bestfit.rec_ptr;
+	*fit_last_ptr = bestfit.last_ptr;
+	return 0;
+}
+
+/* allocate from the size-class lists, starting with the class length falls
+   in and moving up.  Only one class is searched at a time, so allocations
+   of different sizes don't wait for each other. */
+static tdb_off_t tdb_allocate_class(struct tdb_context *tdb, tdb_len_t length,
+				    struct tdb_record *rec)
+{
+	tdb_off_t top, rec_ptr, last_ptr, newrec_ptr;
+	unsigned int c, start = size_class(length);
+
+ again:
+	for (c = start; c < TDB_FREE_CLASSES; c++) {
+		top = FREE_CLASS_TOP(c);
+
+		/* Skip empty lists without locking: at worst we miss a
+		   record freed just now. */
+		if (tdb_ofs_read(tdb, top, &rec_ptr) == -1)
+			return 0;
+		if (rec_ptr == 0)
+			continue;
+
+		if (tdb_lock(tdb, FREE_CLASS_LIST(c), F_WRLCK) == -1)
+			return 0;
+
+		if (tdb_find_fit(tdb, top, length,
+				 c != start && c != TDB_FREE_CLASSES - 1,
+				 rec, &rec_ptr, &last_ptr) == -1)
 			goto fail;
+
+		if (rec_ptr != 0) {
+			if (tdb_rec_free_read(tdb, rec_ptr, rec) == -1)
+				goto fail;
+			newrec_ptr = tdb_allocate_ofs(tdb, length, rec_ptr,
+						      rec, last_ptr);
+			tdb_unlock(tdb, FREE_CLASS_LIST(c), F_WRLCK);
+			return newrec_ptr;
 		}
+		tdb_unlock(tdb, FREE_CLASS_LIST(c), F_WRLCK);
+	}
+
+	/* we didn't find enough space. See if we can expand the
+	   database and if we can then try again */
+	if (tdb_expand(tdb, length + sizeof(*rec)) == 0)
+		goto again;
+	return 0;
 
-		newrec_ptr = tdb_allocate_ofs(tdb, length, bestfit.rec_ptr, 
-					      rec, bestfit.last_ptr);
+ fail:
+	tdb_unlock(tdb, FREE_CLASS_LIST(c), F_WRLCK);
+	return 0;
+}
+
+/* allocate some space from the free list. The offset returned points
+   to a unconnected tdb_record within the database with room for at
+   least length bytes of total data
+
+   0 is returned if the space could not be allocated
+ */
+tdb_off_t tdb_allocate(struct tdb_context *tdb, tdb_len_t length, struct tdb_record *rec)
+{
+	tdb_off_t rec_ptr, last_ptr, newrec_ptr;
+
+	tdb_stat_inc(tdb, allocs);
+
+	/* over-allocate to reduce fragmentation */
+	length *= 1.25;
+
+	/* Extra bytes required for tailer */
+	length += sizeof(tdb_off_t);
+	length = TDB_ALIGN(length, TDB_ALIGNMENT);
+
+	if (tdb->flags & TDB_FREELIST_CLASSES)
+		return tdb_allocate_class(tdb, length, rec);
+
+	if (tdb_lock(tdb, -1, F_WRLCK) == -1)
+		return 0;
+
+ again:
+	if (tdb_find_fit(tdb, FREELIST_TOP, length, false, rec,
+			 &rec_ptr, &last_ptr) == -1)
+		goto fail;
+
+	if (rec_ptr != 0) {
+		if (tdb_rec_free_read(tdb, rec_ptr, rec) == -1) {
+			goto fail;
+		}
+
+		newrec_ptr = tdb_allocate_ofs(tdb, length, rec_ptr,
+					      rec, last_ptr);
 		tdb_unlock(tdb, -1, F_WRLCK);
 		return newrec_ptr;
 	}
@@ -367,20 +674,37 @@ tdb_off_t tdb_allocate(struct tdb_context *tdb, tdb_len_t length, struct tdb_rec
 /* 
    return the size of the freelist - used to decide if we should repack 
 */
-int tdb_freelist_size(struct tdb_context *tdb)
+static int freelist_count(struct tdb_context *tdb, int list, tdb_off_t top)
 {
 	tdb_off_t ptr;
 	int count=0;
 
-	if (tdb_lock(tdb, -1, F_RDLCK) == -1) {
+	if (tdb_lock(tdb, list, F_RDLCK) == -1) {
 		return -1;
 	}
 
-	ptr = FREELIST_TOP;
+	ptr = top;
 	while (tdb_ofs_read(tdb, ptr, &ptr) == 0 && ptr != 0) {
 		count++;
 	}
 
-	tdb_unlock(tdb, -1, F_RDLCK);
+	tdb_unlock(tdb, list, F_RDLCK);
+	return count;
+}
+
+int tdb_freelist_size(struct tdb_context *tdb)
+{
+	unsigned int c;
+	int count = 0, n;
+
+	if (!(tdb->flags & TDB_FREELIST_CLASSES))
+		return freelist_count(tdb, -1, FREELIST_TOP);
+
+	for (c = 0; c < TDB_FREE_CLASSES; c++) {
+		n = freelist_count(tdb, FREE_CLASS_LIST(c), FREE_CLASS_TOP(c));
+		if (n == -1)
+			return -1;
+		count += n;
+	}
 	return count;
 }
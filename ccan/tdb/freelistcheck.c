@@ -43,36 +43,23 @@ static int seen_insert(struct tdb_context *mem_tdb, tdb_off_t rec_ptr)
 	return tdb_store(mem_tdb, key, data, TDB_INSERT);
 }
 
-int tdb_validate_freelist(struct tdb_context *tdb, int *pnum_entries)
+/* Walk one free list, making sure no record is on it (or any list
+   before it) twice. */
+static int validate_list(struct tdb_context *tdb, struct tdb_context *mem_tdb,
+			 tdb_off_t top, int *pnum_entries)
 {
-	struct tdb_context *mem_tdb = NULL;
 	struct tdb_record rec;
 	tdb_off_t rec_ptr;
-	int ret = -1;
-
-	*pnum_entries = 0;
 
-	mem_tdb = tdb_open("flval", tdb->header.hash_size,
-				TDB_INTERNAL, O_RDWR, 0600);
-	if (!mem_tdb) {
-		return -1;
-	}
-
-	if (tdb_lock(tdb, -1, F_WRLCK) == -1) {
-		tdb_close(mem_tdb);
-		return 0;
-	}
-
-	/* Store the FREELIST_TOP record. */
-	if (seen_insert(mem_tdb, FREELIST_TOP) == -1) {
+	/* Store the list top record. */
+	if (seen_insert(mem_tdb, top) == -1) {
 		tdb->ecode = TDB_ERR_CORRUPT;
-		ret = -1;
-		goto fail;
+		return -1;
 	}
 
 	/* read in the freelist top */
-	if (tdb_ofs_read(tdb, FREELIST_TOP, &rec_ptr) == -1) {
-		goto fail;
+	if (tdb_ofs_read(tdb, top, &rec_ptr) == -1) {
+		return -1;
 	}
 
 	while (rec_ptr) {
@@ -83,24 +70,57 @@ int tdb_validate_freelist(struct tdb_context *tdb, int *pnum_entries)
 
 		if (seen_insert(mem_tdb, rec_ptr)) {
 			tdb->ecode = TDB_ERR_CORRUPT;
-			ret = -1;
-			goto fail;
+			return -1;
 		}
 
 		if (tdb_rec_free_read(tdb, rec_ptr, &rec) == -1) {
-			goto fail;
+			return -1;
 		}
 
 		/* move to the next record */
 		rec_ptr = rec.next;
 		*pnum_entries += 1;
 	}
+	return 0;
+}
 
-	ret = 0;
+int tdb_validate_freelist(struct tdb_context *tdb, int *pnum_entries)
+{
+	struct tdb_context *mem_tdb = NULL;
+	unsigned int c;
+	int ret = -1;
+
+	*pnum_entries = 0;
+
+	mem_tdb = tdb_open("flval", tdb->header.hash_size,
+				TDB_INTERNAL, O_RDWR, 0600);
+	if (!mem_tdb) {
+		return -1;
+	}
 
-  fail:
+	if (!(tdb->flags & TDB_FREELIST_CLASSES)) {
+		if (tdb_lock(tdb, -1, F_WRLCK) == -1) {
+			tdb_close(mem_tdb);
+			return 0;
+		}
+		ret = validate_list(tdb, mem_tdb, FREELIST_TOP, pnum_entries);
+		tdb_unlock(tdb, -1, F_WRLCK);
+		tdb_close(mem_tdb);
+		return ret;
+	}
+
+	for (c = 0; c < TDB_FREE_CLASSES; c++) {
+		if (tdb_lock(tdb, FREE_CLASS_LIST(c), F_WRLCK) == -1) {
+			ret = -1;
+			break;
+		}
+		ret = validate_list(tdb, mem_tdb, FREE_CLASS_TOP(c),
+				    pnum_entries);
+		tdb_unlock(tdb, FREE_CLASS_LIST(c), F_WRLCK);
+		if (ret == -1)
+			break;
+	}
 
 	tdb_close(mem_tdb);
-	tdb_unlock(tdb, -1, F_WRLCK);
 	return ret;
 }
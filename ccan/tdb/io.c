@@ -49,6 +49,15 @@ static int tdb_oob(struct tdb_context *tdb, tdb_off_t len, int probe)
 		}
 		return -1;
 	}
+	/* A snapshot never grows, and may not even have the file open. */
+	if (tdb->flags & TDB_SNAPSHOT) {
+		if (!probe) {
+			tdb->ecode = TDB_ERR_IO;
+			TDB_LOG((tdb, TDB_DEBUG_FATAL,"tdb_oob len %d beyond snapshot size %d\n",
+				 (int)len, (int)tdb->map_size));
+		}
+		return -1;
+	}
 
 	if (fstat(tdb->fd, &st) == -1) {
 		tdb->ecode = TDB_ERR_IO;
@@ -213,6 +222,29 @@ int tdb_munmap(struct tdb_context *tdb)
 	return 0;
 }
 
+/* apply the tdb_set_mmap_policy() hints to the current map. These are
+   only hints, so failure (eg. no hugepages on this fs) is ignored */
+void tdb_mmap_advise(struct tdb_context *tdb)
+{
+#if HAVE_MMAP
+	if (!tdb->map_ptr || (tdb->flags & TDB_INTERNAL))
+		return;
+
+#ifdef MADV_RANDOM
+	if (tdb->mmap_policy & TDB_MMAP_RANDOM)
+		madvise(tdb->map_ptr, tdb->map_size, MADV_RANDOM);
+	else if (tdb->mmap_policy & TDB_MMAP_SEQUENTIAL)
+		madvise(tdb->map_ptr, tdb->map_size, MADV_SEQUENTIAL);
+	else
+		madvise(tdb->map_ptr, tdb->map_size, MADV_NORMAL);
+#endif
+#ifdef MADV_HUGEPAGE
+	if (tdb->mmap_policy & TDB_MMAP_HUGEPAGE)
+		madvise(tdb->map_ptr, tdb->map_size, MADV_HUGEPAGE);
+#endif
+#endif
+}
+
 void tdb_mmap(struct tdb_context *tdb)
 {
 	if (tdb->flags & TDB_INTERNAL)
@@ -220,9 +252,14 @@ void tdb_mmap(struct tdb_context *tdb)
 
 #if HAVE_MMAP
 	if (!(tdb->flags & TDB_NOMMAP)) {
+		int map_flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+		if (tdb->mmap_policy & TDB_MMAP_POPULATE)
+			map_flags |= MAP_POPULATE;
+#endif
 		tdb->map_ptr = mmap(NULL, tdb->map_size, 
 				    PROT_READ|(tdb->read_only? 0:PROT_WRITE), 
-				    MAP_SHARED, tdb->fd, 0);
+				    map_flags, tdb->fd, 0);
 
 		/*
 		 * NB. When mmap fails it returns MAP_FAILED *NOT* NULL !!!!
@@ -232,7 +269,8 @@ void tdb_mmap(struct tdb_context *tdb)
 			tdb->map_ptr = NULL;
 			TDB_LOG((tdb, TDB_DEBUG_WARNING, "tdb_mmap failed for size %d (%s)\n", 
 				 tdb->map_size, strerror(errno)));
-		}
+		} else
+			tdb_mmap_advise(tdb);
 	} else {
 		tdb->map_ptr = NULL;
 	}
@@ -370,6 +408,7 @@ int tdb_expand(struct tdb_context *tdb, tdb_off_t size)
 	if (tdb_free(tdb, offset, &rec) == -1)
 		goto fail;
 
+	tdb_stat_inc(tdb, expands);
 	tdb_unlock(tdb, -1, F_WRLCK);
 	return 0;
  fail:
@@ -26,6 +26,7 @@
 */
 
 #include "tdb_private.h"
+#include <pthread.h>
 
 void tdb_setalarm_sigptr(struct tdb_context *tdb, volatile sig_atomic_t *ptr)
 {
@@ -43,10 +44,21 @@ static int fcntl_lock(struct tdb_context *tdb,
 	fl.l_len = len;
 	fl.l_pid = 0;
 
-	if (waitflag)
-		return fcntl(tdb->fd, F_SETLKW, &fl);
-	else
-		return fcntl(tdb->fd, F_SETLK, &fl);
+	if (!waitflag) {
+		tdb_stat_inc(tdb, lock_nonblock);
+		if (fcntl(tdb->fd, F_SETLK, &fl) == 0)
+			return 0;
+		tdb_stat_inc(tdb, lock_nonblock_fail);
+		return -1;
+	}
+
+	/* Try without waiting first, so we can count the waits. */
+	if (fcntl(tdb->fd, F_SETLK, &fl) == 0)
+		return 0;
+	if (errno != EAGAIN && errno != EACCES)
+		return -1;
+	tdb_stat_inc(tdb, lock_wait);
+	return fcntl(tdb->fd, F_SETLKW, &fl);
 }
 
 static int fcntl_unlock(struct tdb_context *tdb, int rw, off_t off, off_t len)
@@ -152,6 +164,7 @@ int tdb_brlock(struct tdb_context *tdb,
 		return -1;
 	}
 
+	tdb_stat_inc(tdb, lock_lowlevel);
 	do {
 		ret = fcntl_lock(tdb, rw_type, offset, len,
 				 flags & TDB_LOCK_WAIT);
@@ -253,6 +266,61 @@ static struct tdb_lock_type *find_nestlock(struct tdb_context *tdb,
 	return NULL;
 }
 
+/* getpid() is a syscall, and TDB_FORK_SAFE checks on every lock: instead
+   count forks, bumped in each child as it starts. */
+static unsigned int fork_generation;
+static pthread_once_t fork_watch_once = PTHREAD_ONCE_INIT;
+
+static void tdb_forked(void)
+{
+	fork_generation++;
+}
+
+static void register_fork_watch(void)
+{
+	pthread_atfork(NULL, NULL, tdb_forked);
+}
+
+/* Called by tdb_open for TDB_FORK_SAFE, before any lock is taken. */
+void tdb_watch_forks(void)
+{
+	pthread_once(&fork_watch_once, register_fork_watch);
+}
+
+/*
+  with TDB_FORK_SAFE a child can carry on with its parent's handle: the
+  fd and mmap are fine to share, but fcntl locks are not inherited.  So
+  if we have forked since taking the locks we think we hold, forget them
+  (and any transaction they belonged to).  Like tdb_reopen_all(1), we
+  assume the parent keeps any TDB_CLEAR_IF_FIRST active lock.
+*/
+void tdb_check_fork(struct tdb_context *tdb)
+{
+	if (!(tdb->flags & TDB_FORK_SAFE)) {
+		return;
+	}
+
+	if (tdb->num_lockrecs == 0 && tdb->allrecord_lock.count == 0) {
+		tdb->lock_generation = fork_generation;
+		return;
+	}
+	if (tdb->lock_generation == fork_generation) {
+		return;
+	}
+
+	TDB_LOG((tdb, TDB_DEBUG_TRACE, "tdb_check_fork: forgetting %u locks "
+		 "taken before fork\n",
+		 tdb->num_lockrecs + tdb->allrecord_lock.count));
+	if (tdb->transaction) {
+		tdb_transaction_forget(tdb);
+	}
+	tdb->num_lockrecs = 0;
+	SAFE_FREE(tdb->lockrecs);
+	tdb->allrecord_lock.count = 0;
+	tdb->allrecord_lock.ltype = 0;
+	tdb->lock_generation = fork_generation;
+}
+
 /* lock an offset in the database. */
 int tdb_nest_lock(struct tdb_context *tdb, uint32_t offset, int ltype,
 		  enum tdb_lock_flags flags)
@@ -268,6 +336,8 @@ int tdb_nest_lock(struct tdb_context *tdb, uint32_t offset, int ltype,
 	if (tdb->flags & TDB_NOLOCK)
 		return 0;
 
+	tdb_check_fork(tdb);
+	tdb_stat_inc(tdb, locks);
 	new_lck = find_nestlock(tdb, offset);
 	if (new_lck) {
 		/*
@@ -328,17 +398,80 @@ static bool have_data_locks(const struct tdb_context *tdb)
 	unsigned int i;
 
 	for (i = 0; i < tdb->num_lockrecs; i++) {
-		if (tdb->lockrecs[i].off >= lock_offset(-1))
+		if (tdb->lockrecs[i].off
+		    >= lock_offset(FREE_CLASS_LIST(TDB_FREE_CLASSES-1)))
 			return true;
 	}
 	return false;
 }
 
+static bool have_chain_locks(const struct tdb_context *tdb)
+{
+	unsigned int i;
+
+	for (i = 0; i < tdb->num_lockrecs; i++) {
+		if (tdb->lockrecs[i].off >= lock_offset(0))
+			return true;
+	}
+	return false;
+}
+
+/* Another process may have tdb_rehash()ed since we last looked.  That
+   takes the allrecord lock, so it can't happen while we hold any chain
+   lock: check when we get the first. */
+static int tdb_update_hash_size(struct tdb_context *tdb)
+{
+	uint32_t hash_size, hash_locks;
+
+	if (tdb->flags & TDB_INTERNAL)
+		return 0;
+
+	if (tdb->methods->tdb_read(tdb, offsetof(struct tdb_header, hash_size),
+				   &hash_size, sizeof(hash_size),
+				   DOCONV()) == -1
+	    || tdb->methods->tdb_read(tdb,
+				      offsetof(struct tdb_header, hash_locks),
+				      &hash_locks, sizeof(hash_locks),
+				      DOCONV()) == -1)
+		return -1;
+
+	if (hash_size == tdb->header.hash_size
+	    && hash_locks == tdb->header.hash_locks)
+		return 0;
+
+	/* A rehash only ever adds chains, in multiples of the stripes,
+	   and records the stripes it used. */
+	if (hash_size <= tdb->header.hash_size
+	    || hash_locks != tdb->hash_locks
+	    || hash_size % hash_locks != 0) {
+		tdb->ecode = TDB_ERR_CORRUPT;
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_update_hash_size: "
+			 "%u hash chains with %u locks after %u chains\n",
+			 hash_size, hash_locks, tdb->header.hash_size));
+		return -1;
+	}
+
+	/* The table grew: make sure we can see all of it. */
+	if (tdb->methods->tdb_oob(tdb, TDB_DATA_START(hash_size), 0) != 0)
+		return -1;
+
+	TDB_LOG((tdb, TDB_DEBUG_TRACE, "tdb_update_hash_size: "
+		 "rehashed from %u to %u chains\n",
+		 tdb->header.hash_size, hash_size));
+	tdb->header.hash_size = hash_size;
+	tdb->header.hash_locks = hash_locks;
+	tdb->header.rwlocks = TDB_FEATURE_FLAG_MAGIC;
+	tdb->header.feature_flags |= TDB_FEATURE_REHASHED;
+	return 0;
+}
+
 static int tdb_lock_list(struct tdb_context *tdb, int list, int ltype,
 			 enum tdb_lock_flags waitflag)
 {
 	int ret;
-	bool check = false;
+	bool check = false, chain_check;
+
+	tdb_check_fork(tdb);
 
 	/* a allrecord lock allows us to avoid per chain locks */
 	if (tdb->allrecord_lock.count &&
@@ -352,6 +485,7 @@ static int tdb_lock_list(struct tdb_context *tdb, int list, int ltype,
 	} else {
 		/* Only check when we grab first data lock. */
 		check = !have_data_locks(tdb);
+		chain_check = list >= 0 && !have_chain_locks(tdb);
 		ret = tdb_nest_lock(tdb, lock_offset(list), ltype, waitflag);
 
 		if (ret == 0 && check && tdb_needs_recovery(tdb)) {
@@ -362,11 +496,17 @@ static int tdb_lock_list(struct tdb_context *tdb, int list, int ltype,
 			}
 			return tdb_lock_list(tdb, list, ltype, waitflag);
 		}
+
+		if (ret == 0 && chain_check && tdb_update_hash_size(tdb) == -1) {
+			tdb_nest_unlock(tdb, lock_offset(list), ltype, false);
+			return -1;
+		}
 	}
 	return ret;
 }
 
-/* lock a list in the database. list -1 is the alloc list */
+/* lock a list in the database. list -1 is the alloc list, and -2 down
+   are the size-class free lists */
 int tdb_lock(struct tdb_context *tdb, int list, int ltype)
 {
 	int ret;
@@ -552,6 +692,8 @@ static int tdb_chainlock_gradual(struct tdb_context *tdb,
 int tdb_allrecord_lock(struct tdb_context *tdb, int ltype,
 		       enum tdb_lock_flags flags, bool upgradable)
 {
+	tdb_check_fork(tdb);
+	tdb_stat_inc(tdb, locks);
 	switch (tdb_allrecord_check(tdb, ltype, flags, upgradable)) {
 	case -1:
 		return -1;
@@ -600,6 +742,11 @@ int tdb_allrecord_lock(struct tdb_context *tdb, int ltype,
 		return tdb_allrecord_lock(tdb, ltype, flags, upgradable);
 	}
 
+	if (tdb_update_hash_size(tdb) == -1) {
+		tdb_allrecord_unlock(tdb, ltype, flags & TDB_LOCK_MARK_ONLY);
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -704,7 +851,7 @@ int tdb_unlockall_read(struct tdb_context *tdb)
    contention - it cannot guarantee how many records will be locked */
 int tdb_chainlock(struct tdb_context *tdb, TDB_DATA key)
 {
-	int ret = tdb_lock(tdb, BUCKET(tdb->hash_fn(&key)), F_WRLCK);
+	int ret = tdb_lock(tdb, BUCKET_LOCK(tdb->hash_fn(&key)), F_WRLCK);
 	tdb_trace_1rec(tdb, "tdb_chainlock", key);
 	return ret;
 }
@@ -714,7 +861,7 @@ int tdb_chainlock(struct tdb_context *tdb, TDB_DATA key)
    locked */
 int tdb_chainlock_nonblock(struct tdb_context *tdb, TDB_DATA key)
 {
-	int ret = tdb_lock_nonblock(tdb, BUCKET(tdb->hash_fn(&key)), F_WRLCK);
+	int ret = tdb_lock_nonblock(tdb, BUCKET_LOCK(tdb->hash_fn(&key)), F_WRLCK);
 	tdb_trace_1rec_ret(tdb, "tdb_chainlock_nonblock", key, ret);
 	return ret;
 }
@@ -722,7 +869,7 @@ int tdb_chainlock_nonblock(struct tdb_context *tdb, TDB_DATA key)
 /* mark a chain as locked without actually locking it. Warning! use with great caution! */
 int tdb_chainlock_mark(struct tdb_context *tdb, TDB_DATA key)
 {
-	int ret = tdb_nest_lock(tdb, lock_offset(BUCKET(tdb->hash_fn(&key))),
+	int ret = tdb_nest_lock(tdb, lock_offset(BUCKET_LOCK(tdb->hash_fn(&key))),
 				F_WRLCK, TDB_LOCK_MARK_ONLY);
 	tdb_trace_1rec(tdb, "tdb_chainlock_mark", key);
 	return ret;
@@ -732,20 +879,20 @@ int tdb_chainlock_mark(struct tdb_context *tdb, TDB_DATA key)
 int tdb_chainlock_unmark(struct tdb_context *tdb, TDB_DATA key)
 {
 	tdb_trace_1rec(tdb, "tdb_chainlock_unmark", key);
-	return tdb_nest_unlock(tdb, lock_offset(BUCKET(tdb->hash_fn(&key))),
+	return tdb_nest_unlock(tdb, lock_offset(BUCKET_LOCK(tdb->hash_fn(&key))),
 			       F_WRLCK, true);
 }
 
 int tdb_chainunlock(struct tdb_context *tdb, TDB_DATA key)
 {
 	tdb_trace_1rec(tdb, "tdb_chainunlock", key);
-	return tdb_unlock(tdb, BUCKET(tdb->hash_fn(&key)), F_WRLCK);
+	return tdb_unlock(tdb, BUCKET_LOCK(tdb->hash_fn(&key)), F_WRLCK);
 }
 
 int tdb_chainlock_read(struct tdb_context *tdb, TDB_DATA key)
 {
 	int ret;
-	ret = tdb_lock(tdb, BUCKET(tdb->hash_fn(&key)), F_RDLCK);
+	ret = tdb_lock(tdb, BUCKET_LOCK(tdb->hash_fn(&key)), F_RDLCK);
 	tdb_trace_1rec(tdb, "tdb_chainlock_read", key);
 	return ret;
 }
@@ -753,7 +900,7 @@ int tdb_chainlock_read(struct tdb_context *tdb, TDB_DATA key)
 int tdb_chainunlock_read(struct tdb_context *tdb, TDB_DATA key)
 {
 	tdb_trace_1rec(tdb, "tdb_chainunlock_read", key);
-	return tdb_unlock(tdb, BUCKET(tdb->hash_fn(&key)), F_RDLCK);
+	return tdb_unlock(tdb, BUCKET_LOCK(tdb->hash_fn(&key)), F_RDLCK);
 }
 
 
@@ -26,6 +26,10 @@
 */
 
 #include "tdb_private.h"
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 
 /* all contexts, to ensure no double-opens (fcntl locks don't nest!) */
 static struct tdb_context *tdbs = NULL;
@@ -60,6 +64,8 @@ static int tdb_new_database(struct tdb_context *tdb, int hash_size)
 
 	/* We make it up in memory, then write it out if not internal */
 	size = sizeof(struct tdb_header) + (hash_size+1)*sizeof(tdb_off_t);
+	if (tdb->flags & TDB_CHAIN_FILTER)
+		size += hash_size*sizeof(uint32_t);
 	if (!(newdb = (struct tdb_header *)calloc(size, 1))) {
 		tdb->ecode = TDB_ERR_OOM;
 		return -1;
@@ -75,11 +81,21 @@ static int tdb_new_database(struct tdb_context *tdb, int hash_size)
 	 * will refuse to open this TDB. */
 	if (tdb->flags & TDB_INCOMPATIBLE_HASH)
 		newdb->rwlocks = TDB_HASH_RWLOCK_MAGIC;
+	/* The size-class free list heads live in the reserved area, which
+	 * older tdbs would ignore, and they would add records without
+	 * setting filter bits: they must not open this either. */
+	if (tdb->flags & TDB_FREELIST_CLASSES)
+		newdb->feature_flags |= TDB_FEATURE_FREELIST_CLASSES;
+	if (tdb->flags & TDB_CHAIN_FILTER)
+		newdb->feature_flags |= TDB_FEATURE_CHAIN_FILTER;
+	if (newdb->feature_flags)
+		newdb->rwlocks = TDB_FEATURE_FLAG_MAGIC;
 
 	if (tdb->flags & TDB_INTERNAL) {
 		tdb->map_size = size;
 		tdb->map_ptr = (char *)newdb;
 		memcpy(&tdb->header, newdb, sizeof(tdb->header));
+		tdb->hash_locks = hash_size;
 		/* Convert the `ondisk' version if asked. */
 		CONVERT(*newdb);
 		return 0;
@@ -134,6 +150,119 @@ static int tdb_already_open(dev_t device,
 	return 0;
 }
 
+/* Share the file's blocks with a new, unlinked file, if the filesystem
+   can do that (btrfs, xfs...).  Returns the new fd, or -1. */
+static int tdb_clone_file(struct tdb_context *tdb)
+{
+#if defined(FICLONE) && defined(O_TMPFILE)
+	const char *slash = strrchr(tdb->name, '/');
+	char dir[slash ? slash - tdb->name + 2 : 2];
+	int fd;
+
+	if (slash) {
+		memcpy(dir, tdb->name, slash - tdb->name + 1);
+		dir[slash - tdb->name + 1] = '\0';
+	} else
+		strcpy(dir, ".");
+
+	fd = open(dir, O_TMPFILE|O_RDWR, 0600);
+	if (fd == -1)
+		return -1;
+	if (ioctl(fd, FICLONE, tdb->fd) == -1) {
+		close(fd);
+		return -1;
+	}
+	fcntl(fd, F_SETFD, fcntl(fd, F_GETFD, 0) | FD_CLOEXEC);
+	return fd;
+#else
+	return -1;
+#endif
+}
+
+/* Otherwise, take a private mapping and write to every page, so none of
+   it is shared with the file any more. */
+static int tdb_private_copy(struct tdb_context *tdb)
+{
+#if HAVE_MMAP
+	volatile unsigned char *p;
+	tdb_off_t off;
+
+	p = mmap(NULL, tdb->map_size, PROT_READ|PROT_WRITE, MAP_PRIVATE,
+		 tdb->fd, 0);
+	if (p == MAP_FAILED)
+		return -1;
+	for (off = 0; off < tdb->map_size; off += tdb->page_size)
+		p[off] = p[off];
+	tdb->map_ptr = (void *)p;
+	return 0;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/* Freeze the database as it is now.  A read lock on the chains and
+   records is enough: writers, transaction commits and rehashes all
+   need write locks there.  Afterwards nothing refers to the live file,
+   so we never lock again. */
+static int tdb_snapshot(struct tdb_context *tdb, bool lock)
+{
+	struct stat st;
+	int fd = -1;
+
+	/* Read-only opens are TDB_NOLOCK, but we do want this one. */
+	if (lock)
+		tdb->flags &= ~TDB_NOLOCK;
+	if (tdb_brlock(tdb, F_RDLCK, FREELIST_TOP, 0, TDB_LOCK_WAIT) == -1) {
+		tdb->flags |= TDB_NOLOCK;
+		return -1;
+	}
+
+	/* It may have grown since we mapped it. */
+	if (fstat(tdb->fd, &st) == -1 || tdb_munmap(tdb) == -1)
+		goto fail;
+	tdb->map_size = st.st_size;
+
+	fd = tdb_clone_file(tdb);
+	if (fd == -1 && tdb_private_copy(tdb) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_snapshot: "
+			 "could not copy %s: %s\n",
+			 tdb->name, strerror(errno)));
+		goto fail;
+	}
+
+	tdb_brunlock(tdb, F_RDLCK, FREELIST_TOP, 0);
+	tdb->flags |= (TDB_NOLOCK | TDB_SNAPSHOT);
+	close(tdb->fd);
+	tdb->fd = fd;
+	if (fd != -1)
+		tdb_mmap(tdb);
+
+	/* Someone may have rehashed before we got the lock. */
+	if (tdb->methods->tdb_read(tdb, 0, &tdb->header, sizeof(tdb->header),
+				   DOCONV()) == -1)
+		return -1;
+	if (tdb->header.hash_size == 0
+	    || (tdb->header.hash_locks != 0
+		&& tdb->header.hash_size % tdb->header.hash_locks != 0)) {
+		tdb->ecode = TDB_ERR_CORRUPT;
+		errno = EIO;
+		return -1;
+	}
+	tdb->hash_locks = tdb->header.hash_locks ? tdb->header.hash_locks
+		: tdb->header.hash_size;
+
+	/* Opening the live database in this process is fine now. */
+	tdb->device = 0;
+	tdb->inode = 0;
+	return 0;
+
+fail:
+	tdb_brunlock(tdb, F_RDLCK, FREELIST_TOP, 0);
+	tdb->flags |= TDB_NOLOCK;
+	return -1;
+}
+
 /* open the database, creating it if necessary 
 
    The open_flags and mode are passed straight to the open call on the
@@ -150,6 +279,63 @@ struct tdb_context *tdb_open(const char *name, int hash_size, int tdb_flags,
 	return tdb_open_ex(name, hash_size, tdb_flags, open_flags, mode, NULL, NULL);
 }
 
+/*
+ * Count into <name>.stats from now on: it holds a struct tdb_stats shared
+ * by everyone who opens the tdb with TDB_SHARED_STATS.  If we can't,
+ * we just keep our own.
+ */
+static void tdb_share_stats(struct tdb_context *tdb)
+{
+#if HAVE_MMAP
+	char *name;
+	int fd;
+	struct stat st;
+	struct tdb_stats *stats;
+
+	name = (char *)malloc(strlen(tdb->name) + sizeof(".stats"));
+	if (name == NULL) {
+		return;
+	}
+	sprintf(name, "%s.stats", tdb->name);
+	fd = open(name, O_RDWR|O_CREAT, 0600);
+	if (fd == -1 || fstat(fd, &st) != 0) {
+		goto fail;
+	}
+	if ((size_t)st.st_size < sizeof(*stats) && ftruncate(fd, sizeof(*stats)) != 0) {
+		goto fail;
+	}
+	stats = (struct tdb_stats *)mmap(NULL, sizeof(*stats),
+					 PROT_READ|PROT_WRITE, MAP_SHARED,
+					 fd, 0);
+	if (stats == MAP_FAILED) {
+		goto fail;
+	}
+	close(fd);
+
+	/* Zero means we're first. */
+	__sync_bool_compare_and_swap(&stats->size, 0, sizeof(*stats));
+	if (stats->size != sizeof(*stats)) {
+		TDB_LOG((tdb, TDB_DEBUG_WARNING, "tdb_open_ex: %s has "
+			 "unexpected size %zu\n", name, stats->size));
+		munmap(stats, sizeof(*stats));
+		free(name);
+		return;
+	}
+	free(name);
+	tdb->stats = stats;
+	tdb->flags |= TDB_SHARED_STATS;
+	return;
+
+fail:
+	TDB_LOG((tdb, TDB_DEBUG_WARNING, "tdb_open_ex: can't share stats "
+		 "in %s: %s\n", name, strerror(errno)));
+	if (fd != -1) {
+		close(fd);
+	}
+	free(name);
+#endif
+}
+
 /* a default logging function */
 static void null_log_fn(struct tdb_context *tdb, enum tdb_debug_level level, const char *fmt, ...) PRINTF_FMT(3, 4);
 static void null_log_fn(struct tdb_context *tdb, enum tdb_debug_level level, const char *fmt, ...)
@@ -203,8 +389,13 @@ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int tdb_flags,
 #endif
 	tdb->name = NULL;
 	tdb->map_ptr = NULL;
-	tdb->flags = tdb_flags;
+	/* TDB_SHARED_STATS is set once we have the page. */
+	tdb->flags = tdb_flags & ~TDB_SHARED_STATS;
+	if (tdb->flags & TDB_FORK_SAFE)
+		tdb_watch_forks();
 	tdb->open_flags = open_flags;
+	tdb->private_stats.size = sizeof(tdb->private_stats);
+	tdb->stats = &tdb->private_stats;
 	if (log_ctx) {
 		tdb->log = *log_ctx;
 	} else {
@@ -240,6 +431,17 @@ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int tdb_flags,
 		goto fail;
 	}
 	
+	/* Set by tdb_snapshot() once there is one. */
+	tdb->flags &= ~TDB_SNAPSHOT;
+	if ((tdb_flags & TDB_SNAPSHOT)
+	    && ((open_flags & O_ACCMODE) != O_RDONLY
+		|| (tdb_flags & TDB_INTERNAL))) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_open_ex: "
+			 "snapshots must be O_RDONLY, and not internal\n"));
+		errno = EINVAL;
+		goto fail;
+	}
+
 	if (hash_size == 0)
 		hash_size = DEFAULT_HASH_SIZE;
 	if ((open_flags & O_ACCMODE) == O_RDONLY) {
@@ -336,11 +538,45 @@ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int tdb_flags,
 		goto fail;
 
 	if (tdb->header.rwlocks != 0 &&
-	    tdb->header.rwlocks != TDB_HASH_RWLOCK_MAGIC) {
+	    tdb->header.rwlocks != TDB_HASH_RWLOCK_MAGIC &&
+	    tdb->header.rwlocks != TDB_FEATURE_FLAG_MAGIC) {
 		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_open_ex: spinlocks no longer supported\n"));
 		goto fail;
 	}
 
+	if (tdb->header.rwlocks != TDB_FEATURE_FLAG_MAGIC)
+		tdb->header.feature_flags = 0;
+	else if (tdb->header.feature_flags & ~TDB_FEATURE_ALL) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_open_ex: "
+			 "unknown features 0x%x\n",
+			 tdb->header.feature_flags & ~TDB_FEATURE_ALL));
+		errno = EINVAL;
+		goto fail;
+	}
+
+	/* Chains are locked in stripes of the original hash size. */
+	if (tdb->header.hash_size == 0
+	    || (tdb->header.hash_locks != 0
+		&& tdb->header.hash_size % tdb->header.hash_locks != 0)) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_open_ex: "
+			 "%u hash chains can't have %u locks\n",
+			 tdb->header.hash_size, tdb->header.hash_locks));
+		errno = EIO;
+		goto fail;
+	}
+	tdb->hash_locks = tdb->header.hash_locks ? tdb->header.hash_locks
+		: tdb->header.hash_size;
+
+	/* The file, not the caller, decides how the free list is kept. */
+	if (tdb->header.feature_flags & TDB_FEATURE_FREELIST_CLASSES)
+		tdb->flags |= TDB_FREELIST_CLASSES;
+	else
+		tdb->flags &= ~TDB_FREELIST_CLASSES;
+	if (tdb->header.feature_flags & TDB_FEATURE_CHAIN_FILTER)
+		tdb->flags |= TDB_CHAIN_FILTER;
+	else
+		tdb->flags &= ~TDB_CHAIN_FILTER;
+
 	if ((tdb->header.magic1_hash == 0) && (tdb->header.magic2_hash == 0)) {
 		/* older TDB without magic hash references */
 		tdb->hash_fn = tdb_old_hash;
@@ -388,6 +624,11 @@ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int tdb_flags,
 
 	}
 
+	if ((tdb_flags & TDB_SNAPSHOT)
+	    && tdb_snapshot(tdb, !(tdb_flags & TDB_NOLOCK)) == -1) {
+		goto fail;
+	}
+
 	/* We always need to do this if the CLEAR_IF_FIRST flag is set, even if
 	   we didn't get the initial exclusive lock as we need to let all other
 	   users know we're using it. */
@@ -427,6 +668,9 @@ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int tdb_flags,
 	if (tdb_nest_unlock(tdb, OPEN_LOCK, F_WRLCK, false) == -1) {
 		goto fail;
 	}
+	if ((tdb_flags & TDB_SHARED_STATS) && !(tdb->flags & TDB_INTERNAL)) {
+		tdb_share_stats(tdb);
+	}
 	tdb->next = tdbs;
 	tdbs = tdb;
 	return tdb;
@@ -466,6 +710,35 @@ void tdb_set_max_dead(struct tdb_context *tdb, int max_dead)
 	tdb->max_dead_records = max_dead;
 }
 
+/*
+ * Set the TDB_MMAP_* hints for how the mapping will be accessed.
+ * Population only happens when the file is next mapped, but we ask
+ * for readahead of the current map now.
+ */
+
+int tdb_set_mmap_policy(struct tdb_context *tdb, unsigned policy)
+{
+	if ((policy & ~(TDB_MMAP_RANDOM|TDB_MMAP_SEQUENTIAL|
+			TDB_MMAP_POPULATE|TDB_MMAP_HUGEPAGE))
+	    || ((policy & TDB_MMAP_RANDOM) && (policy & TDB_MMAP_SEQUENTIAL))) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR,
+			 "tdb_set_mmap_policy: invalid policy 0x%x\n", policy));
+		tdb->ecode = TDB_ERR_EINVAL;
+		return -1;
+	}
+
+	tdb->mmap_policy = policy;
+#if HAVE_MMAP
+#ifdef MADV_WILLNEED
+	if ((policy & TDB_MMAP_POPULATE) && tdb->map_ptr
+	    && !(tdb->flags & TDB_INTERNAL))
+		madvise(tdb->map_ptr, tdb->map_size, MADV_WILLNEED);
+#endif
+#endif
+	tdb_mmap_advise(tdb);
+	return 0;
+}
+
 /**
  * Close a database.
  *
@@ -476,6 +749,8 @@ int tdb_close(struct tdb_context *tdb)
 	struct tdb_context **i;
 	int ret = 0;
 
+	/* A forked child must not cancel its parent's transaction. */
+	tdb_check_fork(tdb);
 	if (tdb->transaction) {
 		tdb_transaction_cancel(tdb);
 	}
@@ -492,6 +767,9 @@ int tdb_close(struct tdb_context *tdb)
 		ret = close(tdb->fd);
 		tdb->fd = -1;
 	}
+	if (tdb->flags & TDB_SHARED_STATS) {
+		munmap(tdb->stats, sizeof(*tdb->stats));
+	}
 	SAFE_FREE(tdb->lockrecs);
 
 	/* Remove from contexts list */
@@ -527,7 +805,8 @@ static int tdb_reopen_internal(struct tdb_context *tdb, bool active_lock)
 {
 	struct stat st;
 
-	if (tdb->flags & TDB_INTERNAL) {
+	/* Snapshots hold no locks, and don't use the file. */
+	if (tdb->flags & (TDB_INTERNAL|TDB_SNAPSHOT)) {
 		return 0; /* Nothing to do. */
 	}
 
@@ -74,13 +74,43 @@ static int tdb_key_compare(TDB_DATA key, TDB_DATA data, void *private_data)
 	return memcmp(data.dptr, key.dptr, data.dsize);
 }
 
+/* Records are never removed from a chain's filter: deletions only
+   make it less selective until the next wipe or repack. */
+static int tdb_filter_add(struct tdb_context *tdb, uint32_t hash)
+{
+	uint32_t filter;
+
+	if (!(tdb->header.feature_flags & TDB_FEATURE_CHAIN_FILTER))
+		return 0;
+	if (tdb_ofs_read(tdb, TDB_FILTER_TOP(hash), &filter) == -1)
+		return -1;
+	if ((filter & TDB_FILTER_BITS(hash)) == TDB_FILTER_BITS(hash))
+		return 0;
+	filter |= TDB_FILTER_BITS(hash);
+	return tdb_ofs_write(tdb, TDB_FILTER_TOP(hash), &filter);
+}
+
 /* Returns 0 on fail.  On success, return offset of record, and fills
    in rec */
 static tdb_off_t tdb_find(struct tdb_context *tdb, TDB_DATA key, uint32_t hash,
 			struct tdb_record *r)
 {
 	tdb_off_t rec_ptr;
-	
+
+	tdb_stat_inc(tdb, finds);
+
+	/* The chain's filter can tell us it's not there without walking. */
+	if (tdb->header.feature_flags & TDB_FEATURE_CHAIN_FILTER) {
+		uint32_t filter;
+
+		if (tdb_ofs_read(tdb, TDB_FILTER_TOP(hash), &filter) == -1)
+			return 0;
+		if ((filter & TDB_FILTER_BITS(hash)) != TDB_FILTER_BITS(hash)) {
+			tdb->ecode = TDB_ERR_NOEXIST;
+			return 0;
+		}
+	}
+
 	/* read in the hash top */
 	if (tdb_ofs_read(tdb, TDB_HASH_TOP(hash), &rec_ptr) == -1)
 		return 0;
@@ -89,6 +119,7 @@ static tdb_off_t tdb_find(struct tdb_context *tdb, TDB_DATA key, uint32_t hash,
 	while (rec_ptr) {
 		if (tdb_rec_read(tdb, rec_ptr, r) == -1)
 			return 0;
+		tdb_stat_inc(tdb, find_walk);
 
 		if (!TDB_DEAD(r) && hash==r->full_hash
 		    && key.dsize==r->key_len
@@ -115,10 +146,10 @@ tdb_off_t tdb_find_lock_hash(struct tdb_context *tdb, TDB_DATA key, uint32_t has
 {
 	uint32_t rec_ptr;
 
-	if (tdb_lock(tdb, BUCKET(hash), locktype) == -1)
+	if (tdb_lock(tdb, BUCKET_LOCK(hash), locktype) == -1)
 		return 0;
 	if (!(rec_ptr = tdb_find(tdb, key, hash, rec)))
-		tdb_unlock(tdb, BUCKET(hash), locktype);
+		tdb_unlock(tdb, BUCKET_LOCK(hash), locktype);
 	return rec_ptr;
 }
 
@@ -196,7 +227,7 @@ static TDB_DATA _tdb_fetch(struct tdb_context *tdb, TDB_DATA key)
 	ret.dptr = tdb_alloc_read(tdb, rec_ptr + sizeof(rec) + rec.key_len,
 				  rec.data_len);
 	ret.dsize = rec.data_len;
-	tdb_unlock(tdb, BUCKET(rec.full_hash), F_RDLCK);
+	tdb_unlock(tdb, BUCKET_LOCK(rec.full_hash), F_RDLCK);
 	return ret;
 }
 
@@ -247,7 +278,7 @@ int tdb_parse_record(struct tdb_context *tdb, TDB_DATA key,
 	ret = tdb_parse_data(tdb, key, rec_ptr + sizeof(rec) + rec.key_len,
 			     rec.data_len, parser, private_data);
 
-	tdb_unlock(tdb, BUCKET(rec.full_hash), F_RDLCK);
+	tdb_unlock(tdb, BUCKET_LOCK(rec.full_hash), F_RDLCK);
 
 	return ret;
 }
@@ -264,7 +295,7 @@ static int tdb_exists_hash(struct tdb_context *tdb, TDB_DATA key, uint32_t hash)
 	
 	if (tdb_find_lock_hash(tdb, key, hash, F_RDLCK, &rec) == 0)
 		return 0;
-	tdb_unlock(tdb, BUCKET(rec.full_hash), F_RDLCK);
+	tdb_unlock(tdb, BUCKET_LOCK(rec.full_hash), F_RDLCK);
 	return 1;
 }
 
@@ -278,8 +309,10 @@ int tdb_exists(struct tdb_context *tdb, TDB_DATA key)
 	return ret;
 }
 
-/* actually delete an entry in the database given the offset */
-int tdb_do_delete(struct tdb_context *tdb, tdb_off_t rec_ptr, struct tdb_record *rec)
+/* actually delete an entry in the database given the offset; if merge,
+   also coalesce it with free records to its right. */
+static int do_delete(struct tdb_context *tdb, tdb_off_t rec_ptr,
+		     struct tdb_record *rec, bool merge)
 {
 	tdb_off_t last_ptr, i;
 	struct tdb_record lastrec;
@@ -309,11 +342,19 @@ int tdb_do_delete(struct tdb_context *tdb, tdb_off_t rec_ptr, struct tdb_record
 		return -1;
 
 	/* recover the space */
-	if (tdb_free(tdb, rec_ptr, rec) == -1)
+	if (merge) {
+		if (tdb_free_merge(tdb, rec_ptr, rec) == -1)
+			return -1;
+	} else if (tdb_free(tdb, rec_ptr, rec) == -1)
 		return -1;
 	return 0;
 }
 
+int tdb_do_delete(struct tdb_context *tdb, tdb_off_t rec_ptr, struct tdb_record *rec)
+{
+	return do_delete(tdb, rec_ptr, rec, false);
+}
+
 static int tdb_count_dead(struct tdb_context *tdb, uint32_t hash)
 {
 	int res = 0;
@@ -337,9 +378,12 @@ static int tdb_count_dead(struct tdb_context *tdb, uint32_t hash)
 }
 
 /*
- * Purge all DEAD records from a hash chain
+ * Purge all DEAD records from a hash chain, adding the space recovered
+ * to *reclaimed if non-NULL.  If merge, the space is also coalesced with
+ * free records on its right (slow: see tdb_free_merge).
  */
-static int tdb_purge_dead(struct tdb_context *tdb, uint32_t hash)
+static int tdb_purge_dead(struct tdb_context *tdb, uint32_t hash,
+			  tdb_len_t *reclaimed, bool merge)
 {
 	int res = -1;
 	struct tdb_record rec;
@@ -362,9 +406,18 @@ static int tdb_purge_dead(struct tdb_context *tdb, uint32_t hash)
 
 		next = rec.next;
 
-		if (rec.magic == TDB_DEAD_MAGIC
-		    && tdb_do_delete(tdb, rec_ptr, &rec) == -1) {
-			goto fail;
+		if (rec.magic == TDB_DEAD_MAGIC) {
+			/* A traverse sitting on it leaves it dead.  We hold
+			   the chain lock, so nobody else can start to. */
+			bool busy = (tdb_write_lock_record(tdb, rec_ptr) == -1);
+			tdb_len_t len = sizeof(rec) + rec.rec_len;
+
+			if (!busy && tdb_write_unlock_record(tdb, rec_ptr) != 0)
+				goto fail;
+			if (do_delete(tdb, rec_ptr, &rec, merge) == -1)
+				goto fail;
+			if (!busy && reclaimed)
+				*reclaimed += len;
 		}
 		rec_ptr = next;
 	}
@@ -388,7 +441,7 @@ static int tdb_delete_hash(struct tdb_context *tdb, TDB_DATA key, uint32_t hash)
 		 * tdb's with a very high create/delete rate like locking.tdb.
 		 */
 
-		if (tdb_lock(tdb, BUCKET(hash), F_WRLCK) == -1)
+		if (tdb_lock(tdb, BUCKET_LOCK(hash), F_WRLCK) == -1)
 			return -1;
 
 		if (tdb_count_dead(tdb, hash) >= tdb->max_dead_records) {
@@ -396,11 +449,11 @@ static int tdb_delete_hash(struct tdb_context *tdb, TDB_DATA key, uint32_t hash)
 			 * Don't let the per-chain freelist grow too large,
 			 * delete all existing dead records
 			 */
-			tdb_purge_dead(tdb, hash);
+			tdb_purge_dead(tdb, hash, NULL, false);
 		}
 
 		if (!(rec_ptr = tdb_find(tdb, key, hash, &rec))) {
-			tdb_unlock(tdb, BUCKET(hash), F_WRLCK);
+			tdb_unlock(tdb, BUCKET_LOCK(hash), F_WRLCK);
 			return -1;
 		}
 
@@ -422,7 +475,7 @@ static int tdb_delete_hash(struct tdb_context *tdb, TDB_DATA key, uint32_t hash)
 		tdb_increment_seqnum(tdb);
 	}
 
-	if (tdb_unlock(tdb, BUCKET(rec.full_hash), F_WRLCK) != 0)
+	if (tdb_unlock(tdb, BUCKET_LOCK(rec.full_hash), F_WRLCK) != 0)
 		TDB_LOG((tdb, TDB_DEBUG_WARNING, "tdb_delete: WARNING tdb_unlock failed!\n"));
 	return ret;
 }
@@ -473,6 +526,7 @@ static int _tdb_store(struct tdb_context *tdb, TDB_DATA key,
 	tdb_off_t rec_ptr;
 	char *p = NULL;
 	int ret = -1;
+	bool freelist_lock;
 
 	/* check for it existing, on insert. */
 	if (flag == TDB_INSERT) {
@@ -532,7 +586,8 @@ static int _tdb_store(struct tdb_context *tdb, TDB_DATA key,
 			if (tdb_rec_write(tdb, rec_ptr, &rec) == -1
 			    || tdb->methods->tdb_write(
 				    tdb, rec_ptr + sizeof(rec),
-				    p, key.dsize + dbuf.dsize) == -1) {
+				    p, key.dsize + dbuf.dsize) == -1
+			    || tdb_filter_add(tdb, hash) == -1) {
 				goto fail;
 			}
 			goto done;
@@ -542,23 +597,27 @@ static int _tdb_store(struct tdb_context *tdb, TDB_DATA key,
 	/*
 	 * We have to allocate some space from the freelist, so this means we
 	 * have to lock it. Use the chance to purge all the DEAD records from
-	 * the hash chain under the freelist lock.
+	 * the hash chain under the freelist lock.  Size-class free lists
+	 * are locked one class at a time by tdb_allocate itself.
 	 */
+	freelist_lock = !(tdb->flags & TDB_FREELIST_CLASSES);
 
-	if (tdb_lock(tdb, -1, F_WRLCK) == -1) {
+	if (freelist_lock && tdb_lock(tdb, -1, F_WRLCK) == -1) {
 		goto fail;
 	}
 
 	if ((tdb->max_dead_records != 0)
-	    && (tdb_purge_dead(tdb, hash) == -1)) {
-		tdb_unlock(tdb, -1, F_WRLCK);
+	    && (tdb_purge_dead(tdb, hash, NULL, false) == -1)) {
+		if (freelist_lock)
+			tdb_unlock(tdb, -1, F_WRLCK);
 		goto fail;
 	}
 
 	/* we have to allocate some space */
 	rec_ptr = tdb_allocate(tdb, key.dsize + dbuf.dsize, &rec);
 
-	tdb_unlock(tdb, -1, F_WRLCK);
+	if (freelist_lock)
+		tdb_unlock(tdb, -1, F_WRLCK);
 
 	if (rec_ptr == 0) {
 		goto fail;
@@ -576,6 +635,7 @@ static int _tdb_store(struct tdb_context *tdb, TDB_DATA key,
 	/* write out and point the top of the hash chain at it */
 	if (tdb_rec_write(tdb, rec_ptr, &rec) == -1
 	    || tdb->methods->tdb_write(tdb, rec_ptr+sizeof(rec), p, key.dsize+dbuf.dsize)==-1
+	    || tdb_filter_add(tdb, hash) == -1
 	    || tdb_ofs_write(tdb, TDB_HASH_TOP(hash), &rec_ptr) == -1) {
 		/* Need to tdb_unallocate() here */
 		goto fail;
@@ -610,12 +670,12 @@ int tdb_store(struct tdb_context *tdb, TDB_DATA key, TDB_DATA dbuf, int flag)
 
 	/* find which hash bucket it is in */
 	hash = tdb->hash_fn(&key);
-	if (tdb_lock(tdb, BUCKET(hash), F_WRLCK) == -1)
+	if (tdb_lock(tdb, BUCKET_LOCK(hash), F_WRLCK) == -1)
 		return -1;
 
 	ret = _tdb_store(tdb, key, dbuf, flag, hash);
 	tdb_trace_2rec_flag_ret(tdb, "tdb_store", key, dbuf, flag, ret);
-	tdb_unlock(tdb, BUCKET(hash), F_WRLCK);
+	tdb_unlock(tdb, BUCKET_LOCK(hash), F_WRLCK);
 	return ret;
 }
 
@@ -628,7 +688,7 @@ int tdb_append(struct tdb_context *tdb, TDB_DATA key, TDB_DATA new_dbuf)
 
 	/* find which hash bucket it is in */
 	hash = tdb->hash_fn(&key);
-	if (tdb_lock(tdb, BUCKET(hash), F_WRLCK) == -1)
+	if (tdb_lock(tdb, BUCKET_LOCK(hash), F_WRLCK) == -1)
 		return -1;
 
 	dbuf = _tdb_fetch(tdb, key);
@@ -661,7 +721,7 @@ int tdb_append(struct tdb_context *tdb, TDB_DATA key, TDB_DATA new_dbuf)
 	tdb_trace_2rec_retrec(tdb, "tdb_append", key, new_dbuf, dbuf);
 	
 failed:
-	tdb_unlock(tdb, BUCKET(hash), F_WRLCK);
+	tdb_unlock(tdb, BUCKET_LOCK(hash), F_WRLCK);
 	SAFE_FREE(dbuf.dptr);
 	return ret;
 }
@@ -729,6 +789,18 @@ int tdb_get_flags(struct tdb_context *tdb)
 	return tdb->flags;
 }
 
+/* With TDB_SHARED_STATS, these are totals for everyone using the tdb. */
+int tdb_get_stats(struct tdb_context *tdb, struct tdb_stats *stats)
+{
+	size_t size = stats->size;
+
+	if (size > sizeof(*tdb->stats))
+		size = sizeof(*tdb->stats);
+	memcpy(stats, tdb->stats, size);
+	stats->size = size;
+	return 0;
+}
+
 void tdb_add_flags(struct tdb_context *tdb, unsigned flags)
 {
 	if ((flags & TDB_ALLOW_NESTING) &&
@@ -803,6 +875,62 @@ static int tdb_free_region(struct tdb_context *tdb, tdb_off_t offset, ssize_t le
 	return 0;
 }
 
+/*
+  purge dead records from the next max_chains hash chains, one chain lock
+  at a time, carrying on from where the last call stopped.  Unlike a
+  delete, which only merges freed space into a free record on its left,
+  this also absorbs free records to its right, so a vacuumed region ends
+  up as one free record.  *reclaimed (if non-NULL) gets the bytes of dead
+  records returned to the free list.
+
+  return 1 after the last chain, 0 if there are more to do, -1 on error
+ */
+int tdb_vacuum(struct tdb_context *tdb, unsigned int max_chains,
+	       size_t *reclaimed)
+{
+	tdb_len_t freed = 0;
+	tdb_off_t off;
+	uint32_t chain;
+	int ret = 0;
+
+	if (reclaimed)
+		*reclaimed = 0;
+
+	if (tdb->read_only || tdb->traverse_read) {
+		tdb->ecode = TDB_ERR_RDONLY;
+		return -1;
+	}
+
+	for (; max_chains && tdb->vacuum_chain < tdb->header.hash_size;
+	     max_chains--) {
+		chain = tdb->vacuum_chain++;
+
+		/* Empty chains are common: don't lock them (a racing
+		   store will be seen next time round). */
+		if (tdb_ofs_read(tdb, TDB_HASH_TOP(chain), &off) == -1)
+			return -1;
+		if (!off)
+			continue;
+
+		/* If this notices a rehash, the chain still has our stripe. */
+		if (tdb_lock(tdb, BUCKET_LOCK(chain), F_WRLCK) == -1)
+			return -1;
+		if (tdb_purge_dead(tdb, chain, &freed, true) == -1) {
+			tdb_unlock(tdb, BUCKET_LOCK(chain), F_WRLCK);
+			return -1;
+		}
+		tdb_unlock(tdb, BUCKET_LOCK(chain), F_WRLCK);
+	}
+
+	if (tdb->vacuum_chain >= tdb->header.hash_size) {
+		tdb->vacuum_chain = 0;
+		ret = 1;
+	}
+	if (reclaimed)
+		*reclaimed = freed;
+	return ret;
+}
+
 /*
   wipe the entire database, deleting all records. This can be done
   very fast by using a allrecord lock. The entire data portion of the
@@ -848,6 +976,11 @@ int tdb_wipe_all(struct tdb_context *tdb)
 			TDB_LOG((tdb, TDB_DEBUG_FATAL,"tdb_wipe_all: failed to write hash %d\n", i));
 			goto failed;
 		}
+		if ((tdb->header.feature_flags & TDB_FEATURE_CHAIN_FILTER)
+		    && tdb_ofs_write(tdb, TDB_FILTER_TOP(i), &offset) == -1) {
+			TDB_LOG((tdb, TDB_DEBUG_FATAL,"tdb_wipe_all: failed to write filter %d\n", i));
+			goto failed;
+		}
 	}
 
 	/* wipe the freelist */
@@ -856,6 +989,15 @@ int tdb_wipe_all(struct tdb_context *tdb)
 		goto failed;
 	}
 
+	if (tdb->flags & TDB_FREELIST_CLASSES) {
+		for (i=0;i<TDB_FREE_CLASSES;i++) {
+			if (tdb_ofs_write(tdb, FREE_CLASS_TOP(i), &offset) == -1) {
+				TDB_LOG((tdb, TDB_DEBUG_FATAL,"tdb_wipe_all: failed to write free class %d\n", i));
+				goto failed;
+			}
+		}
+	}
+
 	/* add all the rest of the file to the freelist, possibly leaving a gap 
 	   for the recovery area */
 	if (recovery_size == 0) {
@@ -915,21 +1057,85 @@ static int repack_traverse(struct tdb_context *tdb, TDB_DATA key, TDB_DATA data,
 }
 
 /*
-  repack a tdb
+  give an (about to be wiped) tdb hash_size chains, inside a transaction.
+  The chains stay locked in stripes of the original hash size, so other
+  openers keep locking the right one and notice the change once they do.
  */
-int tdb_repack(struct tdb_context *tdb)
+static int tdb_set_hash_size(struct tdb_context *tdb, uint32_t hash_size)
+{
+	tdb_off_t recovery_head, rwlocks, zero = 0;
+	uint32_t hash_locks, features;
+
+	/* A recovery area in the way of the new hash table is dropped:
+	   the commit will allocate another one at the end. */
+	if (tdb_ofs_read(tdb, TDB_RECOVERY_HEAD, &recovery_head) == -1)
+		return -1;
+	tdb->header.hash_size = hash_size;
+	if (recovery_head != 0 && recovery_head < TDB_DATA_START(hash_size)
+	    && tdb_ofs_write(tdb, TDB_RECOVERY_HEAD, &zero) == -1)
+		return -1;
+
+	/* Make room for the new hash table. */
+	if (tdb->map_size < TDB_DATA_START(hash_size)) {
+		tdb_len_t size = TDB_ALIGN(TDB_DATA_START(hash_size)
+					   - tdb->map_size, tdb->page_size);
+		if (tdb->methods->tdb_expand_file(tdb, tdb->map_size,
+						  size) != 0)
+			return -1;
+		tdb->map_size += size;
+	}
+
+	if (tdb_transaction_resize_hash(tdb) != 0)
+		return -1;
+
+	/* Older tdbs wouldn't notice a rehash, so keep them out. */
+	rwlocks = TDB_FEATURE_FLAG_MAGIC;
+	features = tdb->header.feature_flags | TDB_FEATURE_REHASHED;
+	if (tdb_ofs_write(tdb, offsetof(struct tdb_header, rwlocks),
+			  &rwlocks) == -1
+	    || tdb_ofs_write(tdb, offsetof(struct tdb_header, feature_flags),
+			     &features) == -1)
+		return -1;
+	tdb->header.rwlocks = rwlocks;
+	tdb->header.feature_flags = features;
+
+	hash_locks = tdb->hash_locks;
+	if (tdb_ofs_write(tdb, offsetof(struct tdb_header, hash_locks),
+			  &hash_locks) == -1
+	    || tdb_ofs_write(tdb, offsetof(struct tdb_header, hash_size),
+			     &hash_size) == -1)
+		return -1;
+	tdb->header.hash_locks = hash_locks;
+	return 0;
+}
+
+/*
+  rebuild a tdb from a copy of its records, with hash_size chains
+ */
+static int tdb_rebuild(struct tdb_context *tdb, uint32_t hash_size)
 {
 	struct tdb_context *tmp_db;
 	struct traverse_state state;
-
-	tdb_trace(tdb, "tdb_repack");
+	struct tdb_header old_header;
 
 	if (tdb_transaction_start(tdb) != 0) {
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, __location__ " Failed to start transaction\n"));
 		return -1;
 	}
+	old_header = tdb->header;
+	if (hash_size == 0)
+		hash_size = old_header.hash_size;
+
+	if (hash_size < old_header.hash_size || hash_size % tdb->hash_locks != 0) {
+		tdb->ecode = TDB_ERR_EINVAL;
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_rehash: %u chains is not"
+			 " a multiple of %u, at least %u\n",
+			 hash_size, tdb->hash_locks, old_header.hash_size));
+		tdb_transaction_cancel(tdb);
+		return -1;
+	}
 
-	tmp_db = tdb_open("tmpdb", tdb_hash_size(tdb), TDB_INTERNAL, O_RDWR|O_CREAT, 0);
+	tmp_db = tdb_open("tmpdb", hash_size, TDB_INTERNAL, O_RDWR|O_CREAT, 0);
 	if (tmp_db == NULL) {
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, __location__ " Failed to create tmp_db\n"));
 		tdb_transaction_cancel(tdb);
@@ -941,23 +1147,23 @@ int tdb_repack(struct tdb_context *tdb)
 
 	if (tdb_traverse_read(tdb, repack_traverse, &state) == -1) {
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, __location__ " Failed to traverse copying out\n"));
-		tdb_transaction_cancel(tdb);
-		tdb_close(tmp_db);
-		return -1;		
+		goto fail;
 	}
 
 	if (state.error) {
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, __location__ " Error during traversal\n"));
-		tdb_transaction_cancel(tdb);
-		tdb_close(tmp_db);
-		return -1;
+		goto fail;
+	}
+
+	if (hash_size != old_header.hash_size
+	    && tdb_set_hash_size(tdb, hash_size) != 0) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, __location__ " Failed to resize hash table\n"));
+		goto fail;
 	}
 
 	if (tdb_wipe_all(tdb) != 0) {
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, __location__ " Failed to wipe database\n"));
-		tdb_transaction_cancel(tdb);
-		tdb_close(tmp_db);
-		return -1;
+		goto fail;
 	}
 
 	state.error = false;
@@ -965,26 +1171,53 @@ int tdb_repack(struct tdb_context *tdb)
 
 	if (tdb_traverse_read(tmp_db, repack_traverse, &state) == -1) {
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, __location__ " Failed to traverse copying back\n"));
-		tdb_transaction_cancel(tdb);
-		tdb_close(tmp_db);
-		return -1;		
+		goto fail;
 	}
 
 	if (state.error) {
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, __location__ " Error during second traversal\n"));
-		tdb_transaction_cancel(tdb);
-		tdb_close(tmp_db);
-		return -1;
+		goto fail;
 	}
 
 	tdb_close(tmp_db);
 
 	if (tdb_transaction_commit(tdb) != 0) {
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, __location__ " Failed to commit\n"));
+		tdb->header = old_header;
 		return -1;
 	}
 
 	return 0;
+
+fail:
+	/* We still hold the allrecord lock: nobody saw the new size. */
+	tdb->header = old_header;
+	tdb_transaction_cancel(tdb);
+	tdb_close(tmp_db);
+	return -1;
+}
+
+/*
+  repack a tdb
+ */
+int tdb_repack(struct tdb_context *tdb)
+{
+	tdb_trace(tdb, "tdb_repack");
+	return tdb_rebuild(tdb, 0);
+}
+
+/*
+  give a tdb more hash chains while it's in use: hash_size must be a
+  multiple of the hash size it was created with.
+ */
+int tdb_rehash(struct tdb_context *tdb, unsigned int hash_size)
+{
+	if (tdb->transaction) {
+		tdb->ecode = TDB_ERR_EINVAL;
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_rehash: not inside a transaction\n"));
+		return -1;
+	}
+	return tdb_rebuild(tdb, hash_size);
 }
 
 #ifdef TDB_TRACE
@@ -1033,7 +1266,7 @@ static void tdb_trace_record(struct tdb_context *tdb, TDB_DATA rec)
 	p = msg;
 	p += snprintf(p, sizeof(msg), " %zu:", rec.dsize);
 	for (i = 0; i < rec.dsize; i++)
-		p += snprintf(p, 2, "%02x", rec.dptr[i]);
+		p += snprintf(p, 3, "%02x", rec.dptr[i]);
 
 	tdb_trace_write(tdb, msg);
 }
@@ -37,6 +37,8 @@ extern "C" {
 #include <sys/stat.h>
 /* For sig_atomic_t. */
 #include <signal.h>
+/* For uint64_t */
+#include <stdint.h>
 #endif
 #include <ccan/compiler/compiler.h>
 
@@ -59,6 +61,17 @@ extern "C" {
 #define TDB_ALLOW_NESTING 512 /* Allow transactions to nest */
 #define TDB_DISALLOW_NESTING 1024 /* Disallow transactions to nest */
 #define TDB_INCOMPATIBLE_HASH 2048 /* Better hashing: can't be opened by older tdb versions. */
+#define TDB_FREELIST_CLASSES 4096 /* Size-class free lists: can't be opened by older tdb versions. */
+#define TDB_CHAIN_FILTER 8192 /* Per-chain lookup filters: can't be opened by older tdb versions. */
+#define TDB_SNAPSHOT 16384 /* O_RDONLY point-in-time copy: no locking after open */
+#define TDB_FORK_SAFE 32768 /* forked children can use it without tdb_reopen */
+#define TDB_SHARED_STATS 65536 /* count into <name>.stats, shared by all openers */
+
+/* mmap policy for tdb_set_mmap_policy() */
+#define TDB_MMAP_RANDOM 1	/* don't read ahead */
+#define TDB_MMAP_SEQUENTIAL 2	/* read ahead aggressively */
+#define TDB_MMAP_POPULATE 4	/* prefault the map */
+#define TDB_MMAP_HUGEPAGE 8	/* use transparent huge pages */
 
 /* error codes */
 enum TDB_ERROR {TDB_SUCCESS=0, TDB_ERR_CORRUPT, TDB_ERR_IO, TDB_ERR_LOCK, 
@@ -70,6 +83,28 @@ enum TDB_ERROR {TDB_SUCCESS=0, TDB_ERR_CORRUPT, TDB_ERR_IO, TDB_ERR_LOCK,
 enum tdb_debug_level {TDB_DEBUG_FATAL = 0, TDB_DEBUG_ERROR, 
 		      TDB_DEBUG_WARNING, TDB_DEBUG_TRACE};
 
+/* Operational statistics, from tdb_get_stats().  New fields will be
+   added at the end: set .size to sizeof(struct tdb_stats) before the
+   call, and it will be overwritten with the size tdb knows about. */
+struct tdb_stats {
+	size_t size;
+	uint64_t locks;
+	uint64_t   lock_lowlevel;
+	uint64_t   lock_nonblock;
+	uint64_t     lock_nonblock_fail;
+	uint64_t   lock_wait; /* blocking locks which had to wait */
+	uint64_t allocs;
+	uint64_t   alloc_walk; /* free records examined */
+	uint64_t finds;
+	uint64_t   find_walk; /* chain records examined */
+	uint64_t expands;
+	uint64_t transactions;
+	uint64_t   transaction_cancel;
+	uint64_t   transaction_nest;
+	uint64_t   transaction_blocks; /* blocks written by commits */
+	uint64_t   transaction_bytes;
+};
+
 typedef struct TDB_DATA {
 	unsigned char *dptr;
 	size_t dsize;
@@ -94,6 +129,7 @@ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int tdb_flags,
 			 const struct tdb_logging_context *log_ctx,
 			 tdb_hash_func hash_fn);
 void tdb_set_max_dead(struct tdb_context *tdb, int max_dead);
+int tdb_set_mmap_policy(struct tdb_context *tdb, unsigned policy);
 
 int tdb_reopen(struct tdb_context *tdb);
 int tdb_reopen_all(int parent_longlived);
@@ -113,6 +149,8 @@ TDB_DATA tdb_firstkey(struct tdb_context *tdb);
 TDB_DATA tdb_nextkey(struct tdb_context *tdb, TDB_DATA key);
 int tdb_traverse(struct tdb_context *tdb, tdb_traverse_func fn, void *);
 int tdb_traverse_read(struct tdb_context *tdb, tdb_traverse_func fn, void *);
+int tdb_traverse_read_parallel(struct tdb_context *tdb, unsigned int threads,
+			       tdb_traverse_func fn, void *private_data[]);
 int tdb_exists(struct tdb_context *tdb, TDB_DATA key);
 int tdb_lockall(struct tdb_context *tdb);
 int tdb_lockall_nonblock(struct tdb_context *tdb);
@@ -135,6 +173,7 @@ int tdb_get_seqnum(struct tdb_context *tdb);
 int tdb_hash_size(struct tdb_context *tdb);
 size_t tdb_map_size(struct tdb_context *tdb);
 int tdb_get_flags(struct tdb_context *tdb);
+int tdb_get_stats(struct tdb_context *tdb, struct tdb_stats *stats);
 void tdb_add_flags(struct tdb_context *tdb, unsigned flag);
 void tdb_remove_flags(struct tdb_context *tdb, unsigned flag);
 void tdb_enable_seqnum(struct tdb_context *tdb);
@@ -158,6 +197,9 @@ void tdb_setalarm_sigptr(struct tdb_context *tdb, volatile sig_atomic_t *sigptr)
 /* wipe and repack */
 int tdb_wipe_all(struct tdb_context *tdb);
 int tdb_repack(struct tdb_context *tdb);
+int tdb_rehash(struct tdb_context *tdb, unsigned int hash_size);
+int tdb_vacuum(struct tdb_context *tdb, unsigned int max_chains,
+	       size_t *reclaimed);
 
 /* Debug functions. Not used in production. */
 void tdb_dump_all(struct tdb_context *tdb);
@@ -82,16 +82,40 @@ typedef uint32_t tdb_off_t;
 #define TDB_RECOVERY_MAGIC (0xf53bc0e7U)
 #define TDB_RECOVERY_INVALID_MAGIC (0x0)
 #define TDB_HASH_RWLOCK_MAGIC (0xbad1a51U)
+/* Older tdbs refuse this: the features are in header.feature_flags. */
+#define TDB_FEATURE_FLAG_MAGIC (0xbad1a52U)
+#define TDB_FEATURE_FREELIST_CLASSES 0x1 /* free list heads by size class */
+#define TDB_FEATURE_REHASHED 0x2 /* hash_locks stripes of hash_size chains */
+#define TDB_FEATURE_CHAIN_FILTER 0x4 /* filter words after the hash table */
+#define TDB_FEATURE_ALL (TDB_FEATURE_FREELIST_CLASSES|TDB_FEATURE_REHASHED\
+			 |TDB_FEATURE_CHAIN_FILTER)
 #define TDB_ALIGNMENT 4
 #define DEFAULT_HASH_SIZE 131
 #define FREELIST_TOP (sizeof(struct tdb_header))
+/* TDB_FREELIST_CLASSES: list heads sit below FREELIST_TOP, locked as -2-c */
+#define TDB_FREE_CLASSES 16
+#define FREE_CLASS_LIST(c) (-2 - (int)(c))
+#define FREE_CLASS_TOP(c) (FREELIST_TOP - ((c)+2)*sizeof(tdb_off_t))
 #define TDB_ALIGN(x,a) (((x) + (a)-1) & ~((a)-1))
 #define TDB_BYTEREV(x) (((((x)&0xff)<<24)|((x)&0xFF00)<<8)|(((x)>>8)&0xFF00)|((x)>>24))
 #define TDB_DEAD(r) ((r)->magic == TDB_DEAD_MAGIC)
 #define TDB_BAD_MAGIC(r) ((r)->magic != TDB_MAGIC && !TDB_DEAD(r))
 #define TDB_HASH_TOP(hash) (FREELIST_TOP + (BUCKET(hash)+1)*sizeof(tdb_off_t))
 #define TDB_HASHTABLE_SIZE(tdb) ((tdb->header.hash_size+1)*sizeof(tdb_off_t))
-#define TDB_DATA_START(hash_size) (TDB_HASH_TOP(hash_size-1) + sizeof(tdb_off_t))
+/* TDB_CHAIN_FILTER: a filter word per chain follows the hash table */
+#define TDB_FILTER_SIZE(hash_size) \
+	((tdb->header.feature_flags & TDB_FEATURE_CHAIN_FILTER) \
+	 ? (hash_size)*sizeof(uint32_t) : 0)
+#define TDB_FILTER_TOP(hash) \
+	(FREELIST_TOP + (tdb->header.hash_size+1)*sizeof(tdb_off_t) \
+	 + BUCKET(hash)*sizeof(uint32_t))
+/* Two bits per key, from hash bits BUCKET() barely uses. */
+#define TDB_FILTER_BITS(hash) \
+	((1U << (((hash) * 0x9E3779B1U) >> 27)) \
+	 | (1U << ((((hash) * 0x9E3779B1U) >> 22) & 31)))
+#define TDB_DATA_START(hash_size) \
+	(FREELIST_TOP + ((hash_size)+1)*sizeof(tdb_off_t) \
+	 + TDB_FILTER_SIZE(hash_size))
 #define TDB_RECOVERY_HEAD offsetof(struct tdb_header, recovery_start)
 #define TDB_SEQNUM_OFS    offsetof(struct tdb_header, sequence_number)
 #define TDB_PAD_BYTE 0x42
@@ -102,6 +126,16 @@ typedef uint32_t tdb_off_t;
  * argument. */
 #define TDB_LOG(x) tdb->log.log_fn x
 
+/* The TDB_SHARED_STATS page is updated by every process using the tdb. */
+#define tdb_stat_add(tdb, field, n)					\
+	do {								\
+		if ((tdb)->flags & TDB_SHARED_STATS)			\
+			__sync_fetch_and_add(&(tdb)->stats->field, (n));	\
+		else							\
+			(tdb)->stats->field += (n);			\
+	} while (0)
+#define tdb_stat_inc(tdb, field) tdb_stat_add(tdb, field, 1)
+
 #ifdef TDB_TRACE
 void tdb_trace(struct tdb_context *tdb, const char *op);
 void tdb_trace_seqnum(struct tdb_context *tdb, uint32_t seqnum, const char *op);
@@ -144,6 +178,10 @@ void tdb_trace_2rec_retrec(struct tdb_context *tdb, const char *op,
 #endif
 
 #define BUCKET(hash) ((hash) % tdb->header.hash_size)
+/* Chains are locked in stripes, one per chain the tdb was created with:
+   tdb_rehash only multiplies the chains, so a chain shares its stripe
+   with every hash in it. */
+#define BUCKET_LOCK(hash) ((hash) % tdb->hash_locks)
 
 #define DOCONV() (tdb->flags & TDB_CONVERT)
 #define CONVERT(x) (DOCONV() ? tdb_convert(&x, sizeof(x)) : &x)
@@ -181,7 +219,9 @@ struct tdb_header {
 	tdb_off_t sequence_number; /* used when TDB_SEQNUM is set */
 	uint32_t magic1_hash; /* hash of TDB_MAGIC_FOOD. */
 	uint32_t magic2_hash; /* hash of TDB_MAGIC. */
-	tdb_off_t reserved[27];
+	uint32_t hash_locks; /* chain lock stripes if rehashed, else 0 */
+	uint32_t feature_flags; /* TDB_FEATURE_*, if TDB_FEATURE_FLAG_MAGIC */
+	tdb_off_t reserved[25];
 };
 
 struct tdb_lock_type {
@@ -226,8 +266,12 @@ struct tdb_context {
 	struct tdb_lock_type allrecord_lock; /* .offset == upgradable */
 	int num_lockrecs;
 	struct tdb_lock_type *lockrecs; /* only real locks, all with count>0 */
+	unsigned int lock_generation; /* TDB_FORK_SAFE: forks before the above */
+	struct tdb_stats *stats; /* private_stats, or the TDB_SHARED_STATS page */
+	struct tdb_stats private_stats;
 	enum TDB_ERROR ecode; /* error code for last tdb error */
 	struct tdb_header header; /* a cached copy of the header */
+	uint32_t hash_locks; /* number of chain lock stripes */
 	uint32_t flags; /* the flags passed to tdb_open */
 	struct tdb_traverse_lock travlocks; /* current traversal locks */
 	struct tdb_context *next; /* all tdbs to avoid multiple opens */
@@ -240,6 +284,8 @@ struct tdb_context {
 	struct tdb_transaction *transaction;
 	int page_size;
 	int max_dead_records;
+	uint32_t vacuum_chain; /* where tdb_vacuum carries on from */
+	unsigned mmap_policy; /* TDB_MMAP_* hints */
 #ifdef TDB_TRACE
 	int tracefd;
 #endif
@@ -252,6 +298,7 @@ struct tdb_context {
 */
 int tdb_munmap(struct tdb_context *tdb);
 void tdb_mmap(struct tdb_context *tdb);
+void tdb_mmap_advise(struct tdb_context *tdb);
 int tdb_lock(struct tdb_context *tdb, int list, int ltype);
 int tdb_lock_nonblock(struct tdb_context *tdb, int list, int ltype);
 int tdb_nest_lock(struct tdb_context *tdb, uint32_t offset, int ltype,
@@ -267,8 +314,12 @@ int tdb_brunlock(struct tdb_context *tdb,
 		 int rw_type, tdb_off_t offset, size_t len);
 bool tdb_have_extra_locks(struct tdb_context *tdb);
 void tdb_release_extra_locks(struct tdb_context *tdb);
+void tdb_watch_forks(void);
+void tdb_check_fork(struct tdb_context *tdb);
+void tdb_transaction_forget(struct tdb_context *tdb);
 int tdb_transaction_lock(struct tdb_context *tdb, int ltype);
 int tdb_transaction_unlock(struct tdb_context *tdb, int ltype);
+int tdb_transaction_resize_hash(struct tdb_context *tdb);
 int tdb_allrecord_lock(struct tdb_context *tdb, int ltype,
 		       enum tdb_lock_flags flags, bool upgradable);
 int tdb_allrecord_unlock(struct tdb_context *tdb, int ltype, bool mark_lock);
@@ -279,6 +330,7 @@ int tdb_ofs_read(struct tdb_context *tdb, tdb_off_t offset, tdb_off_t *d);
 int tdb_ofs_write(struct tdb_context *tdb, tdb_off_t offset, tdb_off_t *d);
 void *tdb_convert(void *buf, uint32_t size);
 int tdb_free(struct tdb_context *tdb, tdb_off_t offset, struct tdb_record *rec);
+int tdb_free_merge(struct tdb_context *tdb, tdb_off_t offset, struct tdb_record *rec);
 tdb_off_t tdb_allocate(struct tdb_context *tdb, tdb_len_t length, struct tdb_record *rec);
 int tdb_ofs_read(struct tdb_context *tdb, tdb_off_t offset, tdb_off_t *d);
 int tdb_ofs_write(struct tdb_context *tdb, tdb_off_t offset, tdb_off_t *d);
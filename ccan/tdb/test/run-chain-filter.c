@@ -0,0 +1,129 @@
+#define _XOPEN_SOURCE 500
+#include <ccan/tdb/tdb.h>
+#include <ccan/tdb/io.c>
+#include <ccan/tdb/tdb.c>
+#include <ccan/tdb/lock.c>
+#include <ccan/tdb/freelist.c>
+#include <ccan/tdb/traverse.c>
+#include <ccan/tdb/transaction.c>
+#include <ccan/tdb/error.c>
+#include <ccan/tdb/open.c>
+#include <ccan/tdb/check.c>
+#include <ccan/tdb/hash.c>
+#include <ccan/tap/tap.h>
+#include <stdlib.h>
+#include <err.h>
+#include "logging.h"
+
+#define NUM_RECORDS 1000
+
+/* Count the chain records we'd read looking for each missing key. */
+static unsigned int miss_reads(struct tdb_context *tdb)
+{
+	unsigned int i, reads = 0;
+	uint32_t hash, filter;
+	tdb_off_t off;
+	struct tdb_record rec;
+	TDB_DATA key;
+
+	key.dptr = (void *)&i;
+	key.dsize = sizeof(i);
+	for (i = NUM_RECORDS; i < NUM_RECORDS * 2; i++) {
+		hash = tdb->hash_fn(&key);
+		if (tdb->header.feature_flags & TDB_FEATURE_CHAIN_FILTER) {
+			tdb_ofs_read(tdb, TDB_FILTER_TOP(hash), &filter);
+			if ((filter & TDB_FILTER_BITS(hash))
+			    != TDB_FILTER_BITS(hash))
+				continue;
+		}
+		tdb_ofs_read(tdb, TDB_HASH_TOP(hash), &off);
+		for (; off; off = rec.next) {
+			tdb_rec_read(tdb, off, &rec);
+			reads++;
+		}
+	}
+	return reads;
+}
+
+static bool all_there(struct tdb_context *tdb, unsigned int from)
+{
+	unsigned int i;
+	TDB_DATA key, data;
+
+	key.dptr = (void *)&i;
+	key.dsize = sizeof(i);
+	for (i = from; i < NUM_RECORDS; i++) {
+		data = tdb_fetch(tdb, key);
+		if (data.dsize != sizeof(i) || memcmp(data.dptr, &i, sizeof(i)))
+			return false;
+		free(data.dptr);
+	}
+	for (; i < NUM_RECORDS * 2; i++) {
+		if (tdb_exists(tdb, key))
+			return false;
+	}
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	struct tdb_context *tdb;
+	unsigned int i, f, filtered, unfiltered = 0;
+	TDB_DATA key;
+	int flags[] = { TDB_DEFAULT, TDB_CHAIN_FILTER,
+			TDB_CHAIN_FILTER|TDB_NOMMAP,
+			TDB_CHAIN_FILTER|TDB_CONVERT,
+			TDB_CHAIN_FILTER|TDB_INTERNAL,
+			TDB_CHAIN_FILTER|TDB_FREELIST_CLASSES };
+
+	plan_tests(sizeof(flags) / sizeof(flags[0]) * 11 + 3);
+	key.dptr = (void *)&i;
+	key.dsize = sizeof(i);
+	for (f = 0; f < sizeof(flags) / sizeof(flags[0]); f++) {
+		/* Chains of eight or so: long enough to be worth skipping. */
+		tdb = tdb_open_ex("run-chain-filter.tdb", 127, flags[f],
+				  O_CREAT|O_TRUNC|O_RDWR, 0600, &taplogctx,
+				  tdb_jenkins_hash);
+		ok1(tdb);
+		ok1(!(tdb_get_flags(tdb) & TDB_CHAIN_FILTER)
+		    == !(flags[f] & TDB_CHAIN_FILTER));
+		for (i = 0; i < NUM_RECORDS; i++)
+			if (tdb_store(tdb, key, key, TDB_INSERT) != 0)
+				break;
+		ok1(i == NUM_RECORDS);
+		ok1(all_there(tdb, 0));
+		ok1((flags[f] & TDB_INTERNAL) || tdb_check(tdb, NULL, NULL) == 0);
+
+		filtered = miss_reads(tdb);
+		if (flags[f] == TDB_DEFAULT) {
+			unfiltered = filtered;
+			ok1(unfiltered > NUM_RECORDS);
+		} else
+			ok1(filtered < unfiltered / 4);
+
+		/* Deleted keys may still pass the filter, but aren't found. */
+		for (i = 0; i < NUM_RECORDS / 2; i++)
+			if (tdb_delete(tdb, key) != 0)
+				break;
+		ok1(i == NUM_RECORDS / 2);
+		ok1(all_there(tdb, NUM_RECORDS / 2));
+
+		/* A repack rebuilds the filters, and so does a rehash. */
+		ok1((flags[f] & TDB_INTERNAL) || tdb_repack(tdb) == 0);
+		ok1((flags[f] & TDB_INTERNAL) || tdb_rehash(tdb, 254) == 0);
+		ok1(all_there(tdb, NUM_RECORDS / 2)
+		    && ((flags[f] & TDB_INTERNAL)
+			|| tdb_check(tdb, NULL, NULL) == 0));
+		tdb_close(tdb);
+	}
+
+	/* The file, not the opener, decides. */
+	tdb = tdb_open_ex("run-chain-filter.tdb", 0, TDB_DEFAULT, O_RDWR, 0,
+			  &taplogctx, tdb_jenkins_hash);
+	ok1(tdb_get_flags(tdb) & TDB_CHAIN_FILTER);
+	ok1(tdb_get_flags(tdb) & TDB_FREELIST_CLASSES);
+	ok1(all_there(tdb, NUM_RECORDS / 2));
+	tdb_close(tdb);
+
+	return exit_status();
+}
@@ -78,6 +78,8 @@ static void check_test(struct tdb_context *tdb)
 	verifiable = strlen(TDB_MAGIC_FOOD) + 1
 		+ 2 * sizeof(uint32_t) + 2 * sizeof(tdb_off_t)
 		+ 2 * sizeof(uint32_t);
+	/* The chain lock stripes (0: never rehashed), and feature flags. */
+	verifiable += 2 * sizeof(uint32_t);
 	/* From the free list chain and hash chains. */
 	verifiable += 3 * sizeof(tdb_off_t);
 	/* From the record headers & tailer */
@@ -0,0 +1,150 @@
+#define _XOPEN_SOURCE 500
+#include <ccan/tdb/tdb.h>
+#include <ccan/tdb/io.c>
+#include <ccan/tdb/tdb.c>
+#include <ccan/tdb/lock.c>
+#include <ccan/tdb/freelist.c>
+#include <ccan/tdb/traverse.c>
+#include <ccan/tdb/transaction.c>
+#include <ccan/tdb/error.c>
+#include <ccan/tdb/open.c>
+#include <ccan/tdb/check.c>
+#include <ccan/tdb/hash.c>
+#include <ccan/tap/tap.h>
+#include <stdlib.h>
+#include <err.h>
+#include <sys/wait.h>
+#include "logging.h"
+
+static TDB_DATA key, data, data2;
+
+static bool fetch_is(struct tdb_context *tdb, TDB_DATA want)
+{
+	TDB_DATA d = tdb_fetch(tdb, key);
+	bool ret;
+
+	ret = (d.dsize == want.dsize && memcmp(d.dptr, want.dptr, d.dsize) == 0);
+	free(d.dptr);
+	return ret;
+}
+
+/* Child inherits our allrecord read lock, but doesn't really hold it. */
+static int child_lockall(struct tdb_context *tdb, int to_parent, int to_child)
+{
+	char c;
+
+	/* Parent still holds it, so we can't write... */
+	if (tdb_chainlock_nonblock(tdb, key) != -1)
+		return 1;
+	/* ...but we can read. */
+	if (!fetch_is(tdb, data))
+		return 2;
+	if (write(to_parent, "x", 1) != 1 || read(to_child, &c, 1) != 1)
+		return 3;
+	/* Parent has let go now. */
+	if (tdb_store(tdb, key, data2, TDB_REPLACE) != 0)
+		return 4;
+	if (tdb_close(tdb) != 0)
+		return 5;
+	return 0;
+}
+
+/* Child inherits our uncommitted transaction. */
+static int child_transaction(struct tdb_context *tdb)
+{
+	/* It sees the committed data, not ours. */
+	if (!fetch_is(tdb, data))
+		return 1;
+	if (tdb->transaction)
+		return 2;
+	if (tdb_close(tdb) != 0)
+		return 3;
+	return 0;
+}
+
+/* Child inherits our prepared transaction: we hold everything now. */
+static int child_prepared(struct tdb_context *tdb)
+{
+	if (tdb_chainlock_nonblock(tdb, key) != -1)
+		return 1;
+	if (tdb->transaction)
+		return 2;
+	/* Closing mustn't touch the parent's recovery area. */
+	if (tdb_close(tdb) != 0)
+		return 3;
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct tdb_context *tdb;
+	int to_parent[2], to_child[2], status;
+	uint32_t magic;
+	char c;
+
+	plan_tests(19);
+	key.dsize = strlen("hi");
+	key.dptr = (void *)"hi";
+	data.dsize = strlen("world");
+	data.dptr = (void *)"world";
+	data2.dsize = strlen("there");
+	data2.dptr = (void *)"there";
+
+	tdb = tdb_open_ex("run-fork-safe.tdb", 1024,
+			  TDB_CLEAR_IF_FIRST|TDB_FORK_SAFE,
+			  O_CREAT|O_TRUNC|O_RDWR, 0600, &taplogctx, NULL);
+	ok1(tdb);
+	ok1(tdb_store(tdb, key, data, TDB_INSERT) == 0);
+
+	if (pipe(to_parent) != 0 || pipe(to_child) != 0)
+		err(1, "pipe");
+
+	ok1(tdb_lockall_read(tdb) == 0);
+	switch (fork()) {
+	case -1:
+		err(1, "fork");
+	case 0:
+		exit(child_lockall(tdb, to_parent[1], to_child[0]));
+	}
+	ok1(read(to_parent[0], &c, 1) == 1);
+	/* We still hold it. */
+	ok1(tdb->allrecord_lock.count == 1);
+	ok1(tdb_unlockall_read(tdb) == 0);
+	ok1(write(to_child[1], "x", 1) == 1);
+	wait(&status);
+	ok1(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	ok1(fetch_is(tdb, data2));
+
+	/* Put it back, then change it in a transaction. */
+	ok1(tdb_store(tdb, key, data, TDB_REPLACE) == 0);
+	ok1(tdb_transaction_start(tdb) == 0);
+	ok1(tdb_store(tdb, key, data2, TDB_REPLACE) == 0);
+	switch (fork()) {
+	case -1:
+		err(1, "fork");
+	case 0:
+		exit(child_transaction(tdb));
+	}
+	wait(&status);
+	ok1(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	ok1(tdb_transaction_prepare_commit(tdb) == 0);
+	switch (fork()) {
+	case -1:
+		err(1, "fork");
+	case 0:
+		exit(child_prepared(tdb));
+	}
+	wait(&status);
+	ok1(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	ok1(tdb->transaction->io_methods->tdb_read(tdb,
+				tdb->transaction->magic_offset, &magic,
+				sizeof(magic), DOCONV()) == 0
+	    && magic == TDB_RECOVERY_MAGIC);
+	ok1(tdb_transaction_commit(tdb) == 0);
+	ok1(fetch_is(tdb, data2));
+	ok1(tdb_check(tdb, NULL, NULL) == 0);
+	tdb_close(tdb);
+
+	return exit_status();
+}
@@ -0,0 +1,143 @@
+#define _XOPEN_SOURCE 500
+#include <ccan/tdb/tdb.h>
+#include <ccan/tdb/io.c>
+#include <ccan/tdb/tdb.c>
+#include <ccan/tdb/lock.c>
+#include <ccan/tdb/freelist.c>
+#include <ccan/tdb/freelistcheck.c>
+#include <ccan/tdb/traverse.c>
+#include <ccan/tdb/transaction.c>
+#include <ccan/tdb/error.c>
+#include <ccan/tdb/open.c>
+#include <ccan/tdb/check.c>
+#include <ccan/tdb/hash.c>
+#include <ccan/tap/tap.h>
+#include <stdlib.h>
+#include <err.h>
+#include "logging.h"
+
+/* Every record on a class list must be big enough for it, and know it.
+ * (Merging may grow it past the class, which is harmless.) */
+static bool classes_ok(struct tdb_context *tdb)
+{
+	unsigned int c;
+	tdb_off_t off;
+	struct tdb_record rec;
+
+	for (c = 0; c < TDB_FREE_CLASSES; c++) {
+		if (tdb_ofs_read(tdb, FREE_CLASS_TOP(c), &off) == -1)
+			return false;
+		while (off) {
+			if (tdb_rec_free_read(tdb, off, &rec) == -1)
+				return false;
+			if (rec.full_hash != c)
+				return false;
+			if (c != 0 && rec.rec_len < (32U << c))
+				return false;
+			off = rec.next;
+		}
+	}
+	return true;
+}
+
+static bool store_all(struct tdb_context *tdb, unsigned int step)
+{
+	unsigned int i;
+	TDB_DATA key, data;
+	char buf[5000];
+
+	memset(buf, 'x', sizeof(buf));
+	key.dptr = (void *)&i;
+	key.dsize = sizeof(i);
+	data.dptr = (void *)buf;
+	for (i = 0; i < 500; i += step) {
+		/* Sizes from a few bytes up to a few k. */
+		data.dsize = (i * 37) % sizeof(buf);
+		if (tdb_store(tdb, key, data, TDB_REPLACE) != 0)
+			return false;
+	}
+	return true;
+}
+
+static bool delete_some(struct tdb_context *tdb, unsigned int step)
+{
+	unsigned int i;
+	TDB_DATA key;
+
+	key.dptr = (void *)&i;
+	key.dsize = sizeof(i);
+	for (i = 0; i < 500; i += step) {
+		if (tdb_delete(tdb, key) != 0)
+			return false;
+	}
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	struct tdb_context *tdb;
+	unsigned int i, c;
+	int num, flags[] = { TDB_DEFAULT, TDB_NOMMAP, TDB_CONVERT,
+			     TDB_INTERNAL };
+	tdb_off_t off;
+
+	plan_tests(sizeof(flags) / sizeof(flags[0]) * 15 + 6);
+	for (i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+		tdb = tdb_open_ex("run-freelist-classes.tdb", 1024,
+				  flags[i]|TDB_FREELIST_CLASSES,
+				  O_CREAT|O_TRUNC|O_RDWR, 0600, &taplogctx,
+				  NULL);
+		ok1(tdb);
+		ok1(tdb_get_flags(tdb) & TDB_FREELIST_CLASSES);
+
+		ok1(store_all(tdb, 1));
+		ok1(delete_some(tdb, 3));
+		ok1(classes_ok(tdb));
+		/* The legacy list is never used. */
+		ok1(tdb_ofs_read(tdb, FREELIST_TOP, &off) == 0 && off == 0);
+
+		/* Refill with different sizes: holes get reused and split. */
+		ok1(store_all(tdb, 2));
+		ok1(delete_some(tdb, 4));
+		ok1(classes_ok(tdb));
+		ok1((flags[i] & TDB_INTERNAL) || tdb_check(tdb, NULL, NULL) == 0);
+		ok1(tdb_validate_freelist(tdb, &num) == 0);
+		ok1(num > 0 && num == tdb_freelist_size(tdb));
+
+		/* Wiping leaves one big free record in the top class. */
+		ok1(tdb_wipe_all(tdb) == 0);
+		ok1(tdb_freelist_size(tdb) == 1);
+		for (c = 0; c < TDB_FREE_CLASSES - 1; c++)
+			if (tdb_ofs_read(tdb, FREE_CLASS_TOP(c), &off) != 0
+			    || off != 0)
+				break;
+		ok1(c == TDB_FREE_CLASSES - 1);
+		tdb_close(tdb);
+	}
+
+	/* The file says which free list to use, not the opener. */
+	tdb = tdb_open_ex("run-freelist-classes.tdb", 1024, TDB_DEFAULT,
+			  O_RDWR, 0600, &taplogctx, NULL);
+	ok1(tdb);
+	ok1(tdb_get_flags(tdb) & TDB_FREELIST_CLASSES);
+	tdb_close(tdb);
+
+	tdb = tdb_open_ex("run-freelist-classes.tdb", 1024,
+			  TDB_FREELIST_CLASSES, O_CREAT|O_TRUNC|O_RDWR, 0600,
+			  &taplogctx, NULL);
+	ok1(tdb);
+	ok1(tdb->header.rwlocks == TDB_FEATURE_FLAG_MAGIC
+	    && tdb->header.feature_flags == TDB_FEATURE_FREELIST_CLASSES);
+	tdb_close(tdb);
+
+	tdb = tdb_open_ex("run-freelist-classes.tdb", 1024, TDB_DEFAULT,
+			  O_CREAT|O_TRUNC|O_RDWR, 0600, &taplogctx, NULL);
+	tdb_close(tdb);
+	tdb = tdb_open_ex("run-freelist-classes.tdb", 1024,
+			  TDB_FREELIST_CLASSES, O_RDWR, 0600, &taplogctx, NULL);
+	ok1(tdb);
+	ok1(!(tdb_get_flags(tdb) & TDB_FREELIST_CLASSES));
+	tdb_close(tdb);
+
+	return exit_status();
+}
@@ -48,7 +48,7 @@ int main(int argc, char *argv[])
 	TDB_DATA d, r;
 	struct tdb_logging_context log_ctx = { log_fn, &log_count };
 
-	plan_tests(38 * 2);
+	plan_tests(38 * 2 + 5);
 
 	for (flags = 0; flags <= TDB_CONVERT; flags += TDB_CONVERT) {
 		unsigned int rwmagic = TDB_HASH_RWLOCK_MAGIC;
@@ -183,5 +183,28 @@ int main(int argc, char *argv[])
 		tdb_close(tdb);
 	}
 
+	/* Features and the incompatible hash combine. */
+	tdb = tdb_open_ex("run-incompatible.tdb", 0,
+			  TDB_INCOMPATIBLE_HASH|TDB_FREELIST_CLASSES
+			  |TDB_CHAIN_FILTER,
+			  O_CREAT|O_RDWR|O_TRUNC, 0600, &log_ctx, NULL);
+	ok1(tdb);
+	ok1(tdb->header.rwlocks == TDB_FEATURE_FLAG_MAGIC
+	    && tdb->header.feature_flags == (TDB_FEATURE_FREELIST_CLASSES
+					     |TDB_FEATURE_CHAIN_FILTER));
+	tdb_close(tdb);
+	tdb = tdb_open_ex("run-incompatible.tdb", 0, 0, O_RDWR, 0,
+			  &log_ctx, NULL);
+	ok1(tdb && (tdb_get_flags(tdb) & TDB_FREELIST_CLASSES)
+	    && (tdb_get_flags(tdb) & TDB_CHAIN_FILTER));
+
+	/* We refuse features we don't know about. */
+	flags = tdb->header.feature_flags | 0x80000000;
+	ok1(tdb_ofs_write(tdb, offsetof(struct tdb_header, feature_flags),
+			  &flags) == 0);
+	tdb_close(tdb);
+	ok1(!tdb_open_ex("run-incompatible.tdb", 0, 0, O_RDWR, 0,
+			 &log_ctx, NULL) && errno == EINVAL);
+
 	return exit_status();
 }
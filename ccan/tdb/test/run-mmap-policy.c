@@ -0,0 +1,57 @@
+#define _XOPEN_SOURCE 500
+#include <ccan/tdb/tdb.h>
+#include <ccan/tdb/io.c>
+#include <ccan/tdb/tdb.c>
+#include <ccan/tdb/lock.c>
+#include <ccan/tdb/freelist.c>
+#include <ccan/tdb/traverse.c>
+#include <ccan/tdb/transaction.c>
+#include <ccan/tdb/error.c>
+#include <ccan/tdb/open.c>
+#include <ccan/tdb/check.c>
+#include <ccan/tdb/hash.c>
+#include <ccan/tap/tap.h>
+#include <stdlib.h>
+#include <err.h>
+#include "logging.h"
+
+int main(int argc, char *argv[])
+{
+	struct tdb_context *tdb;
+	unsigned int i, j;
+	TDB_DATA key, data;
+	int flags[] = { TDB_DEFAULT, TDB_NOMMAP, TDB_INTERNAL };
+
+	plan_tests(sizeof(flags) / sizeof(flags[0]) * 8);
+	key.dptr = (void *)&j;
+	key.dsize = sizeof(j);
+	for (i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+		tdb = tdb_open_ex("run-mmap-policy.tdb", 1024, flags[i],
+				  O_CREAT|O_TRUNC|O_RDWR, 0600, &taplogctx,
+				  NULL);
+		ok1(tdb);
+		ok1(tdb_set_mmap_policy(tdb, TDB_MMAP_RANDOM|TDB_MMAP_POPULATE
+					|TDB_MMAP_HUGEPAGE) == 0);
+
+		/* Growing the file remaps it: hints mustn't upset that. */
+		for (j = 0; j < 1000; j++)
+			if (tdb_store(tdb, key, key, TDB_INSERT) != 0)
+				break;
+		ok1(j == 1000);
+		j = 500;
+		data = tdb_fetch(tdb, key);
+		ok1(data.dsize == sizeof(j) && *(unsigned int *)data.dptr == j);
+		free(data.dptr);
+
+		ok1(tdb_set_mmap_policy(tdb, TDB_MMAP_SEQUENTIAL) == 0);
+		ok1(tdb_traverse(tdb, NULL, NULL) == 1000);
+
+		/* Random and sequential are contradictory. */
+		ok1(tdb_set_mmap_policy(tdb, TDB_MMAP_RANDOM
+					|TDB_MMAP_SEQUENTIAL) == -1);
+		ok1(tdb_error(tdb) == TDB_ERR_EINVAL);
+		tdb_close(tdb);
+	}
+
+	return exit_status();
+}
@@ -0,0 +1,143 @@
+#define _XOPEN_SOURCE 500
+#include <ccan/tdb/tdb.h>
+#include <ccan/tdb/io.c>
+#include <ccan/tdb/tdb.c>
+#include <ccan/tdb/lock.c>
+#include <ccan/tdb/freelist.c>
+#include <ccan/tdb/traverse.c>
+#include <ccan/tdb/transaction.c>
+#include <ccan/tdb/error.c>
+#include <ccan/tdb/open.c>
+#include <ccan/tdb/check.c>
+#include <ccan/tdb/hash.c>
+#include <ccan/tap/tap.h>
+#include <stdlib.h>
+#include <err.h>
+#include <sys/wait.h>
+#include "logging.h"
+
+#define NUM_RECORDS 1000
+
+static bool all_there(struct tdb_context *tdb, unsigned int num)
+{
+	unsigned int i;
+	TDB_DATA key, data;
+
+	key.dptr = (void *)&i;
+	key.dsize = sizeof(i);
+	for (i = 0; i < num; i++) {
+		data = tdb_fetch(tdb, key);
+		if (data.dsize != sizeof(i) || memcmp(data.dptr, &i, sizeof(i)))
+			return false;
+		free(data.dptr);
+	}
+	return tdb_traverse(tdb, NULL, NULL) == num;
+}
+
+/* Opened before the rehash, used after it. */
+static bool child_after_rehash(int flags, int to_child[2], int to_parent[2])
+{
+	struct tdb_context *tdb;
+	unsigned int i;
+	TDB_DATA key;
+	char c;
+
+	tdb = tdb_open_ex("run-rehash.tdb", 0, flags, O_RDWR, 0, &taplogctx,
+			  NULL);
+	if (!tdb || write(to_parent[1], "1", 1) != 1)
+		return false;
+	if (read(to_child[0], &c, 1) != 1)
+		return false;
+
+	if (!all_there(tdb, NUM_RECORDS))
+		return false;
+	if (tdb_hash_size(tdb) != 70)
+		return false;
+	key.dptr = (void *)&i;
+	key.dsize = sizeof(i);
+	for (i = NUM_RECORDS; i < NUM_RECORDS * 2; i++)
+		if (tdb_store(tdb, key, key, TDB_INSERT) != 0)
+			return false;
+	return tdb_close(tdb) == 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct tdb_context *tdb;
+	unsigned int i, f;
+	TDB_DATA key;
+	int flags[] = { TDB_DEFAULT, TDB_NOMMAP, TDB_CONVERT,
+			TDB_FREELIST_CLASSES,
+			TDB_FREELIST_CLASSES|TDB_CHAIN_FILTER|TDB_CONVERT };
+	int to_child[2], to_parent[2], status;
+	pid_t child;
+	char c;
+
+	plan_tests(sizeof(flags) / sizeof(flags[0]) * 19);
+	key.dptr = (void *)&i;
+	key.dsize = sizeof(i);
+	for (f = 0; f < sizeof(flags) / sizeof(flags[0]); f++) {
+		tdb = tdb_open_ex("run-rehash.tdb", 7, flags[f],
+				  O_CREAT|O_TRUNC|O_RDWR, 0600, &taplogctx,
+				  NULL);
+		ok1(tdb);
+		for (i = 0; i < NUM_RECORDS; i++)
+			if (tdb_store(tdb, key, key, TDB_INSERT) != 0)
+				break;
+		ok1(i == NUM_RECORDS);
+
+		/* Must be a multiple of the original size. */
+		ok1(tdb_rehash(tdb, 50) == -1);
+		ok1(tdb_error(tdb) == TDB_ERR_EINVAL);
+		ok1(tdb_hash_size(tdb) == 7);
+
+		tdb_close(tdb);
+
+		/* Child must open first: it can't open it twice. */
+		if (pipe(to_child) != 0 || pipe(to_parent) != 0)
+			err(1, "pipe");
+		fflush(stdout);
+		child = fork();
+		if (child == 0)
+			exit(child_after_rehash(flags[f], to_child, to_parent)
+			     ? 0 : 1);
+		ok1(read(to_parent[0], &c, 1) == 1);
+		tdb = tdb_open_ex("run-rehash.tdb", 0, flags[f], O_RDWR, 0,
+				  &taplogctx, NULL);
+
+		ok1(tdb_rehash(tdb, 70) == 0);
+		ok1(tdb_hash_size(tdb) == 70);
+		ok1(all_there(tdb, NUM_RECORDS));
+		ok1(tdb_check(tdb, NULL, NULL) == 0);
+
+		/* Now let the child, with its stale view, at it. */
+		ok1(write(to_child[1], "1", 1) == 1);
+		ok1(waitpid(child, &status, 0) == child
+		    && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+		ok1(all_there(tdb, NUM_RECORDS * 2));
+		ok1(tdb_check(tdb, NULL, NULL) == 0);
+		tdb_close(tdb);
+		close(to_child[0]);
+		close(to_child[1]);
+		close(to_parent[0]);
+		close(to_parent[1]);
+
+		/* It's marked so older tdbs won't open it. */
+		tdb = tdb_open_ex("run-rehash.tdb", 0, TDB_DEFAULT, O_RDWR, 0,
+				  &taplogctx, NULL);
+		ok1(tdb && tdb_hash_size(tdb) == 70 && tdb->hash_locks == 7);
+		ok1(tdb->header.rwlocks == TDB_FEATURE_FLAG_MAGIC);
+		ok1(tdb->header.feature_flags == (TDB_FEATURE_REHASHED
+			| ((flags[f] & TDB_FREELIST_CLASSES)
+			   ? TDB_FEATURE_FREELIST_CLASSES : 0)
+			| ((flags[f] & TDB_CHAIN_FILTER)
+			   ? TDB_FEATURE_CHAIN_FILTER : 0)));
+		/* The features it had still apply. */
+		ok1((tdb_get_flags(tdb) & (TDB_FREELIST_CLASSES|TDB_CHAIN_FILTER))
+		    == (flags[f] & (TDB_FREELIST_CLASSES|TDB_CHAIN_FILTER)));
+		ok1(tdb_check(tdb, NULL, NULL) == 0);
+		tdb_close(tdb);
+	}
+
+	return exit_status();
+}
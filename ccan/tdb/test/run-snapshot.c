@@ -0,0 +1,139 @@
+#define _XOPEN_SOURCE 500
+#include <ccan/tdb/tdb.h>
+#include <ccan/tdb/io.c>
+#include <ccan/tdb/tdb.c>
+#include <ccan/tdb/lock.c>
+#include <ccan/tdb/freelist.c>
+#include <ccan/tdb/traverse.c>
+#include <ccan/tdb/transaction.c>
+#include <ccan/tdb/error.c>
+#include <ccan/tdb/open.c>
+#include <ccan/tdb/check.c>
+#include <ccan/tdb/hash.c>
+#include <ccan/tap/tap.h>
+#include <stdlib.h>
+#include <err.h>
+#include <sys/wait.h>
+#include "logging.h"
+
+#define NUM_RECORDS 500
+
+/* Every key i < num maps to i + add. */
+static bool all_there(struct tdb_context *tdb, unsigned int num,
+		      unsigned int add)
+{
+	unsigned int i, val;
+	TDB_DATA key, data;
+
+	key.dptr = (void *)&i;
+	key.dsize = sizeof(i);
+	for (i = 0; i < num; i++) {
+		data = tdb_fetch(tdb, key);
+		val = i + add;
+		if (data.dsize != sizeof(val)
+		    || memcmp(data.dptr, &val, sizeof(val)))
+			return false;
+		free(data.dptr);
+	}
+	return tdb_traverse_read(tdb, NULL, NULL) == num;
+}
+
+static bool store_all(struct tdb_context *tdb, unsigned int start,
+		      unsigned int num, unsigned int add)
+{
+	unsigned int i, val;
+	TDB_DATA key, data;
+
+	key.dptr = (void *)&i;
+	key.dsize = sizeof(i);
+	data.dptr = (void *)&val;
+	data.dsize = sizeof(val);
+	for (i = start; i < start + num; i++) {
+		val = i + add;
+		if (tdb_store(tdb, key, data, TDB_REPLACE) != 0)
+			return false;
+	}
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int i;
+	struct tdb_context *tdb, *snap;
+	int flags[] = { TDB_DEFAULT, TDB_NOMMAP, TDB_CONVERT };
+	int to_parent[2], status;
+	TDB_DATA key;
+	char c;
+
+	plan_tests(sizeof(flags) / sizeof(flags[0]) * 13 + 4);
+	for (i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+		tdb = tdb_open_ex("run-snapshot.tdb", 7, flags[i],
+				  O_CREAT|O_TRUNC|O_RDWR, 0600, &taplogctx,
+				  NULL);
+		ok1(tdb);
+		ok1(store_all(tdb, 0, NUM_RECORDS, 0));
+		tdb_close(tdb);
+
+		snap = tdb_open_ex("run-snapshot.tdb", 0, flags[i]|TDB_SNAPSHOT,
+				   O_RDONLY, 0, &taplogctx, NULL);
+		ok1(snap);
+		ok1(tdb_get_flags(snap) & TDB_SNAPSHOT);
+
+		/* The live database can be opened alongside it. */
+		tdb = tdb_open_ex("run-snapshot.tdb", 0, flags[i], O_RDWR, 0,
+				  &taplogctx, NULL);
+		ok1(tdb);
+
+		/* Change everything, grow the file, and rehash it. */
+		ok1(store_all(tdb, 0, NUM_RECORDS, 1));
+		ok1(store_all(tdb, NUM_RECORDS, NUM_RECORDS, 1));
+		ok1(tdb_rehash(tdb, 70) == 0);
+		ok1(all_there(tdb, NUM_RECORDS * 2, 1));
+
+		/* The snapshot saw none of it. */
+		ok1(all_there(snap, NUM_RECORDS, 0));
+		key.dptr = (void *)&i;
+		key.dsize = sizeof(i);
+		ok1(tdb_store(snap, key, key, TDB_REPLACE) == -1);
+		ok1(tdb_error(snap) == TDB_ERR_RDONLY);
+		ok1(all_there(snap, NUM_RECORDS, 0));
+		tdb_close(snap);
+		tdb_close(tdb);
+	}
+
+	/* Snapshots are read-only. */
+	snap = tdb_open_ex("run-snapshot.tdb", 0, TDB_SNAPSHOT, O_RDWR, 0,
+			   &taplogctx, NULL);
+	ok1(!snap && errno == EINVAL);
+
+	/* Taking one waits for writers. */
+	if (pipe(to_parent) != 0)
+		err(1, "pipe");
+	switch (fork()) {
+	case -1:
+		err(1, "fork");
+	case 0:
+		tdb = tdb_open_ex("run-snapshot.tdb", 0, TDB_DEFAULT, O_RDWR,
+				  0, &taplogctx, NULL);
+		if (!tdb || tdb_lockall(tdb) != 0)
+			exit(1);
+		if (write(to_parent[1], "x", 1) != 1)
+			exit(1);
+		sleep(1);
+		/* Parent is waiting for us now. */
+		if (!store_all(tdb, 0, NUM_RECORDS * 2, 2))
+			exit(1);
+		tdb_unlockall(tdb);
+		tdb_close(tdb);
+		exit(0);
+	}
+	ok1(read(to_parent[0], &c, 1) == 1);
+	snap = tdb_open_ex("run-snapshot.tdb", 0, TDB_SNAPSHOT, O_RDONLY, 0,
+			   &taplogctx, NULL);
+	ok1(snap && all_there(snap, NUM_RECORDS * 2, 2));
+	wait(&status);
+	ok1(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	tdb_close(snap);
+
+	return exit_status();
+}
@@ -0,0 +1,121 @@
+#define _XOPEN_SOURCE 500
+#include <ccan/tdb/tdb.h>
+#include <ccan/tdb/io.c>
+#include <ccan/tdb/tdb.c>
+#include <ccan/tdb/lock.c>
+#include <ccan/tdb/freelist.c>
+#include <ccan/tdb/traverse.c>
+#include <ccan/tdb/transaction.c>
+#include <ccan/tdb/error.c>
+#include <ccan/tdb/open.c>
+#include <ccan/tdb/check.c>
+#include <ccan/tdb/hash.c>
+#include <ccan/tap/tap.h>
+#include <stdlib.h>
+#include <err.h>
+#include <sys/wait.h>
+#include "logging.h"
+
+#define NUM_RECORDS 100
+
+static bool store_all(struct tdb_context *tdb, unsigned int start,
+		      unsigned int num)
+{
+	unsigned int i;
+	TDB_DATA key;
+
+	key.dptr = (void *)&i;
+	key.dsize = sizeof(i);
+	for (i = start; i < start + num; i++) {
+		if (tdb_store(tdb, key, key, TDB_REPLACE) != 0)
+			return false;
+	}
+	return true;
+}
+
+static struct tdb_stats get_stats(struct tdb_context *tdb)
+{
+	struct tdb_stats stats;
+
+	stats.size = sizeof(stats);
+	tdb_get_stats(tdb, &stats);
+	return stats;
+}
+
+int main(int argc, char *argv[])
+{
+	struct tdb_context *tdb;
+	struct tdb_stats stats, before;
+	unsigned int i = 0;
+	TDB_DATA key;
+	int status;
+
+	plan_tests(23);
+	key.dptr = (void *)&i;
+	key.dsize = sizeof(i);
+
+	tdb = tdb_open_ex("run-stats.tdb", 1024, TDB_ALLOW_NESTING,
+			  O_CREAT|O_TRUNC|O_RDWR, 0600, &taplogctx, NULL);
+	ok1(tdb);
+	before = get_stats(tdb);
+	ok1(store_all(tdb, 0, NUM_RECORDS));
+	free(tdb_fetch(tdb, key).dptr);
+	stats = get_stats(tdb);
+	ok1(stats.size == sizeof(stats));
+	ok1(stats.allocs == before.allocs + NUM_RECORDS);
+	ok1(stats.alloc_walk >= stats.allocs);
+	ok1(stats.finds > before.finds + NUM_RECORDS);
+	ok1(stats.find_walk > before.find_walk);
+	ok1(stats.locks > before.locks + NUM_RECORDS);
+	ok1(stats.lock_lowlevel > before.lock_lowlevel);
+
+	ok1(tdb_transaction_start(tdb) == 0);
+	ok1(tdb_transaction_start(tdb) == 0);
+	ok1(store_all(tdb, NUM_RECORDS, NUM_RECORDS));
+	ok1(tdb_transaction_commit(tdb) == 0);
+	ok1(tdb_transaction_commit(tdb) == 0);
+	ok1(tdb_transaction_start(tdb) == 0);
+	ok1(tdb_transaction_cancel(tdb) == 0);
+	stats = get_stats(tdb);
+	ok1(stats.transactions == 2 && stats.transaction_nest == 1
+	    && stats.transaction_cancel == 1);
+	ok1(stats.transaction_blocks > 0
+	    && stats.transaction_bytes >= stats.transaction_blocks);
+
+	/* Older callers get only what they know about. */
+	stats.size = offsetof(struct tdb_stats, lock_lowlevel);
+	stats.lock_lowlevel = 0;
+	ok1(tdb_get_stats(tdb, &stats) == 0
+	    && stats.size == offsetof(struct tdb_stats, lock_lowlevel)
+	    && stats.lock_lowlevel == 0);
+	tdb_close(tdb);
+
+	/* Now share them with a child, who has to wait for us. */
+	unlink("run-stats.tdb.stats");
+	tdb = tdb_open_ex("run-stats.tdb", 1024,
+			  TDB_SHARED_STATS|TDB_FORK_SAFE,
+			  O_CREAT|O_TRUNC|O_RDWR, 0600, &taplogctx, NULL);
+	ok1(tdb && (tdb_get_flags(tdb) & TDB_SHARED_STATS));
+	before = get_stats(tdb);
+	ok1(tdb_chainlock(tdb, key) == 0);
+	switch (fork()) {
+	case -1:
+		err(1, "fork");
+	case 0:
+		exit(store_all(tdb, 0, NUM_RECORDS) ? 0 : 1);
+	}
+	while (get_stats(tdb).lock_wait == before.lock_wait)
+		usleep(1000);
+	tdb_chainunlock(tdb, key);
+	wait(&status);
+	ok1(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	tdb_close(tdb);
+
+	/* And they're still there for the next opener. */
+	tdb = tdb_open_ex("run-stats.tdb", 0, TDB_SHARED_STATS, O_RDWR, 0,
+			  &taplogctx, NULL);
+	ok1(get_stats(tdb).allocs >= before.allocs + NUM_RECORDS);
+	tdb_close(tdb);
+
+	return exit_status();
+}
@@ -0,0 +1,127 @@
+/* No _XOPEN_SOURCE here: we want pwritev() for the commit. */
+#include <ccan/tdb/tdb.h>
+#include <ccan/tdb/io.c>
+#include <ccan/tdb/tdb.c>
+#include <ccan/tdb/lock.c>
+#include <ccan/tdb/freelist.c>
+#include <ccan/tdb/traverse.c>
+#include <ccan/tdb/transaction.c>
+#include <ccan/tdb/error.c>
+#include <ccan/tdb/open.c>
+#include <ccan/tdb/check.c>
+#include <ccan/tdb/hash.c>
+#include <ccan/tap/tap.h>
+#include <stdlib.h>
+#include <err.h>
+#include <sys/wait.h>
+#include "logging.h"
+
+#define NUM_RECORDS 2000
+
+/* Every key i < num maps to i + add. */
+static bool all_there(struct tdb_context *tdb, unsigned int num,
+		      unsigned int add)
+{
+	unsigned int i, val;
+	TDB_DATA key, data;
+
+	key.dptr = (void *)&i;
+	key.dsize = sizeof(i);
+	for (i = 0; i < num; i++) {
+		data = tdb_fetch(tdb, key);
+		val = i + add;
+		if (data.dsize != sizeof(val)
+		    || memcmp(data.dptr, &val, sizeof(val)))
+			return false;
+		free(data.dptr);
+	}
+	return tdb_traverse_read(tdb, NULL, NULL) == num;
+}
+
+static bool store_all(struct tdb_context *tdb, unsigned int start,
+		      unsigned int num, unsigned int add)
+{
+	unsigned int i, val;
+	TDB_DATA key, data;
+
+	key.dptr = (void *)&i;
+	key.dsize = sizeof(i);
+	data.dptr = (void *)&val;
+	data.dsize = sizeof(val);
+	for (i = start; i < start + num; i++) {
+		val = i + add;
+		if (tdb_store(tdb, key, data, TDB_REPLACE) != 0)
+			return false;
+	}
+	return true;
+}
+
+/* Prepare, write out every block as commit would, then "crash". */
+static void die_during_commit(int tdb_flags)
+{
+	struct tdb_context *tdb;
+	uint32_t i, n, runs = 0;
+	tdb_len_t length;
+
+	tdb = tdb_open_ex("run-transaction-runs.tdb", 0, tdb_flags, O_RDWR,
+			  0, &taplogctx, NULL);
+	if (!tdb || tdb_transaction_start(tdb) != 0)
+		exit(1);
+	if (!store_all(tdb, 0, NUM_RECORDS * 2, 1))
+		exit(1);
+	if (tdb_transaction_prepare_commit(tdb) != 0)
+		exit(1);
+	for (i = 0; i < tdb->transaction->num_blocks; i += n ? n : 1) {
+		n = transaction_run(tdb, i, (tdb_off_t)-1, &length);
+		if (n && transaction_write_run(tdb, tdb->transaction->io_methods,
+					       i, n) != 0)
+			exit(1);
+		runs += (n != 0);
+	}
+	/* We want to have written some multi-block runs. */
+	exit(runs < tdb->transaction->num_blocks ? 0 : 2);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int i;
+	struct tdb_context *tdb;
+	int flags[] = { TDB_DEFAULT, TDB_NOMMAP, TDB_NOMMAP|TDB_CONVERT };
+	int status;
+
+	plan_tests(sizeof(flags) / sizeof(flags[0]) * 10);
+	for (i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+		tdb = tdb_open_ex("run-transaction-runs.tdb", 1009, flags[i],
+				  O_CREAT|O_TRUNC|O_RDWR, 0600, &taplogctx,
+				  NULL);
+		ok1(tdb);
+		ok1(tdb_transaction_start(tdb) == 0);
+		ok1(store_all(tdb, 0, NUM_RECORDS, 0));
+		ok1(tdb_transaction_commit(tdb) == 0);
+		tdb_close(tdb);
+
+		switch (fork()) {
+		case -1:
+			err(1, "fork");
+		case 0:
+			die_during_commit(flags[i]);
+		}
+		wait(&status);
+		ok1(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+		/* Opening runs recovery, which must undo all of it. */
+		tdb = tdb_open_ex("run-transaction-runs.tdb", 0, flags[i],
+				  O_RDWR, 0, &taplogctx, NULL);
+		ok1(all_there(tdb, NUM_RECORDS, 0));
+		ok1(tdb_check(tdb, NULL, NULL) == 0);
+
+		/* Now do it for real. */
+		ok1(tdb_transaction_start(tdb) == 0
+		    && store_all(tdb, 0, NUM_RECORDS * 2, 1)
+		    && tdb_transaction_commit(tdb) == 0);
+		ok1(all_there(tdb, NUM_RECORDS * 2, 1));
+		ok1(tdb_check(tdb, NULL, NULL) == 0);
+		tdb_close(tdb);
+	}
+	return exit_status();
+}
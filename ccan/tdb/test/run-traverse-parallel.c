@@ -0,0 +1,136 @@
+#define _XOPEN_SOURCE 500
+#include <ccan/tdb/tdb.h>
+#include <ccan/tdb/io.c>
+#include <ccan/tdb/tdb.c>
+#include <ccan/tdb/lock.c>
+#include <ccan/tdb/freelist.c>
+#include <ccan/tdb/traverse.c>
+#include <ccan/tdb/transaction.c>
+#include <ccan/tdb/error.c>
+#include <ccan/tdb/open.c>
+#include <ccan/tdb/check.c>
+#include <ccan/tdb/hash.c>
+#include <ccan/tap/tap.h>
+#include <stdlib.h>
+#include <err.h>
+#include "logging.h"
+
+#define NUM_RECORDS 1000
+#define NUM_THREADS 4
+
+struct seen {
+	unsigned int count, bad, fetches;
+	bool found[NUM_RECORDS];
+	bool stop, write;
+};
+
+static int count_record(struct tdb_context *tdb, TDB_DATA key, TDB_DATA data,
+			void *p)
+{
+	struct seen *seen = p;
+	unsigned int i;
+	TDB_DATA d, missing = { (unsigned char *)&i, sizeof(i) };
+
+	memcpy(&i, key.dptr, sizeof(i));
+	if (key.dsize != sizeof(i) || i >= NUM_RECORDS || seen->found[i]
+	    || data.dsize != sizeof(i) || memcmp(data.dptr, &i, sizeof(i)))
+		seen->bad++;
+	else
+		seen->found[i] = true;
+	seen->count++;
+
+	/* We can look things up, but not change them.  Each thread has its
+	   own error code, whatever the others are doing. */
+	d = tdb_fetch(tdb, key);
+	if (d.dsize != sizeof(i))
+		seen->bad++;
+	free(d.dptr);
+	i += NUM_RECORDS;
+	d = tdb_fetch(tdb, missing);
+	if (d.dptr || tdb_error(tdb) != TDB_ERR_NOEXIST)
+		seen->bad++;
+	seen->fetches += 2;
+	if (seen->write && (tdb_store(tdb, key, data, TDB_REPLACE) == 0
+			    || tdb_error(tdb) != TDB_ERR_RDONLY))
+		seen->bad++;
+
+	return seen->stop;
+}
+
+int main(int argc, char *argv[])
+{
+	struct tdb_context *tdb;
+	struct seen seen[NUM_THREADS];
+	void *priv[NUM_THREADS];
+	struct tdb_stats before, after;
+	unsigned int i, t, f, total, bad, fetches;
+	TDB_DATA key;
+	int flags[] = { TDB_DEFAULT, TDB_NOMMAP, TDB_INTERNAL, TDB_CONVERT,
+			TDB_FORK_SAFE };
+
+	plan_tests(sizeof(flags) / sizeof(flags[0]) * 12);
+	key.dptr = (void *)&i;
+	key.dsize = sizeof(i);
+	for (t = 0; t < NUM_THREADS; t++)
+		priv[t] = &seen[t];
+
+	for (f = 0; f < sizeof(flags) / sizeof(flags[0]); f++) {
+		tdb = tdb_open_ex("run-traverse-parallel.tdb", 1024, flags[f],
+				  O_CREAT|O_TRUNC|O_RDWR, 0600, &taplogctx,
+				  NULL);
+		ok1(tdb);
+		for (i = 0; i < NUM_RECORDS; i++)
+			if (tdb_store(tdb, key, key, TDB_INSERT) != 0)
+				break;
+		ok1(i == NUM_RECORDS);
+		/* Deleted records are skipped. */
+		tdb->max_dead_records = 10;
+		i = 0;
+		ok1(tdb_delete(tdb, key) == 0);
+
+		memset(seen, 0, sizeof(seen));
+		seen[0].write = true;
+		tdb->ecode = TDB_SUCCESS;
+		before.size = after.size = sizeof(before);
+		tdb_get_stats(tdb, &before);
+		ok1(tdb_traverse_read_parallel(tdb, NUM_THREADS, count_record,
+					       priv) == NUM_RECORDS - 1);
+		for (t = total = bad = fetches = 0; t < NUM_THREADS; t++) {
+			total += seen[t].count;
+			bad += seen[t].bad;
+			fetches += seen[t].fetches;
+		}
+		ok1(total == NUM_RECORDS - 1);
+		ok1(bad == 0);
+		/* Their errors stayed theirs, but we count their work. */
+		ok1(tdb_error(tdb) == TDB_SUCCESS);
+		tdb_get_stats(tdb, &after);
+		ok1(after.finds - before.finds == fetches);
+		for (i = 1; i < NUM_RECORDS; i++) {
+			for (t = 0; t < NUM_THREADS; t++)
+				if (seen[t].found[i])
+					break;
+			if (t == NUM_THREADS)
+				break;
+		}
+		ok1(i == NUM_RECORDS);
+		/* Every thread got some work. */
+		for (t = 0; t < NUM_THREADS; t++)
+			if (seen[t].count == 0)
+				break;
+		ok1(t == NUM_THREADS);
+
+		/* One stopping stops them all. */
+		memset(seen, 0, sizeof(seen));
+		seen[1].stop = true;
+		ok1(tdb_traverse_read_parallel(tdb, NUM_THREADS, count_record,
+					       priv) < NUM_RECORDS - 1);
+
+		/* We left it unlocked. */
+		i = 0;
+		ok1(tdb_store(tdb, key, key, TDB_INSERT) == 0);
+		tdb_close(tdb);
+	}
+
+	return exit_status();
+}
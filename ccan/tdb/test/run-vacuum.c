@@ -0,0 +1,127 @@
+#define _XOPEN_SOURCE 500
+#include <ccan/tdb/tdb.h>
+#include <ccan/tdb/io.c>
+#include <ccan/tdb/tdb.c>
+#include <ccan/tdb/lock.c>
+#include <ccan/tdb/freelist.c>
+#include <ccan/tdb/traverse.c>
+#include <ccan/tdb/transaction.c>
+#include <ccan/tdb/error.c>
+#include <ccan/tdb/open.c>
+#include <ccan/tdb/check.c>
+#include <ccan/tdb/hash.c>
+#include <ccan/tap/tap.h>
+#include <stdlib.h>
+#include <err.h>
+#include "logging.h"
+
+#define NUM_RECORDS 200
+#define HASH_SIZE 16
+
+static unsigned int dead_records(struct tdb_context *tdb)
+{
+	unsigned int h, dead = 0;
+
+	for (h = 0; h < tdb->header.hash_size; h++)
+		dead += tdb_count_dead(tdb, h);
+	return dead;
+}
+
+static size_t vacuum_all(struct tdb_context *tdb, unsigned int chains)
+{
+	size_t total = 0, reclaimed;
+	int ret;
+
+	do {
+		ret = tdb_vacuum(tdb, chains, &reclaimed);
+		total += reclaimed;
+	} while (ret == 0);
+	return ret == 1 ? total : (size_t)-1;
+}
+
+static int delete_current(struct tdb_context *tdb, TDB_DATA key, TDB_DATA data,
+			  void *p)
+{
+	size_t *reclaimed = p;
+
+	/* We're on this one, so it stays dead however hard we vacuum. */
+	if (tdb_delete(tdb, key) != 0)
+		return -1;
+	*reclaimed = vacuum_all(tdb, HASH_SIZE);
+	return 1;
+}
+
+int main(int argc, char *argv[])
+{
+	struct tdb_context *tdb;
+	unsigned int i, f;
+	size_t expect, reclaimed;
+	TDB_DATA key, data;
+	char buf[100];
+	int flags[] = { TDB_DEFAULT, TDB_NOMMAP, TDB_CONVERT, TDB_INTERNAL,
+			TDB_FREELIST_CLASSES };
+
+	plan_tests(sizeof(flags) / sizeof(flags[0]) * 16);
+	key.dptr = (void *)&i;
+	key.dsize = sizeof(i);
+	data.dptr = (void *)buf;
+	memset(buf, 'x', sizeof(buf));
+	for (f = 0; f < sizeof(flags) / sizeof(flags[0]); f++) {
+		tdb = tdb_open_ex("run-vacuum.tdb", HASH_SIZE, flags[f],
+				  O_CREAT|O_TRUNC|O_RDWR, 0600, &taplogctx,
+				  NULL);
+		ok1(tdb);
+		tdb_set_max_dead(tdb, NUM_RECORDS);
+		for (i = 0; i < NUM_RECORDS; i++) {
+			data.dsize = i % sizeof(buf);
+			if (tdb_store(tdb, key, data, TDB_INSERT) != 0)
+				break;
+		}
+		ok1(i == NUM_RECORDS);
+
+		/* Deleting every other one leaves them dead in the chains. */
+		expect = 0;
+		for (i = 0; i < NUM_RECORDS; i += 2) {
+			struct tdb_record rec;
+			if (!tdb_find_lock_hash(tdb, key, tdb->hash_fn(&key),
+						F_RDLCK, &rec))
+				break;
+			tdb_unlock(tdb, BUCKET_LOCK(rec.full_hash), F_RDLCK);
+			expect += sizeof(rec) + rec.rec_len;
+			if (tdb_delete(tdb, key) != 0)
+				break;
+		}
+		ok1(i == NUM_RECORDS);
+		ok1(dead_records(tdb) == NUM_RECORDS / 2);
+
+		/* A few chains at a time gets them all back. */
+		ok1(tdb_vacuum(tdb, 3, &reclaimed) == 0);
+		ok1(reclaimed > 0 && reclaimed < expect);
+		ok1(vacuum_all(tdb, 3) + reclaimed == expect);
+		ok1(dead_records(tdb) == 0);
+		ok1((flags[f] & TDB_INTERNAL) || tdb_check(tdb, NULL, NULL) == 0);
+
+		/* Nothing left to do. */
+		ok1(vacuum_all(tdb, HASH_SIZE * 2) == 0);
+		for (i = 1; i < NUM_RECORDS; i += 2)
+			if (!tdb_exists(tdb, key))
+				break;
+		ok1(i == NUM_RECORDS + 1);
+
+		/* A record being traversed can't be reclaimed. */
+		reclaimed = -1;
+		ok1(tdb_traverse(tdb, delete_current, &reclaimed) == 1);
+		ok1(reclaimed == 0 && dead_records(tdb) == 1);
+
+		/* Emptied, it all coalesces into one free record, whichever
+		 * order the chains free their records in. */
+		for (i = 1; i < NUM_RECORDS; i += 2)
+			tdb_delete(tdb, key);
+		ok1(dead_records(tdb) == NUM_RECORDS / 2);
+		ok1(vacuum_all(tdb, 5) > 0 && dead_records(tdb) == 0);
+		ok1(tdb_freelist_size(tdb) == 1);
+		tdb_close(tdb);
+	}
+
+	return exit_status();
+}
@@ -5,6 +5,7 @@
 #include <ccan/str_talloc/str_talloc.h>
 #include <ccan/str/str.h>
 #include <ccan/list/list.h>
+#include <ccan/tally/tally.h>
 #include <err.h>
 #include <ctype.h>
 #include <string.h>
@@ -12,6 +13,9 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <time.h>
 #include <errno.h>
 #include <signal.h>
 #include <assert.h>
@@ -22,6 +26,13 @@
 
 static bool quiet = false;
 
+/* key=value lines instead of human-readable output. */
+static bool machine = false;
+
+/* Per-op latency in nsec, indexed by [file][op_num]: shared with children. */
+static uint64_t **latency;
+#define LATENCY_NONE ((uint64_t)-1)
+
 /* Avoid mod by zero */
 static unsigned int total_keys = 1;
 
@@ -588,6 +599,14 @@ static int get_len(TDB_DATA key, TDB_DATA data, void *private_data)
 	return data.dsize;
 }
 
+static uint64_t now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 static unsigned run_ops(struct tdb_context *tdb,
 			int pre_fd,
 			char *filename[],
@@ -686,8 +705,9 @@ unsigned run_ops(struct tdb_context *tdb,
 		 unsigned int start, unsigned int stop,
 		 bool backoff)
 {
-	unsigned int i;
+	unsigned int i, op_num;
 	struct sigaction sa;
+	uint64_t start_nsec;
 
 	sa.sa_handler = break_out;
 	sa.sa_flags = 0;
@@ -697,6 +717,11 @@ unsigned run_ops(struct tdb_context *tdb,
 		if (!do_pre(tdb, filename, op, file, pre_fd, i, backoff))
 			return i;
 
+		/* Time from here: waiting for other files isn't the op's
+		 * fault.  A traverse is charged as a whole, including the ops
+		 * (and waits) inside it. */
+		op_num = i;
+		start_nsec = now_nsec();
 		switch (op[file][i].type) {
 		case OP_TDB_LOCKALL:
 			try(tdb_lockall(tdb), op[file][i].ret);
@@ -833,6 +858,7 @@ unsigned run_ops(struct tdb_context *tdb,
 			 * may become unnecessary in future. */
 			break;
 		}
+		latency[file][op_num] = now_nsec() - start_nsec;
 		do_post(filename, op, file, i);
 	}
 	return i;
@@ -1353,9 +1379,11 @@ static const TDB_DATA *preexisting_data(char *filename[], struct op *op[],
 	return &tdb_null;
 }
 
-static void sort_ops(struct tdb_context *tdb,
+/* If partial, some tracefiles are missing, so we may not be able to
+ * make sense of them: return false rather than failing. */
+static bool sort_ops(struct tdb_context *tdb,
 		     struct keyinfo hash[], char *filename[], struct op *op[],
-		     unsigned int num)
+		     unsigned int num, bool partial)
 {
 	unsigned int h;
 
@@ -1399,13 +1427,17 @@ static void sort_ops(struct tdb_context *tdb,
 						user, hash[h].num_users);
 			/* Give the first op what it wants: does that help? */
 			if (!figure_deps(filename, op, &hash[h].key, data, user,
-					 hash[h].num_users, num))
+					 hash[h].num_users, num)) {
+				if (partial)
+					return false;
 				fail(filename[user[0].file], user[0].op_num+1,
 				     "Could not resolve inter-dependencies");
+			}
 			if (tdb_store(tdb, hash[h].key, *data, TDB_INSERT) != 0)
 				errx(1, "Could not store initial value");
 		}
 	}
+	return true;
 }
 
 static int destroy_depend(struct depend *dep)
@@ -1701,10 +1733,10 @@ static bool handle_backoff(struct op *op[], int fd)
 }
 #endif
 
-static void derive_dependencies(struct tdb_context *tdb,
+static bool derive_dependencies(struct tdb_context *tdb,
 				char *filename[],
 				struct op *op[], unsigned int num_ops[],
-				unsigned int num)
+				unsigned int num, bool partial)
 {
 	struct keyinfo *hash;
 	unsigned int h, i;
@@ -1713,7 +1745,8 @@ static void derive_dependencies(struct tdb_context *tdb,
 	hash = hash_ops(op, num_ops, num);
 
 	/* Sort them by sequence number. */
-	sort_ops(tdb, hash, filename, op, num);
+	if (!sort_ops(tdb, hash, filename, op, num, partial))
+		return false;
 
 	/* Create dependencies back to the last change, rather than
 	 * creating false dependencies by naively making each one
@@ -1747,6 +1780,7 @@ static void derive_dependencies(struct tdb_context *tdb,
 #endif
 
 	optimize_dependencies(op, num_ops, num);
+	return true;
 }
 
 static struct timeval run_test(char *argv[],
@@ -1755,13 +1789,16 @@ static struct timeval run_test(char *argv[],
 			       unsigned int tdb_flags[],
 			       unsigned int open_flags[],
 			       struct op *op[],
+			       unsigned int num,
 			       int fds[2])
 {
 	unsigned int i;
 	struct timeval start, end, diff;
 	bool ok = true;
 
-	for (i = 0; argv[i+2]; i++) {
+	/* Children would flush anything buffered again on exit. */
+	fflush(stdout);
+	for (i = 0; i < num; i++) {
 		struct tdb_context *tdb;
 		char c;
 
@@ -1798,7 +1835,7 @@ static struct timeval run_test(char *argv[],
 	if (write(fds[1], hashsize, i) != i)
 		err(1, "Writing to wakeup pipe");
 
-	for (i = 0; argv[i + 2]; i++) {
+	for (i = 0; i < num; i++) {
 		int status;
 		wait(&status);
 		if (!WIFEXITED(status)) {
@@ -1845,31 +1882,20 @@ static void init_tdb(struct tdb_context *master_tdb,
 	tdb_close(tdb);
 }
 
-int main(int argc, char *argv[])
-{
-	struct timeval diff;
-	unsigned int i, num_ops[argc], hashsize[argc], tdb_flags[argc], open_flags[argc];
-	struct op *op[argc];
-	int fds[2];
-	struct tdb_context *master;
-	unsigned int runs = 1;
-
-	if (argc < 3)
-		errx(1, "Usage: %s [--quiet] [-n <number>] <tdbfile> <tracefile>...", argv[0]);
 
-	if (streq(argv[1], "--quiet")) {
-		quiet = true;
-		argv++;
-		argc--;
-	}
-	if (streq(argv[1], "-n")) {
-		runs = atoi(argv[2]);
-		argv += 2;
-		argc -= 2;
-	}
+/* Load the first num tracefiles, and work out what waits for what.
+ * Returns false if partial and they don't make sense without the rest. */
+static bool load_traces(struct tdb_context **master,
+			char *argv[], unsigned int num, bool partial,
+			struct op *op[], unsigned int num_ops[],
+			unsigned int hashsize[],
+			unsigned int tdb_flags[],
+			unsigned int open_flags[])
+{
+	unsigned int i;
+	bool ok;
 
-	pipes = talloc_array(NULL, struct pipe, argc - 1);
-	for (i = 0; i < argc - 2; i++) {
+	for (i = 0; i < num; i++) {
 		if (!quiet)
 			printf("Loading tracefile %s...", argv[2+i]);
 		fflush(stdout);
@@ -1887,68 +1913,439 @@ int main(int argc, char *argv[])
 	}
 
 	/* Dependency may figure we need to create seed records. */
-	master = tdb_open(NULL, 0, TDB_INTERNAL, O_RDWR, 0);
+	*master = tdb_open(NULL, 0, TDB_INTERNAL, O_RDWR, 0);
 	if (!quiet) {
 		printf("Calculating inter-dependencies...");
 		fflush(stdout);
 	}
-	derive_dependencies(master, argv+2, op, num_ops, i);
+	ok = derive_dependencies(*master, argv+2, op, num_ops, num, partial);
 	if (!quiet)
-		printf("done\n");
+		printf(ok ? "done\n" : "inconsistent without other traces\n");
+	return ok;
+}
 
-	for (i = 0; i < runs; i++) {
-		init_tdb(master, argv[1], hashsize[0]);
+static void free_traces(struct tdb_context *master,
+			struct op *op[], unsigned int num)
+{
+	unsigned int i;
 
-		/* Don't fork for single arg case: simple debugging. */
-		if (argc == 3) {
-			struct timeval start, end;
-			struct tdb_context *tdb;
+	tdb_close(master);
+	/* The key hash (and most dependencies) hang off op[0], and
+	 * dependencies unlink themselves from other files' ops, so op[0]
+	 * must go first. */
+	for (i = 0; i < num; i++) {
+		talloc_free(op[i]);
+		close(pipes[i].fd[0]);
+		close(pipes[i].fd[1]);
+	}
+	talloc_free(wipe_alls);
+	wipe_alls = NULL;
+	num_wipe_alls = 0;
+	total_keys = 1;
+}
 
-			tdb = tdb_open(argv[1], hashsize[0], tdb_flags[0],
-				       open_flags[0], 0600);
-			if (!quiet) {
-				printf("Single threaded run...");
-				fflush(stdout);
-			}
-			gettimeofday(&start, NULL);
+static void alloc_latencies(unsigned int num_ops[], unsigned int num)
+{
+	unsigned int i;
 
-			run_ops(tdb, pipes[0].fd[0], argv+2, op, 0, 1,
-				num_ops[0], false);
-			gettimeofday(&end, NULL);
-			if (!quiet)
-				printf("done\n");
-			tdb_close(tdb);
+	latency = talloc_array(NULL, uint64_t *, num);
+	for (i = 0; i < num; i++) {
+		/* Children fill these in, so they must be shared. */
+		latency[i] = mmap(NULL, (num_ops[i] + 1) * sizeof(uint64_t),
+				  PROT_READ|PROT_WRITE,
+				  MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+		if (latency[i] == MAP_FAILED)
+			err(1, "mapping latency array");
+	}
+}
 
-			check_deps(argv[2], op[0], num_ops[0]);
-			if (end.tv_usec < start.tv_usec) {
-				end.tv_usec += 1000000;
-				end.tv_sec--;
-			}
-			diff.tv_sec = end.tv_sec - start.tv_sec;
-			diff.tv_usec = end.tv_usec - start.tv_usec;
-			goto print_time;
+static void reset_latencies(unsigned int num_ops[], unsigned int num)
+{
+	unsigned int i;
+
+	for (i = 0; i < num; i++)
+		memset(latency[i], 0xFF, (num_ops[i] + 1) * sizeof(uint64_t));
+}
+
+static void free_latencies(unsigned int num_ops[], unsigned int num)
+{
+	unsigned int i;
+
+	for (i = 0; i < num; i++)
+		munmap(latency[i], (num_ops[i] + 1) * sizeof(uint64_t));
+	talloc_free(latency);
+	latency = NULL;
+}
+
+/* What we break the latencies down by. */
+enum op_class {
+	CLASS_FETCH,
+	CLASS_STORE,
+	CLASS_TRAVERSE,
+	CLASS_TRANSACTION,
+	CLASS_LOCK,
+	CLASS_OTHER,
+	NUM_CLASSES
+};
+
+static const char *class_name[NUM_CLASSES] = {
+	"fetch", "store", "traverse", "transaction", "lock", "other"
+};
+
+static enum op_class op_class(enum op_type type)
+{
+	switch (type) {
+	case OP_TDB_FETCH:
+	case OP_TDB_PARSE_RECORD:
+	case OP_TDB_EXISTS:
+		return CLASS_FETCH;
+	case OP_TDB_STORE:
+	case OP_TDB_APPEND:
+	case OP_TDB_DELETE:
+	case OP_TDB_WIPE_ALL:
+		return CLASS_STORE;
+	case OP_TDB_TRAVERSE_READ_START:
+	case OP_TDB_TRAVERSE_START:
+	case OP_TDB_FIRSTKEY:
+	case OP_TDB_NEXTKEY:
+		return CLASS_TRAVERSE;
+	case OP_TDB_TRANSACTION_START:
+	case OP_TDB_TRANSACTION_CANCEL:
+	case OP_TDB_TRANSACTION_PREPARE_COMMIT:
+	case OP_TDB_TRANSACTION_COMMIT:
+		return CLASS_TRANSACTION;
+	case OP_TDB_LOCKALL:
+	case OP_TDB_LOCKALL_MARK:
+	case OP_TDB_LOCKALL_UNMARK:
+	case OP_TDB_LOCKALL_NONBLOCK:
+	case OP_TDB_UNLOCKALL:
+	case OP_TDB_LOCKALL_READ:
+	case OP_TDB_LOCKALL_READ_NONBLOCK:
+	case OP_TDB_UNLOCKALL_READ:
+	case OP_TDB_CHAINLOCK:
+	case OP_TDB_CHAINLOCK_NONBLOCK:
+	case OP_TDB_CHAINLOCK_MARK:
+	case OP_TDB_CHAINLOCK_UNMARK:
+	case OP_TDB_CHAINUNLOCK:
+	case OP_TDB_CHAINLOCK_READ:
+	case OP_TDB_CHAINUNLOCK_READ:
+		return CLASS_LOCK;
+	default:
+		return CLASS_OTHER;
+	}
+}
+
+struct op_stats {
+	/* For min, mean and max. */
+	struct tally *nsec;
+	/* Latencies vary by orders of magnitude: histogram the log. */
+	struct tally *log2;
+	/* Every sample, for exact percentiles. */
+	uint64_t *v;
+	size_t num;
+};
+
+static void init_stats(struct op_stats stats[])
+{
+	unsigned int c;
+
+	for (c = 0; c < NUM_CLASSES; c++) {
+		stats[c].nsec = tally_new(1);
+		stats[c].log2 = tally_new(64);
+		if (!stats[c].nsec || !stats[c].log2)
+			err(1, "allocating tally");
+		stats[c].v = NULL;
+		stats[c].num = 0;
+	}
+}
+
+static void free_stats(struct op_stats stats[])
+{
+	unsigned int c;
+
+	for (c = 0; c < NUM_CLASSES; c++) {
+		free(stats[c].nsec);
+		free(stats[c].log2);
+		talloc_free(stats[c].v);
+	}
+}
+
+static unsigned int ilog2(uint64_t v)
+{
+	unsigned int bits = 0;
+
+	while (v >>= 1)
+		bits++;
+	return bits;
+}
+
+/* Add the latencies from the last run. */
+static void add_latencies(struct op_stats stats[], struct op *op[],
+			  unsigned int num_ops[], unsigned int num)
+{
+	unsigned int c, i, j, total = 0;
+
+	for (i = 0; i < num; i++)
+		total += num_ops[i];
+	for (c = 0; c < NUM_CLASSES; c++)
+		stats[c].v = talloc_realloc(NULL, stats[c].v, uint64_t,
+					    stats[c].num + total);
+
+	for (i = 0; i < num; i++) {
+		for (j = 1; j < num_ops[i]; j++) {
+			uint64_t nsec = latency[i][j];
+
+			/* Ops inside traversals we backed out of, or
+			 * traverse markers. */
+			if (nsec == LATENCY_NONE)
+				continue;
+			c = op_class(op[i][j].type);
+			tally_add(stats[c].nsec, nsec);
+			tally_add(stats[c].log2, ilog2(nsec));
+			stats[c].v[stats[c].num++] = nsec;
 		}
+	}
+}
 
-		if (pipe(fds) != 0)
-			err(1, "creating pipe");
+static int compare_u64(const void *_a, const void *_b)
+{
+	const uint64_t *a = _a, *b = _b;
+
+	if (*a < *b)
+		return -1;
+	return *a > *b;
+}
+
+/* Percentile of a sorted array. */
+static uint64_t pct(const uint64_t *v, size_t num, unsigned int p)
+{
+	return v[(num - 1) * p / 100];
+}
+
+static void print_latencies(struct op_stats stats[], unsigned int procs)
+{
+	unsigned int c;
+
+	if (!machine)
+		printf("%-12s %8s %10s %10s %10s %10s %10s\n", "op (nsec)",
+		       "count", "min", "mean", "median", "99%", "max");
+	for (c = 0; c < NUM_CLASSES; c++) {
+		struct op_stats *s = &stats[c];
+
+		if (!s->num)
+			continue;
+		qsort(s->v, s->num, sizeof(s->v[0]), compare_u64);
+		if (machine) {
+			printf("latency procs=%u op=%s count=%zu min=%zi"
+			       " mean=%zi median=%llu p99=%llu max=%zi\n",
+			       procs, class_name[c], s->num,
+			       tally_min(s->nsec), tally_mean(s->nsec),
+			       (unsigned long long)pct(s->v, s->num, 50),
+			       (unsigned long long)pct(s->v, s->num, 99),
+			       tally_max(s->nsec));
+			continue;
+		}
+		printf("%-12s %8zu %10zi %10zi %10llu %10llu %10zi\n",
+		       class_name[c], s->num,
+		       tally_min(s->nsec), tally_mean(s->nsec),
+		       (unsigned long long)pct(s->v, s->num, 50),
+		       (unsigned long long)pct(s->v, s->num, 99),
+		       tally_max(s->nsec));
+	}
+
+	if (machine || quiet)
+		return;
+	for (c = 0; c < NUM_CLASSES; c++) {
+		char *graph;
+
+		if (!stats[c].num)
+			continue;
+		graph = tally_histogram(stats[c].log2, 60, 24);
+		if (!graph)
+			continue;
+		printf("\n%s (log2 nsec):\n%s", class_name[c], graph);
+		free(graph);
+	}
+}
+
+/* Traverse records and ends are markers, not tdb calls. */
+static unsigned long real_ops(const struct op op[], unsigned int num)
+{
+	unsigned int i;
+	unsigned long n = 0;
+
+	for (i = 1; i < num; i++) {
+		if (op[i].type != OP_TDB_TRAVERSE
+		    && op[i].type != OP_TDB_TRAVERSE_END
+		    && op[i].type != OP_TDB_TRAVERSE_END_EARLY)
+			n++;
+	}
+	return n;
+}
+
+static unsigned long usec(struct timeval tv)
+{
+	return tv.tv_sec * 1000000UL + tv.tv_usec;
+}
+
+int main(int argc, char *argv[])
+{
+	struct timeval diff;
+	unsigned int i, num, procs, run, num_ops[argc], hashsize[argc], tdb_flags[argc], open_flags[argc];
+	struct op *op[argc];
+	int fds[2];
+	struct tdb_context *master;
+	struct op_stats stats[NUM_CLASSES];
+	unsigned long best[argc], total_ops[argc];
+	unsigned int runs = 1;
+	bool scale = false;
+
+	while (argc > 1 && argv[1][0] == '-') {
+		if (streq(argv[1], "--quiet"))
+			quiet = true;
+		else if (streq(argv[1], "--machine"))
+			machine = quiet = true;
+		else if (streq(argv[1], "--scale"))
+			scale = true;
+		else if (streq(argv[1], "-n") && argc > 2) {
+			runs = atoi(argv[2]);
+			argv++;
+			argc--;
+		} else
+			break;
+		argv++;
+		argc--;
+	}
+
+	if (argc < 3)
+		errx(1, "Usage: %s [--quiet] [--machine] [--scale] [-n <number>] <tdbfile> <tracefile>...", argv[0]);
+
+	num = argc - 2;
+	pipes = talloc_array(NULL, struct pipe, num + 1);
+
+	/* With --scale, replay the first 1, 2 ... num tracefiles at once. */
+	for (procs = scale ? 1 : num; procs <= num; procs++) {
+		/* 0 means we couldn't replay this many. */
+		best[procs] = 0;
+		total_ops[procs] = 0;
+		if (!load_traces(&master, argv, procs, procs < num, op,
+				 num_ops, hashsize, tdb_flags, open_flags)) {
+			free_traces(master, op, procs);
+			continue;
+		}
+		for (i = 0; i < procs; i++)
+			total_ops[procs] += real_ops(op[i], num_ops[i]);
+		best[procs] = -1UL;
+		alloc_latencies(num_ops, procs);
+		init_stats(stats);
+
+		for (run = 0; run < runs; run++) {
+			init_tdb(master, argv[1], hashsize[0]);
+			reset_latencies(num_ops, procs);
+
+			/* Don't fork for single arg case: simple debugging. */
+			if (procs == 1) {
+				struct timeval start, end;
+				struct tdb_context *tdb;
+
+				tdb = tdb_open(argv[1], hashsize[0],
+					       tdb_flags[0], open_flags[0],
+					       0600);
+				if (!quiet) {
+					printf("Single threaded run...");
+					fflush(stdout);
+				}
+				gettimeofday(&start, NULL);
+
+				run_ops(tdb, pipes[0].fd[0], argv+2, op, 0, 1,
+					num_ops[0], false);
+				gettimeofday(&end, NULL);
+				if (!quiet)
+					printf("done\n");
+				tdb_close(tdb);
+
+				check_deps(argv[2], op[0], num_ops[0]);
+				if (end.tv_usec < start.tv_usec) {
+					end.tv_usec += 1000000;
+					end.tv_sec--;
+				}
+				diff.tv_sec = end.tv_sec - start.tv_sec;
+				diff.tv_usec = end.tv_usec - start.tv_usec;
+				goto print_time;
+			}
+
+			if (pipe(fds) != 0)
+				err(1, "creating pipe");
 
 #if TRAVERSALS_TAKE_TRANSACTION_LOCK
-		if (pipe(pipes[argc-2].fd) != 0)
-			err(1, "creating pipe");
-		backoff_fd = pipes[argc-2].fd[1];
-		set_nonblock(pipes[argc-2].fd[1]);
-		set_nonblock(pipes[argc-2].fd[0]);
+			if (pipe(pipes[procs].fd) != 0)
+				err(1, "creating pipe");
+			backoff_fd = pipes[procs].fd[1];
+			set_nonblock(pipes[procs].fd[1]);
+			set_nonblock(pipes[procs].fd[0]);
 #endif
 
-		do {
-			diff = run_test(argv, num_ops, hashsize, tdb_flags,
-					open_flags, op, fds);
-		} while (handle_backoff(op, pipes[argc-2].fd[0]));
+			do {
+				reset_latencies(num_ops, procs);
+				diff = run_test(argv, num_ops, hashsize,
+						tdb_flags, open_flags, op,
+						procs, fds);
+			} while (handle_backoff(op, pipes[procs].fd[0]));
 
-	print_time:
-		if (!quiet)
-			printf("Time replaying: ");
-		printf("%lu usec\n", diff.tv_sec * 1000000UL + diff.tv_usec);
+			close(fds[0]);
+			close(fds[1]);
+#if TRAVERSALS_TAKE_TRANSACTION_LOCK
+			close(pipes[procs].fd[0]);
+			close(pipes[procs].fd[1]);
+#endif
+
+		print_time:
+			if (machine)
+				printf("time procs=%u run=%u usec=%lu\n",
+				       procs, run + 1, usec(diff));
+			else {
+				if (!quiet)
+					printf("Time replaying: ");
+				printf("%lu usec\n", usec(diff));
+			}
+			if (usec(diff) < best[procs])
+				best[procs] = usec(diff);
+			add_latencies(stats, op, num_ops, procs);
+		}
+
+		if (machine || !quiet)
+			print_latencies(stats, procs);
+		free_stats(stats);
+		free_latencies(num_ops, procs);
+		free_traces(master, op, procs);
+	}
+
+	if (scale) {
+		if (!machine)
+			printf("%-6s %10s %12s %12s\n",
+			       "procs", "ops", "best usec", "ops/sec");
+		for (procs = 1; procs <= num; procs++) {
+			unsigned long rate;
+
+			if (!best[procs]) {
+				if (machine)
+					printf("scale procs=%u skipped\n",
+					       procs);
+				else
+					printf("%-6u %10s %12s %12s\n", procs,
+					       "-", "-", "-");
+				continue;
+			}
+			rate = (unsigned long long)total_ops[procs] * 1000000
+				/ best[procs];
+			if (machine)
+				printf("scale procs=%u ops=%lu usec=%lu"
+				       " ops_per_sec=%lu\n", procs,
+				       total_ops[procs], best[procs], rate);
+			else
+				printf("%-6u %10lu %12lu %12lu\n", procs,
+				       total_ops[procs], best[procs], rate);
+		}
 	}
 
 	exit(0);
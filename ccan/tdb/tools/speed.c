@@ -35,6 +35,26 @@ static size_t file_size(void)
 	return st.st_size;
 }
 
+/* Commit (timing it) if we're in a transaction, then print the results. */
+static void report(struct tdb_context *tdb, bool transaction,
+		   const struct timeval *start, const struct timeval *stop,
+		   unsigned int num)
+{
+	struct timeval cstart, cstop;
+
+	if (transaction) {
+		gettimeofday(&cstart, NULL);
+		if (tdb_transaction_commit(tdb))
+			errx(1, "committing transaction: %s",
+			     tdb_errorstr(tdb));
+		gettimeofday(&cstop, NULL);
+	}
+	printf(" %zu ns (%zu bytes)", normalize(start, stop, num), file_size());
+	if (transaction)
+		printf(", commit %zu us", normalize(&cstart, &cstop, 1000));
+	printf("\n");
+}
+
 static int count_record(struct tdb_context *tdb,
 			TDB_DATA key, TDB_DATA data, void *p)
 {
@@ -46,6 +66,7 @@ static int count_record(struct tdb_context *tdb,
 int main(int argc, char *argv[])
 {
 	unsigned int i, j, num = 1000, stage = 0, stopat = -1;
+	unsigned int hash_size = 100003;
 	int flags = TDB_DEFAULT;
 	TDB_DATA key, data;
 	struct tdb_context *tdb;
@@ -58,14 +79,40 @@ int main(int argc, char *argv[])
 		argv++;
 	}
 
+	if (argv[1] && strcmp(argv[1], "--nommap") == 0) {
+		flags |= TDB_NOMMAP;
+		argc--;
+		argv++;
+	}
+
 	if (argv[1] && strcmp(argv[1], "--transaction") == 0) {
 		transaction = true;
 		argc--;
 		argv++;
 	}
 
-	tdb = tdb_open("/tmp/speed.tdb", 100003, flags, O_RDWR|O_CREAT|O_TRUNC,
-		       0600);
+	/* Misses on long chains are what the filter is for: try
+	 * --chain-filter --incompatible-hash --hash-size 1009 10000 */
+	if (argv[1] && strcmp(argv[1], "--chain-filter") == 0) {
+		flags |= TDB_CHAIN_FILTER;
+		argc--;
+		argv++;
+	}
+
+	if (argv[1] && strcmp(argv[1], "--incompatible-hash") == 0) {
+		flags |= TDB_INCOMPATIBLE_HASH;
+		argc--;
+		argv++;
+	}
+
+	if (argv[1] && strcmp(argv[1], "--hash-size") == 0 && argv[2]) {
+		hash_size = atoi(argv[2]);
+		argc -= 2;
+		argv += 2;
+	}
+
+	tdb = tdb_open("/tmp/speed.tdb", hash_size, flags,
+		       O_RDWR|O_CREAT|O_TRUNC, 0600);
 	if (!tdb)
 		err(1, "Opening /tmp/speed.tdb");
 
@@ -96,10 +143,7 @@ int main(int argc, char *argv[])
 			errx(1, "Inserting key %u in tdb: %s",
 			     i, tdb_errorstr(tdb));
 	gettimeofday(&stop, NULL);
-	if (transaction && tdb_transaction_commit(tdb))
-		errx(1, "committing transaction: %s", tdb_errorstr(tdb));
-	printf(" %zu ns (%zu bytes)\n",
-	       normalize(&start, &stop, num), file_size());
+	report(tdb, transaction, &start, &stop, num);
 	if (++stage == stopat)
 		exit(0);
 
@@ -117,10 +161,7 @@ int main(int argc, char *argv[])
 			     i, dptr ? *dptr : -1);
 	}
 	gettimeofday(&stop, NULL);
-	if (transaction && tdb_transaction_commit(tdb))
-		errx(1, "committing transaction: %s", tdb_errorstr(tdb));
-	printf(" %zu ns (%zu bytes)\n",
-	       normalize(&start, &stop, num), file_size());
+	report(tdb, transaction, &start, &stop, num);
 	if (++stage == stopat)
 		exit(0);
 
@@ -137,10 +178,7 @@ int main(int argc, char *argv[])
 			errx(1, "Fetching key %u in tdb gave %u", i, *dptr);
 	}
 	gettimeofday(&stop, NULL);
-	if (transaction && tdb_transaction_commit(tdb))
-		errx(1, "committing transaction: %s", tdb_errorstr(tdb));
-	printf(" %zu ns (%zu bytes)\n",
-	       normalize(&start, &stop, num), file_size());
+	report(tdb, transaction, &start, &stop, num);
 	if (++stage == stopat)
 		exit(0);
 
@@ -156,10 +194,7 @@ int main(int argc, char *argv[])
 	if (i != (num - 1) * (num / 2))
 		errx(1, "Traverse tallied to %u", i);
 	gettimeofday(&stop, NULL);
-	if (transaction && tdb_transaction_commit(tdb))
-		errx(1, "committing transaction: %s", tdb_errorstr(tdb));
-	printf(" %zu ns (%zu bytes)\n",
-	       normalize(&start, &stop, num), file_size());
+	report(tdb, transaction, &start, &stop, num);
 	if (++stage == stopat)
 		exit(0);
 
@@ -176,10 +211,7 @@ int main(int argc, char *argv[])
 			     i, tdb_errorstr(tdb));
 	}
 	gettimeofday(&stop, NULL);
-	if (transaction && tdb_transaction_commit(tdb))
-		errx(1, "committing transaction: %s", tdb_errorstr(tdb));
-	printf(" %zu ns (%zu bytes)\n",
-	       normalize(&start, &stop, num), file_size());
+	report(tdb, transaction, &start, &stop, num);
 	if (++stage == stopat)
 		exit(0);
 
@@ -196,10 +228,7 @@ int main(int argc, char *argv[])
 			     i, tdb_errorstr(tdb));
 	}
 	gettimeofday(&stop, NULL);
-	if (transaction && tdb_transaction_commit(tdb))
-		errx(1, "committing transaction: %s", tdb_errorstr(tdb));
-	printf(" %zu ns (%zu bytes)\n",
-	       normalize(&start, &stop, num), file_size());
+	report(tdb, transaction, &start, &stop, num);
 	if (++stage == stopat)
 		exit(0);
 
@@ -214,10 +243,7 @@ int main(int argc, char *argv[])
 			errx(1, "Appending key %u in tdb: %s",
 			     i, tdb_errorstr(tdb));
 	gettimeofday(&stop, NULL);
-	if (transaction && tdb_transaction_commit(tdb))
-		errx(1, "committing transaction: %s", tdb_errorstr(tdb));
-	printf(" %zu ns (%zu bytes)\n",
-	       normalize(&start, &stop, num), file_size());
+	report(tdb, transaction, &start, &stop, num);
 	if (++stage == stopat)
 		exit(0);
 
@@ -238,10 +264,7 @@ int main(int argc, char *argv[])
 			     i, tdb_errorstr(tdb));
 	}
 	gettimeofday(&stop, NULL);
-	if (transaction && tdb_transaction_commit(tdb))
-		errx(1, "committing transaction: %s", tdb_errorstr(tdb));
-	printf(" %zu ns (%zu bytes)\n",
-	       normalize(&start, &stop, num), file_size());
+	report(tdb, transaction, &start, &stop, num);
 
 	return 0;
 }
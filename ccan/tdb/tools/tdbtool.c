@@ -28,6 +28,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <errno.h>
 #include <string.h>
 #include <stdarg.h>
@@ -60,6 +61,7 @@ enum commands {
 	CMD_LIST_HASH_FREE,
 	CMD_LIST_FREE,
 	CMD_INFO,
+	CMD_STATS,
 	CMD_MMAP,
 	CMD_SPEED,
 	CMD_FIRST,
@@ -93,6 +95,7 @@ COMMAND_TABLE cmd_table[] = {
 	{"list",	CMD_LIST_HASH_FREE},
 	{"free",	CMD_LIST_FREE},
 	{"info",	CMD_INFO},
+	{"stats",	CMD_STATS},
 	{"speed",	CMD_SPEED},
 	{"mmap",	CMD_MMAP},
 	{"first",	CMD_FIRST},
@@ -198,6 +201,7 @@ static void help(void)
 "  keys                 : dump the database keys as strings\n"
 "  hexkeys              : dump the database keys as hex values\n"
 "  info                 : print summary info about the database\n"
+"  stats                : print operation counts (database-wide if it has a .stats file)\n"
 "  insert    key  data  : insert a record\n"
 "  move      key  file  : move a record to a destination tdb\n"
 "  store     key  data  : store a record (replace)\n"
@@ -236,10 +240,17 @@ static void create_tdb(const char *tdbname)
 static void open_tdb(const char *tdbname)
 {
 	struct tdb_logging_context log_ctx;
+	char statsname[strlen(tdbname) + sizeof(".stats")];
+	int flags = disable_mmap?TDB_NOMMAP:0;
 	log_ctx.log_fn = tdb_log;
 
+	/* If others are sharing stats, join in so we can show them. */
+	sprintf(statsname, "%s.stats", tdbname);
+	if (access(statsname, F_OK) == 0)
+		flags |= TDB_SHARED_STATS;
+
 	if (tdb) tdb_close(tdb);
-	tdb = tdb_open_ex(tdbname, 0, disable_mmap?TDB_NOMMAP:0, O_RDWR, 0600,
+	tdb = tdb_open_ex(tdbname, 0, flags, O_RDWR, 0600,
 			  &log_ctx, NULL);
 	if (!tdb) {
 		printf("Could not open %s: %s\n", tdbname, strerror(errno));
@@ -422,6 +433,36 @@ static void info_tdb(void)
 	}
 }
 
+static void stats_tdb(void)
+{
+	struct tdb_stats stats;
+
+	stats.size = sizeof(stats);
+	tdb_get_stats(tdb, &stats);
+	printf("%s stats:\n",
+	       (tdb_get_flags(tdb) & TDB_SHARED_STATS) ? "Shared" : "Our");
+	printf("locks: %llu\n", (unsigned long long)stats.locks);
+	printf("  lowlevel: %llu\n", (unsigned long long)stats.lock_lowlevel);
+	printf("  waited: %llu\n", (unsigned long long)stats.lock_wait);
+	printf("  nonblock: %llu (%llu failed)\n",
+	       (unsigned long long)stats.lock_nonblock,
+	       (unsigned long long)stats.lock_nonblock_fail);
+	printf("allocs: %llu\n", (unsigned long long)stats.allocs);
+	printf("  free records walked: %llu\n",
+	       (unsigned long long)stats.alloc_walk);
+	printf("finds: %llu\n", (unsigned long long)stats.finds);
+	printf("  chain records walked: %llu\n",
+	       (unsigned long long)stats.find_walk);
+	printf("expands: %llu\n", (unsigned long long)stats.expands);
+	printf("transactions: %llu\n", (unsigned long long)stats.transactions);
+	printf("  cancelled: %llu\n",
+	       (unsigned long long)stats.transaction_cancel);
+	printf("  nested: %llu\n", (unsigned long long)stats.transaction_nest);
+	printf("  blocks written: %llu (%llu bytes)\n",
+	       (unsigned long long)stats.transaction_blocks,
+	       (unsigned long long)stats.transaction_bytes);
+}
+
 static void speed_tdb(const char *tlimit)
 {
 	unsigned timelimit = tlimit?atoi(tlimit):0;
@@ -654,6 +695,9 @@ static int do_command(void)
 		case CMD_INFO:
 			info_tdb();
 			return 0;
+		case CMD_STATS:
+			stats_tdb();
+			return 0;
 		case CMD_SPEED:
 			speed_tdb(arg1);
 			return 0;
@@ -24,6 +24,12 @@
 */
 
 #include "tdb_private.h"
+#include <sys/uio.h>
+
+/* glibc hides pwritev() from strict _XOPEN_SOURCE users */
+#if HAVE_PWRITEV && (!defined(__GLIBC__) || defined(__USE_MISC))
+#define TDB_PWRITEV 1
+#endif
 
 /*
   transaction design:
@@ -275,7 +281,9 @@ static int transaction_write(struct tdb_context *tdb, tdb_off_t off,
 			tdb->transaction->transaction_error = 1;
 			return -1;			
 		}
-		if (tdb->transaction->old_map_size > blk * tdb->transaction->block_size) {
+		/* no need to read in what we're about to overwrite */
+		if (len < tdb->transaction->block_size &&
+		    tdb->transaction->old_map_size > blk * tdb->transaction->block_size) {
 			tdb_len_t len2 = tdb->transaction->block_size;
 			if (len2 + (blk * tdb->transaction->block_size) > tdb->transaction->old_map_size) {
 				len2 = tdb->transaction->old_map_size - (blk * tdb->transaction->block_size);
@@ -496,6 +504,43 @@ static int _tdb_transaction_cancel(struct tdb_context *tdb)
 	return ret;
 }
 
+/*
+  after a fork, our copy of the parent's transaction isn't ours to commit
+  or cancel (that would remove the parent's recovery magic): just free it
+*/
+void tdb_transaction_forget(struct tdb_context *tdb)
+{
+	int i;
+
+	tdb->map_size = tdb->transaction->old_map_size;
+	for (i=0;i<tdb->transaction->num_blocks;i++) {
+		SAFE_FREE(tdb->transaction->blocks[i]);
+	}
+	SAFE_FREE(tdb->transaction->blocks);
+	tdb->methods = tdb->transaction->io_methods;
+	SAFE_FREE(tdb->transaction->hash_heads);
+	SAFE_FREE(tdb->transaction);
+}
+
+/*
+  tdb_rehash() is changing the number of hash chains: the cached copy of
+  the hash heads must cover them all.  It writes every one before use.
+*/
+int tdb_transaction_resize_hash(struct tdb_context *tdb)
+{
+	uint32_t *hash_heads;
+
+	hash_heads = (uint32_t *)realloc(tdb->transaction->hash_heads,
+					 TDB_HASHTABLE_SIZE(tdb));
+	if (hash_heads == NULL) {
+		tdb->ecode = TDB_ERR_OOM;
+		return -1;
+	}
+	memset(hash_heads, 0, TDB_HASHTABLE_SIZE(tdb));
+	tdb->transaction->hash_heads = hash_heads;
+	return 0;
+}
+
 /*
   start a tdb transaction. No token is returned, as only a single
   transaction is allowed to be pending per tdb_context
@@ -509,6 +554,9 @@ int tdb_transaction_start(struct tdb_context *tdb)
 		return -1;
 	}
 
+	/* a forked child doesn't inherit its parent's transaction */
+	tdb_check_fork(tdb);
+
 	/* cope with nested tdb_transaction_start() calls */
 	if (tdb->transaction != NULL) {
 		if (!(tdb->flags & TDB_ALLOW_NESTING)) {
@@ -516,6 +564,7 @@ int tdb_transaction_start(struct tdb_context *tdb)
 			return -1;
 		}
 		tdb_trace(tdb, "tdb_transaction_start");
+		tdb_stat_inc(tdb, transaction_nest);
 		tdb->transaction->nesting++;
 		TDB_LOG((tdb, TDB_DEBUG_TRACE, "tdb_transaction_start: nesting %d\n", 
 			 tdb->transaction->nesting));
@@ -593,6 +642,7 @@ int tdb_transaction_start(struct tdb_context *tdb)
 
 	/* Trace at the end, so we get sequence number correct. */
 	tdb_trace(tdb, "tdb_transaction_start");
+	tdb_stat_inc(tdb, transactions);
 	return 0;
 	
 fail:
@@ -612,9 +662,37 @@ fail_allrecord_lock:
 int tdb_transaction_cancel(struct tdb_context *tdb)
 {
 	tdb_trace(tdb, "tdb_transaction_cancel");
+	tdb_stat_inc(tdb, transaction_cancel);
 	return _tdb_transaction_cancel(tdb);
 }
 
+/*
+  find the run of dirty blocks starting at blk, stopping before any
+  block which starts at or beyond limit. Adjacent blocks are written
+  (and saved for recovery) together. Returns the number of blocks, and
+  their total length in *length
+*/
+static uint32_t transaction_run(struct tdb_context *tdb, uint32_t blk,
+				tdb_off_t limit, tdb_len_t *length)
+{
+	struct tdb_transaction *t = tdb->transaction;
+	uint32_t n;
+
+	*length = 0;
+	for (n = 0; blk + n < t->num_blocks; n++) {
+		if (t->blocks[blk + n] == NULL ||
+		    (blk + n) * t->block_size >= limit) {
+			break;
+		}
+		if (blk + n == t->num_blocks-1) {
+			*length += t->last_block_size;
+		} else {
+			*length += t->block_size;
+		}
+	}
+	return n;
+}
+
 /*
   work out how much space the linearised recovery data will consume
 */
@@ -625,18 +703,19 @@ static tdb_len_t tdb_recovery_size(struct tdb_context *tdb)
 
 	recovery_size = sizeof(uint32_t);
 	for (i=0;i<tdb->transaction->num_blocks;i++) {
+		tdb_len_t length;
+		uint32_t n;
+
 		if (i * tdb->transaction->block_size >= tdb->transaction->old_map_size) {
 			break;
 		}
-		if (tdb->transaction->blocks[i] == NULL) {
+		n = transaction_run(tdb, i, tdb->transaction->old_map_size,
+				    &length);
+		if (n == 0) {
 			continue;
 		}
-		recovery_size += 2*sizeof(tdb_off_t);
-		if (i == tdb->transaction->num_blocks-1) {
-			recovery_size += tdb->transaction->last_block_size;
-		} else {
-			recovery_size += tdb->transaction->block_size;
-		}
+		recovery_size += 2*sizeof(tdb_off_t) + length;
+		i += n - 1;
 	}	
 
 	return recovery_size;
@@ -770,7 +849,7 @@ static int transaction_setup_recovery(struct tdb_context *tdb,
 	rec->data_len = recovery_size;
 	rec->rec_len  = recovery_max_size;
 	rec->key_len  = old_map_size;
-	CONVERT(rec);
+	CONVERT(*rec);
 
 	/* build the recovery data into a single blob to allow us to do a single
 	   large write, which should be more efficient */
@@ -778,20 +857,20 @@ static int transaction_setup_recovery(struct tdb_context *tdb,
 	for (i=0;i<tdb->transaction->num_blocks;i++) {
 		tdb_off_t offset;
 		tdb_len_t length;
-
-		if (tdb->transaction->blocks[i] == NULL) {
-			continue;
-		}
+		uint32_t n;
 
 		offset = i * tdb->transaction->block_size;
-		length = tdb->transaction->block_size;
-		if (i == tdb->transaction->num_blocks-1) {
-			length = tdb->transaction->last_block_size;
-		}
-		
 		if (offset >= old_map_size) {
+			break;
+		}
+
+		/* one entry for each run of adjacent blocks */
+		n = transaction_run(tdb, i, old_map_size, &length);
+		if (n == 0) {
 			continue;
 		}
+		i += n - 1;
+
 		if (offset + length > tdb->transaction->old_map_size) {
 			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_setup_recovery: transaction data over new region boundary\n"));
 			free(data);
@@ -816,8 +895,10 @@ static int transaction_setup_recovery(struct tdb_context *tdb,
 
 	/* and the tailer */
 	tailer = sizeof(*rec) + recovery_max_size;
+	if (DOCONV()) {
+		tdb_convert(&tailer, 4);
+	}
 	memcpy(p, &tailer, 4);
-	CONVERT(p);
 
 	/* write the recovery data to the recovery area */
 	if (methods->tdb_write(tdb, recovery_offset, data, sizeof(*rec) + recovery_size) == -1) {
@@ -966,6 +1047,66 @@ int tdb_transaction_prepare_commit(struct tdb_context *tdb)
 	return _tdb_transaction_prepare_commit(tdb);
 }
 
+/*
+  write out a run of n adjacent transaction blocks starting at blk. When
+  not using mmap this is a pwritev() per TRANSACTION_IOV_MAX blocks,
+  rather than a pwrite() for each one
+*/
+#define TRANSACTION_IOV_MAX 64
+static int transaction_write_run(struct tdb_context *tdb,
+				 const struct tdb_methods *methods,
+				 uint32_t blk, uint32_t n)
+{
+	struct tdb_transaction *t = tdb->transaction;
+
+	while (n > 0) {
+		struct iovec iov[TRANSACTION_IOV_MAX];
+		uint32_t i, cnt = n < TRANSACTION_IOV_MAX ? n : TRANSACTION_IOV_MAX;
+		tdb_len_t length = 0;
+		ssize_t written = -1;
+
+		for (i = 0; i < cnt; i++) {
+			iov[i].iov_base = t->blocks[blk + i];
+			iov[i].iov_len = t->block_size;
+			if (blk + i == t->num_blocks-1) {
+				iov[i].iov_len = t->last_block_size;
+			}
+			length += iov[i].iov_len;
+		}
+
+#ifdef TDB_PWRITEV
+		if (tdb->map_ptr == NULL && cnt > 1 &&
+		    tdb->methods->tdb_oob(tdb, blk * t->block_size + length,
+					  0) == 0) {
+			written = pwritev(tdb->fd, iov, cnt, blk * t->block_size);
+		}
+#endif
+		/* mmap, or a short or failed write: finish a block at a time */
+		if (written != (ssize_t)length) {
+			if (written < 0) {
+				written = 0;
+			}
+			for (i = 0; i < cnt; i++) {
+				tdb_len_t len = iov[i].iov_len;
+
+				if (written >= (ssize_t)len) {
+					written -= len;
+				} else if (methods->tdb_write(tdb,
+						(blk + i) * t->block_size + written,
+						(char *)iov[i].iov_base + written,
+						len - written) == -1) {
+					return -1;
+				} else {
+					written = 0;
+				}
+			}
+		}
+		blk += cnt;
+		n -= cnt;
+	}
+	return 0;
+}
+
 /*
   commit the current transaction
 */
@@ -1009,22 +1150,17 @@ int tdb_transaction_commit(struct tdb_context *tdb)
 
 	methods = tdb->transaction->io_methods;
 
-	/* perform all the writes */
+	/* perform all the writes, a run of adjacent blocks at a time */
 	for (i=0;i<tdb->transaction->num_blocks;i++) {
-		tdb_off_t offset;
 		tdb_len_t length;
+		uint32_t n;
 
-		if (tdb->transaction->blocks[i] == NULL) {
+		n = transaction_run(tdb, i, (tdb_off_t)-1, &length);
+		if (n == 0) {
 			continue;
 		}
 
-		offset = i * tdb->transaction->block_size;
-		length = tdb->transaction->block_size;
-		if (i == tdb->transaction->num_blocks-1) {
-			length = tdb->transaction->last_block_size;
-		}
-
-		if (methods->tdb_write(tdb, offset, tdb->transaction->blocks[i], length) == -1) {
+		if (transaction_write_run(tdb, methods, i, n) == -1) {
 			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_commit: write failed during commit\n"));
 			
 			/* we've overwritten part of the data and
@@ -1038,7 +1174,12 @@ int tdb_transaction_commit(struct tdb_context *tdb)
 			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_commit: write failed\n"));
 			return -1;
 		}
-		SAFE_FREE(tdb->transaction->blocks[i]);
+		tdb_stat_add(tdb, transaction_blocks, n);
+		tdb_stat_add(tdb, transaction_bytes, length);
+		for (; n > 0; n--, i++) {
+			SAFE_FREE(tdb->transaction->blocks[i]);
+		}
+		i--;
 	} 
 
 	SAFE_FREE(tdb->transaction->blocks);
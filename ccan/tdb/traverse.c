@@ -26,6 +26,8 @@
 */
 
 #include "tdb_private.h"
+#include <pthread.h>
+#include <stdarg.h>
 
 #define TDB_NEXT_LOCK_ERR ((tdb_off_t)-1)
 
@@ -73,7 +75,7 @@ static tdb_off_t tdb_next_lock(struct tdb_context *tdb, struct tdb_traverse_lock
 			}
 		}
 
-		if (tdb_lock(tdb, tlock->hash, tlock->lock_rw) == -1)
+		if (tdb_lock(tdb, BUCKET_LOCK(tlock->hash), tlock->lock_rw) == -1)
 			return TDB_NEXT_LOCK_ERR;
 
 		/* No previous record?  Start at top of chain. */
@@ -121,7 +123,7 @@ static tdb_off_t tdb_next_lock(struct tdb_context *tdb, struct tdb_traverse_lock
 			    tdb_do_delete(tdb, current, rec) != 0)
 				goto fail;
 		}
-		tdb_unlock(tdb, tlock->hash, tlock->lock_rw);
+		tdb_unlock(tdb, BUCKET_LOCK(tlock->hash), tlock->lock_rw);
 		want_next = 0;
 	}
 	/* We finished iteration without finding anything */
@@ -130,7 +132,7 @@ static tdb_off_t tdb_next_lock(struct tdb_context *tdb, struct tdb_traverse_lock
 
  fail:
 	tlock->off = 0;
-	if (tdb_unlock(tdb, tlock->hash, tlock->lock_rw) != 0)
+	if (tdb_unlock(tdb, BUCKET_LOCK(tlock->hash), tlock->lock_rw) != 0)
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_next_lock: On error unlock failed!\n"));
 	return TDB_NEXT_LOCK_ERR;
 }
@@ -169,7 +171,7 @@ static int tdb_traverse_internal(struct tdb_context *tdb,
 					  rec.key_len + rec.data_len);
 		if (!key.dptr) {
 			ret = -1;
-			if (tdb_unlock(tdb, tl->hash, tl->lock_rw) != 0)
+			if (tdb_unlock(tdb, BUCKET_LOCK(tl->hash), tl->lock_rw) != 0)
 				goto out;
 			if (tdb_unlock_record(tdb, tl->off) != 0)
 				TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_traverse: key.dptr == NULL and unlock_record failed!\n"));
@@ -182,7 +184,7 @@ static int tdb_traverse_internal(struct tdb_context *tdb,
 		tdb_trace_1rec_retrec(tdb, "traverse", key, dbuf);
 
 		/* Drop chain lock, call out */
-		if (tdb_unlock(tdb, tl->hash, tl->lock_rw) != 0) {
+		if (tdb_unlock(tdb, BUCKET_LOCK(tl->hash), tl->lock_rw) != 0) {
 			ret = -1;
 			SAFE_FREE(key.dptr);
 			goto out;
@@ -234,6 +236,226 @@ int tdb_traverse_read(struct tdb_context *tdb,
 	return ret;
 }
 
+struct traverse_worker {
+	/* Must be first: traverse_log() finds us from it. */
+	struct tdb_context view;
+	struct tdb_context *tdb;
+	pthread_mutex_t *log_lock;
+	tdb_traverse_func fn;
+	void *private_data;
+	/* This worker walks chains first, first+stride, ... */
+	uint32_t first, stride;
+	int count;
+	bool error;
+	bool *stop;
+};
+
+/* Workers log through here, one at a time, as the real tdb_context. */
+static void traverse_log(struct tdb_context *view, enum tdb_debug_level level,
+			 const char *fmt, ...)
+{
+	struct traverse_worker *w = (struct traverse_worker *)view;
+	va_list ap;
+	char *msg;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (len < 0 || !(msg = (char *)malloc(len + 1)))
+		return;
+	va_start(ap, fmt);
+	vsnprintf(msg, len + 1, fmt, ap);
+	va_end(ap);
+
+	pthread_mutex_lock(w->log_lock);
+	w->tdb->log.log_fn(w->tdb, level, "%s", msg);
+	pthread_mutex_unlock(w->log_lock);
+	free(msg);
+}
+
+/* Each worker (and its callbacks) uses a copy of the tdb_context, so
+   errors, stats and fork checks don't race the other workers.  Every
+   read lock it wants is covered by our allrecord lock, so it never
+   needs our lock records; anything else fails as in tdb_traverse_read. */
+static void traverse_view(struct traverse_worker *w, struct tdb_context *tdb)
+{
+	w->view = *tdb;
+	w->view.ecode = TDB_SUCCESS;
+	w->view.num_lockrecs = 0;
+	w->view.lockrecs = NULL;
+	memset(&w->view.travlocks, 0, sizeof(w->view.travlocks));
+	w->view.next = NULL;
+	w->view.log.log_fn = traverse_log;
+	if (!(tdb->flags & TDB_SHARED_STATS)) {
+		memset(&w->view.private_stats, 0, sizeof(w->view.private_stats));
+		w->view.stats = &w->view.private_stats;
+	}
+}
+
+/* Fold a worker's private counts back in. */
+static void traverse_add_stats(struct tdb_stats *stats,
+			       const struct tdb_stats *add)
+{
+	uint64_t *to = &stats->locks;
+	const uint64_t *from = &add->locks;
+	unsigned int i;
+
+	/* Everything after size is a uint64_t counter. */
+	for (i = 0; i < (sizeof(*stats) - offsetof(struct tdb_stats, locks))
+		     / sizeof(uint64_t); i++)
+		to[i] += from[i];
+}
+
+/* Any worker can stop them all. */
+static bool traverse_stopped(const struct traverse_worker *w)
+{
+	return __atomic_load_n(w->stop, __ATOMIC_RELAXED);
+}
+
+static void traverse_stop(struct traverse_worker *w)
+{
+	__atomic_store_n(w->stop, true, __ATOMIC_RELAXED);
+}
+
+/* Walk our share of the chains.  The allrecord read lock is held for us,
+   so there's no per-chain locking to do. */
+static void *traverse_chains(void *arg)
+{
+	struct traverse_worker *w = arg;
+	struct tdb_context *tdb = &w->view;
+	struct tdb_record rec;
+	TDB_DATA key, dbuf;
+	tdb_off_t off;
+	uint32_t h;
+
+	for (h = w->first; h < tdb->header.hash_size && !traverse_stopped(w);
+	     h += w->stride) {
+		if (tdb_ofs_read(tdb, TDB_HASH_TOP(h), &off) == -1)
+			goto fail;
+
+		while (off && !traverse_stopped(w)) {
+			if (tdb_rec_read(tdb, off, &rec) == -1)
+				goto fail;
+			if (off == rec.next) {
+				tdb->ecode = TDB_ERR_CORRUPT;
+				TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_traverse_read_parallel: loop detected.\n"));
+				goto fail;
+			}
+			if (TDB_DEAD(&rec)) {
+				off = rec.next;
+				continue;
+			}
+
+			w->count++;
+			key.dptr = tdb_alloc_read(tdb, off + sizeof(rec),
+						  rec.key_len + rec.data_len);
+			if (!key.dptr)
+				goto fail;
+			key.dsize = rec.key_len;
+			dbuf.dptr = key.dptr + rec.key_len;
+			dbuf.dsize = rec.data_len;
+
+			if (w->fn && w->fn(tdb, key, dbuf, w->private_data))
+				traverse_stop(w);
+			SAFE_FREE(key.dptr);
+			off = rec.next;
+		}
+	}
+	return NULL;
+
+fail:
+	w->error = true;
+	traverse_stop(w);
+	return NULL;
+}
+
+/*
+  a read style traverse split across threads by hash chain: thread i
+  calls fn(view, key, data, private_data[i]), concurrently with the
+  others.  view is that thread's own copy of tdb: fn may read through it
+  (tdb_fetch, tdb_exists, tdb_parse_record, tdb_error) but must make no
+  other tdb calls, and writes fail.  The whole database is read locked
+  for the duration.  Returns -1 on error or the record count traversed;
+  a non-zero return from any fn stops them all.
+*/
+int tdb_traverse_read_parallel(struct tdb_context *tdb, unsigned int threads,
+			       tdb_traverse_func fn, void *private_data[])
+{
+	struct traverse_worker *w;
+	pthread_t *tids;
+	pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+	bool stop = false;
+	unsigned int i, started;
+	int ret = 0;
+
+	if (threads == 0) {
+		tdb->ecode = TDB_ERR_EINVAL;
+		return -1;
+	}
+
+	w = calloc(threads, sizeof(*w));
+	tids = calloc(threads, sizeof(*tids));
+	if (!w || !tids) {
+		tdb->ecode = TDB_ERR_OOM;
+		ret = -1;
+		goto free;
+	}
+
+	/* Read lock everything, as tdb_lockall_read does, so no chain
+	   locks are needed: they couldn't be shared between threads. */
+	if (tdb_allrecord_lock(tdb, F_RDLCK, TDB_LOCK_WAIT, false) == -1) {
+		ret = -1;
+		goto free;
+	}
+
+	/* Nobody can grow the file now: make sure we've seen all of it, so
+	   the workers never need to remap. */
+	if (!(tdb->flags & TDB_INTERNAL))
+		tdb->methods->tdb_oob(tdb, tdb->map_size + 1, 1);
+
+	tdb->traverse_read++;
+	for (started = 0; started < threads; started++) {
+		traverse_view(&w[started], tdb);
+		w[started].tdb = tdb;
+		w[started].log_lock = &log_lock;
+		w[started].fn = fn;
+		w[started].private_data = private_data ? private_data[started]
+			: NULL;
+		w[started].first = started;
+		w[started].stride = threads;
+		w[started].stop = &stop;
+		if (pthread_create(&tids[started], NULL, traverse_chains,
+				   &w[started]) != 0) {
+			pthread_mutex_lock(&log_lock);
+			TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_traverse_read_parallel: could not start thread %u\n", started));
+			pthread_mutex_unlock(&log_lock);
+			__atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+			ret = -1;
+			break;
+		}
+	}
+
+	for (i = 0; i < started; i++) {
+		pthread_join(tids[i], NULL);
+		if (!(tdb->flags & TDB_SHARED_STATS))
+			traverse_add_stats(tdb->stats, &w[i].view.private_stats);
+		if (w[i].error) {
+			if (ret != -1)
+				tdb->ecode = w[i].view.ecode;
+			ret = -1;
+		} else if (ret != -1)
+			ret += w[i].count;
+	}
+	tdb->traverse_read--;
+
+	tdb_allrecord_unlock(tdb, F_RDLCK, false);
+free:
+	free(w);
+	free(tids);
+	return ret;
+}
+
 /*
   a write style traverse - needs to get the transaction lock to
   prevent deadlocks
@@ -292,7 +514,7 @@ TDB_DATA tdb_firstkey(struct tdb_context *tdb)
 	tdb_trace_retrec(tdb, "tdb_firstkey", key);
 
 	/* Unlock the hash chain of the record we just read. */
-	if (tdb_unlock(tdb, tdb->travlocks.hash, tdb->travlocks.lock_rw) != 0)
+	if (tdb_unlock(tdb, BUCKET_LOCK(tdb->travlocks.hash), tdb->travlocks.lock_rw) != 0)
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_firstkey: error occurred while tdb_unlocking!\n"));
 	return key;
 }
@@ -308,7 +530,7 @@ TDB_DATA tdb_nextkey(struct tdb_context *tdb, TDB_DATA oldkey)
 
 	/* Is locked key the old key?  If so, traverse will be reliable. */
 	if (tdb->travlocks.off) {
-		if (tdb_lock(tdb,tdb->travlocks.hash,tdb->travlocks.lock_rw))
+		if (tdb_lock(tdb,BUCKET_LOCK(tdb->travlocks.hash),tdb->travlocks.lock_rw))
 			return tdb_null;
 		if (tdb_rec_read(tdb, tdb->travlocks.off, &rec) == -1
 		    || !(k = tdb_alloc_read(tdb,tdb->travlocks.off+sizeof(rec),
@@ -321,7 +543,7 @@ TDB_DATA tdb_nextkey(struct tdb_context *tdb, TDB_DATA oldkey)
 				SAFE_FREE(k);
 				return tdb_null;
 			}
-			if (tdb_unlock(tdb, tdb->travlocks.hash, tdb->travlocks.lock_rw) != 0) {
+			if (tdb_unlock(tdb, BUCKET_LOCK(tdb->travlocks.hash), tdb->travlocks.lock_rw) != 0) {
 				SAFE_FREE(k);
 				return tdb_null;
 			}
@@ -354,11 +576,11 @@ TDB_DATA tdb_nextkey(struct tdb_context *tdb, TDB_DATA oldkey)
 		key.dptr = tdb_alloc_read(tdb, tdb->travlocks.off+sizeof(rec),
 					  key.dsize);
 		/* Unlock the chain of this new record */
-		if (tdb_unlock(tdb, tdb->travlocks.hash, tdb->travlocks.lock_rw) != 0)
+		if (tdb_unlock(tdb, BUCKET_LOCK(tdb->travlocks.hash), tdb->travlocks.lock_rw) != 0)
 			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_nextkey: WARNING tdb_unlock failed!\n"));
 	}
 	/* Unlock the chain of old record */
-	if (tdb_unlock(tdb, BUCKET(oldhash), tdb->travlocks.lock_rw) != 0)
+	if (tdb_unlock(tdb, BUCKET_LOCK(oldhash), tdb->travlocks.lock_rw) != 0)
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_nextkey: WARNING tdb_unlock failed!\n"));
 	tdb_trace_1rec_retrec(tdb, "tdb_nextkey", oldkey, key);
 	return key;
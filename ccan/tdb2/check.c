@@ -30,6 +30,69 @@ static bool append(tdb_off_t **arr, size_t *num, tdb_off_t off)
 	return true;
 }
 
+static enum TDB_ERROR check_changelog(struct tdb_context *tdb, tdb_off_t off)
+{
+	struct tdb_changelog clog;
+	enum TDB_ERROR ecode;
+	uint64_t len;
+
+	ecode = tdb_read_convert(tdb, off, &clog, sizeof(clog));
+	if (ecode != TDB_SUCCESS) {
+		return ecode;
+	}
+
+	if (clog.num_entries == 0 || clog.key_room % 8 != 0) {
+		return tdb_logerr(tdb, TDB_ERR_CORRUPT, TDB_LOG_ERROR,
+				  "tdb_check: bad changelog %llu/%llu",
+				  (long long)clog.num_entries,
+				  (long long)clog.key_room);
+	}
+
+	len = sizeof(clog) + clog.num_entries
+		* (sizeof(struct tdb_changelog_entry) + clog.key_room);
+	if (len > sizeof(clog.cap.hdr) + rec_data_length(&clog.cap.hdr)) {
+		return tdb_logerr(tdb, TDB_ERR_CORRUPT, TDB_LOG_ERROR,
+				  "tdb_check: changelog length %llu"
+				  " exceeds record length %llu",
+				  (long long)len,
+				  (long long)rec_data_length(&clog.cap.hdr));
+	}
+	return TDB_SUCCESS;
+}
+
+static enum TDB_ERROR check_small_table(struct tdb_context *tdb,
+					tdb_off_t off)
+{
+	struct tdb_small slab;
+	enum TDB_ERROR ecode;
+
+	ecode = tdb_read_convert(tdb, off, &slab, sizeof(slab));
+	if (ecode != TDB_SUCCESS) {
+		return ecode;
+	}
+
+	if (slab.num_slots < TDB_SMALL_REGIONS * TDB_SMALL_PROBE
+	    || slab.num_slots % TDB_SMALL_REGIONS != 0
+	    || slab.slots % TDB_SMALL_SLOT != 0
+	    || slab.slots < off + sizeof(slab)) {
+		return tdb_logerr(tdb, TDB_ERR_CORRUPT, TDB_LOG_ERROR,
+				  "tdb_check: bad small slots %llu@%llu",
+				  (long long)slab.num_slots,
+				  (long long)slab.slots);
+	}
+
+	if (slab.slots + slab.num_slots * TDB_SMALL_SLOT
+	    > off + sizeof(slab.cap.hdr) + rec_data_length(&slab.cap.hdr)) {
+		return tdb_logerr(tdb, TDB_ERR_CORRUPT, TDB_LOG_ERROR,
+				  "tdb_check: small slots end %llu"
+				  " exceeds record length %llu",
+				  (long long)(slab.slots + slab.num_slots
+					      * TDB_SMALL_SLOT - off),
+				  (long long)rec_data_length(&slab.cap.hdr));
+	}
+	return TDB_SUCCESS;
+}
+
 static enum TDB_ERROR check_header(struct tdb_context *tdb, tdb_off_t *recovery,
 				   uint64_t *features, size_t *num_capabilities)
 {
@@ -85,16 +148,28 @@ static enum TDB_ERROR check_header(struct tdb_context *tdb, tdb_off_t *recovery,
 	for (off = hdr.capabilities; off && ecode == TDB_SUCCESS; off = next) {
 		const struct tdb_capability *cap;
 		enum TDB_ERROR err;
+		tdb_off_t type;
 
 		cap = tdb_access_read(tdb, off, sizeof(*cap), true);
 		if (TDB_PTR_IS_ERR(cap)) {
 			return TDB_PTR_ERR(cap);
 		}
-
-		/* All capabilities are unknown. */
-		err = unknown_capability(tdb, "tdb_check", cap->type);
+		type = cap->type;
 		next = cap->next;
+		/* Release before reading more: we can't hold a pointer
+		 * into the map while it might be remapped. */
 		tdb_access_release(tdb, cap);
+
+		switch (type & TDB_CAP_TYPE_MASK) {
+		case TDB_CAP_CHANGELOG:
+			err = check_changelog(tdb, off);
+			break;
+		case TDB_CAP_SMALL:
+			err = check_small_table(tdb, off);
+			break;
+		default:
+			err = unknown_capability(tdb, "tdb_check", type);
+		}
 		if (err)
 			return err;
 		(*num_capabilities)++;
@@ -476,6 +551,79 @@ static enum TDB_ERROR check_hash(struct tdb_context *tdb,
 	return ecode;
 }
 
+/* Each small slot is empty, or a record which fits and hashes near it. */
+static enum TDB_ERROR check_small(struct tdb_context *tdb,
+				  enum TDB_ERROR (*check)(TDB_DATA, TDB_DATA,
+							  void *),
+				  void *data)
+{
+	uint64_t i;
+	enum TDB_ERROR ecode;
+
+	for (i = 0; i < tdb->tdb2.small_slots; i++) {
+		tdb_off_t off = tdb->tdb2.small + i * TDB_SMALL_SLOT;
+		struct tdb_used_record rec;
+		const unsigned char *kptr;
+		TDB_DATA k, d;
+		uint64_t h;
+		unsigned int w;
+
+		ecode = tdb_read_convert(tdb, off, &rec, sizeof(rec));
+		if (ecode != TDB_SUCCESS) {
+			return ecode;
+		}
+		if (rec.magic_and_meta == 0)
+			continue;
+
+		if (rec_magic(&rec) != TDB_USED_MAGIC
+		    || sizeof(rec) + rec_key_length(&rec)
+		    + rec_data_length(&rec) + rec_extra_padding(&rec)
+		    != TDB_SMALL_SLOT) {
+			return tdb_logerr(tdb, TDB_ERR_CORRUPT, TDB_LOG_ERROR,
+					  "tdb_check: bad small record"
+					  " at offset %llu", (long long)off);
+		}
+
+		kptr = tdb_access_read(tdb, off + sizeof(rec),
+				       rec_key_length(&rec)
+				       + rec_data_length(&rec), false);
+		if (TDB_PTR_IS_ERR(kptr)) {
+			return TDB_PTR_ERR(kptr);
+		}
+		k = tdb_mkdata(kptr, rec_key_length(&rec));
+		d = tdb_mkdata(kptr + k.dsize, rec_data_length(&rec));
+		h = tdb_hash(tdb, k.dptr, k.dsize);
+
+		/* It must be somewhere find_and_lock() would look. */
+		for (w = 0; w < TDB_SMALL_PROBE; w++)
+			if (small_slot_off(tdb, h, w) == off)
+				break;
+		if (w == TDB_SMALL_PROBE) {
+			ecode = tdb_logerr(tdb, TDB_ERR_CORRUPT,
+					   TDB_LOG_ERROR,
+					   "tdb_check: small record"
+					   " at offset %llu in wrong slot",
+					   (long long)off);
+		} else if ((h & ((1 << 11)-1)) != rec_hash(&rec)) {
+			ecode = tdb_logerr(tdb, TDB_ERR_CORRUPT,
+					   TDB_LOG_ERROR,
+					   "tdb_check: Bad hash magic"
+					   " at offset %llu"
+					   " (0x%llx vs 0x%llx)",
+					   (long long)off,
+					   (long long)h,
+					   (long long)rec_hash(&rec));
+		} else if (check) {
+			ecode = check(k, d, data);
+		}
+		tdb_access_release(tdb, kptr);
+		if (ecode != TDB_SUCCESS) {
+			return ecode;
+		}
+	}
+	return TDB_SUCCESS;
+}
+
 static enum TDB_ERROR check_free(struct tdb_context *tdb,
 				 tdb_off_t off,
 				 const struct tdb_free_record *frec,
@@ -855,6 +1003,10 @@ enum TDB_ERROR tdb_check_(struct tdb_context *tdb,
 	if (ecode != TDB_SUCCESS)
 		goto out;
 
+	ecode = check_small(tdb, check, data);
+	if (ecode != TDB_SUCCESS)
+		goto out;
+
 	if (num_found != num_free) {
 		ecode = tdb_logerr(tdb, TDB_ERR_CORRUPT, TDB_LOG_ERROR,
 				   "tdb_check: Not all entries are in"
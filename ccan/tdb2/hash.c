@@ -100,6 +100,74 @@ static tdb_bool_err key_matches(struct tdb_context *tdb,
 	return ret;
 }
 
+/* The header and key are adjacent, and for the common small record they
+ * share a cache line.  If we can get at them directly, copy the header and
+ * return a pointer to where the key would be, otherwise NULL (or error). */
+static const void *direct_header_and_key(struct tdb_context *tdb,
+					 tdb_off_t off, tdb_len_t keylen,
+					 struct tdb_used_record *rec)
+{
+	const struct tdb_used_record *r;
+
+	if (unlikely(tdb->flags & TDB_CONVERT))
+		return NULL;
+
+	/* Don't trigger oob (and its logging) for a short record at the end
+	 * of the file: we'll take the slow path instead. */
+	if (off + sizeof(*r) + keylen > tdb->file->map_size)
+		return NULL;
+
+	r = tdb->tdb2.io->direct(tdb, off, sizeof(*r) + keylen, false);
+	if (!r || TDB_PTR_IS_ERR(r))
+		return r;
+
+	*rec = *r;
+	return r + 1;
+}
+
+/* Is this the record we want?  Also false if it's not a used record. */
+static tdb_bool_err match_record(struct tdb_context *tdb,
+				 struct hash_info *h,
+				 const struct tdb_data *key,
+				 tdb_off_t off,
+				 struct tdb_used_record *rec)
+{
+	const void *rkey;
+	enum TDB_ERROR ecode;
+
+	rkey = direct_header_and_key(tdb, off, key->dsize, rec);
+	if (TDB_PTR_IS_ERR(rkey)) {
+		return (tdb_bool_err)TDB_PTR_ERR(rkey);
+	}
+	if (!rkey) {
+		ecode = tdb_read_convert(tdb, off, rec, sizeof(*rec));
+		if (ecode != TDB_SUCCESS) {
+			return (tdb_bool_err)ecode;
+		}
+	}
+
+	if (rec_magic(rec) != TDB_USED_MAGIC)
+		return false;
+
+	if ((h->h & ((1 << 11)-1)) != rec_hash(rec)) {
+		tdb->stats.compare_wrong_rechash++;
+		return false;
+	}
+
+	if (!rkey)
+		return key_matches(tdb, rec, off, key);
+
+	if (rec_key_length(rec) != key->dsize) {
+		tdb->stats.compare_wrong_keylen++;
+		return false;
+	}
+	if (memcmp(rkey, key->dptr, key->dsize) != 0) {
+		tdb->stats.compare_wrong_keycmp++;
+		return false;
+	}
+	return true;
+}
+
 /* Does entry match? */
 static tdb_bool_err match(struct tdb_context *tdb,
 			  struct hash_info *h,
@@ -107,9 +175,6 @@ static tdb_bool_err match(struct tdb_context *tdb,
 			  tdb_off_t val,
 			  struct tdb_used_record *rec)
 {
-	tdb_off_t off;
-	enum TDB_ERROR ecode;
-
 	tdb->stats.compares++;
 	/* Desired bucket must match. */
 	if (h->home_bucket != (val & TDB_OFF_HASH_GROUP_MASK)) {
@@ -125,18 +190,60 @@ static tdb_bool_err match(struct tdb_context *tdb,
 		return false;
 	}
 
-	off = val & TDB_OFF_MASK;
-	ecode = tdb_read_convert(tdb, off, rec, sizeof(*rec));
-	if (ecode != TDB_SUCCESS) {
-		return (tdb_bool_err)ecode;
-	}
+	return match_record(tdb, h, key, val & TDB_OFF_MASK, rec);
+}
 
-	if ((h->h & ((1 << 11)-1)) != rec_hash(rec)) {
-		tdb->stats.compare_wrong_rechash++;
-		return false;
-	}
+/* The slots of each region are shared by the keys under one hash lock. */
+static tdb_off_t small_off(struct tdb_context *tdb,
+			   unsigned int group, uint64_t slot)
+{
+	uint64_t per_region = tdb->tdb2.small_slots / TDB_SMALL_REGIONS;
+
+	return tdb->tdb2.small
+		+ (group * per_region + slot) * TDB_SMALL_SLOT;
+}
+
+/* A key may be in any of TDB_SMALL_PROBE slots from where it hashes to. */
+static uint64_t small_window(struct tdb_context *tdb, uint64_t h,
+			     unsigned int i)
+{
+	uint64_t per_region = tdb->tdb2.small_slots / TDB_SMALL_REGIONS;
+
+	return (h % per_region + i) % per_region;
+}
+
+tdb_off_t small_slot_off(struct tdb_context *tdb, uint64_t h, unsigned int i)
+{
+	const unsigned group_bits = TDB_TOPLEVEL_HASH_BITS-TDB_HASH_GROUP_BITS;
 
-	return key_matches(tdb, rec, off, key);
+	return small_off(tdb, bits_from(h, 64 - group_bits, group_bits),
+			 small_window(tdb, h, i));
+}
+
+/* Look through the small slots: on a miss, h->small_free is the first
+ * empty one (or 0).  Returns the offset, 0 if not found, or -ve error. */
+static tdb_off_t find_small(struct tdb_context *tdb,
+			    struct hash_info *h,
+			    const struct tdb_data *key,
+			    struct tdb_used_record *rec)
+{
+	unsigned int i;
+
+	for (i = 0; i < TDB_SMALL_PROBE; i++) {
+		tdb_off_t off = small_slot_off(tdb, h->h, i);
+		tdb_bool_err berr;
+
+		berr = match_record(tdb, h, key, off, rec);
+		if (berr < 0) {
+			return TDB_ERR_TO_OFF(berr);
+		}
+		if (berr) {
+			return off;
+		}
+		if (!h->small_free && rec_magic(rec) != TDB_USED_MAGIC)
+			h->small_free = off;
+	}
+	return 0;
 }
 
 static tdb_off_t hbucket_off(tdb_off_t group_start, unsigned bucket)
@@ -228,44 +335,19 @@ static tdb_off_t COLD find_in_chain(struct tdb_context *tdb,
 	return 0;
 }
 
-/* This is the core routine which searches the hashtable for an entry.
- * On error, no locks are held and -ve is returned.
- * Otherwise, hinfo is filled in (and the optional tinfo).
- * If not found, the return value is 0.
- * If found, the return value is the offset, and *rec is the record. */
-tdb_off_t find_and_lock(struct tdb_context *tdb,
-			struct tdb_data key,
-			int ltype,
-			struct hash_info *h,
-			struct tdb_used_record *rec,
-			struct traverse_info *tinfo)
+/* Search the hashtable from this top-level group, with the lock held. */
+static tdb_off_t find_in_hash(struct tdb_context *tdb,
+			      struct tdb_data key,
+			      uint32_t group,
+			      struct hash_info *h,
+			      struct tdb_used_record *rec,
+			      struct traverse_info *tinfo)
 {
-	uint32_t i, group;
+	uint32_t i;
 	tdb_off_t hashtable;
 	enum TDB_ERROR ecode;
 
-	h->h = tdb_hash(tdb, key.dptr, key.dsize);
-	h->hash_used = 0;
-	group = use_bits(h, TDB_TOPLEVEL_HASH_BITS - TDB_HASH_GROUP_BITS);
-	h->home_bucket = use_bits(h, TDB_HASH_GROUP_BITS);
-
-	h->hlock_start = hlock_range(group, &h->hlock_range);
-	ecode = tdb_lock_hashes(tdb, h->hlock_start, h->hlock_range, ltype,
-				TDB_LOCK_WAIT);
-	if (ecode != TDB_SUCCESS) {
-		return TDB_ERR_TO_OFF(ecode);
-	}
-
 	hashtable = offsetof(struct tdb_header, hashtable);
-	if (tinfo) {
-		tinfo->toplevel_group = group;
-		tinfo->num_levels = 1;
-		tinfo->levels[0].entry = 0;
-		tinfo->levels[0].hashtable = hashtable
-			+ (group << TDB_HASH_GROUP_BITS) * sizeof(tdb_off_t);
-		tinfo->levels[0].total_buckets = 1 << TDB_HASH_GROUP_BITS;
-	}
-
 	while (h->hash_used <= 64) {
 		/* Read in the hash group. */
 		h->group_start = hashtable
@@ -274,7 +356,7 @@ tdb_off_t find_and_lock(struct tdb_context *tdb,
 		ecode = tdb_read_convert(tdb, h->group_start, &h->group,
 					 sizeof(h->group));
 		if (ecode != TDB_SUCCESS) {
-			goto fail;
+			return TDB_ERR_TO_OFF(ecode);
 		}
 
 		/* Pointer to another hash table?  Go down... */
@@ -316,8 +398,7 @@ tdb_off_t find_and_lock(struct tdb_context *tdb,
 			berr = match(tdb, h, &key, h->group[h->found_bucket],
 				     rec);
 			if (berr < 0) {
-				ecode = TDB_OFF_TO_ERR(berr);
-				goto fail;
+				return TDB_ERR_TO_OFF(berr);
 			}
 			if (berr) {
 				if (tinfo) {
@@ -332,6 +413,78 @@ tdb_off_t find_and_lock(struct tdb_context *tdb,
 	}
 
 	return find_in_chain(tdb, key, hashtable, h, rec, tinfo);
+}
+
+/* This is the core routine which searches the hashtable for an entry.
+ * On error, no locks are held and -ve is returned.
+ * Otherwise, hinfo is filled in (and the optional tinfo).
+ * If not found, the return value is 0.
+ * If found, the return value is the offset, and *rec is the record.
+ * If it was found in a small slot, h->small is set and the hash group
+ * in hinfo is not filled in. */
+tdb_off_t find_and_lock(struct tdb_context *tdb,
+			struct tdb_data key,
+			int ltype,
+			struct hash_info *h,
+			struct tdb_used_record *rec,
+			struct traverse_info *tinfo)
+{
+	uint32_t group;
+	tdb_off_t off;
+	enum TDB_ERROR ecode;
+
+	h->h = tdb_hash(tdb, key.dptr, key.dsize);
+	h->hash_used = 0;
+	group = use_bits(h, TDB_TOPLEVEL_HASH_BITS - TDB_HASH_GROUP_BITS);
+	h->home_bucket = use_bits(h, TDB_HASH_GROUP_BITS);
+	h->small = h->small_free = 0;
+
+	h->hlock_start = hlock_range(group, &h->hlock_range);
+	ecode = tdb_lock_hashes(tdb, h->hlock_start, h->hlock_range, ltype,
+				TDB_LOCK_WAIT);
+	if (ecode != TDB_SUCCESS) {
+		return TDB_ERR_TO_OFF(ecode);
+	}
+
+	if (tinfo) {
+		tinfo->toplevel_group = group;
+		tinfo->num_levels = 1;
+		tinfo->levels[0].entry = 0;
+		tinfo->levels[0].hashtable = offsetof(struct tdb_header,
+						      hashtable)
+			+ (group << TDB_HASH_GROUP_BITS) * sizeof(tdb_off_t);
+		tinfo->levels[0].total_buckets = 1 << TDB_HASH_GROUP_BITS;
+		tinfo->small = false;
+		tinfo->small_slot = 0;
+	}
+
+	/* Tiny records are most likely in a small slot: one cache line. */
+	if (tdb->tdb2.small) {
+		off = find_small(tdb, h, &key, rec);
+		if (TDB_OFF_IS_ERR(off)) {
+			ecode = TDB_OFF_TO_ERR(off);
+			goto fail;
+		}
+		if (off) {
+			h->small = off;
+			if (tinfo) {
+				/* Traverse goes on from the next slot. */
+				tinfo->small = true;
+				tinfo->small_slot = (off - tdb->tdb2.small)
+					/ TDB_SMALL_SLOT
+					% (tdb->tdb2.small_slots
+					   / TDB_SMALL_REGIONS) + 1;
+			}
+			return off;
+		}
+	}
+
+	off = find_in_hash(tdb, key, group, h, rec, tinfo);
+	if (TDB_OFF_IS_ERR(off)) {
+		ecode = TDB_OFF_TO_ERR(off);
+		goto fail;
+	}
+	return off;
 
 fail:
 	tdb_unlock_hashes(tdb, h->hlock_start, h->hlock_range, ltype);
@@ -659,6 +812,37 @@ enum TDB_ERROR add_to_hash(struct tdb_context *tdb, struct hash_info *h,
 	return add_to_hash(tdb, h, new_off);
 }
 
+enum TDB_ERROR delete_small(struct tdb_context *tdb, struct hash_info *h)
+{
+	/* A zero header marks the slot empty. */
+	return tdb_write_off(tdb, h->small, 0);
+}
+
+enum TDB_ERROR small_to_hash(struct tdb_context *tdb, struct hash_info *h,
+			     struct tdb_data key, tdb_off_t new_off)
+{
+	struct tdb_used_record rec;
+	uint32_t group;
+	tdb_off_t off;
+	enum TDB_ERROR ecode;
+
+	ecode = delete_small(tdb, h);
+	if (ecode != TDB_SUCCESS) {
+		return ecode;
+	}
+
+	/* find_and_lock() stopped at the slot: find where it goes now. */
+	h->small = 0;
+	h->hash_used = 0;
+	group = use_bits(h, TDB_TOPLEVEL_HASH_BITS - TDB_HASH_GROUP_BITS);
+	h->home_bucket = use_bits(h, TDB_HASH_GROUP_BITS);
+	off = find_in_hash(tdb, key, group, h, &rec, NULL);
+	if (TDB_OFF_IS_ERR(off)) {
+		return TDB_OFF_TO_ERR(off);
+	}
+	return add_to_hash(tdb, h, new_off);
+}
+
 /* Traverse support: returns offset of record, or 0 or -ve error. */
 static tdb_off_t iterate_hash(struct tdb_context *tdb,
 			      struct traverse_info *tinfo)
@@ -737,6 +921,27 @@ again:
 	goto again;
 }
 
+/* After the hash, the small slots under the same lock. */
+static tdb_off_t iterate_small(struct tdb_context *tdb,
+			       struct traverse_info *tinfo)
+{
+	uint64_t per_region = tdb->tdb2.small_slots / TDB_SMALL_REGIONS;
+
+	while (tinfo->small_slot < per_region) {
+		tdb_off_t off, hdr;
+
+		off = small_off(tdb, tinfo->toplevel_group,
+				tinfo->small_slot++);
+		hdr = tdb_read_off(tdb, off);
+		if (TDB_OFF_IS_ERR(hdr)) {
+			return hdr;
+		}
+		if (hdr)
+			return off;
+	}
+	return 0;
+}
+
 /* Return success if we find something, TDB_ERR_NOEXIST if none. */
 enum TDB_ERROR next_in_hash(struct tdb_context *tdb,
 			    struct traverse_info *tinfo,
@@ -756,7 +961,13 @@ enum TDB_ERROR next_in_hash(struct tdb_context *tdb,
 			return ecode;
 		}
 
-		off = iterate_hash(tdb, tinfo);
+		off = 0;
+		if (!tinfo->small)
+			off = iterate_hash(tdb, tinfo);
+		if (!off && tdb->tdb2.small) {
+			tinfo->small = true;
+			off = iterate_small(tdb, tinfo);
+		}
 		if (off) {
 			struct tdb_used_record rec;
 
@@ -805,6 +1016,8 @@ enum TDB_ERROR next_in_hash(struct tdb_context *tdb,
 		tinfo->levels[0].hashtable
 			+= (sizeof(tdb_off_t) << TDB_HASH_GROUP_BITS);
 		tinfo->levels[0].entry = 0;
+		tinfo->small = false;
+		tinfo->small_slot = 0;
 	}
 	return TDB_ERR_NOEXIST;
 
@@ -824,6 +1037,8 @@ enum TDB_ERROR first_in_hash(struct tdb_context *tdb,
 	tinfo->levels[0].hashtable = offsetof(struct tdb_header, hashtable);
 	tinfo->levels[0].entry = 0;
 	tinfo->levels[0].total_buckets = (1 << TDB_HASH_GROUP_BITS);
+	tinfo->small = false;
+	tinfo->small_slot = 0;
 
 	return next_in_hash(tdb, tinfo, kbuf, dlen);
 }
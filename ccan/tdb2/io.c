@@ -40,6 +40,40 @@ void tdb_munmap(struct tdb_file *file)
 	}
 }
 
+/* Extra mmap flags for TDB_MMAP_POPULATE. */
+int tdb_map_populate(struct tdb_context *tdb)
+{
+#ifdef MAP_POPULATE
+	if (tdb->mmap_policy & TDB_MMAP_POPULATE)
+		return MAP_POPULATE;
+#endif
+	return 0;
+}
+
+/* Apply the TDB_ATTRIBUTE_MMAP hints to the current mapping.  Failure
+ * is harmless (eg. no hugepage support for this filesystem): ignore it. */
+void tdb_mmap_advise(struct tdb_context *tdb)
+{
+	void *p = tdb->file->map_ptr;
+	size_t len = tdb->file->map_size;
+
+	if (!p || (tdb->flags & TDB_INTERNAL))
+		return;
+
+#ifdef MADV_RANDOM
+	if (tdb->mmap_policy & TDB_MMAP_RANDOM)
+		madvise(p, len, MADV_RANDOM);
+	else if (tdb->mmap_policy & TDB_MMAP_SEQUENTIAL)
+		madvise(p, len, MADV_SEQUENTIAL);
+	else
+		madvise(p, len, MADV_NORMAL);
+#endif
+#ifdef MADV_HUGEPAGE
+	if (tdb->mmap_policy & TDB_MMAP_HUGEPAGE)
+		madvise(p, len, MADV_HUGEPAGE);
+#endif
+}
+
 void tdb_mmap(struct tdb_context *tdb)
 {
 	int mmap_flags;
@@ -59,7 +93,8 @@ void tdb_mmap(struct tdb_context *tdb)
 	if ((size_t)tdb->file->map_size == tdb->file->map_size) {
 		tdb->file->map_ptr = mmap(NULL, tdb->file->map_size,
 					  mmap_flags,
-					  MAP_SHARED, tdb->file->fd, 0);
+					  MAP_SHARED | tdb_map_populate(tdb),
+					  tdb->file->fd, 0);
 	} else
 		tdb->file->map_ptr = MAP_FAILED;
 
@@ -71,7 +106,8 @@ void tdb_mmap(struct tdb_context *tdb)
 		tdb_logerr(tdb, TDB_SUCCESS, TDB_LOG_WARNING,
 			   "tdb_mmap failed for size %lld (%s)",
 			   (long long)tdb->file->map_size, strerror(errno));
-	}
+	} else
+		tdb_mmap_advise(tdb);
 }
 
 /* check for an out of bounds access - if it is out of bounds then
@@ -94,16 +130,14 @@ static enum TDB_ERROR tdb_oob(struct tdb_context *tdb, tdb_off_t len,
 
 	if (len <= tdb->file->map_size)
 		return TDB_SUCCESS;
-	if (tdb->flags & TDB_INTERNAL) {
+
+	/* A snapshot never grows, and may not even have a file. */
+	if (tdb->flags & TDB_SNAPSHOT) {
 		if (probe)
 			return TDB_SUCCESS;
-
-		tdb_logerr(tdb, TDB_ERR_IO, TDB_LOG_ERROR,
-			   "tdb_oob len %lld beyond internal"
-			   " malloc size %lld",
-			   (long long)len,
-			   (long long)tdb->file->map_size);
-		return TDB_ERR_IO;
+		return tdb_logerr(tdb, TDB_ERR_IO, TDB_LOG_ERROR,
+				  "tdb_oob len %zu beyond snapshot size %zu",
+				  (size_t)len, (size_t)tdb->file->map_size);
 	}
 
 	ecode = tdb_lock_expand(tdb, F_RDLCK);
@@ -421,35 +455,23 @@ static enum TDB_ERROR tdb_expand_file(struct tdb_context *tdb,
 				  "Expand on read-only database");
 	}
 
-	if (tdb->flags & TDB_INTERNAL) {
-		char *new = realloc(tdb->file->map_ptr,
-				    tdb->file->map_size + addition);
-		if (!new) {
-			return tdb_logerr(tdb, TDB_ERR_OOM, TDB_LOG_ERROR,
-					  "No memory to expand database");
-		}
-		tdb->file->map_ptr = new;
-		tdb->file->map_size += addition;
-	} else {
-		/* Unmap before trying to write; old TDB claimed OpenBSD had
-		 * problem with this otherwise. */
-		tdb_munmap(tdb->file);
-
-		/* If this fails, we try to fill anyway. */
-		if (ftruncate(tdb->file->fd, tdb->file->map_size + addition))
-			;
-
-		/* now fill the file with something. This ensures that the
-		   file isn't sparse, which would be very bad if we ran out of
-		   disk. This must be done with write, not via mmap */
-		memset(buf, 0x43, sizeof(buf));
-		ecode = fill(tdb, buf, sizeof(buf), tdb->file->map_size,
-			     addition);
-		if (ecode != TDB_SUCCESS)
-			return ecode;
-		tdb->file->map_size += addition;
-		tdb_mmap(tdb);
-	}
+	/* Unmap before trying to write; old TDB claimed OpenBSD had
+	 * problem with this otherwise. */
+	tdb_munmap(tdb->file);
+
+	/* If this fails, we try to fill anyway. */
+	if (ftruncate(tdb->file->fd, tdb->file->map_size + addition))
+		;
+
+	/* now fill the file with something. This ensures that the
+	   file isn't sparse, which would be very bad if we ran out of
+	   disk. This must be done with write, not via mmap */
+	memset(buf, 0x43, sizeof(buf));
+	ecode = fill(tdb, buf, sizeof(buf), tdb->file->map_size, addition);
+	if (ecode != TDB_SUCCESS)
+		return ecode;
+	tdb->file->map_size += addition;
+	tdb_mmap(tdb);
 	return TDB_SUCCESS;
 }
 
@@ -622,10 +644,131 @@ static const struct tdb_methods io_methods = {
 	tdb_direct,
 };
 
+/* Internal databases live in anonymous memory.  There's no file, no other
+ * process and no locking, so they don't need to go near fstat or remap, and
+ * with mremap() we can grow them without copying the old contents. */
+void *tdb_internal_alloc(size_t len)
+{
+#if HAVE_MREMAP
+	void *p = mmap(NULL, len, PROT_READ|PROT_WRITE,
+		       MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	return p;
+#else
+	return malloc(len);
+#endif
+}
+
+void tdb_internal_free(struct tdb_context *tdb)
+{
+	/* TDB1 internal databases are always malloc'ed. */
+#if HAVE_MREMAP
+	if (!(tdb->flags & TDB_VERSION1)) {
+		munmap(tdb->file->map_ptr, tdb->file->map_size);
+		tdb->file->map_ptr = NULL;
+		return;
+	}
+#endif
+	free(tdb->file->map_ptr);
+	tdb->file->map_ptr = NULL;
+}
+
+static enum TDB_ERROR internal_oob(struct tdb_context *tdb, tdb_off_t len,
+				   bool probe)
+{
+	if (likely(len <= tdb->file->map_size) || probe)
+		return TDB_SUCCESS;
+
+	return tdb_logerr(tdb, TDB_ERR_IO, TDB_LOG_ERROR,
+			  "tdb_oob len %lld beyond internal alloc size %lld",
+			  (long long)len, (long long)tdb->file->map_size);
+}
+
+static enum TDB_ERROR internal_read(struct tdb_context *tdb, tdb_off_t off,
+				    void *buf, tdb_len_t len)
+{
+	enum TDB_ERROR ecode;
+
+	ecode = internal_oob(tdb, off + len, false);
+	if (unlikely(ecode != TDB_SUCCESS)) {
+		return ecode;
+	}
+	memcpy(buf, off + (char *)tdb->file->map_ptr, len);
+	return TDB_SUCCESS;
+}
+
+static enum TDB_ERROR internal_write(struct tdb_context *tdb, tdb_off_t off,
+				     const void *buf, tdb_len_t len)
+{
+	enum TDB_ERROR ecode;
+
+	if (tdb->flags & TDB_RDONLY) {
+		return tdb_logerr(tdb, TDB_ERR_RDONLY, TDB_LOG_USE_ERROR,
+				  "Write to read-only database");
+	}
+
+	ecode = internal_oob(tdb, off + len, false);
+	if (unlikely(ecode != TDB_SUCCESS)) {
+		return ecode;
+	}
+	memcpy(off + (char *)tdb->file->map_ptr, buf, len);
+	return TDB_SUCCESS;
+}
+
+static enum TDB_ERROR internal_expand_file(struct tdb_context *tdb,
+					   tdb_len_t addition)
+{
+	char *new;
+
+	if (tdb->flags & TDB_RDONLY) {
+		return tdb_logerr(tdb, TDB_ERR_RDONLY, TDB_LOG_USE_ERROR,
+				  "Expand on read-only database");
+	}
+
+#if HAVE_MREMAP
+	new = mremap(tdb->file->map_ptr, tdb->file->map_size,
+		     tdb->file->map_size + addition, MREMAP_MAYMOVE);
+	if (new == MAP_FAILED)
+		new = NULL;
+#else
+	new = realloc(tdb->file->map_ptr, tdb->file->map_size + addition);
+#endif
+	if (!new) {
+		return tdb_logerr(tdb, TDB_ERR_OOM, TDB_LOG_ERROR,
+				  "No memory to expand database");
+	}
+	tdb->file->map_ptr = new;
+	tdb->file->map_size += addition;
+	return TDB_SUCCESS;
+}
+
+static void *internal_direct(struct tdb_context *tdb, tdb_off_t off,
+			     size_t len, bool write_mode)
+{
+	enum TDB_ERROR ecode;
+
+	ecode = internal_oob(tdb, off + len, false);
+	if (unlikely(ecode != TDB_SUCCESS))
+		return TDB_ERR_PTR(ecode);
+	return (char *)tdb->file->map_ptr + off;
+}
+
+static const struct tdb_methods internal_methods = {
+	internal_read,
+	internal_write,
+	internal_oob,
+	internal_expand_file,
+	internal_direct,
+};
+
 /*
   initialise the default methods table
 */
 void tdb_io_init(struct tdb_context *tdb)
 {
-	tdb->tdb2.io = &io_methods;
+	if (tdb->flags & TDB_INTERNAL)
+		tdb->tdb2.io = &internal_methods;
+	else
+		tdb->tdb2.io = &io_methods;
 }
@@ -650,6 +650,17 @@ void tdb_unlock_expand(struct tdb_context *tdb, int ltype)
 	tdb_nest_unlock(tdb, TDB_EXPANSION_LOCK, ltype);
 }
 
+enum TDB_ERROR tdb_lock_changelog(struct tdb_context *tdb, int ltype)
+{
+	/* The committer already holds the allrecord lock. */
+	return tdb_nest_lock(tdb, TDB_CHANGELOG_LOCK, ltype, TDB_LOCK_WAIT);
+}
+
+void tdb_unlock_changelog(struct tdb_context *tdb, int ltype)
+{
+	tdb_nest_unlock(tdb, TDB_CHANGELOG_LOCK, ltype);
+}
+
 /* unlock entire db */
 void tdb_allrecord_unlock(struct tdb_context *tdb, int ltype)
 {
@@ -853,21 +864,25 @@ void tdb_unlock_free_bucket(struct tdb_context *tdb, tdb_off_t b_off)
 
 enum TDB_ERROR tdb_lockall(struct tdb_context *tdb)
 {
+	tdb_trace(tdb, "tdb_lockall");
 	return tdb_allrecord_lock(tdb, F_WRLCK, TDB_LOCK_WAIT, false);
 }
 
 void tdb_unlockall(struct tdb_context *tdb)
 {
+	tdb_trace(tdb, "tdb_unlockall");
 	tdb_allrecord_unlock(tdb, F_WRLCK);
 }
 
 enum TDB_ERROR tdb_lockall_read(struct tdb_context *tdb)
 {
+	tdb_trace(tdb, "tdb_lockall_read");
 	return tdb_allrecord_lock(tdb, F_RDLCK, TDB_LOCK_WAIT, false);
 }
 
 void tdb_unlockall_read(struct tdb_context *tdb)
 {
+	tdb_trace(tdb, "tdb_unlockall_read");
 	tdb_allrecord_unlock(tdb, F_RDLCK);
 }
 
@@ -18,6 +18,10 @@
 #include "private.h"
 #include <ccan/build_assert/build_assert.h>
 #include <assert.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 
 /* all tdbs, to detect double-opens (fcntl file don't nest!) */
 static struct tdb_context *tdbs = NULL;
@@ -103,6 +107,10 @@ static void tdb2_context_init(struct tdb_context *tdb)
 	tdb->tdb2.direct_access = 0;
 	tdb->tdb2.transaction = NULL;
 	tdb->tdb2.access = NULL;
+	tdb->tdb2.changelog = 0;
+	tdb->tdb2.changelog_map = NULL;
+	tdb->tdb2.small = 0;
+	tdb->tdb2.small_slots = 0;
 }
 
 struct new_database {
@@ -110,15 +118,35 @@ struct new_database {
 	struct tdb_freetable ftable;
 };
 
+static enum TDB_ERROR write_new(struct tdb_context *tdb,
+			        const void *buf, size_t len)
+{
+	ssize_t rlen = write(tdb->file->fd, buf, len);
+
+	if (rlen != len) {
+		if (rlen >= 0)
+			errno = ENOSPC;
+		return tdb_logerr(tdb, TDB_ERR_IO, TDB_LOG_ERROR,
+				  "tdb_new_database: %zi writing header: %s",
+				  rlen, strerror(errno));
+	}
+	return TDB_SUCCESS;
+}
+
 /* initialise a new database */
 static enum TDB_ERROR tdb_new_database(struct tdb_context *tdb,
 				       struct tdb_attribute_seed *seed,
+				       struct tdb_attribute_changelog *clog,
+				       struct tdb_attribute_small *small,
 				       struct tdb_header *hdr)
 {
 	/* We make it up in memory, then write it out if not internal */
 	struct new_database newdb;
+	struct tdb_changelog *changelog = NULL;
+	struct tdb_small *slab = NULL;
+	tdb_len_t clen = 0, slen = 0;
+	tdb_off_t slab_off;
 	unsigned int magic_len;
-	ssize_t rlen;
 	enum TDB_ERROR ecode;
 
 	/* Fill in the header */
@@ -151,6 +179,75 @@ static enum TDB_ERROR tdb_new_database(struct tdb_context *tdb,
 		return ecode;
 	}
 
+	/* Changelog (empty) goes straight after the free table. */
+	if (clog) {
+		uint64_t key_room = (clog->key_len + 7) & ~7ULL;
+
+		clen = sizeof(*changelog) + clog->entries
+			* (sizeof(struct tdb_changelog_entry) + key_room);
+		changelog = calloc(clen, 1);
+		if (!changelog) {
+			return tdb_logerr(tdb, TDB_ERR_OOM, TDB_LOG_ERROR,
+					  "tdb_new_database:"
+					  " failed to allocate changelog");
+		}
+		ecode = set_header(NULL, &changelog->cap.hdr, TDB_CAP_MAGIC, 0,
+				   clen - sizeof(changelog->cap.hdr),
+				   clen - sizeof(changelog->cap.hdr), 0);
+		if (ecode != TDB_SUCCESS) {
+			free(changelog);
+			return ecode;
+		}
+		/* Older tdbs would not update it, so can't write. */
+		changelog->cap.type = TDB_CAP_CHANGELOG | TDB_CAP_NOWRITE;
+		changelog->cap.next = 0;
+		changelog->num_entries = clog->entries;
+		changelog->key_room = key_room;
+		changelog->last = 0;
+		newdb.hdr.capabilities = sizeof(newdb);
+	}
+
+	/* Then the (empty) small slots, cache-line aligned in the file. */
+	slab_off = sizeof(newdb) + clen;
+	if (small) {
+		uint64_t num = (small->slots + TDB_SMALL_REGIONS - 1)
+			/ TDB_SMALL_REGIONS * TDB_SMALL_REGIONS;
+		tdb_off_t slots;
+
+		if (num < TDB_SMALL_REGIONS * TDB_SMALL_PROBE)
+			num = TDB_SMALL_REGIONS * TDB_SMALL_PROBE;
+		slots = (slab_off + sizeof(*slab) + TDB_SMALL_SLOT - 1)
+			/ TDB_SMALL_SLOT * TDB_SMALL_SLOT;
+		slen = slots - slab_off + num * TDB_SMALL_SLOT;
+		slab = calloc(slen, 1);
+		if (!slab) {
+			free(changelog);
+			return tdb_logerr(tdb, TDB_ERR_OOM, TDB_LOG_ERROR,
+					  "tdb_new_database:"
+					  " failed to allocate small slots");
+		}
+		ecode = set_header(NULL, &slab->cap.hdr, TDB_CAP_MAGIC, 0,
+				   slen - sizeof(slab->cap.hdr),
+				   slen - sizeof(slab->cap.hdr), 0);
+		if (ecode != TDB_SUCCESS) {
+			free(changelog);
+			free(slab);
+			return ecode;
+		}
+		/* Older tdbs would miss records in the slots entirely. */
+		slab->cap.type = TDB_CAP_SMALL | TDB_CAP_NOOPEN;
+		slab->cap.next = 0;
+		slab->num_slots = num;
+		slab->slots = slots;
+		tdb_convert(tdb, slab, sizeof(*slab));
+		if (changelog)
+			changelog->cap.next = slab_off;
+		else
+			newdb.hdr.capabilities = slab_off;
+	}
+	if (changelog)
+		tdb_convert(tdb, changelog, sizeof(*changelog));
+
 	/* Magic food */
 	memset(newdb.hdr.magic_food, 0, sizeof(newdb.hdr.magic_food));
 	strcpy(newdb.hdr.magic_food, TDB_MAGIC_FOOD);
@@ -163,37 +260,47 @@ static enum TDB_ERROR tdb_new_database(struct tdb_context *tdb,
 	*hdr = newdb.hdr;
 
 	if (tdb->flags & TDB_INTERNAL) {
-		tdb->file->map_size = sizeof(newdb);
-		tdb->file->map_ptr = malloc(tdb->file->map_size);
+		tdb->file->map_size = sizeof(newdb) + clen + slen;
+		tdb->file->map_ptr = tdb_internal_alloc(tdb->file->map_size);
 		if (!tdb->file->map_ptr) {
+			free(changelog);
+			free(slab);
 			return tdb_logerr(tdb, TDB_ERR_OOM, TDB_LOG_ERROR,
 					  "tdb_new_database:"
 					  " failed to allocate");
 		}
-		memcpy(tdb->file->map_ptr, &newdb, tdb->file->map_size);
+		memcpy(tdb->file->map_ptr, &newdb, sizeof(newdb));
+		memcpy((char *)tdb->file->map_ptr + sizeof(newdb),
+		       changelog, clen);
+		memcpy((char *)tdb->file->map_ptr + slab_off, slab, slen);
+		free(changelog);
+		free(slab);
 		return TDB_SUCCESS;
 	}
 	if (lseek(tdb->file->fd, 0, SEEK_SET) == -1) {
+		free(changelog);
+		free(slab);
 		return tdb_logerr(tdb, TDB_ERR_IO, TDB_LOG_ERROR,
 				  "tdb_new_database:"
 				  " failed to seek: %s", strerror(errno));
 	}
 
 	if (ftruncate(tdb->file->fd, 0) == -1) {
+		free(changelog);
+		free(slab);
 		return tdb_logerr(tdb, TDB_ERR_IO, TDB_LOG_ERROR,
 				  "tdb_new_database:"
 				  " failed to truncate: %s", strerror(errno));
 	}
 
-	rlen = write(tdb->file->fd, &newdb, sizeof(newdb));
-	if (rlen != sizeof(newdb)) {
-		if (rlen >= 0)
-			errno = ENOSPC;
-		return tdb_logerr(tdb, TDB_ERR_IO, TDB_LOG_ERROR,
-				  "tdb_new_database: %zi writing header: %s",
-				  rlen, strerror(errno));
-	}
-	return TDB_SUCCESS;
+	ecode = write_new(tdb, &newdb, sizeof(newdb));
+	if (ecode == TDB_SUCCESS && changelog)
+		ecode = write_new(tdb, changelog, clen);
+	if (ecode == TDB_SUCCESS && slab)
+		ecode = write_new(tdb, slab, slen);
+	free(changelog);
+	free(slab);
+	return ecode;
 }
 
 static enum TDB_ERROR tdb_new_file(struct tdb_context *tdb)
@@ -221,6 +328,8 @@ enum TDB_ERROR tdb_set_attribute(struct tdb_context *tdb,
 	case TDB_ATTRIBUTE_HASH:
 	case TDB_ATTRIBUTE_SEED:
 	case TDB_ATTRIBUTE_OPENHOOK:
+	case TDB_ATTRIBUTE_CHANGELOG:
+	case TDB_ATTRIBUTE_SMALL:
 	case TDB_ATTRIBUTE_TDB1_HASHSIZE:
 		return tdb->last_error
 			= tdb_logerr(tdb, TDB_ERR_EINVAL,
@@ -233,6 +342,10 @@ enum TDB_ERROR tdb_set_attribute(struct tdb_context *tdb,
 				     ? "TDB_ATTRIBUTE_SEED"
 				     : attr->base.attr == TDB_ATTRIBUTE_OPENHOOK
 				     ? "TDB_ATTRIBUTE_OPENHOOK"
+				     : attr->base.attr == TDB_ATTRIBUTE_CHANGELOG
+				     ? "TDB_ATTRIBUTE_CHANGELOG"
+				     : attr->base.attr == TDB_ATTRIBUTE_SMALL
+				     ? "TDB_ATTRIBUTE_SMALL"
 				     : "TDB_ATTRIBUTE_TDB1_HASHSIZE");
 	case TDB_ATTRIBUTE_STATS:
 		return tdb->last_error
@@ -245,6 +358,30 @@ enum TDB_ERROR tdb_set_attribute(struct tdb_context *tdb,
 		tdb->unlock_fn = attr->flock.unlock;
 		tdb->lock_data = attr->flock.data;
 		break;
+	case TDB_ATTRIBUTE_MMAP:
+		if ((attr->mmap.flags & ~(TDB_MMAP_RANDOM|TDB_MMAP_SEQUENTIAL
+					  |TDB_MMAP_POPULATE
+					  |TDB_MMAP_HUGEPAGE))
+		    || ((attr->mmap.flags & TDB_MMAP_RANDOM)
+			&& (attr->mmap.flags & TDB_MMAP_SEQUENTIAL)))
+			return tdb->last_error
+				= tdb_logerr(tdb, TDB_ERR_EINVAL,
+					     TDB_LOG_USE_ERROR,
+					     "tdb_set_attribute:"
+					     " invalid TDB_ATTRIBUTE_MMAP"
+					     " flags %u", attr->mmap.flags);
+		tdb->mmap_policy = attr->mmap.flags;
+		/* During tdb_open, tdb_mmap() does this. */
+		if (tdb->file) {
+#ifdef MADV_WILLNEED
+			if ((tdb->mmap_policy & TDB_MMAP_POPULATE)
+			    && tdb->file->map_ptr)
+				madvise(tdb->file->map_ptr,
+					tdb->file->map_size, MADV_WILLNEED);
+#endif
+			tdb_mmap_advise(tdb);
+		}
+		break;
 	default:
 		return tdb->last_error
 			= tdb_logerr(tdb, TDB_ERR_EINVAL,
@@ -298,6 +435,20 @@ enum TDB_ERROR tdb_get_attribute(struct tdb_context *tdb,
 		attr->flock.unlock = tdb->unlock_fn;
 		attr->flock.data = tdb->lock_data;
 		break;
+	case TDB_ATTRIBUTE_CHANGELOG:
+		if ((tdb->flags & TDB_VERSION1) || !tdb->tdb2.changelog)
+			return tdb->last_error = TDB_ERR_NOEXIST;
+		attr->changelog.entries = tdb->tdb2.changelog_entries;
+		attr->changelog.key_len = tdb->tdb2.changelog_key_room;
+		break;
+	case TDB_ATTRIBUTE_SMALL:
+		if ((tdb->flags & TDB_VERSION1) || !tdb->tdb2.small)
+			return tdb->last_error = TDB_ERR_NOEXIST;
+		attr->small.slots = tdb->tdb2.small_slots;
+		break;
+	case TDB_ATTRIBUTE_MMAP:
+		attr->mmap.flags = tdb->mmap_policy;
+		break;
 	case TDB_ATTRIBUTE_TDB1_HASHSIZE:
 		if (!(tdb->flags & TDB_VERSION1))
 			return tdb->last_error
@@ -332,6 +483,8 @@ void tdb_unset_attribute(struct tdb_context *tdb,
 		break;
 	case TDB_ATTRIBUTE_HASH:
 	case TDB_ATTRIBUTE_SEED:
+	case TDB_ATTRIBUTE_CHANGELOG:
+	case TDB_ATTRIBUTE_SMALL:
 	case TDB_ATTRIBUTE_TDB1_HASHSIZE:
 		tdb_logerr(tdb, TDB_ERR_EINVAL, TDB_LOG_USE_ERROR,
 			   "tdb_unset_attribute: cannot unset %s after opening",
@@ -339,6 +492,10 @@ void tdb_unset_attribute(struct tdb_context *tdb,
 			   ? "TDB_ATTRIBUTE_HASH"
 			   : type == TDB_ATTRIBUTE_SEED
 			   ? "TDB_ATTRIBUTE_SEED"
+			   : type == TDB_ATTRIBUTE_CHANGELOG
+			   ? "TDB_ATTRIBUTE_CHANGELOG"
+			   : type == TDB_ATTRIBUTE_SMALL
+			   ? "TDB_ATTRIBUTE_SMALL"
 			   : "TDB_ATTRIBUTE_TDB1_HASHSIZE");
 		break;
 	case TDB_ATTRIBUTE_STATS:
@@ -351,6 +508,11 @@ void tdb_unset_attribute(struct tdb_context *tdb,
 		tdb->lock_fn = tdb_fcntl_lock;
 		tdb->unlock_fn = tdb_fcntl_unlock;
 		break;
+	case TDB_ATTRIBUTE_MMAP:
+		tdb->mmap_policy = 0;
+		if (tdb->file)
+			tdb_mmap_advise(tdb);
+		break;
 	default:
 		tdb_logerr(tdb, TDB_ERR_EINVAL,
 			   TDB_LOG_USE_ERROR,
@@ -399,10 +561,56 @@ enum TDB_ERROR unknown_capability(struct tdb_context *tdb, const char *caller,
 	return TDB_SUCCESS;
 }
 
+static enum TDB_ERROR changelog_ok(struct tdb_context *tdb, tdb_off_t off)
+{
+	struct tdb_changelog clog;
+	enum TDB_ERROR ecode;
+
+	ecode = tdb_read_convert(tdb, off, &clog, sizeof(clog));
+	if (ecode != TDB_SUCCESS)
+		return ecode;
+
+	if (clog.num_entries == 0 || clog.key_room % 8 != 0) {
+		return tdb_logerr(tdb, TDB_ERR_CORRUPT, TDB_LOG_ERROR,
+				  "tdb_open: invalid changelog %llu/%llu",
+				  (long long)clog.num_entries,
+				  (long long)clog.key_room);
+	}
+	tdb->tdb2.changelog = off;
+	tdb->tdb2.changelog_entries = clog.num_entries;
+	tdb->tdb2.changelog_key_room = clog.key_room;
+	return TDB_SUCCESS;
+}
+
+static enum TDB_ERROR small_ok(struct tdb_context *tdb, tdb_off_t off)
+{
+	struct tdb_small slab;
+	enum TDB_ERROR ecode;
+
+	ecode = tdb_read_convert(tdb, off, &slab, sizeof(slab));
+	if (ecode != TDB_SUCCESS)
+		return ecode;
+
+	if (slab.num_slots < TDB_SMALL_REGIONS * TDB_SMALL_PROBE
+	    || slab.num_slots % TDB_SMALL_REGIONS != 0
+	    || slab.slots % TDB_SMALL_SLOT != 0
+	    || slab.slots < off + sizeof(slab)
+	    || slab.slots + slab.num_slots * TDB_SMALL_SLOT
+	    > off + sizeof(slab.cap.hdr) + rec_data_length(&slab.cap.hdr)) {
+		return tdb_logerr(tdb, TDB_ERR_CORRUPT, TDB_LOG_ERROR,
+				  "tdb_open: invalid small slots %llu@%llu",
+				  (long long)slab.num_slots,
+				  (long long)slab.slots);
+	}
+	tdb->tdb2.small = slab.slots;
+	tdb->tdb2.small_slots = slab.num_slots;
+	return TDB_SUCCESS;
+}
+
 static enum TDB_ERROR capabilities_ok(struct tdb_context *tdb,
 				      tdb_off_t capabilities)
 {
-	tdb_off_t off, next;
+	tdb_off_t off, next, type;
 	enum TDB_ERROR ecode = TDB_SUCCESS;
 	const struct tdb_capability *cap;
 
@@ -412,18 +620,137 @@ static enum TDB_ERROR capabilities_ok(struct tdb_context *tdb,
 		if (TDB_PTR_IS_ERR(cap)) {
 			return TDB_PTR_ERR(cap);
 		}
+		type = cap->type;
+		next = cap->next;
+		/* Release before reading more: we can't hold a pointer
+		 * into the map while it might be remapped. */
+		tdb_access_release(tdb, cap);
 
-		switch (cap->type & TDB_CAP_TYPE_MASK) {
-		/* We don't understand any capabilities (yet). */
+		switch (type & TDB_CAP_TYPE_MASK) {
+		case TDB_CAP_CHANGELOG:
+			ecode = changelog_ok(tdb, off);
+			break;
+		case TDB_CAP_SMALL:
+			ecode = small_ok(tdb, off);
+			break;
 		default:
-			ecode = unknown_capability(tdb, "tdb_open", cap->type);
+			ecode = unknown_capability(tdb, "tdb_open", type);
 		}
-		next = cap->next;
-		tdb_access_release(tdb, cap);
 	}
 	return ecode;
 }
 
+/* Share the file's blocks with a new, unlinked file, if the filesystem
+ * can (btrfs, xfs...).  Returns the new fd, or -1. */
+static int clone_file(const char *name, int fd)
+{
+#if defined(FICLONE) && defined(O_TMPFILE)
+	const char *slash = strrchr(name, '/');
+	char dir[slash ? slash - name + 2 : 2];
+	int clone;
+
+	if (slash) {
+		memcpy(dir, name, slash - name + 1);
+		dir[slash - name + 1] = '\0';
+	} else
+		strcpy(dir, ".");
+
+	clone = open(dir, O_TMPFILE|O_RDWR, 0600);
+	if (clone == -1)
+		return -1;
+	if (ioctl(clone, FICLONE, fd) == -1) {
+		close(clone);
+		return -1;
+	}
+	fcntl(clone, F_SETFD, fcntl(clone, F_GETFD, 0) | FD_CLOEXEC);
+	return clone;
+#else
+	return -1;
+#endif
+}
+
+/* Otherwise, a private mapping with every page written to, so none of it
+ * is shared with the file any more. */
+static void *private_copy(int fd, size_t len)
+{
+	volatile unsigned char *p;
+	size_t off, pagesize = getpagesize();
+
+	p = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	for (off = 0; off < len; off += pagesize)
+		p[off] = p[off];
+	return (void *)p;
+}
+
+/* Replace tdb->file with a frozen copy.  A read lock on every record is
+ * enough: writers, transaction commits and recovery all need write locks.
+ * Afterwards nothing refers to the live file, so we never lock again. */
+static enum TDB_ERROR tdb_snapshot(struct tdb_context *tdb)
+{
+	struct tdb_file *live = tdb->file, *snap = NULL;
+	enum TDB_ERROR ecode;
+
+	if (tdb->flags & TDB_VERSION1) {
+		if (tdb1_allrecord_lock(tdb, F_RDLCK, TDB_LOCK_WAIT, false))
+			return tdb->last_error;
+		/* It may have grown since we mapped it. */
+		ecode = tdb1_probe_length(tdb);
+	} else {
+		ecode = tdb_allrecord_lock(tdb, F_RDLCK, TDB_LOCK_WAIT, false);
+		if (ecode != TDB_SUCCESS)
+			return ecode;
+		ecode = tdb->tdb2.io->oob(tdb, tdb->file->map_size + 1, true);
+	}
+	if (ecode != TDB_SUCCESS)
+		goto unlock;
+
+	ecode = tdb_new_file(tdb);
+	snap = tdb->file;
+	tdb->file = live;
+	if (ecode != TDB_SUCCESS)
+		goto unlock;
+
+	snap->locker = live->locker;
+	snap->map_size = live->map_size;
+	/* No later tdb_open will share this. */
+	snap->device = 0;
+	snap->inode = 0;
+	snap->fd = clone_file(tdb->name, live->fd);
+	if (snap->fd == -1) {
+		snap->map_ptr = private_copy(live->fd, live->map_size);
+		if (!snap->map_ptr) {
+			ecode = tdb_logerr(tdb, TDB_ERR_IO, TDB_LOG_ERROR,
+					   "tdb_open: could not copy %s: %s",
+					   tdb->name, strerror(errno));
+			free(snap);
+		}
+	}
+
+unlock:
+	if (tdb->flags & TDB_VERSION1)
+		tdb1_allrecord_unlock(tdb, F_RDLCK);
+	else
+		tdb_allrecord_unlock(tdb, F_RDLCK);
+	if (ecode != TDB_SUCCESS)
+		return ecode;
+
+	/* Let go of the live file. */
+	tdb_lock_cleanup(tdb);
+	if (--live->refcnt == 0) {
+		tdb_munmap(live);
+		close(live->fd);
+		free(live->lockrecs);
+		free(live);
+	}
+	tdb->file = snap;
+	tdb->flags |= (TDB_NOLOCK | TDB_SNAPSHOT);
+	if (snap->fd != -1)
+		tdb_mmap(tdb);
+	return TDB_SUCCESS;
+}
+
 struct tdb_context *tdb_open(const char *name, int tdb_flags,
 			     int open_flags, mode_t mode,
 			     union tdb_attribute *attr)
@@ -436,6 +763,8 @@ struct tdb_context *tdb_open(const char *name, int tdb_flags,
 	ssize_t rlen;
 	struct tdb_header hdr;
 	struct tdb_attribute_seed *seed = NULL;
+	struct tdb_attribute_changelog *clog = NULL;
+	struct tdb_attribute_small *small = NULL;
 	struct tdb_attribute_tdb1_hashsize *hsize_attr = NULL;
 	struct tdb_attribute_tdb1_max_dead *maxsize_attr = NULL;
 	tdb_bool_err berr;
@@ -455,10 +784,14 @@ struct tdb_context *tdb_open(const char *name, int tdb_flags,
 		tdb->name = NULL;
 	}
 	tdb->flags = tdb_flags;
+	tdb->mmap_policy = 0;
 	tdb->log_fn = NULL;
 	tdb->open_flags = open_flags;
 	tdb->last_error = TDB_SUCCESS;
 	tdb->file = NULL;
+#ifdef TDB_TRACE
+	tdb->tracefd = -1;
+#endif
 	tdb->openhook = NULL;
 	tdb->lock_fn = tdb_fcntl_lock;
 	tdb->unlock_fn = tdb_fcntl_unlock;
@@ -480,6 +813,12 @@ struct tdb_context *tdb_open(const char *name, int tdb_flags,
 			tdb->openhook = attr->openhook.fn;
 			tdb->openhook_data = attr->openhook.data;
 			break;
+		case TDB_ATTRIBUTE_CHANGELOG:
+			clog = &attr->changelog;
+			break;
+		case TDB_ATTRIBUTE_SMALL:
+			small = &attr->small;
+			break;
 		case TDB_ATTRIBUTE_TDB1_HASHSIZE:
 			hsize_attr = &attr->tdb1_hashsize;
 			break;
@@ -497,12 +836,23 @@ struct tdb_context *tdb_open(const char *name, int tdb_flags,
 
 	if (tdb_flags & ~(TDB_INTERNAL | TDB_NOLOCK | TDB_NOMMAP | TDB_CONVERT
 			  | TDB_NOSYNC | TDB_SEQNUM | TDB_ALLOW_NESTING
-			  | TDB_RDONLY | TDB_VERSION1)) {
+			  | TDB_RDONLY | TDB_VERSION1 | TDB_SNAPSHOT)) {
 		ecode = tdb_logerr(tdb, TDB_ERR_EINVAL, TDB_LOG_USE_ERROR,
 				   "tdb_open: unknown flags %u", tdb_flags);
 		goto fail;
 	}
 
+	/* Set by tdb_snapshot() once there is one. */
+	tdb->flags &= ~TDB_SNAPSHOT;
+	if ((tdb_flags & TDB_SNAPSHOT)
+	    && ((open_flags & O_ACCMODE) != O_RDONLY
+		|| (tdb_flags & TDB_INTERNAL))) {
+		ecode = tdb_logerr(tdb, TDB_ERR_EINVAL, TDB_LOG_USE_ERROR,
+				   "tdb_open: TDB_SNAPSHOT needs O_RDONLY,"
+				   " and can't be internal");
+		goto fail;
+	}
+
 	if (hsize_attr) {
 		if (!(tdb_flags & TDB_VERSION1) ||
 		    (!(tdb_flags & TDB_INTERNAL) && !(open_flags & O_CREAT))) {
@@ -534,6 +884,51 @@ struct tdb_context *tdb_open(const char *name, int tdb_flags,
 		}
 	}
 
+	if (clog) {
+		if (tdb_flags & TDB_VERSION1) {
+			ecode = tdb_logerr(tdb, TDB_ERR_EINVAL,
+					   TDB_LOG_USE_ERROR,
+					   "tdb_open:"
+					   " cannot set TDB_ATTRIBUTE_CHANGELOG"
+					   " on TDB1 tdb.");
+			goto fail;
+		} else if (!(tdb_flags & TDB_INTERNAL)
+			   && !(open_flags & O_CREAT)) {
+			ecode = tdb_logerr(tdb, TDB_ERR_EINVAL,
+					   TDB_LOG_USE_ERROR,
+					   "tdb_open:"
+					   " cannot set TDB_ATTRIBUTE_CHANGELOG"
+					   " without O_CREAT.");
+			goto fail;
+		} else if (clog->entries == 0) {
+			ecode = tdb_logerr(tdb, TDB_ERR_EINVAL,
+					   TDB_LOG_USE_ERROR,
+					   "tdb_open:"
+					   " TDB_ATTRIBUTE_CHANGELOG"
+					   " needs at least one entry");
+			goto fail;
+		}
+	}
+
+	if (small) {
+		if (tdb_flags & TDB_VERSION1) {
+			ecode = tdb_logerr(tdb, TDB_ERR_EINVAL,
+					   TDB_LOG_USE_ERROR,
+					   "tdb_open:"
+					   " cannot set TDB_ATTRIBUTE_SMALL"
+					   " on TDB1 tdb.");
+			goto fail;
+		} else if (!(tdb_flags & TDB_INTERNAL)
+			   && !(open_flags & O_CREAT)) {
+			ecode = tdb_logerr(tdb, TDB_ERR_EINVAL,
+					   TDB_LOG_USE_ERROR,
+					   "tdb_open:"
+					   " cannot set TDB_ATTRIBUTE_SMALL"
+					   " without O_CREAT.");
+			goto fail;
+		}
+	}
+
 	if ((open_flags & O_ACCMODE) == O_WRONLY) {
 		ecode = tdb_logerr(tdb, TDB_ERR_EINVAL, TDB_LOG_USE_ERROR,
 				   "tdb_open: can't open tdb %s write-only",
@@ -566,13 +961,13 @@ struct tdb_context *tdb_open(const char *name, int tdb_flags,
 		if (tdb->flags & TDB_VERSION1)
 			ecode = tdb1_new_database(tdb, hsize_attr, maxsize_attr);
 		else {
-			ecode = tdb_new_database(tdb, seed, &hdr);
+			ecode = tdb_new_database(tdb, seed, clog, small, &hdr);
 			if (ecode == TDB_SUCCESS) {
-				tdb_convert(tdb, &hdr.hash_seed,
-					    sizeof(hdr.hash_seed));
+				tdb_convert(tdb, &hdr, sizeof(hdr));
 				tdb->hash_seed = hdr.hash_seed;
 				tdb2_context_init(tdb);
 				tdb_ftable_init(tdb);
+				ecode = capabilities_ok(tdb, hdr.capabilities);
 			}
 		}
 		if (ecode != TDB_SUCCESS) {
@@ -649,7 +1044,7 @@ struct tdb_context *tdb_open(const char *name, int tdb_flags,
 				goto fail;
 			goto finished;
 		}
-		ecode = tdb_new_database(tdb, seed, &hdr);
+		ecode = tdb_new_database(tdb, seed, clog, small, &hdr);
 		if (ecode != TDB_SUCCESS) {
 			goto fail;
 		}
@@ -770,6 +1165,32 @@ finished:
 		if (ecode != TDB_SUCCESS) {
 			goto fail;
 		}
+
+#ifdef TDB_TRACE
+		{
+			char tracefile[strlen(name) + 32];
+
+			snprintf(tracefile, sizeof(tracefile),
+				 "%s.trace.%li", name, (long)getpid());
+			tdb->tracefd = open(tracefile,
+					    O_WRONLY|O_CREAT|O_EXCL, 0600);
+			if (tdb->tracefd >= 0) {
+				/* Seqnums order the traces of each process. */
+				tdb->flags |= TDB_SEQNUM;
+				tdb_trace_open(tdb, "tdb_open", 0, tdb_flags,
+					       open_flags);
+			} else
+				tdb_logerr(tdb, TDB_SUCCESS, TDB_LOG_WARNING,
+					   "tdb_open: failed to open trace"
+					   " file %s", tracefile);
+		}
+#endif
+	}
+
+	if (tdb_flags & TDB_SNAPSHOT) {
+		ecode = tdb_snapshot(tdb);
+		if (ecode != TDB_SUCCESS)
+			goto fail;
 	}
 
 	tdb->next = tdbs;
@@ -807,7 +1228,7 @@ fail_errno:
 			assert(tdb->file->num_lockrecs == 0);
 			if (tdb->file->map_ptr) {
 				if (tdb->flags & TDB_INTERNAL) {
-					free(tdb->file->map_ptr);
+					tdb_internal_free(tdb);
 				} else
 					tdb_munmap(tdb->file);
 			}
@@ -842,16 +1263,21 @@ int tdb_close(struct tdb_context *tdb)
 		}
 	}
 
+	if (!(tdb->flags & TDB_VERSION1) && tdb->tdb2.changelog_map)
+		munmap(tdb->tdb2.changelog_map, getpagesize());
+
 	if (tdb->file->map_ptr) {
 		if (tdb->flags & TDB_INTERNAL)
-			free(tdb->file->map_ptr);
+			tdb_internal_free(tdb);
 		else
 			tdb_munmap(tdb->file);
 	}
 	if (tdb->file) {
 		tdb_lock_cleanup(tdb);
 		if (--tdb->file->refcnt == 0) {
-			ret = close(tdb->file->fd);
+			/* Internal and copied snapshots have no fd. */
+			if (tdb->file->fd != -1)
+				ret = close(tdb->file->fd);
 			free(tdb->file->lockrecs);
 			free(tdb->file);
 		}
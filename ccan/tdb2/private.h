@@ -72,6 +72,10 @@ typedef uint64_t tdb_off_t;
 #define TDB_CAP_NOWRITE		0x4000000000000000ULL
 #define TDB_CAP_NOOPEN		0x2000000000000000ULL
 
+/* Capabilities we understand. */
+#define TDB_CAP_CHANGELOG	0x1001ULL
+#define TDB_CAP_SMALL		0x1002ULL
+
 #define TDB_OFF_IS_ERR(off) unlikely(off >= (tdb_off_t)(long)TDB_ERR_LAST)
 #define TDB_OFF_TO_ERR(off) ((enum TDB_ERROR)(long)(off))
 #define TDB_ERR_TO_OFF(ecode) ((tdb_off_t)(long)(ecode))
@@ -89,6 +93,8 @@ typedef int tdb_bool_err;
 #define TDB_OPEN_LOCK 0
 /* Expanding file. */
 #define TDB_EXPANSION_LOCK 2
+/* Reading the changelog, vs. committing to it (4 is TDB_CLEAR_IF_FIRST's). */
+#define TDB_CHANGELOG_LOCK 6
 /* Doing a transaction. */
 #define TDB_TRANSACTION_LOCK 8
 /* Hash chain locks. */
@@ -107,6 +113,13 @@ typedef int tdb_bool_err;
 /* This is currently 10: beyond this we chain. */
 #define TDB_MAX_LEVELS (1+(64-TDB_TOPLEVEL_HASH_BITS) / TDB_SUBLEVEL_HASH_BITS)
 
+/* Small record slab: each slot is one cache line, holding a whole record. */
+#define TDB_SMALL_SLOT 64
+/* How many slots we try for a key before using the hash table. */
+#define TDB_SMALL_PROBE 4
+/* One region of slots per top-level hash lock. */
+#define TDB_SMALL_REGIONS (1 << (TDB_TOPLEVEL_HASH_BITS - TDB_HASH_GROUP_BITS))
+
 /* Extend file by least 100 times larger than needed. */
 #define TDB_EXTENSION_FACTOR 100
 
@@ -257,6 +270,29 @@ struct tdb_capability {
 	/* ... */
 };
 
+/* A ring of recent changes: see tdb_changes(). */
+struct tdb_changelog {
+	struct tdb_capability cap; /* .type = TDB_CAP_CHANGELOG */
+	uint64_t num_entries;
+	uint64_t key_room; /* Multiple of 8 */
+	uint64_t last; /* Number of last change written (0 == none). */
+	/* struct tdb_changelog_entry + key_room bytes of key, num_entries times */
+};
+
+struct tdb_changelog_entry {
+	uint64_t changenum;
+	uint64_t hash;
+	uint64_t op_and_keylen; /* top 8 bits op, bottom 56 full key length */
+};
+
+/* Slots for tiny records, so a lookup only touches one cache line. */
+struct tdb_small {
+	struct tdb_capability cap; /* .type = TDB_CAP_SMALL */
+	uint64_t num_slots; /* Multiple of TDB_SMALL_REGIONS */
+	tdb_off_t slots; /* Aligned to TDB_SMALL_SLOT */
+	/* Each slot is a used record (or a zero magic_and_meta if empty). */
+};
+
 /* Information about a particular (locked) hash entry. */
 struct hash_info {
 	/* Full hash value of entry. */
@@ -274,6 +310,8 @@ struct hash_info {
 	unsigned int hash_used;
 	/* Current working group. */
 	tdb_off_t group[1 << TDB_HASH_GROUP_BITS];
+	/* Small slot we were found in, and the first empty one we saw. */
+	tdb_off_t small, small_free;
 };
 
 struct traverse_info {
@@ -285,6 +323,9 @@ struct traverse_info {
 	} levels[TDB_MAX_LEVELS + 1];
 	unsigned int num_levels;
 	unsigned int toplevel_group;
+	/* Have we moved onto this group's small slots?  Next one to look at. */
+	bool small;
+	unsigned int small_slot;
 	/* This makes delete-everything-inside-traverse work as expected. */
 	tdb_off_t prev;
 };
@@ -390,6 +431,15 @@ enum TDB_ERROR add_to_hash(struct tdb_context *tdb, struct hash_info *h,
 
 enum TDB_ERROR delete_from_hash(struct tdb_context *tdb, struct hash_info *h);
 
+/* Move a record found in a small slot into the hash table at new_off. */
+enum TDB_ERROR small_to_hash(struct tdb_context *tdb, struct hash_info *h,
+			     struct tdb_data key, tdb_off_t new_off);
+
+enum TDB_ERROR delete_small(struct tdb_context *tdb, struct hash_info *h);
+
+/* Where a record would live in the small slots, if anywhere. */
+tdb_off_t small_slot_off(struct tdb_context *tdb, uint64_t h, unsigned int i);
+
 /* For tdb_check */
 bool is_subhash(tdb_off_t val);
 enum TDB_ERROR unknown_capability(struct tdb_context *tdb, const char *caller,
@@ -435,6 +485,12 @@ void *tdb_convert(const struct tdb_context *tdb, void *buf, tdb_len_t size);
 /* Unmap and try to map the tdb. */
 void tdb_munmap(struct tdb_file *file);
 void tdb_mmap(struct tdb_context *tdb);
+void tdb_mmap_advise(struct tdb_context *tdb);
+int tdb_map_populate(struct tdb_context *tdb);
+
+/* Allocate and free the memory behind a TDB_INTERNAL database. */
+void *tdb_internal_alloc(size_t len);
+void tdb_internal_free(struct tdb_context *tdb);
 
 /* Either alloc a copy, or give direct access.  Release frees or noop. */
 const void *tdb_access_read(struct tdb_context *tdb,
@@ -528,6 +584,10 @@ enum TDB_ERROR tdb_lock_expand(struct tdb_context *tdb, int ltype);
 void tdb_unlock_expand(struct tdb_context *tdb, int ltype);
 bool tdb_has_expansion_lock(struct tdb_context *tdb);
 
+/* Keep tdb_changes() out of a transaction commit. */
+enum TDB_ERROR tdb_lock_changelog(struct tdb_context *tdb, int ltype);
+void tdb_unlock_changelog(struct tdb_context *tdb, int ltype);
+
 /* If it needs recovery, grab all the locks and do it. */
 enum TDB_ERROR tdb_lock_and_recover(struct tdb_context *tdb);
 
@@ -604,6 +664,9 @@ struct tdb_context {
 	/* the tdb flags passed to tdb_open. */
 	uint32_t flags;
 
+	/* TDB_MMAP_* hints from TDB_ATTRIBUTE_MMAP. */
+	unsigned int mmap_policy;
+
 	/* Our statistics. */
 	struct tdb_attribute_stats stats;
 
@@ -622,6 +685,11 @@ struct tdb_context {
 	/* Last error we returned. */
 	enum TDB_ERROR last_error;
 
+#ifdef TDB_TRACE
+	/* Where tdb_trace() writes (-1 if not tracing). */
+	int tracefd;
+#endif
+
 	struct {
 
 		/* Are we accessing directly? (debugging check). */
@@ -639,6 +707,16 @@ struct tdb_context {
 
 		/* Direct access information */
 		struct tdb_access_hdr *access;
+
+		/* Changelog, if any (see tdb_changes()). */
+		tdb_off_t changelog;
+		uint64_t changelog_entries, changelog_key_room;
+		/* Page holding its counter, if the file isn't mapped. */
+		void *changelog_map;
+
+		/* First small record slot, and how many, if any. */
+		tdb_off_t small;
+		uint64_t small_slots;
 	} tdb2;
 
 	struct {
@@ -720,6 +798,11 @@ TDB_DATA tdb1_firstkey(struct tdb_context *tdb);
 TDB_DATA tdb1_nextkey(struct tdb_context *tdb, TDB_DATA key);
 
 /* tdb.c: */
+/* Record change in changelog, if any: caller holds the hash lock, and
+ * hasn't made the change yet. */
+enum TDB_ERROR tdb_changelog_add(struct tdb_context *tdb, uint64_t h,
+				 struct tdb_data key, enum tdb_change_op op);
+
 enum TDB_ERROR COLD tdb_logerr(struct tdb_context *tdb,
 			       enum TDB_ERROR ecode,
 			       enum tdb_log_level level,
@@ -78,6 +78,7 @@ static enum TDB_ERROR summarize(struct tdb_context *tdb,
 	tdb_off_t off;
 	tdb_len_t len;
 	tdb_len_t unc = 0;
+	uint64_t i;
 
 	for (off = sizeof(struct tdb_header);
 	     off < tdb->file->map_size;
@@ -140,6 +141,10 @@ static enum TDB_ERROR summarize(struct tdb_context *tdb,
 				+ rec_extra_padding(&p->u);
 			tally_add(chains, 1);
 			tally_add(extra, rec_extra_padding(&p->u));
+		} else if (rec_magic(&p->u) == TDB_CAP_MAGIC) {
+			len = sizeof(p->u)
+				+ rec_data_length(&p->u)
+				+ rec_extra_padding(&p->u);
 		} else {
 			len = dead_space(tdb, off);
 			if (TDB_OFF_IS_ERR(len)) {
@@ -150,6 +155,24 @@ static enum TDB_ERROR summarize(struct tdb_context *tdb,
 	}
 	if (unc)
 		tally_add(uncoal, unc);
+
+	/* Records in small slots are inside their capability record. */
+	for (i = 0; i < tdb->tdb2.small_slots; i++) {
+		struct tdb_used_record rec;
+		enum TDB_ERROR ecode;
+
+		ecode = tdb_read_convert(tdb,
+					 tdb->tdb2.small + i * TDB_SMALL_SLOT,
+					 &rec, sizeof(rec));
+		if (ecode != TDB_SUCCESS) {
+			return ecode;
+		}
+		if (rec.magic_and_meta == 0)
+			continue;
+		tally_add(keys, rec_key_length(&rec));
+		tally_add(data, rec_data_length(&rec));
+		tally_add(extra, rec_extra_padding(&rec));
+	}
 	return TDB_SUCCESS;
 }
 
@@ -198,8 +221,12 @@ static void add_capabilities(struct tdb_context *tdb, size_t num, char *summary)
 		count++;
 		sprintf(summary, CAPABILITY_FORMAT,
 			cap->type & TDB_CAP_TYPE_MASK,
+			(cap->type & TDB_CAP_TYPE_MASK) == TDB_CAP_CHANGELOG
+			? " (changelog)"
+			: (cap->type & TDB_CAP_TYPE_MASK) == TDB_CAP_SMALL
+			? " (small records)"
 			/* Noopen?  How did we get here? */
-			(cap->type & TDB_CAP_NOOPEN) ? " (unopenable)"
+			: (cap->type & TDB_CAP_NOOPEN) ? " (unopenable)"
 			: ((cap->type & TDB_CAP_NOWRITE)
 			   && (cap->type & TDB_CAP_NOCHECK)) ? " (uncheckable,read-only)"
 			: (cap->type & TDB_CAP_NOWRITE) ? " (read-only)"
@@ -46,6 +46,32 @@ static enum TDB_ERROR replace_data(struct tdb_context *tdb,
 	tdb_off_t new_off;
 	enum TDB_ERROR ecode;
 
+	/* A new tiny record goes in a free small slot, if there is one. */
+	if (!old_off && h->small_free
+	    && sizeof(struct tdb_used_record) + key.dsize + dbuf.dsize
+	    <= TDB_SMALL_SLOT) {
+		struct tdb_used_record rec;
+
+		new_off = h->small_free;
+		ecode = set_header(tdb, &rec, TDB_USED_MAGIC,
+				   key.dsize, dbuf.dsize,
+				   TDB_SMALL_SLOT - sizeof(rec), h->h);
+		if (ecode == TDB_SUCCESS) {
+			ecode = tdb_write_convert(tdb, new_off,
+						  &rec, sizeof(rec));
+		}
+		/* As alloc() does, put a 0 in the unused space. */
+		if (ecode == TDB_SUCCESS && rec_extra_padding(&rec)) {
+			ecode = tdb->tdb2.io->twrite(tdb, new_off + sizeof(rec)
+						     + key.dsize + dbuf.dsize,
+						     "", 1);
+		}
+		if (ecode != TDB_SUCCESS) {
+			return ecode;
+		}
+		goto write;
+	}
+
 	/* Allocate a new record. */
 	new_off = alloc(tdb, key.dsize, dbuf.dsize, h->h, TDB_USED_MAGIC,
 			growing);
@@ -54,7 +80,10 @@ static enum TDB_ERROR replace_data(struct tdb_context *tdb,
 	}
 
 	/* We didn't like the existing one: remove it. */
-	if (old_off) {
+	if (h->small) {
+		/* Outgrew its small slot: empty that, don't free it. */
+		ecode = small_to_hash(tdb, h, key, new_off);
+	} else if (old_off) {
 		tdb->stats.frees++;
 		ecode = add_free_record(tdb, old_off,
 					sizeof(struct tdb_used_record)
@@ -69,6 +98,7 @@ static enum TDB_ERROR replace_data(struct tdb_context *tdb,
 		return ecode;
 	}
 
+write:
 	new_off += sizeof(struct tdb_used_record);
 	ecode = tdb->tdb2.io->twrite(tdb, new_off, key.dptr, key.dsize);
 	if (ecode != TDB_SUCCESS) {
@@ -137,6 +167,11 @@ enum TDB_ERROR tdb_store(struct tdb_context *tdb,
 				+ rec_extra_padding(&rec);
 			if (old_room >= dbuf.dsize) {
 				/* Can modify in-place.  Easy! */
+				ecode = tdb_changelog_add(tdb, h.h, key,
+							  TDB_CHANGE_STORE);
+				if (ecode != TDB_SUCCESS) {
+					goto out;
+				}
 				ecode = update_rec_hdr(tdb, off,
 						       key.dsize, dbuf.dsize,
 						       &rec, h.h);
@@ -152,6 +187,8 @@ enum TDB_ERROR tdb_store(struct tdb_context *tdb,
 				}
 				tdb_unlock_hashes(tdb, h.hlock_start,
 						  h.hlock_range, F_WRLCK);
+				tdb_trace_2rec_flag_ret(tdb, "tdb_store",
+							key, dbuf, flag, 0);
 				return tdb->last_error = TDB_SUCCESS;
 			}
 		} else {
@@ -165,13 +202,38 @@ enum TDB_ERROR tdb_store(struct tdb_context *tdb,
 		}
 	}
 
+	ecode = tdb_changelog_add(tdb, h.h, key, TDB_CHANGE_STORE);
+	if (ecode != TDB_SUCCESS) {
+		goto out;
+	}
+
 	/* If we didn't use the old record, this implies we're growing. */
 	ecode = replace_data(tdb, &h, key, dbuf, off, old_room, off);
 out:
 	tdb_unlock_hashes(tdb, h.hlock_start, h.hlock_range, F_WRLCK);
+	tdb_trace_2rec_flag_ret(tdb, "tdb_store", key, dbuf, flag, ecode);
 	return tdb->last_error = ecode;
 }
 
+#ifdef TDB_TRACE
+/* Traces show the whole new value, which we may only have on disk. */
+static void trace_append(struct tdb_context *tdb,
+			 struct tdb_data key, struct tdb_data dbuf,
+			 tdb_off_t off, tdb_len_t len)
+{
+	struct tdb_data post;
+
+	post.dptr = tdb_alloc_read(tdb, off, len);
+	if (TDB_PTR_IS_ERR(post.dptr))
+		return;
+	post.dsize = len;
+	tdb_trace_2rec_retrec(tdb, "tdb_append", key, dbuf, post);
+	free(post.dptr);
+}
+#else
+#define trace_append(tdb, key, dbuf, off, len)
+#endif
+
 enum TDB_ERROR tdb_append(struct tdb_context *tdb,
 			  struct tdb_data key, struct tdb_data dbuf)
 {
@@ -194,6 +256,11 @@ enum TDB_ERROR tdb_append(struct tdb_context *tdb,
 		return tdb->last_error = TDB_OFF_TO_ERR(off);
 	}
 
+	ecode = tdb_changelog_add(tdb, h.h, key, TDB_CHANGE_APPEND);
+	if (ecode != TDB_SUCCESS) {
+		goto out;
+	}
+
 	if (off) {
 		old_dlen = rec_data_length(&rec);
 		old_room = old_dlen + rec_extra_padding(&rec);
@@ -210,6 +277,9 @@ enum TDB_ERROR tdb_append(struct tdb_context *tdb,
 			off += sizeof(rec) + key.dsize + old_dlen;
 			ecode = update_data(tdb, off, dbuf,
 					    rec_extra_padding(&rec));
+			if (ecode == TDB_SUCCESS)
+				trace_append(tdb, key, dbuf, off - old_dlen,
+					     old_dlen + dbuf.dsize);
 			goto out;
 		}
 
@@ -238,6 +308,8 @@ enum TDB_ERROR tdb_append(struct tdb_context *tdb,
 
 	/* If they're using tdb_append(), it implies they're growing record. */
 	ecode = replace_data(tdb, &h, key, new_dbuf, off, old_room, true);
+	if (ecode == TDB_SUCCESS)
+		tdb_trace_2rec_retrec(tdb, "tdb_append", key, dbuf, new_dbuf);
 
 out_free_newdata:
 	free(newdata);
@@ -275,6 +347,9 @@ enum TDB_ERROR tdb_fetch(struct tdb_context *tdb, struct tdb_data key,
 	}
 
 	tdb_unlock_hashes(tdb, h.hlock_start, h.hlock_range, F_RDLCK);
+	tdb_trace_1rec_retrec(tdb, "tdb_fetch", key,
+			      ecode == TDB_SUCCESS ? *data
+			      : tdb_mkdata(NULL, 0));
 	return tdb->last_error = ecode;
 }
 
@@ -294,6 +369,7 @@ bool tdb_exists(struct tdb_context *tdb, TDB_DATA key)
 		return false;
 	}
 	tdb_unlock_hashes(tdb, h.hlock_start, h.hlock_range, F_RDLCK);
+	tdb_trace_1rec_ret(tdb, "tdb_exists", key, off ? 1 : 0);
 
 	tdb->last_error = TDB_SUCCESS;
 	return off ? true : false;
@@ -322,25 +398,36 @@ enum TDB_ERROR tdb_delete(struct tdb_context *tdb, struct tdb_data key)
 		goto unlock;
 	}
 
-	ecode = delete_from_hash(tdb, &h);
+	ecode = tdb_changelog_add(tdb, h.h, key, TDB_CHANGE_DELETE);
 	if (ecode != TDB_SUCCESS) {
 		goto unlock;
 	}
 
-	/* Free the deleted entry. */
-	tdb->stats.frees++;
-	ecode = add_free_record(tdb, off,
-				sizeof(struct tdb_used_record)
-				+ rec_key_length(&rec)
-				+ rec_data_length(&rec)
-				+ rec_extra_padding(&rec),
-				TDB_LOCK_WAIT, true);
+	if (h.small) {
+		/* Empty the slot for the next tiny record. */
+		ecode = delete_small(tdb, &h);
+	} else {
+		ecode = delete_from_hash(tdb, &h);
+		if (ecode != TDB_SUCCESS) {
+			goto unlock;
+		}
+
+		/* Free the deleted entry. */
+		tdb->stats.frees++;
+		ecode = add_free_record(tdb, off,
+					sizeof(struct tdb_used_record)
+					+ rec_key_length(&rec)
+					+ rec_data_length(&rec)
+					+ rec_extra_padding(&rec),
+					TDB_LOCK_WAIT, true);
+	}
 
 	if (tdb->flags & TDB_SEQNUM)
 		tdb_inc_seqnum(tdb);
 
 unlock:
 	tdb_unlock_hashes(tdb, h.hlock_start, h.hlock_range, F_WRLCK);
+	tdb_trace_1rec_ret(tdb, "tdb_delete", key, ecode);
 	return tdb->last_error = ecode;
 }
 
@@ -543,6 +630,7 @@ enum TDB_ERROR tdb_parse_record_(struct tdb_context *tdb,
 	}
 
 	tdb_unlock_hashes(tdb, h.hlock_start, h.hlock_range, F_RDLCK);
+	tdb_trace_1rec_ret(tdb, "tdb_parse_record", key, ecode);
 	return tdb->last_error = ecode;
 }
 
@@ -573,7 +661,271 @@ int64_t tdb_get_seqnum(struct tdb_context *tdb)
 		tdb->last_error = TDB_SUCCESS;
 	return off;
 }
-	
+
+static tdb_off_t changelog_entry_off(struct tdb_context *tdb, uint64_t num)
+{
+	return tdb->tdb2.changelog + sizeof(struct tdb_changelog)
+		+ (num % tdb->tdb2.changelog_entries)
+		* (sizeof(struct tdb_changelog_entry)
+		   + tdb->tdb2.changelog_key_room);
+}
+
+/* Without the file mapped, we map just the page holding the counter. */
+static uint64_t *changelog_counter(struct tdb_context *tdb)
+{
+	tdb_off_t off = tdb->tdb2.changelog
+		+ offsetof(struct tdb_changelog, last);
+	size_t pagesize = getpagesize();
+	uint64_t *p;
+	void *map;
+
+	p = tdb->tdb2.io->direct(tdb, off, sizeof(*p), true);
+	if (p)
+		return p;
+
+	if (!tdb->tdb2.changelog_map) {
+		map = mmap(NULL, pagesize, PROT_READ|PROT_WRITE, MAP_SHARED,
+			   tdb->file->fd, off & ~(tdb_off_t)(pagesize - 1));
+		if (map == MAP_FAILED) {
+			return TDB_ERR_PTR(tdb_logerr(tdb, TDB_ERR_IO,
+						      TDB_LOG_ERROR,
+						      "tdb_changelog_add:"
+						      " mmap failed: %s",
+						      strerror(errno)));
+		}
+		tdb->tdb2.changelog_map = map;
+	}
+	return (uint64_t *)((char *)tdb->tdb2.changelog_map
+			    + (off & (pagesize - 1)));
+}
+
+/* Claim the next change number.  Writers on other hash chains don't
+ * wait for us: we bump the counter with a compare-and-swap.  Inside a
+ * transaction we're the only writer, and it must be undone on cancel. */
+static tdb_off_t changelog_reserve(struct tdb_context *tdb)
+{
+	tdb_off_t off = tdb->tdb2.changelog
+		+ offsetof(struct tdb_changelog, last);
+	uint64_t *p, old, num;
+	enum TDB_ERROR ecode;
+
+	if (tdb->tdb2.transaction) {
+		num = tdb_read_off(tdb, off);
+		if (TDB_OFF_IS_ERR(num))
+			return num;
+		ecode = tdb_write_off(tdb, off, ++num);
+		if (ecode != TDB_SUCCESS)
+			return TDB_ERR_TO_OFF(ecode);
+		return num;
+	}
+
+	p = changelog_counter(tdb);
+	if (TDB_PTR_IS_ERR(p))
+		return TDB_ERR_TO_OFF(TDB_PTR_ERR(p));
+
+	do {
+		old = *(volatile uint64_t *)p;
+		num = old;
+		tdb_convert(tdb, &num, sizeof(num));
+		num++;
+		tdb_convert(tdb, &num, sizeof(num));
+	} while (!__sync_bool_compare_and_swap(p, old, num));
+
+	tdb_convert(tdb, &num, sizeof(num));
+	return num;
+}
+
+enum TDB_ERROR tdb_changelog_add(struct tdb_context *tdb, uint64_t h,
+				 struct tdb_data key, enum tdb_change_op op)
+{
+	struct tdb_changelog_entry e;
+	tdb_off_t num, off;
+	enum TDB_ERROR ecode;
+
+	if (likely(!tdb->tdb2.changelog))
+		return TDB_SUCCESS;
+
+	num = changelog_reserve(tdb);
+	if (TDB_OFF_IS_ERR(num))
+		return TDB_OFF_TO_ERR(num);
+
+	/* Like a seqlock: readers only trust an entry whose changenum
+	 * is the same before and after they copy it. */
+	off = changelog_entry_off(tdb, num);
+	ecode = tdb_write_off(tdb, off, 0);
+	if (ecode != TDB_SUCCESS)
+		return ecode;
+	__sync_synchronize();
+
+	e.hash = h;
+	e.op_and_keylen = ((uint64_t)op << 56) | key.dsize;
+	tdb_convert(tdb, &e, sizeof(e));
+	ecode = tdb->tdb2.io->twrite(tdb, off + offsetof(struct tdb_changelog_entry,
+							 hash),
+				     &e.hash, sizeof(e) - sizeof(e.changenum));
+	if (ecode != TDB_SUCCESS)
+		return ecode;
+
+	if (key.dsize > tdb->tdb2.changelog_key_room)
+		key.dsize = tdb->tdb2.changelog_key_room;
+	ecode = tdb->tdb2.io->twrite(tdb, off + sizeof(e), key.dptr, key.dsize);
+	if (ecode != TDB_SUCCESS)
+		return ecode;
+	__sync_synchronize();
+
+	return tdb_write_off(tdb, off, num);
+}
+
+/* Copy out entry @num: true if it's there, false if it's not written yet
+ * or being overwritten. */
+static tdb_bool_err read_change(struct tdb_context *tdb, uint64_t num,
+				unsigned char *buf, uint64_t esize)
+{
+	struct tdb_changelog_entry *e = (void *)buf;
+	tdb_off_t off = changelog_entry_off(tdb, num), after;
+	uint64_t before;
+	enum TDB_ERROR ecode;
+
+	ecode = tdb->tdb2.io->tread(tdb, off, buf, esize);
+	if (ecode != TDB_SUCCESS)
+		return TDB_ERR_TO_OFF(ecode);
+	__sync_synchronize();
+
+	after = tdb_read_off(tdb, off);
+	if (TDB_OFF_IS_ERR(after))
+		return after;
+
+	before = e->changenum;
+	tdb_convert(tdb, &before, sizeof(before));
+	return before == num && after == num;
+}
+
+int64_t tdb_changes_(struct tdb_context *tdb, uint64_t since,
+		     int (*fn)(const struct tdb_change *, void *), void *p)
+{
+	struct tdb_change c;
+	uint64_t first, last, num, esize;
+	tdb_off_t now;
+	tdb_bool_err berr;
+	unsigned char *entries = NULL;
+	enum TDB_ERROR ecode;
+	bool lost;
+
+	if ((tdb->flags & TDB_VERSION1) || !tdb->tdb2.changelog) {
+		return tdb->last_error = tdb_logerr(tdb, TDB_ERR_EINVAL,
+						    TDB_LOG_USE_ERROR,
+						    "tdb_changes:"
+						    " tdb has no changelog");
+	}
+
+	/* Writers don't take this: it only keeps out transaction commits. */
+	ecode = tdb_lock_changelog(tdb, F_RDLCK);
+	if (ecode != TDB_SUCCESS)
+		return tdb->last_error = ecode;
+
+	last = tdb_read_off(tdb, tdb->tdb2.changelog
+			    + offsetof(struct tdb_changelog, last));
+	if (TDB_OFF_IS_ERR(last)) {
+		ecode = TDB_OFF_TO_ERR(last);
+		goto unlock;
+	}
+
+	/* Oldest change still in the ring. */
+	if (last > tdb->tdb2.changelog_entries)
+		first = last - tdb->tdb2.changelog_entries + 1;
+	else
+		first = 1;
+
+	/* Overwritten, or the tdb was recreated? */
+	lost = (since > last || since + 1 < first);
+	if (lost)
+		since = first - 1;
+	else
+		first = since + 1;
+
+	/* Copy them out, so we can drop the lock before calling fn. */
+	esize = sizeof(struct tdb_changelog_entry)
+		+ tdb->tdb2.changelog_key_room;
+	if (fn && first <= last) {
+		entries = malloc((last - first + 1) * esize);
+		if (!entries) {
+			ecode = tdb_logerr(tdb, TDB_ERR_OOM, TDB_LOG_ERROR,
+					   "tdb_changes: failed to allocate"
+					   " %llu entries",
+					   (long long)(last - first + 1));
+			goto unlock;
+		}
+	}
+
+	/* A writer logs before it changes the record, so stopping before
+	 * an entry it hasn't finished means we haven't missed its change. */
+	for (num = first; entries && num <= last; num++) {
+		berr = read_change(tdb, num, entries + (num - first) * esize,
+				   esize);
+		if (berr < 0) {
+			ecode = TDB_OFF_TO_ERR(berr);
+			goto unlock;
+		}
+		if (berr)
+			continue;
+
+		now = tdb_read_off(tdb, tdb->tdb2.changelog
+				   + offsetof(struct tdb_changelog, last));
+		if (TDB_OFF_IS_ERR(now)) {
+			ecode = TDB_OFF_TO_ERR(now);
+			goto unlock;
+		}
+		if (now < num + tdb->tdb2.changelog_entries) {
+			last = num - 1;
+			break;
+		}
+		/* Wrapped while we were reading: everything so far is lost. */
+		lost = true;
+		since = num;
+	}
+unlock:
+	tdb_unlock_changelog(tdb, F_RDLCK);
+	if (ecode != TDB_SUCCESS) {
+		free(entries);
+		return tdb->last_error = ecode;
+	}
+
+	tdb->last_error = TDB_SUCCESS;
+	if (!fn)
+		return last;
+
+	if (lost) {
+		c.num = since;
+		c.op = TDB_CHANGE_LOST;
+		c.hash = 0;
+		c.key.dptr = NULL;
+		c.key.dsize = 0;
+		c.key_len = 0;
+		if (fn(&c, p)) {
+			free(entries);
+			return c.num;
+		}
+	}
+
+	for (num = since + 1; num <= last; num++) {
+		struct tdb_changelog_entry *e;
+
+		e = (void *)(entries + (num - first) * esize);
+		tdb_convert(tdb, e, sizeof(*e));
+		c.num = e->changenum;
+		c.op = e->op_and_keylen >> 56;
+		c.hash = e->hash;
+		c.key_len = e->op_and_keylen & ((1ULL << 56) - 1);
+		c.key.dptr = (unsigned char *)(e + 1);
+		c.key.dsize = c.key_len;
+		if (c.key.dsize > tdb->tdb2.changelog_key_room)
+			c.key.dsize = tdb->tdb2.changelog_key_room;
+		if (fn(&c, p))
+			break;
+	}
+	free(entries);
+	return num > last ? last : num;
+}
 
 int tdb_fd(const struct tdb_context *tdb)
 {
@@ -603,6 +955,7 @@ enum TDB_ERROR tdb_repack(struct tdb_context *tdb)
 	struct tdb_context *tmp_db;
 	struct traverse_state state;
 
+	tdb_trace(tdb, "tdb_repack");
 	state.error = tdb_transaction_start(tdb);
 	if (state.error != TDB_SUCCESS) {
 		return state.error;
@@ -640,3 +993,173 @@ fail:
 	tdb_close(tmp_db);
 	return state.error;
 }
+
+#ifdef TDB_TRACE
+static void tdb_trace_write(struct tdb_context *tdb, const char *str)
+{
+	if (write(tdb->tracefd, str, strlen(str)) != strlen(str)) {
+		close(tdb->tracefd);
+		tdb->tracefd = -1;
+	}
+}
+
+static bool tdb_trace_start(struct tdb_context *tdb)
+{
+	tdb_off_t seqnum;
+	char msg[sizeof(tdb_off_t) * 4 + 1];
+
+	/* Not tracing (or a TDB1, or inside tdb_wipe_all)? */
+	if (tdb->tracefd < 0)
+		return false;
+
+	seqnum = tdb_read_off(tdb, offsetof(struct tdb_header, seqnum));
+	if (TDB_OFF_IS_ERR(seqnum))
+		seqnum = 0;
+	snprintf(msg, sizeof(msg), "%llu ", (long long)seqnum);
+	tdb_trace_write(tdb, msg);
+	return true;
+}
+
+static void tdb_trace_end(struct tdb_context *tdb)
+{
+	tdb_trace_write(tdb, "\n");
+}
+
+static void tdb_trace_end_ret(struct tdb_context *tdb, int ret)
+{
+	char msg[sizeof(ret) * 4 + 4];
+	snprintf(msg, sizeof(msg), " = %i\n", ret);
+	tdb_trace_write(tdb, msg);
+}
+
+static void tdb_trace_record(struct tdb_context *tdb, TDB_DATA rec)
+{
+	char msg[20 + rec.dsize*2], *p;
+	unsigned int i;
+
+	/* We differentiate zero-length records from non-existent ones. */
+	if (rec.dptr == NULL) {
+		tdb_trace_write(tdb, " NULL");
+		return;
+	}
+
+	p = msg;
+	p += snprintf(p, sizeof(msg), " %zu:", rec.dsize);
+	for (i = 0; i < rec.dsize; i++)
+		p += sprintf(p, "%02x", rec.dptr[i]);
+
+	tdb_trace_write(tdb, msg);
+}
+
+void tdb_trace(struct tdb_context *tdb, const char *op)
+{
+	if (!tdb_trace_start(tdb))
+		return;
+	tdb_trace_write(tdb, op);
+	tdb_trace_end(tdb);
+}
+
+void tdb_trace_seqnum(struct tdb_context *tdb, uint32_t seqnum, const char *op)
+{
+	char msg[sizeof(tdb_off_t) * 4 + 1];
+
+	if (tdb->tracefd < 0)
+		return;
+	snprintf(msg, sizeof(msg), "%u ", seqnum);
+	tdb_trace_write(tdb, msg);
+	tdb_trace_write(tdb, op);
+	tdb_trace_end(tdb);
+}
+
+void tdb_trace_open(struct tdb_context *tdb, const char *op,
+		    unsigned hash_size, unsigned tdb_flags, unsigned open_flags)
+{
+	char msg[128];
+
+	if (!tdb_trace_start(tdb))
+		return;
+	snprintf(msg, sizeof(msg),
+		 "%s %u 0x%x 0x%x", op, hash_size, tdb_flags, open_flags);
+	tdb_trace_write(tdb, msg);
+	tdb_trace_end(tdb);
+}
+
+void tdb_trace_ret(struct tdb_context *tdb, const char *op, int ret)
+{
+	if (!tdb_trace_start(tdb))
+		return;
+	tdb_trace_write(tdb, op);
+	tdb_trace_end_ret(tdb, ret);
+}
+
+void tdb_trace_retrec(struct tdb_context *tdb, const char *op, TDB_DATA ret)
+{
+	if (!tdb_trace_start(tdb))
+		return;
+	tdb_trace_write(tdb, op);
+	tdb_trace_write(tdb, " =");
+	tdb_trace_record(tdb, ret);
+	tdb_trace_end(tdb);
+}
+
+void tdb_trace_1rec(struct tdb_context *tdb, const char *op,
+		    TDB_DATA rec)
+{
+	if (!tdb_trace_start(tdb))
+		return;
+	tdb_trace_write(tdb, op);
+	tdb_trace_record(tdb, rec);
+	tdb_trace_end(tdb);
+}
+
+void tdb_trace_1rec_ret(struct tdb_context *tdb, const char *op,
+			TDB_DATA rec, int ret)
+{
+	if (!tdb_trace_start(tdb))
+		return;
+	tdb_trace_write(tdb, op);
+	tdb_trace_record(tdb, rec);
+	tdb_trace_end_ret(tdb, ret);
+}
+
+void tdb_trace_1rec_retrec(struct tdb_context *tdb, const char *op,
+			   TDB_DATA rec, TDB_DATA ret)
+{
+	if (!tdb_trace_start(tdb))
+		return;
+	tdb_trace_write(tdb, op);
+	tdb_trace_record(tdb, rec);
+	tdb_trace_write(tdb, " =");
+	tdb_trace_record(tdb, ret);
+	tdb_trace_end(tdb);
+}
+
+void tdb_trace_2rec_flag_ret(struct tdb_context *tdb, const char *op,
+			     TDB_DATA rec1, TDB_DATA rec2, unsigned flag,
+			     int ret)
+{
+	char msg[1 + sizeof(ret) * 4];
+
+	if (!tdb_trace_start(tdb))
+		return;
+	snprintf(msg, sizeof(msg), " %#x", flag);
+	tdb_trace_write(tdb, op);
+	tdb_trace_record(tdb, rec1);
+	tdb_trace_record(tdb, rec2);
+	tdb_trace_write(tdb, msg);
+	tdb_trace_end_ret(tdb, ret);
+}
+
+void tdb_trace_2rec_retrec(struct tdb_context *tdb, const char *op,
+			   TDB_DATA rec1, TDB_DATA rec2, TDB_DATA ret)
+{
+	if (!tdb_trace_start(tdb))
+		return;
+	tdb_trace_write(tdb, op);
+	tdb_trace_record(tdb, rec1);
+	tdb_trace_record(tdb, rec2);
+	tdb_trace_write(tdb, " =");
+	tdb_trace_record(tdb, ret);
+	tdb_trace_end(tdb);
+}
+#endif
@@ -49,6 +49,15 @@ static int tdb1_oob(struct tdb_context *tdb, tdb1_off_t len, int probe)
 		}
 		return -1;
 	}
+	/* A snapshot never grows, and may not even have a file. */
+	if (tdb->flags & TDB_SNAPSHOT) {
+		if (!probe) {
+			tdb->last_error = tdb_logerr(tdb, TDB_ERR_IO, TDB_LOG_ERROR,
+						"tdb1_oob len %d beyond snapshot size %d",
+						(int)len, (int)tdb->file->map_size);
+		}
+		return -1;
+	}
 
 	if (fstat(tdb->file->fd, &st) == -1) {
 		tdb->last_error = TDB_ERR_IO;
@@ -221,7 +230,8 @@ void tdb1_mmap(struct tdb_context *tdb)
 
 		tdb->file->map_ptr = mmap(NULL, tdb->file->map_size,
 				    mmap_flags,
-				    MAP_SHARED|MAP_FILE, tdb->file->fd, 0);
+				    MAP_SHARED|MAP_FILE|tdb_map_populate(tdb),
+				    tdb->file->fd, 0);
 
 		/*
 		 * NB. When mmap fails it returns MAP_FAILED *NOT* NULL !!!!
@@ -232,7 +242,8 @@ void tdb1_mmap(struct tdb_context *tdb)
 			tdb_logerr(tdb, TDB_ERR_IO, TDB_LOG_WARNING,
 				   "tdb1_mmap failed for size %d (%s)",
 				   tdb->file->map_size, strerror(errno));
-		}
+		} else
+			tdb_mmap_advise(tdb);
 	} else {
 		tdb->file->map_ptr = NULL;
 	}
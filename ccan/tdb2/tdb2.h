@@ -88,6 +88,7 @@ struct tdb_context *tdb_open(const char *name, int tdb_flags,
 #define TDB_RDONLY   512 /* implied by O_RDONLY */
 #define TDB_VERSION1  1024 /* create/open an old style TDB */
 #define TDB_CANT_CHECK  2048 /* has a feature which we don't understand */
+#define TDB_SNAPSHOT  4096 /* O_RDONLY point-in-time copy: no locking after open */
 
 /**
  * tdb1_incompatible_hash - better (Jenkins) hash for tdb1
@@ -395,6 +396,77 @@ enum TDB_ERROR tdb_parse_record_(struct tdb_context *tdb,
  */
 int64_t tdb_get_seqnum(struct tdb_context *tdb);
 
+/**
+ * enum tdb_change_op - what happened to a key in the changelog.
+ * @TDB_CHANGE_STORE: the key was stored using tdb_store().
+ * @TDB_CHANGE_APPEND: the key was appended to using tdb_append().
+ * @TDB_CHANGE_DELETE: the key was deleted (including by tdb_wipe_all()).
+ * @TDB_CHANGE_LOST: changes were overwritten before you read them.
+ *
+ * TDB_CHANGE_LOST means the changelog is too small for how rarely you
+ * call tdb_changes(): you should assume that any key may have changed.
+ */
+enum tdb_change_op {
+	TDB_CHANGE_STORE = 1,
+	TDB_CHANGE_APPEND = 2,
+	TDB_CHANGE_DELETE = 3,
+	TDB_CHANGE_LOST = 4
+};
+
+/**
+ * struct tdb_change - a single change from the changelog.
+ * @num: the change number: these increase by one for every change.
+ * @op: what happened.
+ * @hash: the hash of the key.
+ * @key: the key, or as much of it as the changelog keeps.
+ * @key_len: the full length of the key.
+ *
+ * If @key.dsize is less than @key_len, the key was truncated: @hash can
+ * be used to narrow down which key it was.
+ */
+struct tdb_change {
+	uint64_t num;
+	enum tdb_change_op op;
+	uint64_t hash;
+	TDB_DATA key;
+	uint64_t key_len;
+};
+
+/**
+ * tdb_changes - read the changelog of a TDB
+ * @tdb: the tdb context returned from tdb_open()
+ * @since: the number of the last change you have seen (0 initially).
+ * @fn: the function to call for each change since then (or NULL)
+ * @p: the pointer to hand to @fn
+ *
+ * A TDB created with a struct tdb_attribute_changelog keeps a ring of
+ * recent tdb_store(), tdb_append() and tdb_delete() operations, so a
+ * cache of the database can be kept up to date without rereading it.
+ * This calls @fn for each change after @since, oldest first; if the
+ * ring has wrapped past @since, @fn is first handed a TDB_CHANGE_LOST
+ * change.
+ *
+ * Each change is logged just before it is made, so (rarely) one may
+ * appear which then failed, eg. for lack of space.  A change which
+ * another writer is still logging ends the walk: it will be handed to
+ * @fn next time.
+ *
+ * The changelog is not locked while @fn is called, so it may use the
+ * tdb.  If @fn returns non-zero, no more changes are handed to it.  If
+ * @fn is NULL, this simply returns the number of the latest change.
+ *
+ * Returns the number of the last change handed to @fn (or @since if there
+ * were none): hand that back as @since next time.  Returns TDB_ERR_EINVAL
+ * if the TDB has no changelog, or another negative enum TDB_ERROR on error.
+ */
+#define tdb_changes(tdb, since, fn, p)					\
+	tdb_changes_((tdb), (since),					\
+		     typesafe_cb_preargs(int, void *, (fn), (p),	\
+					 const struct tdb_change *), (p))
+
+int64_t tdb_changes_(struct tdb_context *tdb, uint64_t since,
+		     int (*fn)(const struct tdb_change *, void *), void *p);
+
 /**
  * tdb_firstkey - get the "first" key in a TDB
  * @tdb: the tdb context returned from tdb_open()
@@ -636,6 +708,9 @@ enum tdb_attribute_type {
 	TDB_ATTRIBUTE_STATS = 3,
 	TDB_ATTRIBUTE_OPENHOOK = 4,
 	TDB_ATTRIBUTE_FLOCK = 5,
+	TDB_ATTRIBUTE_CHANGELOG = 6,
+	TDB_ATTRIBUTE_MMAP = 7,
+	TDB_ATTRIBUTE_SMALL = 8,
 	TDB_ATTRIBUTE_TDB1_HASHSIZE = 128,
 	TDB_ATTRIBUTE_TDB1_MAX_DEAD = 129,
 };
@@ -662,8 +737,8 @@ enum TDB_ERROR tdb_get_attribute(struct tdb_context *tdb,
  * unknown or invalid.
  *
  * Note that TDB_ATTRIBUTE_HASH, TDB_ATTRIBUTE_SEED,
- * TDB_ATTRIBUTE_OPENHOOK and TDB_ATTRIBUTE_TDB1_HASHSIZE cannot
- * currently be set after tdb_open.
+ * TDB_ATTRIBUTE_OPENHOOK, TDB_ATTRIBUTE_CHANGELOG, TDB_ATTRIBUTE_SMALL and
+ * TDB_ATTRIBUTE_TDB1_HASHSIZE cannot currently be set after tdb_open.
  */
 enum TDB_ERROR tdb_set_attribute(struct tdb_context *tdb,
 				 const union tdb_attribute *attr);
@@ -676,8 +751,8 @@ enum TDB_ERROR tdb_set_attribute(struct tdb_context *tdb,
  * This unsets an attribute on a TDB, returning it to the defaults
  * (where applicable).
  *
- * Note that it only makes sense for TDB_ATTRIBUTE_LOG and TDB_ATTRIBUTE_FLOCK
- * to be unset.
+ * Note that it only makes sense for TDB_ATTRIBUTE_LOG, TDB_ATTRIBUTE_FLOCK
+ * and TDB_ATTRIBUTE_MMAP to be unset.
  */
 void tdb_unset_attribute(struct tdb_context *tdb,
 			 enum tdb_attribute_type type);
@@ -869,6 +944,69 @@ struct tdb_attribute_flock {
 	void *data;
 };
 
+/**
+ * struct tdb_attribute_changelog - keep a changelog in the tdb
+ *
+ * This attribute reserves room in a new TDB for the last @entries
+ * changes, keeping up to @key_len bytes of each key: see tdb_changes().
+ * It only makes sense with O_CREAT; tdb_get_attribute() returns the
+ * geometry of an existing changelog.
+ *
+ * A TDB with a changelog can be opened read-only by tdb versions which
+ * don't know about changelogs, but not written by them.
+ */
+struct tdb_attribute_changelog {
+	struct tdb_attribute_base base; /* .attr = TDB_ATTRIBUTE_CHANGELOG */
+	uint64_t entries;
+	uint64_t key_len;
+};
+
+/**
+ * struct tdb_attribute_mmap - hints for how the database will be accessed
+ *
+ * By default the database is mapped with no hints, so the kernel reads ahead
+ * on every fault.  For a random-access database much larger than memory,
+ * TDB_MMAP_RANDOM avoids pulling in pages nobody asked for; for a database
+ * which is mostly traversed, TDB_MMAP_SEQUENTIAL reads ahead more
+ * aggressively.  TDB_MMAP_POPULATE prefaults the whole file each time it's
+ * mapped (which suits small, hot databases), and TDB_MMAP_HUGEPAGE asks for
+ * transparent huge pages where the filesystem supports them.
+ *
+ * These are only hints: they're ignored where the OS doesn't support them,
+ * or for TDB_NOMMAP and TDB_INTERNAL databases.  The mapping is shared by
+ * every tdb_open() of the same file within a process, so the last one set
+ * wins.
+ */
+struct tdb_attribute_mmap {
+	struct tdb_attribute_base base; /* .attr = TDB_ATTRIBUTE_MMAP */
+	unsigned int flags;
+};
+
+#define TDB_MMAP_RANDOM 1	/* Don't read ahead */
+#define TDB_MMAP_SEQUENTIAL 2	/* Read ahead aggressively */
+#define TDB_MMAP_POPULATE 4	/* Prefault the map */
+#define TDB_MMAP_HUGEPAGE 8	/* Use transparent huge pages */
+
+/**
+ * struct tdb_attribute_small - keep tiny records in cache-line slots
+ *
+ * Normally finding a record means reading a hash group, then the record
+ * header and key elsewhere in the file.  This attribute reserves @slots
+ * 64-byte slots in a new TDB (rounded up to a multiple of 128), each of
+ * which holds a whole record whose key and data total 48 bytes or less.
+ * A new record which fits is placed in one of a few slots chosen by its
+ * hash, so finding it touches a single cache line; records which don't fit
+ * (or find those slots taken) go in the hash table as usual.
+ *
+ * It only makes sense with O_CREAT; tdb_get_attribute() returns the number
+ * of slots in an existing TDB.  Such a TDB cannot be opened at all by tdb
+ * versions which don't know about small record slots.
+ */
+struct tdb_attribute_small {
+	struct tdb_attribute_base base; /* .attr = TDB_ATTRIBUTE_SMALL */
+	uint64_t slots;
+};
+
 /**
  * struct tdb_attribute_tdb1_hashsize - tdb1 hashsize
  *
@@ -903,7 +1041,9 @@ struct tdb_attribute_tdb1_max_dead {
  * See also:
  *	struct tdb_attribute_log, struct tdb_attribute_hash,
  *	struct tdb_attribute_seed, struct tdb_attribute_stats,
- *	struct tdb_attribute_openhook, struct tdb_attribute_flock.
+ *	struct tdb_attribute_openhook, struct tdb_attribute_flock,
+ *	struct tdb_attribute_changelog, struct tdb_attribute_mmap,
+ *	struct tdb_attribute_small.
  */
 union tdb_attribute {
 	struct tdb_attribute_base base;
@@ -913,6 +1053,9 @@ union tdb_attribute {
 	struct tdb_attribute_stats stats;
 	struct tdb_attribute_openhook openhook;
 	struct tdb_attribute_flock flock;
+	struct tdb_attribute_changelog changelog;
+	struct tdb_attribute_mmap mmap;
+	struct tdb_attribute_small small;
 	struct tdb_attribute_tdb1_hashsize tdb1_hashsize;
 	struct tdb_attribute_tdb1_max_dead tdb1_max_dead;
 };
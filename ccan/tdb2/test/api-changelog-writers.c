@@ -0,0 +1,130 @@
+#include <ccan/tdb2/tdb2.h>
+#include <ccan/tap/tap.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "logging.h"
+
+#define NUM_WRITERS 4
+#define NUM_STORES 500
+
+struct seen {
+	uint64_t next;
+	unsigned int count[NUM_WRITERS];
+	bool bad;
+};
+
+static int check_change(const struct tdb_change *c, struct seen *seen)
+{
+	unsigned int w;
+
+	/* Every number once, in order, and nothing lost. */
+	if (c->num != seen->next || c->op != TDB_CHANGE_STORE
+	    || c->key.dsize != 2 || c->key.dptr[0] != 'w') {
+		seen->bad = true;
+		return 1;
+	}
+	w = c->key.dptr[1] - '0';
+	if (w >= NUM_WRITERS) {
+		seen->bad = true;
+		return 1;
+	}
+	seen->count[w]++;
+	seen->next++;
+	return 0;
+}
+
+static void writer(int flags, unsigned int w)
+{
+	struct tdb_context *tdb;
+	char k[2] = { 'w', '0' + w };
+	unsigned int i;
+
+	tdb = tdb_open("api-changelog-writers.tdb", flags, O_RDWR, 0,
+		       &tap_log_attr);
+	if (!tdb)
+		_exit(1);
+	for (i = 0; i < NUM_STORES; i++) {
+		if (tdb_store(tdb, tdb_mkdata(k, 2), tdb_mkdata(&i, sizeof(i)),
+			      TDB_REPLACE) != TDB_SUCCESS)
+			_exit(1);
+	}
+	tdb_close(tdb);
+	_exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int i, w, status;
+	struct tdb_context *tdb;
+	struct seen seen;
+	union tdb_attribute clog;
+	int64_t since;
+	pid_t pid[NUM_WRITERS];
+	int flags[] = { TDB_DEFAULT, TDB_NOMMAP,
+			TDB_CONVERT, TDB_NOMMAP|TDB_CONVERT };
+
+	clog.changelog.base.attr = TDB_ATTRIBUTE_CHANGELOG;
+	clog.changelog.base.next = &tap_log_attr;
+	clog.changelog.entries = NUM_WRITERS * NUM_STORES;
+	clog.changelog.key_len = 8;
+
+	plan_tests(sizeof(flags) / sizeof(flags[0]) * 8);
+	/* Rather than spin forever if a writer dies. */
+	alarm(60);
+	for (i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+		tdb = tdb_open("api-changelog-writers.tdb", flags[i],
+			       O_RDWR|O_CREAT|O_TRUNC, 0600, &clog);
+		if (!ok1(tdb))
+			continue;
+		/* Don't hand the children an open tdb. */
+		tdb_close(tdb);
+
+		/* Writers on different chains don't wait for each other
+		 * to log, so read while they're at it. */
+		for (w = 0; w < NUM_WRITERS; w++) {
+			pid[w] = fork();
+			if (pid[w] == 0)
+				writer(flags[i], w);
+		}
+		tdb = tdb_open("api-changelog-writers.tdb", flags[i], O_RDWR, 0,
+			       &tap_log_attr);
+
+		memset(&seen, 0, sizeof(seen));
+		seen.next = 1;
+		since = 0;
+		while (since < NUM_WRITERS * NUM_STORES && !seen.bad) {
+			since = tdb_changes(tdb, since, check_change, &seen);
+			if (since < 0)
+				break;
+		}
+
+		status = 0;
+		for (w = 0; w < NUM_WRITERS; w++) {
+			int ws;
+			waitpid(pid[w], &ws, 0);
+			if (!WIFEXITED(ws) || WEXITSTATUS(ws) != 0)
+				status++;
+		}
+		ok1(status == 0);
+		ok1(!seen.bad);
+		ok1(since == NUM_WRITERS * NUM_STORES);
+		for (w = 0; w < NUM_WRITERS; w++)
+			if (seen.count[w] != NUM_STORES)
+				break;
+		ok1(w == NUM_WRITERS);
+		tdb_close(tdb);
+
+		tdb = tdb_open("api-changelog-writers.tdb", flags[i], O_RDWR, 0,
+			       &tap_log_attr);
+		ok1(tdb_changes(tdb, 0, NULL, NULL) == since);
+		ok1(tdb_check(tdb, NULL, NULL) == TDB_SUCCESS);
+		tdb_close(tdb);
+		ok1(tap_log_messages == 0);
+	}
+	return exit_status();
+}
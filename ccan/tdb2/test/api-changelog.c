@@ -0,0 +1,137 @@
+#include <ccan/tdb2/tdb2.h>
+#include <ccan/tap/tap.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include "logging.h"
+
+struct seen {
+	unsigned int num, stop_after;
+	struct tdb_change c[10];
+	char key[10][8];
+};
+
+static int record_change(const struct tdb_change *c, struct seen *seen)
+{
+	seen->c[seen->num] = *c;
+	memcpy(seen->key[seen->num], c->key.dptr, c->key.dsize);
+	seen->c[seen->num].key.dptr = (unsigned char *)seen->key[seen->num];
+	return ++seen->num == seen->stop_after;
+}
+
+static bool is_change(const struct tdb_change *c, uint64_t num,
+		      enum tdb_change_op op, const char *key, uint64_t key_len)
+{
+	return c->num == num && c->op == op
+		&& c->key.dsize == strlen(key)
+		&& memcmp(c->key.dptr, key, c->key.dsize) == 0
+		&& c->key_len == key_len;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int i;
+	struct tdb_context *tdb;
+	struct seen seen;
+	union tdb_attribute clog, attr;
+	struct tdb_data key = tdb_mkdata("key", 3);
+	struct tdb_data longkey = tdb_mkdata("a long key", 10);
+	struct tdb_data data = tdb_mkdata("data", 4);
+	int flags[] = { TDB_INTERNAL, TDB_DEFAULT, TDB_NOMMAP,
+			TDB_INTERNAL|TDB_CONVERT, TDB_CONVERT,
+			TDB_NOMMAP|TDB_CONVERT };
+
+	clog.changelog.base.attr = TDB_ATTRIBUTE_CHANGELOG;
+	clog.changelog.base.next = &tap_log_attr;
+	clog.changelog.entries = 4;
+	clog.changelog.key_len = 5;
+
+	plan_tests(sizeof(flags) / sizeof(flags[0]) * 32 + 4 * 6 + 4);
+	for (i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+		tdb = tdb_open("api-changelog.tdb", flags[i],
+			       O_RDWR|O_CREAT|O_TRUNC, 0600, &clog);
+		if (!ok1(tdb))
+			continue;
+
+		attr.base.attr = TDB_ATTRIBUTE_CHANGELOG;
+		ok1(tdb_get_attribute(tdb, &attr) == TDB_SUCCESS);
+		ok1(attr.changelog.entries == 4);
+		ok1(attr.changelog.key_len == 8);
+
+		ok1(tdb_changes(tdb, 0, NULL, NULL) == 0);
+		ok1(tdb_store(tdb, key, data, TDB_INSERT) == TDB_SUCCESS);
+		/* Failed operations aren't recorded. */
+		ok1(tdb_store(tdb, key, data, TDB_INSERT) == TDB_ERR_EXISTS);
+		ok1(tdb_append(tdb, key, data) == TDB_SUCCESS);
+		ok1(tdb_delete(tdb, key) == TDB_SUCCESS);
+		ok1(tdb_changes(tdb, 0, NULL, NULL) == 3);
+
+		memset(&seen, 0, sizeof(seen));
+		ok1(tdb_changes(tdb, 0, record_change, &seen) == 3);
+		ok1(seen.num == 3);
+		ok1(is_change(&seen.c[0], 1, TDB_CHANGE_STORE, "key", 3));
+		ok1(is_change(&seen.c[1], 2, TDB_CHANGE_APPEND, "key", 3));
+		ok1(is_change(&seen.c[2], 3, TDB_CHANGE_DELETE, "key", 3));
+		ok1(seen.c[0].hash == seen.c[2].hash);
+
+		/* Nothing new. */
+		memset(&seen, 0, sizeof(seen));
+		ok1(tdb_changes(tdb, 3, record_change, &seen) == 3);
+		ok1(seen.num == 0);
+
+		/* Keys are truncated to the key room. */
+		ok1(tdb_store(tdb, longkey, data, TDB_INSERT) == TDB_SUCCESS);
+		memset(&seen, 0, sizeof(seen));
+		ok1(tdb_changes(tdb, 3, record_change, &seen) == 4);
+		ok1(seen.num == 1);
+		ok1(is_change(&seen.c[0], 4, TDB_CHANGE_STORE, "a long k", 10));
+
+		/* Wrap the ring: 1 and 2 are lost. */
+		ok1(tdb_store(tdb, key, data, TDB_INSERT) == TDB_SUCCESS);
+		ok1(tdb_wipe_all(tdb) == TDB_SUCCESS);
+		memset(&seen, 0, sizeof(seen));
+		ok1(tdb_changes(tdb, 0, record_change, &seen) == 7);
+		ok1(seen.num == 5);
+		ok1(seen.c[0].num == 3 && seen.c[0].op == TDB_CHANGE_LOST);
+		ok1(is_change(&seen.c[1], 4, TDB_CHANGE_STORE, "a long k", 10));
+
+		/* Stopping early returns the last one seen. */
+		memset(&seen, 0, sizeof(seen));
+		seen.stop_after = 2;
+		ok1(tdb_changes(tdb, 4, record_change, &seen) == 6);
+		ok1(seen.num == 2);
+
+		ok1(tdb_check(tdb, NULL, NULL) == TDB_SUCCESS);
+		tdb_close(tdb);
+		ok1(tap_log_messages == 0);
+
+		if (flags[i] & TDB_INTERNAL)
+			continue;
+
+		/* It persists, and cancelled transactions aren't recorded. */
+		tdb = tdb_open("api-changelog.tdb", flags[i], O_RDWR, 0,
+			       &tap_log_attr);
+		ok1(tdb_changes(tdb, 0, NULL, NULL) == 7);
+		ok1(tdb_transaction_start(tdb) == TDB_SUCCESS);
+		ok1(tdb_store(tdb, key, data, TDB_INSERT) == TDB_SUCCESS);
+		ok1(tdb_changes(tdb, 0, NULL, NULL) == 8);
+		tdb_transaction_cancel(tdb);
+		ok1(tdb_changes(tdb, 0, NULL, NULL) == 7);
+		tdb_close(tdb);
+		ok1(tap_log_messages == 0);
+	}
+
+	/* Can only create a changelog. */
+	ok1(!tdb_open("api-changelog.tdb", TDB_DEFAULT, O_RDWR, 0, &clog));
+	ok1(tap_log_messages == 1);
+
+	/* A tdb without one can't give changes. */
+	tdb = tdb_open("api-changelog.tdb", TDB_DEFAULT, O_RDWR|O_CREAT|O_TRUNC,
+		       0600, &tap_log_attr);
+	ok1(tdb_changes(tdb, 0, NULL, NULL) == TDB_ERR_EINVAL);
+	ok1(tap_log_messages == 2);
+	tdb_close(tdb);
+	return exit_status();
+}
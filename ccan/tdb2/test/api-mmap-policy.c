@@ -0,0 +1,67 @@
+#include <ccan/tdb2/tdb2.h>
+#include <ccan/tap/tap.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include "logging.h"
+
+int main(int argc, char *argv[])
+{
+	unsigned int i, j = 0;
+	struct tdb_context *tdb;
+	union tdb_attribute mattr, attr;
+	struct tdb_data key = tdb_mkdata(&j, sizeof(j)), data;
+	int flags[] = { TDB_INTERNAL, TDB_DEFAULT, TDB_NOMMAP,
+			TDB_INTERNAL|TDB_CONVERT, TDB_CONVERT,
+			TDB_NOMMAP|TDB_CONVERT,
+			TDB_INTERNAL|TDB_VERSION1, TDB_VERSION1,
+			TDB_NOMMAP|TDB_VERSION1 };
+
+	mattr.base.attr = TDB_ATTRIBUTE_MMAP;
+	mattr.base.next = &tap_log_attr;
+	mattr.mmap.flags = TDB_MMAP_RANDOM|TDB_MMAP_POPULATE|TDB_MMAP_HUGEPAGE;
+
+	plan_tests(sizeof(flags) / sizeof(flags[0]) * 14);
+	for (i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+		tdb = tdb_open("api-mmap-policy.tdb", flags[i],
+			       O_RDWR|O_CREAT|O_TRUNC, 0600, &mattr);
+		if (!ok1(tdb))
+			continue;
+
+		attr.base.attr = TDB_ATTRIBUTE_MMAP;
+		ok1(tdb_get_attribute(tdb, &attr) == TDB_SUCCESS);
+		ok1(attr.mmap.flags == mattr.mmap.flags);
+
+		/* Growing the file remaps it: hints mustn't upset that. */
+		for (j = 0; j < 1000; j++) {
+			if (tdb_store(tdb, key, key, TDB_INSERT) != TDB_SUCCESS)
+				break;
+		}
+		ok1(j == 1000);
+		j = 500;
+		ok1(tdb_fetch(tdb, key, &data) == TDB_SUCCESS);
+		ok1(data.dsize == sizeof(j) && *(unsigned int *)data.dptr == j);
+		free(data.dptr);
+
+		/* Can change it after opening. */
+		attr.mmap.flags = TDB_MMAP_SEQUENTIAL;
+		ok1(tdb_set_attribute(tdb, &attr) == TDB_SUCCESS);
+		ok1(tdb_traverse(tdb, NULL, NULL) == 1000);
+
+		tdb_unset_attribute(tdb, TDB_ATTRIBUTE_MMAP);
+		ok1(tdb_get_attribute(tdb, &attr) == TDB_SUCCESS);
+		ok1(attr.mmap.flags == 0);
+
+		/* Random and sequential are contradictory. */
+		attr.mmap.flags = TDB_MMAP_RANDOM|TDB_MMAP_SEQUENTIAL;
+		ok1(tdb_set_attribute(tdb, &attr) == TDB_ERR_EINVAL);
+		ok1(tap_log_messages == 1);
+		tap_log_messages = 0;
+
+		ok1(tdb_check(tdb, NULL, NULL) == TDB_SUCCESS);
+		tdb_close(tdb);
+		ok1(tap_log_messages == 0);
+	}
+	return exit_status();
+}
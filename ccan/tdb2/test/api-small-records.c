@@ -0,0 +1,247 @@
+#include <ccan/tdb2/tdb2.h>
+#include <ccan/tap/tap.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "logging.h"
+
+#define NUM_RECORDS 100
+
+static uint64_t fixed_hash(const void *key, size_t len, uint64_t seed,
+			   void *unused)
+{
+	return 0;
+}
+
+static int count_record(struct tdb_context *tdb,
+			TDB_DATA key, TDB_DATA data, unsigned int *count)
+{
+	(*count)++;
+	return 0;
+}
+
+static enum TDB_ERROR check_record(TDB_DATA key, TDB_DATA data,
+				   unsigned int *count)
+{
+	(*count)++;
+	return TDB_SUCCESS;
+}
+
+static struct tdb_data make_key(char *buf, unsigned int i)
+{
+	sprintf(buf, "key%05u", i);
+	return tdb_mkdata(buf, 8);
+}
+
+static uint64_t compares(struct tdb_context *tdb)
+{
+	union tdb_attribute stats;
+
+	stats.base.attr = TDB_ATTRIBUTE_STATS;
+	stats.stats.size = sizeof(stats.stats);
+	if (tdb_get_attribute(tdb, &stats) != TDB_SUCCESS)
+		return -1ULL;
+	return stats.stats.compares;
+}
+
+static bool fetch_is(struct tdb_context *tdb, struct tdb_data key,
+		     const void *val, size_t len)
+{
+	struct tdb_data d;
+	bool ret;
+
+	if (tdb_fetch(tdb, key, &d) != TDB_SUCCESS)
+		return false;
+	ret = (d.dsize == len && memcmp(d.dptr, val, len) == 0);
+	free(d.dptr);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int i, count;
+	uint64_t v, before;
+	struct tdb_context *tdb;
+	union tdb_attribute small, seed, hash, attr;
+	struct tdb_data key, k, big;
+	char kbuf[9], bigbuf[100], expect[16 + 100];
+	bool ok;
+	int flags[] = { TDB_INTERNAL, TDB_DEFAULT, TDB_NOMMAP,
+			TDB_INTERNAL|TDB_CONVERT, TDB_CONVERT,
+			TDB_NOMMAP|TDB_CONVERT };
+
+	small.small.base.attr = TDB_ATTRIBUTE_SMALL;
+	small.small.base.next = &seed;
+	small.small.slots = 4000;
+	/* Same layout every time, so the compares count is stable. */
+	seed.seed.base.attr = TDB_ATTRIBUTE_SEED;
+	seed.seed.base.next = &tap_log_attr;
+	seed.seed.seed = 0;
+	hash.hash.base.attr = TDB_ATTRIBUTE_HASH;
+	hash.hash.base.next = &tap_log_attr;
+	hash.hash.fn = fixed_hash;
+	memset(bigbuf, 'x', sizeof(bigbuf));
+	big = tdb_mkdata(bigbuf, sizeof(bigbuf));
+
+	plan_tests(sizeof(flags) / sizeof(flags[0]) * 25 + 4 * 3 + 4 * 6 + 12);
+	for (i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+		tdb = tdb_open("api-small-records.tdb", flags[i],
+			       O_RDWR|O_CREAT|O_TRUNC, 0600, &small);
+		if (!ok1(tdb))
+			continue;
+
+		/* Rounded up to a multiple of the number of hash locks. */
+		attr.base.attr = TDB_ATTRIBUTE_SMALL;
+		ok1(tdb_get_attribute(tdb, &attr) == TDB_SUCCESS);
+		ok1(attr.small.slots == 4096);
+
+		for (ok = true, v = 0; v < NUM_RECORDS; v++) {
+			key = make_key(kbuf, v);
+			if (tdb_store(tdb, key, tdb_mkdata(&v, sizeof(v)),
+				      TDB_INSERT) != TDB_SUCCESS)
+				ok = false;
+		}
+		ok1(ok);
+
+		/* They all landed in slots, so finding them never goes
+		 * near the hash table. */
+		before = compares(tdb);
+		for (ok = true, v = 0; v < NUM_RECORDS; v++) {
+			key = make_key(kbuf, v);
+			if (!fetch_is(tdb, key, &v, sizeof(v)))
+				ok = false;
+		}
+		ok1(ok);
+		ok1(compares(tdb) == before);
+		ok1(tdb_check(tdb, NULL, NULL) == TDB_SUCCESS);
+
+		/* Growing within the slot's padding stays put... */
+		key = make_key(kbuf, 1);
+		ok1(tdb_append(tdb, key, tdb_mkdata("appended", 8))
+		    == TDB_SUCCESS);
+		ok1(fetch_is(tdb, key, "\1\0\0\0\0\0\0\0appended", 16));
+		ok1(compares(tdb) == before);
+
+		/* ... beyond it moves to the hash table. */
+		ok1(tdb_append(tdb, key, big) == TDB_SUCCESS);
+		memcpy(expect, "\1\0\0\0\0\0\0\0appended", 16);
+		memcpy(expect + 16, bigbuf, sizeof(bigbuf));
+		ok1(fetch_is(tdb, key, expect, sizeof(expect)));
+		key = make_key(kbuf, 0);
+		ok1(tdb_store(tdb, key, big, TDB_REPLACE) == TDB_SUCCESS);
+		ok1(fetch_is(tdb, key, bigbuf, sizeof(bigbuf)));
+		ok1(compares(tdb) > before);
+		ok1(tdb_check(tdb, NULL, NULL) == TDB_SUCCESS);
+
+		/* Deleting frees the slot for another. */
+		key = make_key(kbuf, 2);
+		ok1(tdb_delete(tdb, key) == TDB_SUCCESS);
+		ok1(!tdb_exists(tdb, key));
+		v = 2;
+		ok1(tdb_store(tdb, key, tdb_mkdata(&v, sizeof(v)), TDB_INSERT)
+		    == TDB_SUCCESS);
+
+		/* A store we cancel leaves the slot empty. */
+		if (!(flags[i] & TDB_INTERNAL)) {
+			ok1(tdb_transaction_start(tdb) == TDB_SUCCESS);
+			key = make_key(kbuf, NUM_RECORDS);
+			ok1(tdb_store(tdb, key, key, TDB_INSERT)
+			    == TDB_SUCCESS);
+			tdb_transaction_cancel(tdb);
+			ok1(!tdb_exists(tdb, key));
+		}
+
+		/* Traversals see slots as well as the hash table. */
+		count = 0;
+		ok1(tdb_traverse(tdb, count_record, &count) == NUM_RECORDS);
+		ok1(count == NUM_RECORDS);
+		count = 0;
+		for (ok = (tdb_firstkey(tdb, &k) == TDB_SUCCESS); ok;
+		     ok = (tdb_nextkey(tdb, &k) == TDB_SUCCESS))
+			count++;
+		ok1(count == NUM_RECORDS);
+		count = 0;
+		ok1(tdb_check(tdb, check_record, &count) == TDB_SUCCESS);
+		ok1(count == NUM_RECORDS);
+		tdb_close(tdb);
+		ok1(tap_log_messages == 0);
+	}
+
+	/* The slots stay with the file. */
+	for (i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+		if (flags[i] & TDB_INTERNAL)
+			continue;
+		tdb = tdb_open("api-small-records.tdb", flags[i],
+			       O_RDWR|O_CREAT|O_TRUNC, 0600, &small);
+		for (v = 0; v < NUM_RECORDS; v++) {
+			key = make_key(kbuf, v);
+			tdb_store(tdb, key, tdb_mkdata(&v, sizeof(v)),
+				  TDB_INSERT);
+		}
+		tdb_close(tdb);
+
+		tdb = tdb_open("api-small-records.tdb", flags[i], O_RDWR, 0,
+			       &tap_log_attr);
+		attr.base.attr = TDB_ATTRIBUTE_SMALL;
+		ok1(tdb_get_attribute(tdb, &attr) == TDB_SUCCESS);
+		ok1(attr.small.slots == 4096);
+		for (ok = true, v = 0; v < NUM_RECORDS; v++) {
+			key = make_key(kbuf, v);
+			if (!fetch_is(tdb, key, &v, sizeof(v)))
+				ok = false;
+		}
+		ok1(ok);
+		ok1(tdb_check(tdb, NULL, NULL) == TDB_SUCCESS);
+		tdb_close(tdb);
+
+		/* Creation only. */
+		small.small.base.next = &tap_log_attr;
+		ok1(!tdb_open("api-small-records.tdb", flags[i], O_RDWR, 0,
+			      &small));
+		ok1(tap_log_messages == 1);
+		tap_log_messages = 0;
+		small.small.base.next = &seed;
+	}
+
+	/* When a key's slots are all full, it goes in the hash table. */
+	small.small.base.next = &hash;
+	tdb = tdb_open("api-small-records.tdb", TDB_DEFAULT,
+		       O_RDWR|O_CREAT|O_TRUNC, 0600, &small);
+	ok1(tdb);
+	for (ok = true, v = 0; v < 6; v++) {
+		key = make_key(kbuf, v);
+		if (tdb_store(tdb, key, tdb_mkdata(&v, sizeof(v)),
+			      TDB_INSERT) != TDB_SUCCESS)
+			ok = false;
+	}
+	ok1(ok);
+	for (ok = true, v = 0; v < 6; v++) {
+		key = make_key(kbuf, v);
+		if (!fetch_is(tdb, key, &v, sizeof(v)))
+			ok = false;
+	}
+	ok1(ok);
+	ok1(tdb_check(tdb, NULL, NULL) == TDB_SUCCESS);
+
+	/* Emptying a slot doesn't lose the ones in the hash table. */
+	key = make_key(kbuf, 0);
+	ok1(tdb_delete(tdb, key) == TDB_SUCCESS);
+	key = make_key(kbuf, 5);
+	ok1(tdb_exists(tdb, key));
+	ok1(tdb_delete(tdb, key) == TDB_SUCCESS);
+	ok1(!tdb_exists(tdb, key));
+	count = 0;
+	ok1(tdb_traverse(tdb, count_record, &count) == 4);
+	ok1(tdb_check(tdb, NULL, NULL) == TDB_SUCCESS);
+	tdb_close(tdb);
+
+	/* Not for TDB1. */
+	small.small.base.next = &tap_log_attr;
+	ok1(!tdb_open("api-small-records.tdb", TDB_VERSION1,
+		      O_RDWR|O_CREAT|O_TRUNC, 0600, &small));
+	ok1(tap_log_messages == 1);
+	return exit_status();
+}
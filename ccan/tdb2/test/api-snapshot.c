@@ -0,0 +1,92 @@
+#include <ccan/tdb2/tdb2.h>
+#include <ccan/tap/tap.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <errno.h>
+#include "logging.h"
+
+#define NUM_RECORDS 500
+
+/* Every key i < num maps to i + add. */
+static bool all_there(struct tdb_context *tdb, unsigned int num,
+		      unsigned int add)
+{
+	unsigned int i, val;
+	struct tdb_data key = { (unsigned char *)&i, sizeof(i) };
+	struct tdb_data d;
+
+	for (i = 0; i < num; i++) {
+		if (tdb_fetch(tdb, key, &d) != TDB_SUCCESS)
+			return false;
+		val = i + add;
+		if (d.dsize != sizeof(val) || memcmp(d.dptr, &val, sizeof(val)))
+			return false;
+		free(d.dptr);
+	}
+	return tdb_traverse(tdb, NULL, NULL) == num;
+}
+
+static bool store_all(struct tdb_context *tdb, unsigned int start,
+		      unsigned int num, unsigned int add)
+{
+	unsigned int i, val;
+	struct tdb_data key = { (unsigned char *)&i, sizeof(i) };
+	struct tdb_data data = { (unsigned char *)&val, sizeof(val) };
+
+	for (i = start; i < start + num; i++) {
+		val = i + add;
+		if (tdb_store(tdb, key, data, TDB_REPLACE) != TDB_SUCCESS)
+			return false;
+	}
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int i;
+	struct tdb_context *tdb, *snap;
+	struct tdb_data key = { (unsigned char *)&i, sizeof(i) };
+	int flags[] = { TDB_DEFAULT, TDB_NOMMAP,
+			TDB_CONVERT, TDB_NOMMAP|TDB_CONVERT,
+			TDB_VERSION1, TDB_NOMMAP|TDB_VERSION1,
+			TDB_CONVERT|TDB_VERSION1,
+			TDB_NOMMAP|TDB_CONVERT|TDB_VERSION1 };
+
+	plan_tests(sizeof(flags) / sizeof(flags[0]) * 12 + 2);
+	for (i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+		tdb = tdb_open("api-snapshot.tdb", flags[i],
+			       O_RDWR|O_CREAT|O_TRUNC, 0600, &tap_log_attr);
+		ok1(tdb);
+		if (!tdb)
+			continue;
+		ok1(store_all(tdb, 0, NUM_RECORDS, 0));
+
+		/* The live tdb is open in this process too: that's fine. */
+		snap = tdb_open("api-snapshot.tdb", flags[i]|TDB_SNAPSHOT,
+				O_RDONLY, 0, &tap_log_attr);
+		ok1(snap);
+		ok1(tdb_get_flags(snap) & TDB_SNAPSHOT);
+
+		/* Change everything, and grow the file. */
+		ok1(store_all(tdb, 0, NUM_RECORDS, 1));
+		ok1(store_all(tdb, NUM_RECORDS, NUM_RECORDS, 1));
+		ok1(all_there(tdb, NUM_RECORDS * 2, 1));
+
+		/* The snapshot saw none of it. */
+		ok1(all_there(snap, NUM_RECORDS, 0));
+		ok1(tdb_store(snap, key, key, TDB_REPLACE) == TDB_ERR_RDONLY);
+		ok1(tdb_check(snap, NULL, NULL) == TDB_SUCCESS);
+		ok1(tdb_close(snap) == 0);
+		ok1(tdb_close(tdb) == 0);
+	}
+
+	/* Snapshots are read-only. */
+	snap = tdb_open("api-snapshot.tdb", TDB_SNAPSHOT, O_RDWR, 0,
+			&tap_log_attr);
+	ok1(!snap && errno == EINVAL);
+	/* One for each failed store, and this. */
+	ok1(tap_log_messages == sizeof(flags) / sizeof(flags[0]) + 1);
+	return exit_status();
+}
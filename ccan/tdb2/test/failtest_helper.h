@@ -4,9 +4,9 @@
 #include <stdbool.h>
 
 /* FIXME: Check these! */
-#define INITIAL_TDB_MALLOC	"open.c", 445, FAILTEST_MALLOC
-#define URANDOM_OPEN		"open.c", 62, FAILTEST_OPEN
-#define URANDOM_READ		"open.c", 42, FAILTEST_READ
+#define INITIAL_TDB_MALLOC	"open.c", 774, FAILTEST_MALLOC
+#define URANDOM_OPEN		"open.c", 66, FAILTEST_OPEN
+#define URANDOM_READ		"open.c", 46, FAILTEST_READ
 
 bool exit_check_log(struct tlist_calls *history);
 bool failmatch(const struct failtest_call *call,
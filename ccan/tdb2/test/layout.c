@@ -273,7 +273,6 @@ static struct tle_freetable *find_ftable(struct tdb_layout *layout, unsigned num
 
 /* FIXME: Support TDB_CONVERT */
 struct tdb_context *tdb_layout_get(struct tdb_layout *layout,
-				   void (*freefn)(void *),
 				   union tdb_attribute *attr)
 {
 	unsigned int i;
@@ -309,7 +308,7 @@ struct tdb_context *tdb_layout_get(struct tdb_layout *layout,
 		off += len;
 	}
 
-	mem = malloc(off);
+	mem = tdb_internal_alloc(off);
 	/* Fill with some weird pattern. */
 	memset(mem, 0x99, off);
 	/* Now populate our header, cribbing from a real TDB header. */
@@ -317,7 +316,7 @@ struct tdb_context *tdb_layout_get(struct tdb_layout *layout,
 	memcpy(mem, tdb->file->map_ptr, sizeof(struct tdb_header));
 
 	/* Mug the tdb we have to make it use this. */
-	freefn(tdb->file->map_ptr);
+	tdb_internal_free(tdb);
 	tdb->file->map_ptr = mem;
 	tdb->file->map_size = off;
 
@@ -371,10 +370,10 @@ struct tdb_context *tdb_layout_get(struct tdb_layout *layout,
 	return tdb;
 }
 
-void tdb_layout_write(struct tdb_layout *layout, void (*freefn)(void *),
+void tdb_layout_write(struct tdb_layout *layout,
 		       union tdb_attribute *attr, const char *filename)
 {
-	struct tdb_context *tdb = tdb_layout_get(layout, freefn, attr);
+	struct tdb_context *tdb = tdb_layout_get(layout, attr);
 	int fd;
 
 	fd = open(filename, O_WRONLY|O_TRUNC|O_CREAT,  0600);
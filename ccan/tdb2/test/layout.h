@@ -22,11 +22,9 @@ void tdb_layout_add_hashtable(struct tdb_layout *layout,
 			      unsigned int bucket,
 			      tdb_len_t extra);
 #endif
-/* freefn is needed if we're using failtest_free. */
 struct tdb_context *tdb_layout_get(struct tdb_layout *layout,
-				   void (*freefn)(void *),
 				   union tdb_attribute *attr);
-void tdb_layout_write(struct tdb_layout *layout, void (*freefn)(void *),
+void tdb_layout_write(struct tdb_layout *layout,
 		       union tdb_attribute *attr, const char *filename);
 
 void tdb_layout_free(struct tdb_layout *layout);
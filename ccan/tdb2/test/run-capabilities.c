@@ -62,7 +62,7 @@ static void create_tdb(const char *name,
 	va_end(ap);
 
 	/* We open-code this, because we need to use the failtest write. */
-	tdb = tdb_layout_get(layout, failtest_free, &tap_log_attr);
+	tdb = tdb_layout_get(layout, &tap_log_attr);
 
 	fd = open(name, O_RDWR|O_TRUNC|O_CREAT, 0600);
 	if (fd < 0)
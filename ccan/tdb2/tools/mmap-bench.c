@@ -0,0 +1,219 @@
+/* Compare TDB_ATTRIBUTE_MMAP policies on a cold database.
+ *
+ * The interesting case is a database larger than memory: create one with
+ * --create, then each policy is timed after the file is dropped from the
+ * page cache.  With a smaller file, eviction still gives cold-cache numbers,
+ * but the kernel can keep it all once it's read.  Rather than filling the
+ * disk, run it in a memory cgroup smaller than the file, eg:
+ *
+ *	mkdir /sys/fs/cgroup/memory/bench
+ *	echo 192M > /sys/fs/cgroup/memory/bench/memory.limit_in_bytes
+ *	echo $$ > /sys/fs/cgroup/memory/bench/tasks
+ *	mmap-bench /tmp/big.tdb 2000
+ *
+ * Without MADV_RANDOM, readahead there evicts pages we still want.
+ */
+#include "tdb2.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <err.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+
+#define VALUE_SIZE 1000
+
+static void logfn(struct tdb_context *tdb,
+		  enum tdb_log_level level,
+		  enum TDB_ERROR ecode,
+		  const char *message,
+		  void *data)
+{
+	fprintf(stderr, "tdb:%s:%s:%s\n",
+		tdb_name(tdb), tdb_errorstr(ecode), message);
+}
+
+static unsigned long usec_since(const struct timeval *start)
+{
+	struct timeval now, diff;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, start, &diff);
+	return diff.tv_sec * 1000000UL + diff.tv_usec;
+}
+
+static long major_faults(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_majflt;
+}
+
+static void drop_cache(const char *name)
+{
+	int fd = open(name, O_RDONLY);
+
+	if (fd < 0)
+		err(1, "Opening %s", name);
+	fdatasync(fd);
+	if (posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) != 0)
+		warnx("Could not drop %s from page cache", name);
+	close(fd);
+}
+
+static void create(const char *name, int flags, unsigned int records,
+		   union tdb_attribute *log)
+{
+	struct tdb_context *tdb;
+	union tdb_attribute hsize;
+	TDB_DATA k, d;
+	enum TDB_ERROR ecode;
+	unsigned int i;
+
+	/* TDB1 needs a decent hash size to be fair. */
+	hsize.base.attr = TDB_ATTRIBUTE_TDB1_HASHSIZE;
+	hsize.base.next = log;
+	hsize.tdb1_hashsize.hsize = records / 4 + 1;
+
+	tdb = tdb_open(name, flags, O_RDWR|O_CREAT|O_TRUNC, 0600,
+		       (flags & TDB_VERSION1) ? &hsize : log);
+	if (!tdb)
+		err(1, "Creating %s", name);
+
+	k = tdb_mkdata(&i, sizeof(i));
+	d.dsize = VALUE_SIZE;
+	d.dptr = calloc(d.dsize, 1);
+	tdb_transaction_start(tdb);
+	for (i = 0; i < records; i++) {
+		memcpy(d.dptr, &i, sizeof(i));
+		ecode = tdb_store(tdb, k, d, TDB_INSERT);
+		if (ecode != TDB_SUCCESS)
+			errx(1, "tdb insert failed: %s", tdb_errorstr(ecode));
+	}
+	if ((ecode = tdb_transaction_commit(tdb)) != 0)
+		errx(1, "tdb commit failed: %s", tdb_errorstr(ecode));
+	free(d.dptr);
+	tdb_close(tdb);
+}
+
+/* --create stores keys 0 to records-1, so find the first one missing.
+ * A traverse would do, but that reads the whole (uncached) file. */
+static unsigned int count_records(struct tdb_context *tdb)
+{
+	unsigned int lo = 0, hi = -1U, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (tdb_exists(tdb, tdb_mkdata(&mid, sizeof(mid))))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int i, p, records = 0, lookups, key;
+	int flags = TDB_NOSYNC;
+	struct tdb_context *tdb;
+	union tdb_attribute log, mmap;
+	struct timeval start;
+	unsigned long open_usec, lookup_usec, traverse_usec;
+	long faults;
+	int64_t count;
+	const struct {
+		const char *name;
+		unsigned int flags;
+	} policy[] = { { "none", 0 },
+		       { "random", TDB_MMAP_RANDOM },
+		       { "sequential", TDB_MMAP_SEQUENTIAL },
+		       { "populate", TDB_MMAP_POPULATE },
+		       { "hugepage", TDB_MMAP_HUGEPAGE },
+		       { "random+hugepage", TDB_MMAP_RANDOM|TDB_MMAP_HUGEPAGE } };
+
+	if (argv[1] && strcmp(argv[1], "--tdb1") == 0) {
+		flags |= TDB_VERSION1;
+		argc--;
+		argv++;
+	}
+	if (argv[1] && strcmp(argv[1], "--create") == 0 && argv[2]) {
+		records = atoi(argv[2]);
+		argc -= 2;
+		argv += 2;
+	}
+	if (argc != 3) {
+		printf("Usage: mmap-bench [--tdb1] [--create <records>]"
+		       " <tdbfile> <lookups>\n");
+		exit(1);
+	}
+	lookups = atoi(argv[2]);
+
+	log.base.attr = TDB_ATTRIBUTE_LOG;
+	log.base.next = NULL;
+	log.log.fn = logfn;
+
+	if (records)
+		create(argv[1], flags, records, &log);
+	else {
+		tdb = tdb_open(argv[1], flags & ~TDB_VERSION1, O_RDWR, 0,
+			       &log);
+		if (!tdb)
+			err(1, "Opening %s", argv[1]);
+		records = count_records(tdb);
+		if (!records)
+			errx(1, "%s is empty", argv[1]);
+		tdb_close(tdb);
+	}
+
+	printf("%-16s %10s %12s %12s %10s\n",
+	       "policy", "open(us)", "lookup(ns)", "traverse(us)", "majflt");
+	for (p = 0; p < sizeof(policy) / sizeof(policy[0]); p++) {
+		mmap.base.attr = TDB_ATTRIBUTE_MMAP;
+		mmap.base.next = &log;
+		mmap.mmap.flags = policy[p].flags;
+
+		drop_cache(argv[1]);
+		faults = major_faults();
+		gettimeofday(&start, NULL);
+		tdb = tdb_open(argv[1], flags & ~TDB_VERSION1, O_RDWR, 0,
+			       &mmap);
+		if (!tdb)
+			err(1, "Opening %s", argv[1]);
+		open_usec = usec_since(&start);
+
+		srandom(0);
+		gettimeofday(&start, NULL);
+		for (i = 0; i < lookups; i++) {
+			TDB_DATA d;
+			enum TDB_ERROR ecode;
+
+			key = random() % records;
+			ecode = tdb_fetch(tdb, tdb_mkdata(&key, sizeof(key)),
+					  &d);
+			if (ecode != TDB_SUCCESS)
+				errx(1, "fetch %u failed: %s",
+				     key, tdb_errorstr(ecode));
+			free(d.dptr);
+		}
+		lookup_usec = usec_since(&start);
+
+		gettimeofday(&start, NULL);
+		count = tdb_traverse(tdb, NULL, NULL);
+		traverse_usec = usec_since(&start);
+		if (count != records)
+			errx(1, "traverse found %lli not %u",
+			     (long long)count, records);
+		tdb_close(tdb);
+
+		printf("%-16s %10lu %12lu %12lu %10li\n", policy[p].name,
+		       open_usec, lookups ? lookup_usec * 1000 / lookups : 0,
+		       traverse_usec, major_faults() - faults);
+	}
+	return 0;
+}
@@ -144,9 +144,11 @@ int main(int argc, char *argv[])
 	TDB_DATA key, data;
 	struct tdb_context *tdb;
 	struct timeval start, stop;
-	union tdb_attribute seed, log;
+	union tdb_attribute seed, log, small;
 	bool do_stats = false;
 	enum TDB_ERROR ecode;
+	unsigned char skey[16];
+	uint64_t sval;
 
 	/* Try to keep benchmarks even. */
 	seed.base.attr = TDB_ATTRIBUTE_SEED;
@@ -182,15 +184,13 @@ int main(int argc, char *argv[])
 		argc--;
 		argv++;
 	}
-
-	tdb = tdb_open("/tmp/speed.tdb", flags, O_RDWR|O_CREAT|O_TRUNC,
-		       0600, &log);
-	if (!tdb)
-		err(1, "Opening /tmp/speed.tdb");
-
-	key.dptr = (void *)&i;
-	key.dsize = sizeof(i);
-	data = key;
+	if (argv[1] && strcmp(argv[1], "--small") == 0) {
+		small.base.attr = TDB_ATTRIBUTE_SMALL;
+		small.base.next = NULL;
+		seed.base.next = &small;
+		argc--;
+		argv++;
+	}
 
 	if (argv[1]) {
 		num = atoi(argv[1]);
@@ -204,6 +204,19 @@ int main(int argc, char *argv[])
 		argc--;
 	}
 
+	/* Every record here is tiny: room for all three stages of them. */
+	small.small.slots = num * 4;
+	tdb = tdb_open("/tmp/speed.tdb", flags, O_RDWR|O_CREAT|O_TRUNC,
+		       0600, &log);
+	if (!tdb)
+		err(1, "Opening /tmp/speed.tdb");
+	/* Only for creation. */
+	seed.base.next = NULL;
+
+	key.dptr = (void *)&i;
+	key.dsize = sizeof(i);
+	data = key;
+
 	/* Add 1000 records. */
 	printf("Adding %u records: ", num); fflush(stdout);
 	if (transaction && (ecode = tdb_transaction_start(tdb)))
@@ -439,5 +452,69 @@ int main(int argc, char *argv[])
 	if (++stage == stopat)
 		exit(0);
 
+	/* Small records: 16 byte keys, 8 byte values. */
+	key.dptr = (void *)skey;
+	key.dsize = sizeof(skey);
+	data.dptr = (void *)&sval;
+	data.dsize = sizeof(sval);
+	memset(skey, 'k', sizeof(skey));
+
+	printf("Adding %u small records: ", num); fflush(stdout);
+	if (transaction && (ecode = tdb_transaction_start(tdb)))
+		errx(1, "starting transaction: %s", tdb_errorstr(ecode));
+	gettimeofday(&start, NULL);
+	for (i = 0; i < num; i++) {
+		memcpy(skey, &i, sizeof(i));
+		sval = i;
+		if ((ecode = tdb_store(tdb, key, data, TDB_INSERT)) != 0)
+			errx(1, "Inserting small key %u in tdb: %s",
+			     i, tdb_errorstr(ecode));
+	}
+	gettimeofday(&stop, NULL);
+	if (transaction && (ecode = tdb_transaction_commit(tdb)))
+		errx(1, "committing transaction: %s", tdb_errorstr(ecode));
+	printf(" %zu ns (%zu bytes)\n",
+	       normalize(&start, &stop, num), file_size());
+	if (tdb_check(tdb, NULL, NULL))
+		errx(1, "tdb_check failed!");
+	if (summary) {
+		char *sumstr = NULL;
+		tdb_summary(tdb, TDB_SUMMARY_HISTOGRAMS, &sumstr);
+		printf("%s\n", sumstr);
+		free(sumstr);
+	}
+	if (do_stats)
+		dump_and_clear_stats(&tdb, flags, &log);
+	if (++stage == stopat)
+		exit(0);
+
+	printf("Finding %u small records: ", num); fflush(stdout);
+	if (transaction && (ecode = tdb_transaction_start(tdb)))
+		errx(1, "starting transaction: %s", tdb_errorstr(ecode));
+	gettimeofday(&start, NULL);
+	for (j = 0; j < num; j++) {
+		struct tdb_data dbuf;
+		i = (j + 100003) % num;
+		memcpy(skey, &i, sizeof(i));
+		if ((ecode = tdb_fetch(tdb, key, &dbuf)) != TDB_SUCCESS
+		    || dbuf.dsize != sizeof(sval)
+		    || *(uint64_t *)dbuf.dptr != i) {
+			errx(1, "Fetching small key %u in tdb gave %u",
+			     i, ecode);
+		}
+		free(dbuf.dptr);
+	}
+	gettimeofday(&stop, NULL);
+	if (transaction && (ecode = tdb_transaction_commit(tdb)))
+		errx(1, "committing transaction: %s", tdb_errorstr(ecode));
+	printf(" %zu ns (%zu bytes)\n",
+	       normalize(&start, &stop, num), file_size());
+	if (tdb_check(tdb, NULL, NULL))
+		errx(1, "tdb_check failed!");
+	if (do_stats)
+		dump_and_clear_stats(&tdb, flags, &log);
+	if (++stage == stopat)
+		exit(0);
+
 	return 0;
 }
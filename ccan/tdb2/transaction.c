@@ -558,6 +558,7 @@ enum TDB_ERROR tdb_transaction_start(struct tdb_context *tdb)
 		}
 		tdb->tdb2.transaction->nesting++;
 		tdb->stats.transaction_nest++;
+		tdb_trace(tdb, "tdb_transaction_start");
 		return 0;
 	}
 
@@ -608,6 +609,7 @@ enum TDB_ERROR tdb_transaction_start(struct tdb_context *tdb)
 	   transaction specific methods */
 	tdb->tdb2.transaction->io_methods = tdb->tdb2.io;
 	tdb->tdb2.io = &transaction_methods;
+	tdb_trace(tdb, "tdb_transaction_start");
 	return tdb->last_error = TDB_SUCCESS;
 
 fail_allrecord_lock:
@@ -628,6 +630,7 @@ void tdb_transaction_cancel(struct tdb_context *tdb)
 		return;
 	}
 	tdb->stats.transaction_cancel++;
+	tdb_trace(tdb, "tdb_transaction_cancel");
 	_tdb_transaction_cancel(tdb);
 }
 
@@ -1069,6 +1072,7 @@ enum TDB_ERROR tdb_transaction_prepare_commit(struct tdb_context *tdb)
 			return tdb->last_error;
 		return TDB_SUCCESS;
 	}
+	tdb_trace(tdb, "tdb_transaction_prepare_commit");
 	return tdb->last_error = _tdb_transaction_prepare_commit(tdb);
 }
 
@@ -1117,6 +1121,16 @@ enum TDB_ERROR tdb_transaction_commit(struct tdb_context *tdb)
 
 	methods = tdb->tdb2.transaction->io_methods;
 
+	/* tdb_changes() doesn't take our other locks, so keep it from
+	 * seeing half the changelog. */
+	if (tdb->tdb2.changelog) {
+		ecode = tdb_lock_changelog(tdb, F_WRLCK);
+		if (ecode != TDB_SUCCESS) {
+			_tdb_transaction_cancel(tdb);
+			return tdb->last_error = ecode;
+		}
+	}
+
 	/* perform all the writes */
 	for (i=0;i<tdb->tdb2.transaction->num_blocks;i++) {
 		tdb_off_t offset;
@@ -1140,6 +1154,8 @@ enum TDB_ERROR tdb_transaction_commit(struct tdb_context *tdb)
 			   run the crash recovery code */
 			tdb->tdb2.io = methods;
 			tdb_transaction_recover(tdb);
+			if (tdb->tdb2.changelog)
+				tdb_unlock_changelog(tdb, F_WRLCK);
 
 			_tdb_transaction_cancel(tdb);
 
@@ -1150,6 +1166,8 @@ enum TDB_ERROR tdb_transaction_commit(struct tdb_context *tdb)
 
 	SAFE_FREE(tdb->tdb2.transaction->blocks);
 	tdb->tdb2.transaction->num_blocks = 0;
+	if (tdb->tdb2.changelog)
+		tdb_unlock_changelog(tdb, F_WRLCK);
 
 	/* ensure the new data is on disk */
 	ecode = transaction_sync(tdb, 0, tdb->file->map_size);
@@ -35,6 +35,7 @@ int64_t tdb_traverse_(struct tdb_context *tdb,
 		return count;
 	}
 
+	tdb_trace(tdb, "tdb_traverse_start");
 	k.dptr = NULL;
 	for (ecode = first_in_hash(tdb, &tinfo, &k, &d.dsize);
 	     ecode == TDB_SUCCESS;
@@ -42,14 +43,17 @@ int64_t tdb_traverse_(struct tdb_context *tdb,
 		d.dptr = k.dptr + k.dsize;
 		
 		count++;
+		tdb_trace_1rec_retrec(tdb, "traverse", k, d);
 		if (fn && fn(tdb, k, d, p)) {
 			free(k.dptr);
+			tdb_trace_ret(tdb, "tdb_traverse_end", count);
 			tdb->last_error = TDB_SUCCESS;
 			return count;
 		}
 		free(k.dptr);
 	}
 
+	tdb_trace(tdb, "tdb_traverse_end");
 	if (ecode != TDB_ERR_NOEXIST) {
 		return TDB_ERR_TO_OFF(tdb->last_error = ecode);
 	}
@@ -71,7 +75,11 @@ enum TDB_ERROR tdb_firstkey(struct tdb_context *tdb, struct tdb_data *key)
 		return tdb->last_error;
 	}
 
-	return tdb->last_error = first_in_hash(tdb, &tinfo, key, NULL);
+	tdb->last_error = first_in_hash(tdb, &tinfo, key, NULL);
+	tdb_trace_retrec(tdb, "tdb_firstkey",
+			 tdb->last_error == TDB_SUCCESS ? *key
+			 : tdb_mkdata(NULL, 0));
+	return tdb->last_error;
 }
 
 /* We lock twice, not very efficient.  We could keep last key & tinfo cached. */
@@ -80,6 +88,7 @@ enum TDB_ERROR tdb_nextkey(struct tdb_context *tdb, struct tdb_data *key)
 	struct traverse_info tinfo;
 	struct hash_info h;
 	struct tdb_used_record rec;
+	struct tdb_data last_key;
 
 	if (tdb->flags & TDB_VERSION1) {
 		struct tdb_data last_key = *key;
@@ -93,14 +102,20 @@ enum TDB_ERROR tdb_nextkey(struct tdb_context *tdb, struct tdb_data *key)
 		return tdb->last_error;
 	}
 
-	tinfo.prev = find_and_lock(tdb, *key, F_RDLCK, &h, &rec, &tinfo);
-	free(key->dptr);
+	last_key = *key;
+	tinfo.prev = find_and_lock(tdb, last_key, F_RDLCK, &h, &rec, &tinfo);
 	if (TDB_OFF_IS_ERR(tinfo.prev)) {
+		free(last_key.dptr);
 		return tdb->last_error = TDB_OFF_TO_ERR(tinfo.prev);
 	}
 	tdb_unlock_hashes(tdb, h.hlock_start, h.hlock_range, F_RDLCK);
 
-	return tdb->last_error = next_in_hash(tdb, &tinfo, key, NULL);
+	tdb->last_error = next_in_hash(tdb, &tinfo, key, NULL);
+	tdb_trace_1rec_retrec(tdb, "tdb_nextkey", last_key,
+			      tdb->last_error == TDB_SUCCESS ? *key
+			      : tdb_mkdata(NULL, 0));
+	free(last_key.dptr);
+	return tdb->last_error;
 }
 
 static int wipe_one(struct tdb_context *tdb,
@@ -114,6 +129,9 @@ enum TDB_ERROR tdb_wipe_all(struct tdb_context *tdb)
 {
 	enum TDB_ERROR ecode;
 	int64_t count;
+#ifdef TDB_TRACE
+	int tracefd;
+#endif
 
 	if (tdb->flags & TDB_VERSION1) {
 		if (tdb1_wipe_all(tdb) == -1)
@@ -125,10 +143,19 @@ enum TDB_ERROR tdb_wipe_all(struct tdb_context *tdb)
 	if (ecode != TDB_SUCCESS)
 		return tdb->last_error = ecode;
 
+	tdb_trace(tdb, "tdb_wipe_all");
+#ifdef TDB_TRACE
+	/* The traverse and deletes are implied by the wipe. */
+	tracefd = tdb->tracefd;
+	tdb->tracefd = -1;
+#endif
 	/* FIXME: Be smarter. */
 	count = tdb_traverse(tdb, wipe_one, &ecode);
 	if (count < 0)
 		ecode = TDB_OFF_TO_ERR(count);
+#ifdef TDB_TRACE
+	tdb->tracefd = tracefd;
+#endif
 	tdb_allrecord_unlock(tdb, F_WRLCK);
 	return tdb->last_error = ecode;
 }
@@ -40,7 +40,9 @@
 #define HAVE_LITTLE_ENDIAN 1
 #define HAVE_MEMMEM 1
 #define HAVE_MMAP 1
+#define HAVE_MREMAP 1
 #define HAVE_PROC_SELF_MAPS 1
+#define HAVE_PWRITEV 1
 #define HAVE_QSORT_R_PRIVATE_LAST 1
 #define HAVE_SECTION_START_STOP 1
 #define HAVE_STACK_GROWS_UPWARDS 0
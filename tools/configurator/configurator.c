@@ -161,6 +161,12 @@ static struct test tests[] = {
 	  "static void *func(int fd) {\n"
 	  "	return mmap(0, 65536, PROT_READ, MAP_SHARED, fd, 0);\n"
 	  "}" },
+	{ "HAVE_MREMAP", DEFINES_FUNC, "HAVE_MMAP",
+	  "#define _GNU_SOURCE\n"
+	  "#include <sys/mman.h>\n"
+	  "static void *func(void *p) {\n"
+	  "	return mremap(p, 65536, 131072, MREMAP_MAYMOVE);\n"
+	  "}" },
 	{ "HAVE_PROC_SELF_MAPS", DEFINES_EVERYTHING|EXECUTE, NULL,
 	  "#include <sys/types.h>\n"
 	  "#include <sys/stat.h>\n"
@@ -168,6 +174,12 @@ static struct test tests[] = {
 	  "int main(void) {\n"
 	  "	return open(\"/proc/self/maps\", O_RDONLY) != -1 ? 0 : 1;\n"
 	  "}\n" },
+	{ "HAVE_PWRITEV", DEFINES_FUNC, NULL,
+	  "#include <sys/types.h>\n"
+	  "#include <sys/uio.h>\n"
+	  "static ssize_t func(int fd, const struct iovec *iov) {\n"
+	  "	return pwritev(fd, iov, 1, 0);\n"
+	  "}" },
 	{ "HAVE_QSORT_R_PRIVATE_LAST",
 	  DEFINES_EVERYTHING|EXECUTE|MAY_NOT_COMPILE, NULL,
 	  "#define _GNU_SOURCE 1\n"